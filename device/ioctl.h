@@ -12,6 +12,12 @@
 #define IOC_RQ_TOUT     4                       // Set timeout in microseconds
 #define IOC_RQ_SCFG     5                       // Set serial configuration
 #define IOC_RQ_KEYMAP   6                       // Set keyboard mapping
+#define IOC_RQ_FSEEK    7                       // Build (or release) FAT fast seek table
+#define IOC_RQ_MMAP     8                       // Get the address of file data in memory mapped flash
+#define IOC_RQ_DRAIN    9                       // Wait until all output has been transmitted
+#define IOC_RQ_POLL     10                      // Set device polling intervals
+#define IOC_RQ_SYNC     11                      // Set policy for syncing a file while writing
+#define IOC_RQ_LOG      12                      // Set log mode for a file on a flash volume
 
 // Modes specifying when a read request will return
 #define IOC_MD_FULL      0x00000                // Only return when the buffer is full
@@ -23,6 +29,41 @@
 #define IOC_MD_TLF       0x80000                // Replace terminating character by Line Feed
 #define IOC_MD_ECHO     0x100000                // Echo the input characters to the output
 
-int ioctl (int fd, long request, void *argp);
+// Mode specifying when a write request will return
+#define IOC_MD_TXBUF    0x200000                // Return once output is buffered, not when sent
+#define IOC_MD_LBUF     0x400000                // With IOC_MD_TXBUF, send buffered output at each Line Feed
+
+// Argument for IOC_RQ_MMAP
+struct ioc_mmap
+    {
+    const void *    addr;                       // Returned address of the data at the file position
+    int             length;                     // Maximum length wanted, returns the length at addr
+    };
+
+// Argument for IOC_RQ_POLL
+struct ioc_poll
+    {
+    int             idle_ms;                    // Interval while there is no activity
+    int             active_ms;                  // Interval while active
+    int             linger_ms;                  // Time after activity ends before returning to idle interval
+    };
+
+// Argument for IOC_RQ_SYNC
+struct ioc_sync
+    {
+    int             bytes;                      // Sync after this many bytes written (0 = never)
+    int             ms;                         // Sync when written data is this old (0 = never)
+    };
+
+// Argument for IOC_RQ_LOG
+struct ioc_log
+    {
+    int             buffer;                     // Bytes held in RAM, rounded up to a page (0 = littlefs cache size)
+    int             commit;                     // Commit after about this many bytes (0 = only on fsync or close)
+    long            segment;                    // Start a new segment before exceeding this size (0 = never)
+    int             keep;                       // Old segments kept, as name.1 (newest) to name.keep
+    };
+
+int ioctl (int fd, unsigned long request, void *argp);
 
 #endif
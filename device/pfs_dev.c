@@ -29,7 +29,10 @@ STATIC const struct pfs_v_pfs dev_v_pfs =
     NULL,           // mkdir
     NULL,           // rmdir
     dev_opendir,
-    NULL            // chmod
+    NULL,           // chmod
+    NULL,           // umount
+    NULL,           // statvfs
+    NULL            // cache_id
     };
 
 STATIC const struct pfs_v_dir dev_v_dir =
@@ -64,6 +67,7 @@ struct dev_dir
     int                         flags;
     struct pfs_mount *          m;
     struct dirent               de;
+    long long                   size;       // Size of the file in de (0 if not known)
     const struct dev_device *   ddv;
     };
 
@@ -127,6 +131,7 @@ STATIC struct dirent *dev_readdir (void *dirp)
     struct dev_dir *dd = (struct dev_dir *) dirp;
     if ( dd->ddv == NULL ) return NULL;
     strncpy (dd->de.d_name, dd->ddv->name, NAME_MAX);
+    dd->de.d_type = DT_CHR;
     dd->ddv = dd->ddv->next;
     return &dd->de;
     }
@@ -29,7 +29,14 @@ STATIC const struct pfs_v_file gdd_v_file =
     NULL,           // lseek
     NULL,           // fstat
     NULL,           // isatty
-    NULL            // ioctl
+    NULL,           // ioctl
+    NULL,           // allocate
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    NULL,           // pread
+    NULL,           // pwrite
+    NULL            // fsync
     };
 
 STATIC struct pfs_file *gdd_open (const struct pfs_device *dev, const char *name, int oflags)
@@ -39,7 +46,7 @@ STATIC struct pfs_file *gdd_open (const struct pfs_device *dev, const char *name
         pfs_error (EACCES);
         return NULL;
         }
-    struct pfs_file *gdd = (struct pfs_file *) malloc (sizeof (struct pfs_file));
+    struct pfs_file *gdd = (struct pfs_file *) pfs_file_alloc (sizeof (struct pfs_file));
     if ( gdd == NULL )
         {
         pfs_error (ENOMEM);
@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/errno.h>
 #include <pico/sync.h>
@@ -39,6 +40,13 @@ STATIC const struct pfs_v_file gio_v_file =
     NULL,           // fstat
     NULL,           // isatty
     gio_ioctl,      // ioctl
+    NULL,           // allocate
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    NULL,           // pread
+    NULL,           // pwrite
+    NULL            // fsync
     };
 
 int pfs_dev_gio_input (struct pfs_device *dev, char ch)
@@ -50,11 +58,36 @@ int pfs_dev_gio_input (struct pfs_device *dev, char ch)
     if (( gio->mode & IOC_MD_ECHO ) && ( gio->output != NULL )) gio->output (ch);
     gio->data[wptr] = ch;
     wptr = (++wptr) & ( gio->ndata - 1 );
+    __compiler_memory_barrier ();
     gio->wptr = wptr;
+    // Wake a reader waiting on either core
+    __sev ();
     if ( wptr == wend ) return 1;
     return 0;
     }
 
+int pfs_dev_gio_input_buf (struct pfs_device *dev, const char *buf, int n)
+    {
+    struct pfs_dev_gio *gio = (struct pfs_dev_gio *) dev;
+    int wptr = gio->wptr;
+    int nfree = ( gio->rptr - 1 - wptr ) & ( gio->ndata - 1 );
+    if ( n > nfree ) n = nfree;
+    if (( gio->mode & IOC_MD_ECHO ) && ( gio->output != NULL ))
+        {
+        for (int i = 0; i < n; ++i) gio->output (buf[i]);
+        }
+    // At most two spans, either side of the end of the buffer
+    int nspan = gio->ndata - wptr;
+    if ( nspan > n ) nspan = n;
+    memcpy (&gio->data[wptr], buf, nspan);
+    memcpy (gio->data, buf + nspan, n - nspan);
+    // The data must be in the buffer before the reader sees the new pointer
+    __compiler_memory_barrier ();
+    gio->wptr = ( wptr + n ) & ( gio->ndata - 1 );
+    __sev ();
+    return n;
+    }
+
 STATIC int gio_read (struct pfs_file *fd, char *buffer, int length)
     {
     absolute_time_t tend = at_the_end_of_time;
@@ -69,22 +102,37 @@ STATIC int gio_read (struct pfs_file *fd, char *buffer, int length)
             if ( gio->mode & IOC_MD_NBLOCK ) break;
             if (( gio->mode & IOC_MD_ANY ) && ( nread > 0 )) break;
             }
+        // Sleep until the producer signals an event, or the timeout
         while ( gio->rptr == gio->wptr )
             {
-            if ( time_reached (tend) ) break;
-            // __wfi ();
+            if ( best_effort_wfe_or_timeout (tend) ) break;
+            }
+        int wptr = gio->wptr;
+        if ( gio->rptr == wptr ) break;
+        // Copy the characters available up to the end of the buffer
+        const char *src = &gio->data[gio->rptr];
+        int nspan = (( wptr > gio->rptr ) ? wptr : gio->ndata ) - gio->rptr;
+        if ( nspan > length ) nspan = length;
+        bool bEnd = false;
+        if ( gio->mode & IOC_MD_CHR )
+            {
+            const char *pend = (const char *) memchr (src, gio->mode & 0xFF, nspan);
+            if ( pend != NULL )
+                {
+                nspan = pend - src + 1;
+                bEnd = true;
+                }
             }
-        if ( gio->rptr == gio->wptr ) break;
-        *bptr = gio->data[gio->rptr];
-        gio->rptr = (++gio->rptr) & ( gio->ndata - 1 );
-        ++nread;
-        --length;
-        if (( gio->mode & IOC_MD_CHR ) && ( *bptr == (gio->mode & 0xFF) ))
+        memcpy (bptr, src, nspan);
+        gio->rptr = ( gio->rptr + nspan ) & ( gio->ndata - 1 );
+        bptr += nspan;
+        nread += nspan;
+        length -= nspan;
+        if ( bEnd )
             {
-            if ( gio->mode & IOC_MD_TLF ) *bptr = '\n';
+            if ( gio->mode & IOC_MD_TLF ) bptr[-1] = '\n';
             break;
             }
-        ++bptr;
         }
     return nread;
     }
@@ -130,7 +178,7 @@ STATIC struct pfs_file *gio_open (const struct pfs_device *dev, const char *name
         pfs_error (EACCES);
         return NULL;
         }
-    struct pfs_file *gio = (struct pfs_file *) malloc (sizeof (struct pfs_file));
+    struct pfs_file *gio = (struct pfs_file *) pfs_file_alloc (sizeof (struct pfs_file));
     if ( gio == NULL )
         {
         pfs_error (ENOMEM);
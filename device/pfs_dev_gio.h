@@ -21,6 +21,7 @@ typedef void (*GIO_OUTPUT_RTN) (char ch);
 #endif
 
 int pfs_dev_gio_input (struct pfs_device *gio, char ch);
+int pfs_dev_gio_input_buf (struct pfs_device *gio, const char *buf, int n);
 struct pfs_device *pfs_dev_gio_create (GIO_OUTPUT_RTN output, int ndata, int mode);
 
 #endif
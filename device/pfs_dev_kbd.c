@@ -8,9 +8,11 @@
 #include <tusb.h>
 #include <class/hid/hid.h>
 #include <stdio.h>
+#include <sys/errno.h>
 #include <pfs_private.h>
 #include <pfs_dev_gio.h>
 #include <pfs_dev_kbd.h>
+#include <pfs_trace.h>
 #include <pfs_dev_keymap.h>
 
 #ifndef KBD_VERSION
@@ -46,6 +48,22 @@ STATIC struct pfs_v_file kbd_entry;
 #define DEBUG               0
 #endif
 
+// USB polling intervals: while idle, while keys are held, and how long
+// to keep polling quickly after the last key change
+#ifndef KBD_POLL_IDLE_MS
+#define KBD_POLL_IDLE_MS    100
+#endif
+#ifndef KBD_POLL_ACTIVE_MS
+#define KBD_POLL_ACTIVE_MS  10
+#endif
+#ifndef KBD_POLL_LINGER_MS
+#define KBD_POLL_LINGER_MS  500
+#endif
+
+STATIC struct ioc_poll kbd_poll = { KBD_POLL_IDLE_MS, KBD_POLL_ACTIVE_MS, KBD_POLL_LINGER_MS };
+STATIC bool bKeysHeld = false;
+STATIC absolute_time_t t_active;
+
 #if USE_ASYNC_CONTEXT
 #include <pico/async_context_threadsafe_background.h>
 STATIC void kbd_work (async_context_t *context, struct async_work_on_timeout *timeout);
@@ -119,6 +137,7 @@ STATIC void key_encode (uint8_t key, bool bPress)
 
 STATIC void key_press (uint8_t modifier, uint8_t key)
     {
+    pfs_trace (PFS_TR_KBD_PRESS, key, modifier);
 #if DEBUG > 0
     printf ("key_press (0x%02X), keymap = %p\n", key, keymap);
 #endif
@@ -151,6 +170,7 @@ STATIC void key_press (uint8_t modifier, uint8_t key)
 
 STATIC void key_release (uint8_t key)
     {
+    pfs_trace (PFS_TR_KBD_RELEASE, key, 0);
 #if DEBUG > 0
     printf ("key_release (0x%02X)\n", key);
 #endif
@@ -226,6 +246,11 @@ STATIC inline void process_kbd_report(hid_keyboard_report_t const *p_new_report)
             }
         }
     prev_report = *p_new_report;
+    bKeysHeld = ( p_new_report->modifier != 0 );
+    for (int i = 0; i < 6; ++i)
+        {
+        if ( p_new_report->keycode[i] ) bKeysHeld = true;
+        }
     }
 
 #if (KBD_VERSION == 3) || (KBD_VERSION == 4)
@@ -250,6 +275,7 @@ STATIC struct
 void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_report, uint16_t desc_len)
     {
     uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
+    pfs_trace (PFS_TR_KBD_MOUNT, dev_addr, itf_protocol);
 #if DEBUG > 0
     printf("HID device address = %d, instance = %d is mounted\r\n", dev_addr, instance);
 
@@ -283,6 +309,7 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 // Invoked when device with hid interface is un-mounted
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance)
     {
+    pfs_trace (PFS_TR_KBD_UMOUNT, dev_addr, instance);
 #if DEBUG > 0
     printf("HID device address = %d, instance = %d is unmounted\r\n", dev_addr, instance);
 #endif
@@ -292,6 +319,7 @@ void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance)
 void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
     {
     uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
+    pfs_trace (PFS_TR_KBD_REPORT, instance, len);
 
     if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD)
         {
@@ -313,6 +341,26 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
 #error Unknown TinyUSB Version
 #endif  // KBD_VERSION
 
+// Run the USB host stack, and return the interval until it should next run.
+// Poll quickly while keys are held (so repeats are seen promptly) and for a
+// while after they change, otherwise slowly.
+STATIC int kbd_service (void)
+    {
+    bool bActive = false;
+    bRepeat = true;
+    while ( bRepeat )
+        {
+        bRepeat = false;
+        tuh_task();
+        if ( bRepeat ) bActive = true;
+        }
+    if ( bActive ) t_active = get_absolute_time ();
+    if ( bKeysHeld ) return kbd_poll.active_ms;
+    if ( ! time_reached (delayed_by_us (t_active, 1000 * (uint64_t) kbd_poll.linger_ms)) )
+        return kbd_poll.active_ms;
+    return kbd_poll.idle_ms;
+    }
+
 #if USE_ASYNC_CONTEXT
 
 STATIC void kbd_work (async_context_t *context, struct async_work_on_timeout *timeout)
@@ -321,13 +369,8 @@ STATIC void kbd_work (async_context_t *context, struct async_work_on_timeout *ti
 #if DEBUG > 1
     printf ("-");
 #endif
-    bRepeat = true;
-    while ( bRepeat )
-        {
-        bRepeat = false;
-        tuh_task();
-        }
-    if ( ! async_context_add_at_time_worker_in_ms ((async_context_t *) &asyc, &asyw, 100) )
+    int interval = kbd_service ();
+    if ( ! async_context_add_at_time_worker_in_ms ((async_context_t *) &asyc, &asyw, interval) )
         {
 #if DEBUG > 0
         printf ("Failed to add kbd_worker task\n");
@@ -345,13 +388,10 @@ STATIC bool keyboard_periodic (struct repeating_timer *prt)
 #if DEBUG > 1
     printf ("-");
 #endif
-    bRepeat = true;
-    while ( bRepeat )
-        {
-        bRepeat = false;
-        tuh_task();
-        }
+    int interval = kbd_service ();
     if ( led_flags != leds) set_leds (led_flags);
+    // The sign of the delay selects how it is measured, so keep it
+    prt->delay_us = ( prt->delay_us < 0 ) ? -1000 * (int64_t) interval : 1000 * (int64_t) interval;
     return true;
     }
 #endif
@@ -363,6 +403,14 @@ STATIC int kbd_ioctl (struct pfs_file *fd, unsigned long request, void *argp)
         keymap = (PFS_DEV_KEYMAP *) argp;
         return 0;
         }
+    else if ( request == IOC_RQ_POLL )
+        {
+        struct ioc_poll *poll = (struct ioc_poll *) argp;
+        if (( poll->idle_ms <= 0 ) || ( poll->active_ms <= 0 ) || ( poll->linger_ms < 0 ))
+            return pfs_error (EINVAL);
+        kbd_poll = *poll;
+        return 0;
+        }
     return kbd_gio_ioctl (fd, request, argp);
     }
 
@@ -396,7 +444,7 @@ struct pfs_device *pfs_dev_kbd_fetch (PFS_DEV_KEYMAP *km)
 #if USE_ASYNC_CONTEXT
             if ( async_context_threadsafe_background_init_with_defaults (&asyc) )
                 {
-                if ( ! async_context_add_at_time_worker_in_ms ((async_context_t *) &asyc, &asyw, 100) )
+                if ( ! async_context_add_at_time_worker_in_ms ((async_context_t *) &asyc, &asyw, kbd_poll.idle_ms) )
                     {
 #if DEBUG > 0
                     printf ("Failed to add kbd_worker task\n");
@@ -408,7 +456,7 @@ struct pfs_device *pfs_dev_kbd_fetch (PFS_DEV_KEYMAP *km)
                 printf ("Failed to initialise async context\n");
                 }
 #else
-            add_repeating_timer_ms (100, keyboard_periodic, NULL, &s_kbd_timer);
+            add_repeating_timer_ms (kbd_poll.idle_ms, keyboard_periodic, NULL, &s_kbd_timer);
 #endif
             }
         }
@@ -0,0 +1,127 @@
+// pfs_dev_stat.c - I/O statistics report device for pico-filesystem
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Each open of the device takes a snapshot of the statistics as text, which
+// is then read like a file. The volume statistics kept by pfs_base.c come
+// first, followed by those of any sources added by pfs_dev_stat_source.
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/errno.h>
+#include <pfs_private.h>
+#include <pfs_dev_stat.h>
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+STATIC struct pfs_file *stat_open (const struct pfs_device *dev, const char *name, int oflags);
+STATIC int stat_close (struct pfs_file *fd);
+STATIC int stat_read (struct pfs_file *fd, char *buffer, int length);
+
+struct pfs_stat_file
+    {
+    const struct pfs_v_file *   entry;
+    struct pfs_pfs *            pfs;
+    const char *                pn;
+    char *                      text;       // Report snapshot
+    int                         len;        // Length of report
+    int                         pos;        // Read position
+    };
+
+struct pfs_stat_source
+    {
+    PFS_STAT_REPORT_RTN report;
+    void *              ctx;
+    };
+
+STATIC const struct pfs_v_file stat_v_file =
+    {
+    stat_close,     // close
+    stat_read,      // read
+    NULL,           // write
+    NULL,           // lseek
+    NULL,           // fstat
+    NULL,           // isatty
+    NULL,           // ioctl
+    NULL,           // allocate
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    NULL,           // pread
+    NULL,           // pwrite
+    NULL            // fsync
+    };
+
+STATIC struct pfs_device s_stat = { stat_open };
+STATIC struct pfs_stat_source stat_sources[PFS_STAT_NSOURCE];
+STATIC int stat_nsource = 0;
+
+STATIC int stat_close (struct pfs_file *fd)
+    {
+    struct pfs_stat_file *sf = (struct pfs_stat_file *) fd;
+    free (sf->text);
+    return 0;
+    }
+
+STATIC int stat_read (struct pfs_file *fd, char *buffer, int length)
+    {
+    struct pfs_stat_file *sf = (struct pfs_stat_file *) fd;
+    int nread = sf->len - sf->pos;
+    if ( nread > length ) nread = length;
+    if ( nread <= 0 ) return 0;
+    memcpy (buffer, sf->text + sf->pos, nread);
+    sf->pos += nread;
+    return nread;
+    }
+
+STATIC struct pfs_file *stat_open (const struct pfs_device *dev, const char *name, int oflags)
+    {
+    if (( oflags & O_ACCMODE ) != O_RDONLY )
+        {
+        pfs_error (EACCES);
+        return NULL;
+        }
+    struct pfs_stat_file *sf = (struct pfs_stat_file *) pfs_file_alloc (sizeof (struct pfs_stat_file));
+    if ( sf == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    sf->text = (char *) malloc (PFS_STAT_REPORT);
+    if ( sf->text == NULL )
+        {
+        pfs_file_free (sf);
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    int n = pfs_stats_print (sf->text, PFS_STAT_REPORT);
+    for (int i = 0; i < stat_nsource; ++i)
+        {
+        if ( n >= PFS_STAT_REPORT - 1 ) break;
+        n += stat_sources[i].report (stat_sources[i].ctx, sf->text + n, PFS_STAT_REPORT - n);
+        }
+    sf->entry = &stat_v_file;
+    sf->pfs = (struct pfs_pfs *) dev;
+    sf->pn = NULL;
+    sf->len = n;
+    sf->pos = 0;
+    return (struct pfs_file *) sf;
+    }
+
+int pfs_dev_stat_source (PFS_STAT_REPORT_RTN report, void *ctx)
+    {
+    if ( report == NULL ) return pfs_error (EINVAL);
+    if ( stat_nsource >= PFS_STAT_NSOURCE ) return pfs_error (ENOMEM);
+    stat_sources[stat_nsource].report = report;
+    stat_sources[stat_nsource].ctx = ctx;
+    ++stat_nsource;
+    return 0;
+    }
+
+struct pfs_device *pfs_dev_stat_fetch (void)
+    {
+    return &s_stat;
+    }
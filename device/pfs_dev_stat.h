@@ -0,0 +1,30 @@
+// pfs_dev_stat.h - I/O statistics report device for pico-filesystem
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef PFS_DEV_STAT_H
+#define PFS_DEV_STAT_H
+
+#include <pfs.h>
+
+// Largest report (bytes) produced on opening the device
+#ifndef PFS_STAT_REPORT
+#define PFS_STAT_REPORT     2048
+#endif
+
+// Number of additional report sources which may be added
+#ifndef PFS_STAT_NSOURCE
+#define PFS_STAT_NSOURCE    4
+#endif
+
+// Writes text lines to buf (len bytes, including terminator), returning the
+// number of characters written. ff_disk_stats_print and ffs_pico_stats_print
+// have this form.
+typedef int (*PFS_STAT_REPORT_RTN) (void *ctx, char *buf, int len);
+
+struct pfs_device *pfs_dev_stat_fetch (void);
+
+// Add a source of statistics to the report. Returns zero, or -1 and sets errno.
+int pfs_dev_stat_source (PFS_STAT_REPORT_RTN report, void *ctx);
+
+#endif
@@ -0,0 +1,126 @@
+// pfs_dev_trace.c - Device to read the event trace of pico-filesystem
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Each open of the device takes a copy of the events recorded so far (see
+// pfs_trace.h), which reads return one line of text per event, oldest first.
+// Opening with O_TRUNC also discards the events copied from the trace.
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/errno.h>
+#include <pico.h>
+#include <pfs_private.h>
+#include <pfs_dev_trace.h>
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+#define TRACE_LINE  64              // Longest line of text for an event
+
+STATIC struct pfs_file *trace_open (const struct pfs_device *dev, const char *name, int oflags);
+STATIC int trace_close (struct pfs_file *fd);
+STATIC int trace_read (struct pfs_file *fd, char *buffer, int length);
+
+struct pfs_trace_file
+    {
+    const struct pfs_v_file *   entry;
+    struct pfs_pfs *            pfs;
+    const char *                pn;
+    struct pfs_trace_entry *    ent;        // Copy of the trace
+    int                         nent;       // Number of events copied
+    int                         ient;       // Next event to format
+    int                         nline;      // Length of current line
+    int                         iline;      // Read position in current line
+    char                        line[TRACE_LINE];
+    };
+
+STATIC const struct pfs_v_file trace_v_file =
+    {
+    trace_close,    // close
+    trace_read,     // read
+    NULL,           // write
+    NULL,           // lseek
+    NULL,           // fstat
+    NULL,           // isatty
+    NULL,           // ioctl
+    NULL,           // allocate
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    NULL,           // pread
+    NULL,           // pwrite
+    NULL            // fsync
+    };
+
+STATIC struct pfs_device s_trace = { trace_open };
+
+STATIC int trace_close (struct pfs_file *fd)
+    {
+    struct pfs_trace_file *tf = (struct pfs_trace_file *) fd;
+    free (tf->ent);
+    return 0;
+    }
+
+STATIC int trace_read (struct pfs_file *fd, char *buffer, int length)
+    {
+    struct pfs_trace_file *tf = (struct pfs_trace_file *) fd;
+    int nread = 0;
+    while ( nread < length )
+        {
+        if ( tf->iline >= tf->nline )
+            {
+            if ( tf->ient >= tf->nent ) break;
+            tf->nline = pfs_trace_format (&tf->ent[tf->ient], tf->line, TRACE_LINE);
+            tf->iline = 0;
+            ++tf->ient;
+            }
+        int n = tf->nline - tf->iline;
+        if ( n > length - nread ) n = length - nread;
+        memcpy (buffer + nread, tf->line + tf->iline, n);
+        tf->iline += n;
+        nread += n;
+        }
+    return nread;
+    }
+
+STATIC struct pfs_file *trace_open (const struct pfs_device *dev, const char *name, int oflags)
+    {
+    if (( oflags & O_ACCMODE ) != O_RDONLY )
+        {
+        pfs_error (EACCES);
+        return NULL;
+        }
+    struct pfs_trace_file *tf = (struct pfs_trace_file *) pfs_file_alloc (sizeof (struct pfs_trace_file));
+    if ( tf == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    tf->ent = NULL;
+    tf->nent = 0;
+#if PFS_TRACE
+    tf->ent = (struct pfs_trace_entry *) malloc (NUM_CORES * PFS_TRACE_SIZE * sizeof (struct pfs_trace_entry));
+    if ( tf->ent == NULL )
+        {
+        pfs_file_free (tf);
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    tf->nent = pfs_trace_read (tf->ent, NUM_CORES * PFS_TRACE_SIZE, ( oflags & O_TRUNC ) != 0);
+#endif
+    tf->entry = &trace_v_file;
+    tf->pfs = (struct pfs_pfs *) dev;
+    tf->pn = NULL;
+    tf->ient = 0;
+    tf->nline = 0;
+    tf->iline = 0;
+    return (struct pfs_file *) tf;
+    }
+
+struct pfs_device *pfs_dev_trace_fetch (void)
+    {
+    return &s_trace;
+    }
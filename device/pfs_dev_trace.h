@@ -0,0 +1,13 @@
+// pfs_dev_trace.h - Device to read the event trace of pico-filesystem
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef PFS_DEV_TRACE_H
+#define PFS_DEV_TRACE_H
+
+#include <pfs.h>
+#include <pfs_trace.h>
+
+struct pfs_device *pfs_dev_trace_fetch (void);
+
+#endif
@@ -3,19 +3,36 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include <stdlib.h>
+#include <string.h>
 #include <sys/errno.h>
 #include <pico/stdio.h>
+#include <pico/time.h>
 #include <pfs_private.h>
 #include <../device/pfs_dev_tty.h>
+#include <../device/ioctl.h>
+#if PFS_MULTICORE
+#include <pico/sync.h>
+#endif
 
 #ifndef STATIC
 #define STATIC  static
 #endif
 
+// Longest time (microseconds) that a blocked read sleeps before checking for input again
+#ifndef TTY_POLL_US
+#define TTY_POLL_US     1000
+#endif
+
+// Size of the output buffer used in IOC_MD_TXBUF mode
+#ifndef TTY_NBUF
+#define TTY_NBUF        256
+#endif
+
 STATIC struct pfs_file *tty_open (const struct pfs_device *dev, const char *name, int oflags);
 STATIC int tty_read (struct pfs_file *fd, char *buffer, int length);
 STATIC int tty_write (struct pfs_file *fd, char *buffer, int length);
 STATIC int tty_isatty (struct pfs_file *fd);
+STATIC int tty_ioctl (struct pfs_file *fd, unsigned long request, void *argp);
 
 STATIC struct pfs_device s_tty =
     {
@@ -30,12 +47,50 @@ STATIC const struct pfs_v_file tty_v_file =
     NULL,           // lseek
     NULL,           // fstat
     tty_isatty,     // isatty
-    NULL            // ioctl
+    tty_ioctl,      // ioctl
+    NULL,           // allocate
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    NULL,           // pread
+    NULL,           // pwrite
+    NULL            // fsync
     };
 
+STATIC int tty_mode = 0;
+STATIC int tty_nout = 0;
+STATIC char tty_out[TTY_NBUF];
+
+#if PFS_MULTICORE
+// Protects the output buffer and mode, and keeps output in order. This is
+// held while sending, which may wait for USB, so it is not the global lock.
+auto_init_mutex (tty_mutex);
+#define tty_lock()      mutex_enter_blocking (&tty_mutex)
+#define tty_unlock()    mutex_exit (&tty_mutex)
+#else
+#define tty_lock()
+#define tty_unlock()
+#endif
+
+// Send characters to all stdio drivers in one call where the SDK allows
+STATIC void tty_put (const char *ps, int len)
+    {
+#if PICO_SDK_VERSION_MAJOR >= 2
+    stdio_put_string (ps, len, false, false);
+#else
+    for (int i = 0; i < len; ++i) putchar_raw (ps[i]);
+#endif
+    }
+
+STATIC void tty_flush (void)
+    {
+    if ( tty_nout > 0 ) tty_put (tty_out, tty_nout);
+    tty_nout = 0;
+    }
+
 STATIC struct pfs_file *tty_open (const struct pfs_device *dev, const char *name, int oflags)
     {
-    struct pfs_file *tty = (struct pfs_file *) malloc (sizeof (struct pfs_file));
+    struct pfs_file *tty = (struct pfs_file *) pfs_file_alloc (sizeof (struct pfs_file));
     if ( tty == NULL )
         {
         pfs_error (ENOMEM);
@@ -49,23 +104,67 @@ STATIC struct pfs_file *tty_open (const struct pfs_device *dev, const char *name
 
 STATIC int tty_read (struct pfs_file *fd, char *buffer, int length)
     {
-    // return stdio_get_until (buffer, length, at_the_end_of_time);
-    for (int i = 0; i < length; ++i)
+    // Make sure any prompt has been sent
+    tty_lock ();
+    tty_flush ();
+    tty_unlock ();
+    int nread = 0;
+    while ( nread < length )
         {
-        int ch = PICO_ERROR_TIMEOUT;
-        while (ch == PICO_ERROR_TIMEOUT)
+#if PICO_SDK_VERSION_MAJOR >= 2
+        int n = stdio_get_until (&buffer[nread], length - nread, get_absolute_time ());
+        if ( n > 0 )
             {
-            ch = getchar_timeout_us (0xFFFFFFFF);
+            nread += n;
+            continue;
             }
-        buffer[i] = (char) ch;
+#else
+        int ch = getchar_timeout_us (0);
+        if ( ch != PICO_ERROR_TIMEOUT )
+            {
+            buffer[nread] = (char) ch;
+            ++nread;
+            continue;
+            }
+#endif
+        // Sleep between checks. USB or UART activity usually wakes the core
+        // sooner, otherwise TTY_POLL_US bounds the delay.
+        best_effort_wfe_or_timeout (make_timeout_time_us (TTY_POLL_US));
         }
     return length;
     }
 
 STATIC int tty_write (struct pfs_file *fd, char *buffer, int length)
     {
-    // stdio_put_string (buffer, length, false, false);
-    for (int i = 0; i < length; ++i) putchar_raw (buffer[i]);
+    tty_lock ();
+    if ( tty_mode & IOC_MD_TXBUF )
+        {
+        const char *ps = buffer;
+        int nleft = length;
+        while ( nleft > 0 )
+            {
+            if (( tty_nout == 0 ) && ( nleft >= TTY_NBUF ))
+                {
+                // No point copying a whole buffer full
+                tty_put (ps, nleft);
+                break;
+                }
+            int n = TTY_NBUF - tty_nout;
+            if ( n > nleft ) n = nleft;
+            memcpy (&tty_out[tty_nout], ps, n);
+            tty_nout += n;
+            ps += n;
+            nleft -= n;
+            if ( tty_nout == TTY_NBUF ) tty_flush ();
+            }
+        if (( tty_mode & IOC_MD_LBUF ) && ( memchr (buffer, '\n', length) != NULL )) tty_flush ();
+        }
+    else
+        {
+        tty_flush ();
+        tty_put (buffer, length);
+        }
+    tty_unlock ();
     return length;
     }
 
@@ -74,6 +173,28 @@ STATIC int tty_isatty (struct pfs_file *fd)
     return 1;
     }
 
+STATIC int tty_ioctl (struct pfs_file *fd, unsigned long request, void *argp)
+    {
+    int ierr = 0;
+    tty_lock ();
+    switch (request)
+        {
+        case IOC_RQ_MODE:
+            tty_mode = *((int *) argp);
+            if ( ! ( tty_mode & IOC_MD_TXBUF ) ) tty_flush ();
+            break;
+        case IOC_RQ_DRAIN:
+            tty_flush ();
+            stdio_flush ();
+            break;
+        default:
+            ierr = pfs_error (EINVAL);
+            break;
+        }
+    tty_unlock ();
+    return ierr;
+    }
+
 struct pfs_device *pfs_dev_tty_fetch (void)
     {
     return &s_tty;
@@ -9,6 +9,7 @@
 #include <hardware/structs/uart.h>
 #include <hardware/gpio.h>
 #include <hardware/irq.h>
+#include <hardware/dma.h>
 #include <pfs_private.h>
 #include <pfs_dev_uart.h>
 
@@ -21,7 +22,14 @@ STATIC int uart_read (struct pfs_file *fd, char *buffer, int length);
 STATIC int uart_write (struct pfs_file *fd, char *buffer, int length);
 STATIC int uart_ioctl (struct pfs_file *fd, unsigned long request, void *argp);
 
-#define NDATA   512     // Length of serial receive buffer (must be a power of 2)
+#define NDATA   512     // Default length of serial receive buffer (must be a power of 2)
+#define NDMAMAX 32768   // Largest receive buffer the DMA ring can wrap
+#define NTXDATA 256     // Length of serial transmit buffer (must be a power of 2)
+
+// Interval (microseconds) at which a blocked read checks for characters received by DMA
+#ifndef UART_DMA_POLL_US
+#define UART_DMA_POLL_US    1000
+#endif
 
 STATIC struct pfs_dev_uart
     {
@@ -32,7 +40,14 @@ STATIC struct pfs_dev_uart
     unsigned int        tout;
     int                 rptr;
     int                 wptr;
-    char                data[NDATA];
+    int                 ndata;      // Length of receive buffer (a power of 2)
+    char *              data;       // Receive buffer (aligned to its length for DMA)
+    bool                bDma;       // Receive by DMA rather than from the interrupt
+    int                 dma;        // DMA channel writing the receive buffer (-1 if none)
+    uint32_t            dmacnt;     // DMA transfer count when last examined
+    volatile int        txrptr;
+    volatile int        txwptr;
+    char                txdata[NTXDATA];
     } *uart_dev[NUM_UARTS] = {NULL, NULL};
 
 STATIC const struct pfs_v_file uart_v_file =
@@ -43,19 +58,56 @@ STATIC const struct pfs_v_file uart_v_file =
     NULL,           // lseek
     NULL,           // fstat
     NULL,           // isatty
-    uart_ioctl      // ioctl
+    uart_ioctl,     // ioctl
+    NULL,           // allocate
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    NULL,           // pread
+    NULL,           // pwrite
+    NULL            // fsync
     };
 
+// Catch up with characters written to the receive buffer by DMA. The DMA
+// cannot be held off when the buffer is full, so on overrun the oldest
+// characters are discarded. Must be called within the critical section.
+STATIC void uart_dma_input (struct pfs_dev_uart *pud)
+    {
+    int mask = pud->ndata - 1;
+    uint32_t cnt = dma_channel_hw_addr (pud->dma)->transfer_count;
+    uint32_t adv = pud->dmacnt - cnt;
+    int used = ( pud->wptr - pud->rptr ) & mask;
+    pud->dmacnt = cnt;
+    pud->wptr = ( pud->wptr + adv ) & mask;
+    if ( adv > mask - used ) pud->rptr = ( pud->wptr + 1 ) & mask;
+    if ( cnt == 0 )
+        {
+        // Transfer count exhausted, restart it. Characters arriving
+        // meanwhile wait in the UART FIFO.
+        pud->dmacnt = 0xFFFFFFFF;
+        dma_channel_set_trans_count (pud->dma, pud->dmacnt, true);
+        }
+    }
+
 STATIC void uart_input (struct pfs_dev_uart *pud)
     {
     critical_section_enter_blocking (&pud->ucs);
-    int wend = ( pud->rptr - 1 ) & ( NDATA - 1 );
+    if ( pud->dma >= 0 )
+        {
+        uart_dma_input (pud);
+        critical_section_exit (&pud->ucs);
+        return;
+        }
+    int wend = ( pud->rptr - 1 ) & ( pud->ndata - 1 );
+    int wptr = pud->wptr;
     while ((pud->wptr != wend) && (uart_is_readable (pud->uart)))
         {
         pud->data[pud->wptr] = uart_getc (pud->uart);
         if ( pud->mode & IOC_MD_ECHO ) uart_putc_raw (pud->uart, pud->data[pud->wptr]);
-        pud->wptr = (++pud->wptr) & ( NDATA - 1 );
+        pud->wptr = (++pud->wptr) & ( pud->ndata - 1 );
         }
+    // Wake a reader waiting on the other core
+    if ( pud->wptr != wptr ) __sev ();
     if ( pud->wptr == wend )
         {
         hw_clear_bits (&((uart_hw_t *)pud->uart)->cr, UART_UARTCR_RTS_BITS);
@@ -64,14 +116,40 @@ STATIC void uart_input (struct pfs_dev_uart *pud)
     critical_section_exit (&pud->ucs);
     }
 
+// Move buffered output into the UART FIFO. The transmit interrupt is only
+// enabled while there is output waiting for room in the FIFO.
+// Must be called within the critical section.
+STATIC void uart_output (struct pfs_dev_uart *pud)
+    {
+    while ((pud->txrptr != pud->txwptr) && (uart_is_writable (pud->uart)))
+        {
+        uart_putc_raw (pud->uart, pud->txdata[pud->txrptr]);
+        pud->txrptr = ( pud->txrptr + 1 ) & ( NTXDATA - 1 );
+        }
+    if ( pud->txrptr == pud->txwptr )
+        hw_clear_bits (&((uart_hw_t *)pud->uart)->imsc, UART_UARTIMSC_TXIM_BITS);
+    else
+        hw_set_bits (&((uart_hw_t *)pud->uart)->imsc, UART_UARTIMSC_TXIM_BITS);
+    // Wake a writer waiting for room
+    __sev ();
+    }
+
+STATIC void uart_irq (struct pfs_dev_uart *pud)
+    {
+    uart_input (pud);
+    critical_section_enter_blocking (&pud->ucs);
+    uart_output (pud);
+    critical_section_exit (&pud->ucs);
+    }
+
 STATIC void irq_uart0 (void)
     {
-    if ( uart_dev[0] != NULL ) uart_input (uart_dev[0]);
+    if ( uart_dev[0] != NULL ) uart_irq (uart_dev[0]);
     }
 
 STATIC void irq_uart1 (void)
     {
-    if ( uart_dev[1] != NULL ) uart_input (uart_dev[1]);
+    if ( uart_dev[1] != NULL ) uart_irq (uart_dev[1]);
     }
 
 STATIC int uart_read (struct pfs_file *fd, char *buffer, int length)
@@ -89,15 +167,26 @@ STATIC int uart_read (struct pfs_file *fd, char *buffer, int length)
             if ( pud->mode & IOC_MD_NBLOCK ) break;
             if (( pud->mode & IOC_MD_ANY ) && ( nread > 0 )) break;
             }
+        // Sleep until the receive interrupt, or the timeout
         while ( pud->rptr == pud->wptr )
             {
-            if ( time_reached (tend) ) break;
-            // __wfi ();
+            if ( pud->dma >= 0 )
+                {
+                // DMA gives no event for each character, so look again after a while
+                absolute_time_t twake = make_timeout_time_us (UART_DMA_POLL_US);
+                if ( absolute_time_diff_us (twake, tend) < 0 ) twake = tend;
+                best_effort_wfe_or_timeout (twake);
+                }
+            else
+                {
+                best_effort_wfe_or_timeout (tend);
+                }
             uart_input (pud);
+            if ( time_reached (tend) ) break;
             }
         if ( pud->rptr == pud->wptr ) break;
         *bptr = pud->data[pud->rptr];
-        pud->rptr = (++pud->rptr) & ( NDATA - 1 );
+        pud->rptr = (++pud->rptr) & ( pud->ndata - 1 );
         ++nread;
         --length;
         if (( pud->mode & IOC_MD_CHR ) && ( *bptr == (pud->mode & 0xFF) ))
@@ -114,11 +203,35 @@ STATIC int uart_read (struct pfs_file *fd, char *buffer, int length)
     return nread;
     }
 
+// Wait until the transmit buffer is empty (the last characters may still be in the FIFO)
+STATIC void uart_flush (struct pfs_dev_uart *pud)
+    {
+    while ( pud->txrptr != pud->txwptr )
+        {
+        __wfe ();
+        }
+    }
+
 STATIC int uart_write (struct pfs_file *fd, char *buffer, int length)
     {
     struct pfs_dev_uart *pud = (struct pfs_dev_uart *) fd->pfs;
-    uart_write_blocking (pud->uart, buffer, length);
-    return length;
+    int nwrite = 0;
+    while ( nwrite < length )
+        {
+        critical_section_enter_blocking (&pud->ucs);
+        int wend = ( pud->txrptr - 1 ) & ( NTXDATA - 1 );
+        while (( pud->txwptr != wend ) && ( nwrite < length ))
+            {
+            pud->txdata[pud->txwptr] = buffer[nwrite];
+            pud->txwptr = ( pud->txwptr + 1 ) & ( NTXDATA - 1 );
+            ++nwrite;
+            }
+        uart_output (pud);
+        critical_section_exit (&pud->ucs);
+        if ( nwrite < length ) __wfe ();
+        }
+    if ( ! ( pud->mode & IOC_MD_TXBUF ) ) uart_flush (pud);
+    return nwrite;
     }
 
 STATIC int uart_ioctl (struct pfs_file *fd, unsigned long request, void *argp)
@@ -128,18 +241,25 @@ STATIC int uart_ioctl (struct pfs_file *fd, unsigned long request, void *argp)
     switch (request)
         {
         case IOC_RQ_MODE:
+            // Characters received by DMA are not seen one at a time to be echoed
+            if (( pud->dma >= 0 ) && ( *((int *) argp) & IOC_MD_ECHO )) return pfs_error (EINVAL);
             pud->mode = *((int *) argp);
             break;
         case IOC_RQ_PURGE:
-            pud->rptr = 0;
-            pud->wptr = 0;
+            uart_input (pud);
+            pud->rptr = pud->wptr;
             break;
         case IOC_RQ_COUNT:
-            *((int *) argp) = (pud->wptr - pud->rptr) & (NDATA - 1);
+            uart_input (pud);
+            *((int *) argp) = (pud->wptr - pud->rptr) & (pud->ndata - 1);
             break;
         case IOC_RQ_TOUT:
             pud->tout = *((int *) argp);
             break;
+        case IOC_RQ_DRAIN:
+            uart_flush (pud);
+            uart_tx_wait_blocking (pud->uart);
+            break;
         case IOC_RQ_SCFG:
             {
             SERIAL_CONFIG *sc = (SERIAL_CONFIG *) argp;
@@ -179,8 +299,29 @@ STATIC bool uopen (int uid, SERIAL_CONFIG *sc)
     pud->uart = uart_get_instance (uid);
     pud->rptr = 0;
     pud->wptr = 0;
+    pud->txrptr = 0;
+    pud->txwptr = 0;
+    pud->dma = -1;
     critical_section_init (&pud->ucs);
+    if ( pud->bDma && ( sc->rts >= 0 )) return false;
     if ( uart_init (pud->uart, sc->baud) == 0 ) return false;
+    if ( pud->bDma )
+        {
+        // Receive into the buffer as a DMA ring. If there is no free
+        // channel, fall back to receiving from the interrupt.
+        pud->dma = dma_claim_unused_channel (false);
+        }
+    if ( pud->dma >= 0 )
+        {
+        dma_channel_config dc = dma_channel_get_default_config (pud->dma);
+        channel_config_set_transfer_data_size (&dc, DMA_SIZE_8);
+        channel_config_set_read_increment (&dc, false);
+        channel_config_set_write_increment (&dc, true);
+        channel_config_set_ring (&dc, true, __builtin_ctz (pud->ndata));
+        channel_config_set_dreq (&dc, uart_get_dreq (pud->uart, false));
+        pud->dmacnt = 0xFFFFFFFF;
+        dma_channel_configure (pud->dma, &dc, pud->data, &uart_get_hw (pud->uart)->dr, pud->dmacnt, true);
+        }
     if ( sc->tx >= 0 )
         {
         if ( ! uart_pin_valid (uid, 0, sc->tx) ) return false;
@@ -225,19 +366,27 @@ STATIC bool uopen (int uid, SERIAL_CONFIG *sc)
         && ( sc->parity != UART_PARITY_ODD )) return false;
     uart_set_format (pud->uart, sc->data, sc->stop, sc->parity);
     uart_set_irq_enables (pud->uart, true, false);
+    return true;
     }
 
 void uclose (int uid)
     {
     if (( uid < 0 ) || ( uid > 1 )) return;
     struct pfs_dev_uart *pud = uart_dev[uid];
+    if ( pud->dma >= 0 )
+        {
+        dma_channel_abort (pud->dma);
+        dma_channel_unclaim (pud->dma);
+        pud->dma = -1;
+        }
+    irq_set_enabled (( uid == 0 ) ? UART0_IRQ : UART1_IRQ, false);
     uart_deinit (pud->uart);
     critical_section_deinit (&pud->ucs);
     }
 
 STATIC struct pfs_file *uart_open (const struct pfs_device *dev, const char *name, int oflags)
     {
-    struct pfs_file *uart = (struct pfs_file *) malloc (sizeof (struct pfs_file));
+    struct pfs_file *uart = (struct pfs_file *) pfs_file_alloc (sizeof (struct pfs_file));
     if ( uart == NULL )
         {
         pfs_error (ENOMEM);
@@ -249,21 +398,50 @@ STATIC struct pfs_file *uart_open (const struct pfs_device *dev, const char *nam
     return uart;
     }
 
+// Creating an existing device again keeps its buffer and receive mode
 struct pfs_device *pfs_dev_uart_create (int uid, SERIAL_CONFIG *sc)
+    {
+    if (( uid >= 0 ) && ( uid <= 1 ) && ( uart_dev[uid] != NULL ))
+        return pfs_dev_uart_create_ex (uid, sc, uart_dev[uid]->ndata, uart_dev[uid]->bDma);
+    return pfs_dev_uart_create_ex (uid, sc, NDATA, false);
+    }
+
+// Receiving by DMA, the buffer cannot hold off the sender, so an RTS pin
+// is refused, as is IOC_MD_ECHO mode while the DMA channel is in use.
+// An existing device may only be reconfigured with the same buffer size
+// and receive mode.
+struct pfs_device *pfs_dev_uart_create_ex (int uid, SERIAL_CONFIG *sc, int ndata, bool bDma)
     {
     if (( uid < 0 ) || ( uid > 1 )) return NULL;
     if ( uart_dev[uid] != NULL )
         {
-        uopen (uid, sc);
-        return (struct pfs_device *) uart_dev[uid];
+        if (( ndata != uart_dev[uid]->ndata ) || ( bDma != uart_dev[uid]->bDma )) return NULL;
+        // Send any buffered output and release the DMA channel before reconfiguring
+        uart_flush (uart_dev[uid]);
+        uart_tx_wait_blocking (uart_dev[uid]->uart);
+        uclose (uid);
+        if ( uopen (uid, sc) ) return (struct pfs_device *) uart_dev[uid];
+        return NULL;
         }
+    if (( ndata < 2 ) || (( ndata & ( ndata - 1 )) != 0 )) return NULL;
+    if ( bDma && ( ndata > NDMAMAX )) return NULL;
     uart_dev[uid] = (struct pfs_dev_uart *) malloc (sizeof (struct pfs_dev_uart));
     if ( uart_dev[uid] == NULL ) return NULL;
+    uart_dev[uid]->data = (char *) ( bDma ? aligned_alloc (ndata, ndata) : malloc (ndata) );
+    if ( uart_dev[uid]->data == NULL )
+        {
+        free (uart_dev[uid]);
+        uart_dev[uid] = NULL;
+        return NULL;
+        }
+    uart_dev[uid]->ndata = ndata;
+    uart_dev[uid]->bDma = bDma;
     uart_dev[uid]->open = uart_open;
     uart_dev[uid]->mode = IOC_MD_CR | IOC_MD_TLF;
     uart_dev[uid]->tout = 0;
     if ( uopen (uid, sc) ) return (struct pfs_device *) uart_dev[uid];
     uclose (uid);
+    free (uart_dev[uid]->data);
     free (uart_dev[uid]);
     uart_dev[uid] = NULL;
     return NULL;
@@ -8,5 +8,6 @@
 #include <ioctl.h>
 
 struct pfs_device *pfs_dev_uart_create (int uid, SERIAL_CONFIG *sc);
+struct pfs_device *pfs_dev_uart_create_ex (int uid, SERIAL_CONFIG *sc, int ndata, bool bDma);
 
 #endif
@@ -6,12 +6,42 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <lfs.h>
 #include <hardware/flash.h>
 #include <hardware/sync.h>
+
+// How littlefs reads flash:
+//  0 = Through the XIP cache (default)
+//  1 = Through the non-caching, non-allocating XIP alias, so that file data
+//      does not evict code from the XIP cache
+//  2 = By DMA from the XIP streaming interface, also bypassing the cache,
+//      with the CPU free while the transfer runs
+#ifndef FFS_PICO_XIP
+#define FFS_PICO_XIP    0
+#endif
+
+// Number of flash operations (page programs or sector erases) that may be
+// held in RAM, to be written later by ffs_pico_flush. Zero writes through.
+#ifndef FFS_PICO_WBUF
+#define FFS_PICO_WBUF   0
+#endif
+
+#if FFS_PICO_XIP == 2
+#include <hardware/dma.h>
+#include <hardware/structs/xip_ctrl.h>
+#endif
 #ifdef PICO_MCLOCK
 #include <pico/multicore.h>
 #endif
+#ifdef LFS_THREADSAFE
+#include <pico/sync.h>
+#endif
+#include <pico/time.h>
+#include <ffs_pico.h>
+#include <pfs_trace.h>
 
 #ifndef STATIC
 #define STATIC  static
@@ -21,30 +51,161 @@ STATIC int ffs_pico_read (const struct lfs_config *cfg, lfs_block_t block, lfs_o
 STATIC int ffs_pico_prog (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
 STATIC int ffs_pico_erase (const struct lfs_config *cfg, lfs_block_t block);
 STATIC int ffs_pico_sync (const struct lfs_config *cfg);
+#if FFS_PICO_WBUF > 0
+STATIC void ffs_pico_wop_overlay (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off,
+    uint8_t *buffer, lfs_size_t size);
+#endif
+#ifdef LFS_THREADSAFE
+STATIC int ffs_pico_lock (const struct lfs_config *cfg);
+STATIC int ffs_pico_unlock (const struct lfs_config *cfg);
+#endif
+
+#if FFS_PICO_WBUF > 0
+// A flash operation waiting to be written
+struct ffs_pico_wop
+    {
+    lfs_block_t     block;      // Block to write
+    int             off;        // Offset of page in block, or -1 to erase the block
+    uint8_t         data[FLASH_PAGE_SIZE];
+    };
+#endif
+
+// Block device context, one per volume
+struct ffs_pico_context
+    {
+    uint8_t *       base;       // Start of the volume in XIP address space
+    const uint8_t * rbase;      // Start of the volume in the XIP alias used for reading
+#if FFS_PICO_XIP == 2
+    int             dma;        // DMA channel for streaming reads (-1 if none)
+#endif
+#ifdef LFS_THREADSAFE
+    mutex_t         lock;       // Serialises littlefs calls on this volume
+#endif
+    uint32_t *      erased;     // Bitmap of free blocks erased by ffs_pico_preerase
+    uint32_t        gen;        // Count of programs and erases, to detect littlefs activity
+#if FFS_PICO_WBUF > 0
+    int             wfirst;     // Oldest queued operation
+    int             nwop;       // Number of queued operations
+    struct ffs_pico_wop wop[FFS_PICO_WBUF];
+#endif
+    struct ffs_pico_stats stats;
+    };
 
 int ffs_pico_createcfg (struct lfs_config *cfg, int offset, int size)
     {
+    return ffs_pico_createcfg_ex (cfg, offset, size, NULL);
+    }
+
+int ffs_pico_createcfg_ex (struct lfs_config *cfg, int offset, int size, const struct ffs_pico_params *params)
+    {
+    static const struct ffs_pico_params defaults = { 0 };
+    if ( params == NULL ) params = &defaults;
+    int block_size = ( params->block_size > 0 ) ? params->block_size : FLASH_SECTOR_SIZE;
+    int cache_size = ( params->cache_size > 0 ) ? params->cache_size : FLASH_PAGE_SIZE;
     if ( offset % FLASH_PAGE_SIZE != 0 ) return -1;
+    if (( block_size % FLASH_SECTOR_SIZE != 0 ) || ( cache_size % FLASH_PAGE_SIZE != 0 )
+        || ( block_size % cache_size != 0 ) || ( params->lookahead_size % 8 != 0 )) return -1;
+    struct ffs_pico_context *ctx = (struct ffs_pico_context *) malloc (sizeof (struct ffs_pico_context));
+    if ( ctx == NULL ) return -1;
+    memset (ctx, 0, sizeof (struct ffs_pico_context));
+    ctx->erased = (uint32_t *) calloc ((size / block_size + 31) / 32, sizeof (uint32_t));
+    if ( ctx->erased == NULL )
+        {
+        free (ctx);
+        return -1;
+        }
+    ctx->base = (uint8_t *) (XIP_BASE + offset);
+#if FFS_PICO_XIP == 0
+    ctx->rbase = ctx->base;
+#else
+    ctx->rbase = (const uint8_t *) (XIP_NOCACHE_NOALLOC_BASE + offset);
+#endif
+#if FFS_PICO_XIP == 2
+    // Without a free channel, reads just use the non-caching alias
+    ctx->dma = dma_claim_unused_channel (false);
+#endif
+#ifdef LFS_THREADSAFE
+    mutex_init (&ctx->lock);
+#endif
     memset (cfg, 0, sizeof (struct lfs_config));
-    cfg->context = (void *) (XIP_BASE + offset);
+    cfg->context = ctx;
     cfg->read = ffs_pico_read;
     cfg->prog = ffs_pico_prog;
     cfg->erase = ffs_pico_erase;
     cfg->sync = ffs_pico_sync;
+#ifdef LFS_THREADSAFE
+    cfg->lock = ffs_pico_lock;
+    cfg->unlock = ffs_pico_unlock;
+#endif
     cfg->read_size = 1;
     cfg->prog_size = FLASH_PAGE_SIZE;
-    cfg->block_size = FLASH_SECTOR_SIZE;
-    cfg->block_count = size / FLASH_SECTOR_SIZE;
-    cfg->cache_size = FLASH_PAGE_SIZE;
-    cfg->cache_size = 256;
-    cfg->lookahead_size = 32;
-    cfg->block_cycles = 256;
+    cfg->block_size = block_size;
+    cfg->block_count = size / block_size;
+    cfg->cache_size = cache_size;
+    cfg->lookahead_size = ( params->lookahead_size > 0 ) ? params->lookahead_size : 32;
+    cfg->block_cycles = ( params->block_cycles != 0 ) ? params->block_cycles : 256;
+    cfg->read_buffer = params->read_buffer;
+    cfg->prog_buffer = params->prog_buffer;
+    cfg->lookahead_buffer = params->lookahead_buffer;
 	return 0;
     }
 
+const uint8_t *ffs_pico_mmap_base (const struct lfs_config *cfg)
+    {
+    if ( cfg->read != ffs_pico_read ) return NULL;
+    return ((struct ffs_pico_context *) cfg->context)->rbase;
+    }
+
+int ffs_pico_destroy (const struct lfs_config *cfg)
+    {
+    ffs_pico_flush (cfg, 0);
+#if FFS_PICO_XIP == 2
+    struct ffs_pico_context *ctx = (struct ffs_pico_context *) cfg->context;
+    if ( ctx->dma >= 0 ) dma_channel_unclaim (ctx->dma);
+#endif
+    free (((struct ffs_pico_context *) cfg->context)->erased);
+    free (cfg->context);
+    return 0;
+    }
+
+#if FFS_PICO_XIP == 2
+#ifdef LFS_THREADSAFE
+// There is only one streaming interface, shared by all volumes
+auto_init_mutex (ffs_stream_lock);
+#endif
+
+// Stream whole words from flash to memory. Returns the number of bytes
+// transferred, which is zero if the stream could not be used.
+STATIC lfs_size_t ffs_pico_stream (struct ffs_pico_context *ctx, const uint8_t *src, uint8_t *dst, lfs_size_t size)
+    {
+    uint32_t nword = size / 4;
+    if (( ctx->dma < 0 ) || ( nword == 0 )) return 0;
+    if ((((uint32_t) src | (uint32_t) dst) & 3) != 0 ) return 0;
+#ifdef LFS_THREADSAFE
+    uint32_t owner;
+    if ( ! mutex_try_enter (&ffs_stream_lock, &owner) ) return 0;
+#endif
+    // Discard anything left in the FIFO by an earlier user of the stream
+    while ( ! ( xip_ctrl_hw->stat & XIP_STAT_FIFO_EMPTY ) ) (void) xip_ctrl_hw->stream_fifo;
+    xip_ctrl_hw->stream_addr = (uint32_t) src;
+    xip_ctrl_hw->stream_ctr = nword;
+    dma_channel_config dc = dma_channel_get_default_config (ctx->dma);
+    channel_config_set_transfer_data_size (&dc, DMA_SIZE_32);
+    channel_config_set_read_increment (&dc, false);
+    channel_config_set_write_increment (&dc, true);
+    channel_config_set_dreq (&dc, DREQ_XIP_STREAM);
+    dma_channel_configure (ctx->dma, &dc, dst, (const void *) XIP_AUX_BASE, nword, true);
+    dma_channel_wait_for_finish_blocking (ctx->dma);
+#ifdef LFS_THREADSAFE
+    mutex_exit (&ffs_stream_lock);
+#endif
+    return 4 * nword;
+    }
+#endif
+
 STATIC int ffs_pico_read (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
     {
-    uint8_t *ffs_mem  = (uint8_t *) cfg->context;
+    const uint8_t *ffs_mem  = ((struct ffs_pico_context *) cfg->context)->rbase;
 
 	// check if read is valid
 	LFS_ASSERT (off  % cfg->read_size == 0);
@@ -52,58 +213,331 @@ STATIC int ffs_pico_read (const struct lfs_config *cfg, lfs_block_t block, lfs_o
 	LFS_ASSERT (block < cfg->block_count);
 
 	// read data
-	memcpy (buffer, &ffs_mem[block*cfg->block_size + off], size);
+    const uint8_t *src = &ffs_mem[block*cfg->block_size + off];
+    uint8_t *dst = (uint8_t *) buffer;
+    lfs_size_t len = size;
+#if FFS_PICO_XIP == 2
+    lfs_size_t nstream = ffs_pico_stream ((struct ffs_pico_context *) cfg->context, src, dst, len);
+    src += nstream;
+    dst += nstream;
+    len -= nstream;
+#endif
+	memcpy (dst, src, len);
+#if FFS_PICO_WBUF > 0
+    // Data still queued for writing replaces what is in flash
+    ffs_pico_wop_overlay (cfg, block, off, (uint8_t *) buffer, size);
+#endif
 
 	return 0;
     }
 
-STATIC int ffs_pico_prog (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+// Program (data != NULL) or erase flash at offset foff from the start of
+// flash. Interrupts on this core are off, and with PICO_MCLOCK the other core
+// is stalled, for just this one operation. The code runs from RAM, so when
+// the other core is not locked out it may carry on with code and interrupt
+// handlers that are also in RAM.
+STATIC void __no_inline_not_in_flash_func(ffs_pico_flash_op1) (struct ffs_pico_context *ctx,
+    uint32_t foff, const uint8_t *data, uint32_t size)
     {
-    uint8_t *ffs_mem  = (uint8_t *) cfg->context;
-
-	// check if write is valid
-	LFS_ASSERT (off  % cfg->prog_size == 0);
-	LFS_ASSERT (size % cfg->prog_size == 0);
-	LFS_ASSERT (block < cfg->block_count);
-
-	// program data
+    pfs_trace (( data != NULL ) ? PFS_TR_FLASH_PROG : PFS_TR_FLASH_ERASE, 0, foff);
 #if defined (PICO_MCLOCK)
     multicore_lockout_start_blocking ();
 #endif
+    uint32_t t0 = time_us_32 ();
 	uint32_t ints = save_and_disable_interrupts ();
-	flash_range_program (&ffs_mem[block*cfg->block_size + off]
-		-(uint8_t *)XIP_BASE, buffer, size);
+    if ( data != NULL ) flash_range_program (foff, data, size);
+    else flash_range_erase (foff, size);
 	restore_interrupts (ints);
+    uint32_t t = time_us_32 () - t0;
 #if defined (PICO_MCLOCK)
     multicore_lockout_end_blocking ();
 #endif
+    if ( data != NULL ) ++ctx->stats.progs;
+    else ++ctx->stats.erases;
+    if ( t > ctx->stats.max_blackout_us ) ctx->stats.max_blackout_us = t;
+    ctx->stats.blackout_us += t;
+    pfs_trace (PFS_TR_FLASH_DONE, 0, t);
+    }
+
+// Flash is programmed one page and erased one sector at a time, so that the
+// interrupt blackout does not grow with the cache or block size
+STATIC void ffs_pico_flash_op (struct ffs_pico_context *ctx, uint32_t foff, const uint8_t *data, uint32_t size)
+    {
+    uint32_t step = ( data != NULL ) ? FLASH_PAGE_SIZE : FLASH_SECTOR_SIZE;
+    for (uint32_t done = 0; done < size; done += step)
+        ffs_pico_flash_op1 (ctx, foff + done, ( data != NULL ) ? data + done : NULL, step);
+    }
+
+STATIC uint32_t ffs_pico_foff (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off)
+    {
+    return ((struct ffs_pico_context *) cfg->context)->base + block * cfg->block_size + off
+        - (uint8_t *) XIP_BASE;
+    }
+
+#if FFS_PICO_WBUF > 0
+// Write the oldest queued operation to flash
+STATIC void ffs_pico_wop_flush (const struct lfs_config *cfg)
+    {
+    struct ffs_pico_context *ctx = (struct ffs_pico_context *) cfg->context;
+    struct ffs_pico_wop *wop = &ctx->wop[ctx->wfirst];
+    if ( wop->off < 0 )
+        ffs_pico_flash_op (ctx, ffs_pico_foff (cfg, wop->block, 0), NULL, cfg->block_size);
+    else
+        ffs_pico_flash_op (ctx, ffs_pico_foff (cfg, wop->block, wop->off), wop->data, FLASH_PAGE_SIZE);
+    if ( ++ctx->wfirst >= FFS_PICO_WBUF ) ctx->wfirst = 0;
+    --ctx->nwop;
+    }
+
+// Add an operation to the queue, making room if it is full
+STATIC struct ffs_pico_wop *ffs_pico_wop_add (const struct lfs_config *cfg, lfs_block_t block, int off)
+    {
+    struct ffs_pico_context *ctx = (struct ffs_pico_context *) cfg->context;
+    if ( ctx->nwop >= FFS_PICO_WBUF )
+        {
+        ++ctx->stats.stalls;
+        ffs_pico_wop_flush (cfg);
+        }
+    int iwop = ctx->wfirst + ctx->nwop;
+    if ( iwop >= FFS_PICO_WBUF ) iwop -= FFS_PICO_WBUF;
+    ++ctx->nwop;
+    struct ffs_pico_wop *wop = &ctx->wop[iwop];
+    wop->block = block;
+    wop->off = off;
+    return wop;
+    }
+
+// Apply queued operations, oldest first, to data just read from flash
+STATIC void ffs_pico_wop_overlay (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off,
+    uint8_t *buffer, lfs_size_t size)
+    {
+    struct ffs_pico_context *ctx = (struct ffs_pico_context *) cfg->context;
+    int iwop = ctx->wfirst;
+    for (int i = 0; i < ctx->nwop; ++i)
+        {
+        struct ffs_pico_wop *wop = &ctx->wop[iwop];
+        if ( wop->block == block )
+            {
+            if ( wop->off < 0 )
+                {
+                memset (buffer, 0xFF, size);
+                }
+            else if (( wop->off < off + size ) && ( wop->off + FLASH_PAGE_SIZE > off ))
+                {
+                lfs_off_t o1 = ( wop->off > off ) ? wop->off : off;
+                lfs_off_t o2 = ( wop->off + FLASH_PAGE_SIZE < off + size ) ? wop->off + FLASH_PAGE_SIZE : off + size;
+                memcpy (&buffer[o1 - off], &wop->data[o1 - wop->off], o2 - o1);
+                }
+            }
+        if ( ++iwop >= FFS_PICO_WBUF ) iwop = 0;
+        }
+    }
+#endif
+
+int ffs_pico_flush (const struct lfs_config *cfg, int nop)
+    {
+#if FFS_PICO_WBUF > 0
+    struct ffs_pico_context *ctx = (struct ffs_pico_context *) cfg->context;
+#ifdef LFS_THREADSAFE
+    mutex_enter_blocking (&ctx->lock);
+#endif
+    if ( nop <= 0 ) nop = ctx->nwop;
+    while (( nop > 0 ) && ( ctx->nwop > 0 ))
+        {
+        ffs_pico_wop_flush (cfg);
+        --nop;
+        }
+    int nleft = ctx->nwop;
+#ifdef LFS_THREADSAFE
+    mutex_exit (&ctx->lock);
+#endif
+    return nleft;
+#else
+    return 0;
+#endif
+    }
+
+void ffs_pico_stats (const struct lfs_config *cfg, struct ffs_pico_stats *stats, bool bReset)
+    {
+    struct ffs_pico_context *ctx = (struct ffs_pico_context *) cfg->context;
+#ifdef LFS_THREADSAFE
+    mutex_enter_blocking (&ctx->lock);
+#endif
+    memcpy (stats, &ctx->stats, sizeof (struct ffs_pico_stats));
+#if FFS_PICO_WBUF > 0
+    stats->queued = ctx->nwop;
+#endif
+    if ( bReset )
+        {
+        ctx->stats.progs = 0;
+        ctx->stats.erases = 0;
+        ctx->stats.stalls = 0;
+        ctx->stats.preerased = 0;
+        ctx->stats.skipped = 0;
+        ctx->stats.max_blackout_us = 0;
+        ctx->stats.blackout_us = 0;
+        }
+#ifdef LFS_THREADSAFE
+    mutex_exit (&ctx->lock);
+#endif
+    }
+
+int ffs_pico_stats_print (void *ctx, char *buf, int len)
+    {
+    if (( ctx == NULL ) || ( buf == NULL ) || ( len <= 0 )) return 0;
+    struct ffs_pico_stats st;
+    ffs_pico_stats ((const struct lfs_config *) ctx, &st, false);
+    int n = snprintf (buf, len, "flash progs %lu erases %lu stalls %lu queued %lu"
+        " preerased %lu skipped %lu irq off %llu us %lu us max\n", (unsigned long) st.progs,
+        (unsigned long) st.erases, (unsigned long) st.stalls, (unsigned long) st.queued,
+        (unsigned long) st.preerased, (unsigned long) st.skipped, (unsigned long long) st.blackout_us,
+        (unsigned long) st.max_blackout_us);
+    if ( n < 0 ) return 0;
+    return ( n < len ) ? n : len - 1;
+    }
+
+STATIC int ffs_pico_prog (const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+    {
+	// check if write is valid
+	LFS_ASSERT (off  % cfg->prog_size == 0);
+	LFS_ASSERT (size % cfg->prog_size == 0);
+	LFS_ASSERT (block < cfg->block_count);
+
+    // The block is no longer erased
+    struct ffs_pico_context *ctx = (struct ffs_pico_context *) cfg->context;
+    ctx->erased[block / 32] &= ~( 1u << ( block % 32 ) );
+    ++ctx->gen;
+
+	// program data
+#if FFS_PICO_WBUF > 0
+    const uint8_t *data = (const uint8_t *) buffer;
+    while ( size > 0 )
+        {
+        struct ffs_pico_wop *wop = ffs_pico_wop_add (cfg, block, off);
+        memcpy (wop->data, data, FLASH_PAGE_SIZE);
+        data += FLASH_PAGE_SIZE;
+        off += FLASH_PAGE_SIZE;
+        size -= FLASH_PAGE_SIZE;
+        }
+#else
+    ffs_pico_flash_op (ctx, ffs_pico_foff (cfg, block, off), buffer, size);
+#endif
 
 	return 0;
     }
 
 STATIC int ffs_pico_erase (const struct lfs_config *cfg, lfs_block_t block)
     {
-    uint8_t *ffs_mem  = (uint8_t *) cfg->context;
-
 	// check if erase is valid
 	LFS_ASSERT (block < cfg->block_count);
 
-#if defined (PICO_MCLOCK)
-    multicore_lockout_start_blocking ();
-#endif
-	uint32_t ints = save_and_disable_interrupts ();
-	flash_range_erase (&ffs_mem[block*cfg->block_size]
-		-(uint8_t *)XIP_BASE, cfg->block_size);
-	restore_interrupts (ints);
-#if defined (PICO_MCLOCK)
-    multicore_lockout_end_blocking ();
+    // A block erased by ffs_pico_preerase has not been programmed since
+    struct ffs_pico_context *ctx = (struct ffs_pico_context *) cfg->context;
+    ++ctx->gen;
+    if ( ctx->erased[block / 32] & ( 1u << ( block % 32 ) ) )
+        {
+        ctx->erased[block / 32] &= ~( 1u << ( block % 32 ) );
+        ++ctx->stats.skipped;
+        return 0;
+        }
+
+#if FFS_PICO_WBUF > 0
+    ffs_pico_wop_add (cfg, block, -1);
+#else
+    ffs_pico_flash_op (ctx, ffs_pico_foff (cfg, block, 0), NULL, cfg->block_size);
 #endif
 
 	return 0;
     }
 
+// Mark a block found by lfs_fs_traverse as in use
+STATIC int ffs_pico_used (void *data, lfs_block_t block)
+    {
+    uint32_t *used = (uint32_t *) data;
+    used[block / 32] |= 1u << ( block % 32 );
+    return 0;
+    }
+
+STATIC bool ffs_pico_blank (const uint32_t *data, lfs_size_t size)
+    {
+    for (lfs_size_t i = 0; i < size / 4; ++i)
+        {
+        if ( data[i] != 0xFFFFFFFF ) return false;
+        }
+    return true;
+    }
+
+int ffs_pico_preerase (lfs_t *lfs, const struct lfs_config *cfg, int nblk)
+    {
+    if ( cfg->read != ffs_pico_read ) return -1;
+    struct ffs_pico_context *ctx = (struct ffs_pico_context *) cfg->context;
+    int nword = ( cfg->block_count + 31 ) / 32;
+    uint32_t *used = (uint32_t *) calloc (nword, sizeof (uint32_t));
+    if ( used == NULL ) return -1;
+#ifdef LFS_THREADSAFE
+    mutex_enter_blocking (&ctx->lock);
+#endif
+    uint32_t gen = ctx->gen;
+#ifdef LFS_THREADSAFE
+    mutex_exit (&ctx->lock);
+#endif
+    // lfs_fs_traverse takes the volume lock itself. It lists every block
+    // littlefs may yet read, including those of files open for writing.
+    int r = lfs_fs_traverse (lfs, ffs_pico_used, used);
+    if ( r < 0 )
+        {
+        free (used);
+        return r;
+        }
+#ifdef LFS_THREADSAFE
+    mutex_enter_blocking (&ctx->lock);
+#endif
+    // Any program or erase since the traverse may be to a block it found free
+    int nerase = 0;
+    if ( ctx->gen == gen )
+        {
+#if FFS_PICO_WBUF > 0
+        // Queued operations must reach flash before it is checked for blank blocks
+        while ( ctx->nwop > 0 ) ffs_pico_wop_flush (cfg);
+#endif
+        for (lfs_block_t block = 0; block < cfg->block_count; ++block)
+            {
+            uint32_t bit = 1u << ( block % 32 );
+            if (( used[block / 32] | ctx->erased[block / 32] ) & bit ) continue;
+            // A block that is already blank is only marked, to save wear
+            if ( ! ffs_pico_blank ((const uint32_t *) &ctx->rbase[block * cfg->block_size], cfg->block_size) )
+                {
+                if (( nblk > 0 ) && ( nerase >= nblk )) continue;
+                ffs_pico_flash_op (ctx, ffs_pico_foff (cfg, block, 0), NULL, cfg->block_size);
+                ++ctx->stats.preerased;
+                ++nerase;
+                }
+            ctx->erased[block / 32] |= bit;
+            }
+        }
+#ifdef LFS_THREADSAFE
+    mutex_exit (&ctx->lock);
+#endif
+    free (used);
+    return nerase;
+    }
+
 STATIC int ffs_pico_sync (const struct lfs_config *cfg)
     {
-	// sync does nothing because we aren't backed by anything real
+	// With write-behind, queued data reaches flash when ffs_pico_flush is called
+	// (or the queue fills), not on sync
 	return 0;
     }
+
+#ifdef LFS_THREADSAFE
+STATIC int ffs_pico_lock (const struct lfs_config *cfg)
+    {
+    mutex_enter_blocking (&((struct ffs_pico_context *) cfg->context)->lock);
+    return 0;
+    }
+
+STATIC int ffs_pico_unlock (const struct lfs_config *cfg)
+    {
+    mutex_exit (&((struct ffs_pico_context *) cfg->context)->lock);
+    return 0;
+    }
+#endif
@@ -22,29 +22,77 @@ extern "C"
 #endif
 
 // Create a configuration for a flash block device
+//
+// When built with LFS_THREADSAFE the configuration includes a lock
+// for the volume, so that both cores may use it.
 int ffs_pico_createcfg (struct lfs_config *cfg, int offset, int size);
 
-// Clean up memory associated with block device
-int ffs_pico_destroy (const struct lfs_config *cfg);
+// Tuning for ffs_pico_createcfg_ex. Zero (or NULL) members take the
+// defaults used by ffs_pico_createcfg.
+struct ffs_pico_params
+    {
+    int         block_size;         // Logical block size, a multiple of FLASH_SECTOR_SIZE (default one sector)
+    int         cache_size;         // Read, program and file cache size, a multiple of FLASH_PAGE_SIZE
+                                    // which divides the block size (default FLASH_PAGE_SIZE)
+    int         lookahead_size;     // Lookahead bitmap size in bytes, a multiple of 8 (default 32)
+    int         block_cycles;       // Erase cycles before moving metadata, -1 to disable wear levelling (default 256)
+    void *      read_buffer;        // Static read cache of cache_size bytes (default allocated by littlefs)
+    void *      prog_buffer;        // Static program cache of cache_size bytes (default allocated by littlefs)
+    void *      lookahead_buffer;   // Static lookahead buffer of lookahead_size bytes, 32-bit aligned
+                                    // (default allocated by littlefs)
+    };
+
+// Create a configuration with the given tuning. Returns -1 if any of the
+// sizes are invalid, or as for ffs_pico_createcfg.
+int ffs_pico_createcfg_ex (struct lfs_config *cfg, int offset, int size, const struct ffs_pico_params *params);
+
+// Address of block 0 in the XIP address space, if the configuration was
+// created by ffs_pico_createcfg, otherwise NULL
+const uint8_t *ffs_pico_mmap_base (const struct lfs_config *cfg);
 
-// Read a block
-int ffs_pico_read (const struct lfs_config *cfg, lfs_block_t block,
-        lfs_off_t off, void *buffer, lfs_size_t size);
+// Counts of flash operations, and the time (microseconds) that interrupts
+// were disabled for them
+struct ffs_pico_stats
+    {
+    uint32_t    progs;              // Pages programmed
+    uint32_t    erases;             // Sectors erased
+    uint32_t    stalls;             // Operations written early because the queue was full
+    uint32_t    queued;             // Operations currently waiting to be written
+    uint32_t    preerased;          // Blocks erased by ffs_pico_preerase
+    uint32_t    skipped;            // Erases not needed, as ffs_pico_preerase had done them
+    uint32_t    max_blackout_us;    // Longest period with interrupts disabled
+    uint64_t    blackout_us;        // Total time with interrupts disabled
+    };
 
-// Program a block
+// Write operations queued by write-behind (FFS_PICO_WBUF > 0) to flash.
+// Writes at most nop operations, or all of them if nop is zero. Returns the
+// number of operations still queued.
 //
-// The block must have previously been erased.
-int ffs_pico_prog (const struct lfs_config *cfg, lfs_block_t block,
-        lfs_off_t off, const void *buffer, lfs_size_t size);
+// Call this from a low priority context, such as the main loop, to keep the
+// time spent with interrupts disabled out of time critical code. It must not
+// be called from an interrupt handler.
+int ffs_pico_flush (const struct lfs_config *cfg, int nop);
 
-// Erase a block
+// Erase blocks which littlefs has released, so that it does not have to
+// erase them when it next allocates them. Erases at most nblk blocks, or
+// all free ones if nblk is zero, and returns the number erased, or a
+// negative value on error. lfs is the volume mounted with cfg.
 //
-// A block must be erased before being programmed. The
-// state of an erased block is undefined.
-int ffs_pico_erase (const struct lfs_config *cfg, lfs_block_t block);
+// Call this when the volume is idle, for example from the main loop, to
+// move erase time out of later writes. It must not be called from an
+// interrupt handler, or while a littlefs call on the volume is in progress.
+int ffs_pico_preerase (lfs_t *lfs, const struct lfs_config *cfg, int nblk);
 
-// Sync the block device
-int ffs_pico_sync (const struct lfs_config *cfg);
+// Get flash operation statistics, optionally resetting the counts
+void ffs_pico_stats (const struct lfs_config *cfg, struct ffs_pico_stats *stats, bool bReset);
+
+// Write a text report of the flash statistics to buf (len bytes, including
+// terminator), returning its length. ctx is the struct lfs_config, this may
+// be given to pfs_dev_stat_source.
+int ffs_pico_stats_print (void *ctx, char *buf, int len);
+
+// Clean up memory associated with block device
+int ffs_pico_destroy (const struct lfs_config *cfg);
 
 #ifdef __cplusplus
 } /* extern "C" */
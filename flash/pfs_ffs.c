@@ -2,20 +2,32 @@
 // Copyright (c) 2023, Memotech-Bill
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/syslimits.h>
 #include <fcntl.h>
 #include <pfs_private.h>
 #include <lfs.h>
+#include <ffs_pico.h>
+#include <../device/ioctl.h>
 
 #ifndef STATIC
 #define STATIC  static
 #endif
 
+// Size of a file cache held in each open file structure (and so in the file
+// pool when that is used), rather than allocated by littlefs. It is used when
+// at least the cache size of the volume. Zero leaves allocation to littlefs.
+#ifndef FFS_FILE_BUF
+#define FFS_FILE_BUF    0
+#endif
+
 STATIC struct pfs_file *ffs_open (struct pfs_pfs *pfs, const char *fn, int oflag);
 STATIC int ffs_close (struct pfs_file *pfs_fd);
 STATIC int ffs_read (struct pfs_file *pfs_fd, char *buffer, int length);
@@ -23,6 +35,11 @@ STATIC int ffs_write (struct pfs_file *pfs_fd, char *buffer, int length);
 STATIC long ffs_lseek (struct pfs_file *pfs_fd, long pos, int whence);
 STATIC int ffs_fstat (struct pfs_file *pfs_fd, struct stat *buf);
 STATIC int ffs_isatty (struct pfs_file *fd);
+STATIC int ffs_ioctl (struct pfs_file *pfs_fd, unsigned long request, void *argp);
+STATIC int ffs_allocate (struct pfs_file *pfs_fd, off_t offset, off_t len);
+STATIC int ffs_pread (struct pfs_file *pfs_fd, char *buffer, int length, off_t offset);
+STATIC int ffs_pwrite (struct pfs_file *pfs_fd, const char *buffer, int length, off_t offset);
+STATIC int ffs_fsync (struct pfs_file *pfs_fd);
 STATIC int ffs_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf);
 STATIC int ffs_rename (struct pfs_pfs *pfs, const char *old, const char *new);
 STATIC int ffs_delete (struct pfs_pfs *pfs, const char *name);
@@ -32,6 +49,9 @@ STATIC void *ffs_opendir (struct pfs_pfs *pfs, const char *name);
 STATIC struct dirent *ffs_readdir (void *dirp);
 STATIC int ffs_closedir (void *dirp);
 STATIC int ffs_chmod (struct pfs_pfs *pfs, const char *pathname, mode_t mode);
+STATIC int ffs_umount (struct pfs_pfs *pfs);
+STATIC int ffs_statvfs (struct pfs_pfs *pfs, struct statvfs *buf);
+STATIC uint32_t ffs_cache_id (struct pfs_pfs *pfs);
 
 STATIC const struct pfs_v_pfs ffs_v_pfs =
     {
@@ -42,7 +62,10 @@ STATIC const struct pfs_v_pfs ffs_v_pfs =
     ffs_mkdir,
     ffs_rmdir,
     ffs_opendir,
-    ffs_chmod
+    ffs_chmod,
+    ffs_umount,
+    ffs_statvfs,
+    ffs_cache_id
     };
     
 STATIC const struct pfs_v_file ffs_v_file =
@@ -53,7 +76,14 @@ STATIC const struct pfs_v_file ffs_v_file =
     ffs_lseek,
     ffs_fstat,
     NULL,           // isatty
-    NULL            // ioctl
+    ffs_ioctl,
+    ffs_allocate,
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    ffs_pread,
+    ffs_pwrite,
+    ffs_fsync
     };
 
 STATIC const struct pfs_v_dir ffs_v_dir =
@@ -67,6 +97,24 @@ struct ffs_pfs
     const struct pfs_v_pfs *    entry;
     lfs_t                       base;
     struct lfs_config           cfg;
+    const uint8_t *             xip;        // Block 0 in memory mapped flash (NULL if not mapped)
+    bool                        bMounted;   // False until first use, for pfs_ffs_create_lazy
+    lfs_ssize_t                 nused;      // Blocks in use when last counted (-1 = not known)
+    lfs_size_t                  nalloc;     // Most blocks that can have been allocated since
+    uint32_t                    cache_gen;  // Changed when files are renamed behind the stat cache
+    };
+
+// Log mode (IOC_RQ_LOG) of an open file
+struct ffs_log
+    {
+    lfs_size_t                  size;       // Size of the RAM buffer, whole pages
+    lfs_size_t                  nbuf;       // Bytes held in the buffer
+    lfs_size_t                  commit;     // Commit after this many bytes (0 = only on fsync or close)
+    lfs_size_t                  ncommit;    // Bytes written since the last commit
+    lfs_soff_t                  segment;    // Segment size limit (0 = no rotation)
+    int                         keep;       // Old segments kept
+    bool                        bLost;      // The file could not be opened again after rotation
+    uint8_t                     data[];
     };
 
 struct ffs_file
@@ -75,6 +123,13 @@ struct ffs_file
     struct ffs_pfs *            ffs;
     const char *                pn;
     lfs_file_t                  ft;
+    struct pfs_sync             sync;       // When to sync while writing
+    struct ffs_log *            log;        // Log mode state (NULL if not in log mode)
+    int                         nrel;       // Length of the name within the volume, the end of pn
+#if FFS_FILE_BUF > 0
+    struct lfs_file_config      fc;
+    uint32_t                    fbuf[(FFS_FILE_BUF + 3) / 4];
+#endif
     };
 
 struct ffs_dir
@@ -84,13 +139,84 @@ struct ffs_dir
     int                         flags;
     struct pfs_mount *          m;
     struct dirent               de;
+    long long                   size;       // Size of the file in de (0 if not known)
     lfs_dir_t                   dt;
     };
 
+// Counting the blocks in use (lfs_fs_size) reads all the metadata and file
+// block lists. So the count is kept, with an upper bound on the blocks which
+// later writes can have allocated, and only repeated when space may have been
+// freed or the bound becomes too loose.
+
+// Allow for writing length bytes (possibly spanning one more block)
+STATIC void ffs_alloc (struct ffs_pfs *ffs, lfs_size_t length)
+    {
+    pfs_lock ();
+    ffs->nalloc += ( length + ffs->cfg.block_size - 1 ) / ffs->cfg.block_size + 1;
+    pfs_unlock ();
+    }
+
+// Blocks may have been freed, so count them again when next needed
+STATIC void ffs_freed (struct ffs_pfs *ffs)
+    {
+    pfs_lock ();
+    ffs->nused = -1;
+    pfs_unlock ();
+    }
+
+// Mount the flash, formatting it if it does not hold a filesystem
+STATIC int ffs_mount (struct ffs_pfs *ffs)
+    {
+    ffs->nused = -1;
+    ffs->nalloc = 0;
+    int r = lfs_mount (&ffs->base, &ffs->cfg);
+    if ( r < 0 )
+        {
+        r = lfs_format (&ffs->base, &ffs->cfg);
+        if ( r == 0 ) r = lfs_mount (&ffs->base, &ffs->cfg);
+        }
+    ffs->bMounted = ( r >= 0 );
+    return r;
+    }
+
+// Mount a lazily created volume on first use. Returns 0 or sets errno.
+STATIC int ffs_ready (struct ffs_pfs *ffs)
+    {
+    if ( ffs->bMounted ) return 0;
+    pfs_lock ();
+    int r = ffs->bMounted ? 0 : ffs_mount (ffs);
+    pfs_unlock ();
+    if ( r < 0 ) return pfs_error (EIO);
+    return 0;
+    }
+
+// Stat results may be out of date for any file of the volume
+STATIC void ffs_cache_changed (struct ffs_pfs *ffs)
+    {
+    pfs_lock ();
+    if ( ++ffs->cache_gen == 0 ) ffs->cache_gen = 1;
+    pfs_unlock ();
+    }
+
+// Open the littlefs file, with its cache in the file structure if that is large enough
+STATIC int ffs_file_open (struct ffs_pfs *ffs, struct ffs_file *fd, const char *fn, int of)
+    {
+#if FFS_FILE_BUF > 0
+    if ( ffs->cfg.cache_size <= FFS_FILE_BUF )
+        {
+        memset (&fd->fc, 0, sizeof (fd->fc));
+        fd->fc.buffer = fd->fbuf;
+        return lfs_file_opencfg (&ffs->base, &fd->ft, fn, of, &fd->fc);
+        }
+#endif
+    return lfs_file_open (&ffs->base, &fd->ft, fn, of);
+    }
+
 STATIC struct pfs_file *ffs_open (struct pfs_pfs *pfs, const char *fn, int oflag)
     {
     struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
-    struct ffs_file *fd = (struct ffs_file *) malloc (sizeof (struct ffs_file));
+    if ( ffs_ready (ffs) < 0 ) return NULL;
+    struct ffs_file *fd = (struct ffs_file *) pfs_file_alloc (sizeof (struct ffs_file));
     if ( fd == NULL )
         {
         pfs_error (ENOMEM);
@@ -98,6 +224,9 @@ STATIC struct pfs_file *ffs_open (struct pfs_pfs *pfs, const char *fn, int oflag
         }
     fd->entry = &ffs_v_file;
     fd->ffs = ffs;
+    fd->log = NULL;
+    fd->nrel = strlen (fn);
+    pfs_sync_init (&fd->sync);
     enum lfs_open_flags of = 0;
     switch ( oflag & O_ACCMODE )
         {
@@ -108,24 +237,212 @@ STATIC struct pfs_file *ffs_open (struct pfs_pfs *pfs, const char *fn, int oflag
     if ( oflag & O_APPEND ) of |= LFS_O_APPEND;
     if ( oflag & O_CREAT )  of |= LFS_O_CREAT;
     if ( oflag & O_TRUNC )  of |= LFS_O_TRUNC;
-    int r = lfs_file_open (&ffs->base, &fd->ft, fn, of);
+    if ( oflag & O_TRUNC ) ffs_freed (ffs);
+    else if ( oflag & O_CREAT ) ffs_alloc (ffs, ffs->cfg.block_size);
+    int r = ffs_file_open (ffs, fd, fn, of);
     if ( r >= 0 ) return (struct pfs_file *) fd;
     pfs_error (r);
-    free (fd);
+    pfs_file_free (fd);
     return NULL;
     }
 
+// Log mode holds written data in RAM, and passes it to littlefs in whole
+// pages. littlefs commits the file's metadata only when it is synced, but
+// each commit part way through a block means that the next write copies
+// that block to a new one before adding to it. So a commit, once due, waits
+// until littlefs has filled its current block, and the next write then
+// starts a new block. A log file may also be split into segments of a
+// limited size, the older ones being renamed and eventually deleted.
+
+// Pass the first n bytes held by log mode to littlefs
+STATIC int ffs_log_put (struct ffs_file *fd, lfs_size_t n)
+    {
+    struct ffs_log *log = fd->log;
+    struct ffs_pfs *ffs = fd->ffs;
+    if ( n == 0 ) return 0;
+    lfs_ssize_t r = lfs_file_write (&ffs->base, &fd->ft, log->data, n);
+    if ( r < 0 ) return r;
+    ffs_alloc (ffs, r);
+    log->nbuf -= n;
+    if ( log->nbuf > 0 ) memmove (log->data, log->data + n, log->nbuf);
+    return 0;
+    }
+
+// Commit what littlefs has been given, including anything held by write-behind
+STATIC int ffs_log_sync (struct ffs_file *fd)
+    {
+    struct ffs_pfs *ffs = fd->ffs;
+    pfs_sync_done (&fd->sync);
+    fd->log->ncommit = fd->log->nbuf;
+    int r = lfs_file_sync (&ffs->base, &fd->ft);
+    if (( r >= 0 ) && ( ffs->xip != NULL )) ffs_pico_flush (&ffs->cfg, 0);
+    return r;
+    }
+
+// Pass data held by log mode to littlefs, before any other operation on the
+// file. Returns 0 or sets errno.
+STATIC int ffs_log_drain (struct ffs_file *fd)
+    {
+    if ( fd->log == NULL ) return 0;
+    if ( fd->log->bLost ) return pfs_error (EIO);
+    return pfs_error (ffs_log_put (fd, fd->log->nbuf));
+    }
+
+// Give littlefs the data due to be written or committed
+STATIC int ffs_log_push (struct ffs_file *fd)
+    {
+    struct ffs_log *log = fd->log;
+    if (( log->commit > 0 ) && ( log->ncommit >= log->commit ))
+        {
+        // After a commit littlefs only knows where its block ends once written to again
+        if (( ! ( fd->ft.flags & ( LFS_F_WRITING | LFS_F_INLINE ) ) ) && ( log->nbuf > 0 ))
+            {
+            int r = ffs_log_put (fd, log->nbuf);
+            if ( r < 0 ) return r;
+            }
+        if ( fd->ft.flags & LFS_F_INLINE )
+            {
+            // Still small enough to be held in its directory entry, so no block to fill
+            int r = ffs_log_put (fd, log->nbuf);
+            return ( r < 0 ) ? r : ffs_log_sync (fd);
+            }
+        if ( fd->ft.flags & LFS_F_WRITING )
+            {
+            lfs_size_t room = fd->ffs->cfg.block_size - fd->ft.off;
+            if ( log->nbuf >= room )
+                {
+                int r = ffs_log_put (fd, room);
+                return ( r < 0 ) ? r : ffs_log_sync (fd);
+                }
+            }
+        }
+    if ( log->nbuf >= log->size ) return ffs_log_put (fd, log->nbuf);
+    return 0;
+    }
+
+// Start a new segment. The file becomes name.1, older segments move up one,
+// the oldest past keep is replaced, and the file is opened again empty.
+STATIC int ffs_log_rotate (struct ffs_file *fd)
+    {
+    struct ffs_pfs *ffs = fd->ffs;
+    struct ffs_log *log = fd->log;
+    const char *fn = fd->pn + strlen (fd->pn) - fd->nrel;
+    int of = ( fd->ft.flags & LFS_O_RDWR ) | LFS_O_CREAT | LFS_O_APPEND;
+    int r = ffs_log_put (fd, log->nbuf);
+    int r2 = lfs_file_close (&ffs->base, &fd->ft);
+    if ( r >= 0 ) r = r2;
+    size_t nlen = fd->nrel + 12;
+    char *sOld = (char *) malloc (2 * nlen);
+    if (( r >= 0 ) && ( sOld == NULL )) r = LFS_ERR_NOMEM;
+    if ( r >= 0 )
+        {
+        char *sNew = sOld + nlen;
+        ffs_freed (ffs);
+        for (int k = log->keep; ( r >= 0 ) && ( k > 1 ); --k)
+            {
+            sprintf (sOld, "%s.%d", fn, k - 1);
+            sprintf (sNew, "%s.%d", fn, k);
+            r = lfs_rename (&ffs->base, sOld, sNew);
+            if ( r == LFS_ERR_NOENT ) r = 0;
+            }
+        if (( r >= 0 ) && ( log->keep > 0 ))
+            {
+            sprintf (sNew, "%s.1", fn);
+            r = lfs_rename (&ffs->base, fn, sNew);
+            }
+        ffs_cache_changed (ffs);
+        }
+    free (sOld);
+    // If the segment was not renamed, carry on adding to it
+    if ( r >= 0 ) of |= LFS_O_TRUNC;
+    r2 = ffs_file_open (ffs, fd, fn, of);
+    if ( r2 < 0 )
+        {
+        log->bLost = true;
+        if ( r >= 0 ) r = r2;
+        }
+    log->ncommit = 0;
+    return r;
+    }
+
+STATIC int ffs_log_write (struct ffs_file *fd, const char *buffer, int length)
+    {
+    struct ffs_log *log = fd->log;
+    if ( log->bLost ) return pfs_error (EIO);
+    if ( log->segment > 0 )
+        {
+        // A single write is not split between segments
+        lfs_soff_t size = lfs_file_size (&fd->ffs->base, &fd->ft);
+        if ( size < 0 ) return pfs_error (size);
+        size += log->nbuf;
+        if (( size > 0 ) && ( size + length > log->segment ))
+            {
+            int r = ffs_log_rotate (fd);
+            if ( r < 0 ) return pfs_error (r);
+            }
+        }
+    int done = 0;
+    while ( done < length )
+        {
+        lfs_size_t n = log->size - log->nbuf;
+        if ( n > (lfs_size_t) ( length - done )) n = length - done;
+        memcpy (log->data + log->nbuf, buffer + done, n);
+        log->nbuf += n;
+        log->ncommit += n;
+        done += n;
+        int r = ffs_log_push (fd);
+        if ( r < 0 ) return pfs_error (r);
+        }
+    return length;
+    }
+
+// Start (plog != NULL) or end log mode. Data already held is passed to
+// littlefs first, but not committed.
+STATIC int ffs_log_mode (struct ffs_file *fd, const struct ioc_log *plog)
+    {
+    struct ffs_pfs *ffs = fd->ffs;
+    if ( ! ( fd->ft.flags & LFS_O_WRONLY ) ) return pfs_error (EBADF);
+    if (( plog != NULL ) && (( plog->buffer < 0 ) || ( plog->commit < 0 ) || ( plog->segment < 0 )
+        || ( plog->keep < 0 ))) return pfs_error (EINVAL);
+    if ( ffs_log_drain (fd) < 0 ) return -1;
+    free (fd->log);
+    fd->log = NULL;
+    if ( plog == NULL ) return 0;
+    lfs_size_t size = ( plog->buffer > 0 ) ? (lfs_size_t) plog->buffer : ffs->cfg.cache_size;
+    size = ( size + ffs->cfg.prog_size - 1 ) / ffs->cfg.prog_size * ffs->cfg.prog_size;
+    struct ffs_log *log = (struct ffs_log *) malloc (sizeof (struct ffs_log) + size);
+    if ( log == NULL ) return pfs_error (ENOMEM);
+    memset (log, 0, sizeof (struct ffs_log));
+    log->size = size;
+    log->commit = plog->commit;
+    log->segment = plog->segment;
+    log->keep = plog->keep;
+    fd->log = log;
+    return 0;
+    }
+
 STATIC int ffs_close (struct pfs_file *pfs_fd)
     {
     struct ffs_file *fd = (struct ffs_file *) pfs_fd;
     struct ffs_pfs *ffs = fd->ffs;
-    return pfs_error (lfs_file_close (&ffs->base, &fd->ft));
+    int r = 0;
+    if ( fd->log != NULL )
+        {
+        bool bLost = fd->log->bLost;
+        if ( ! bLost ) r = ffs_log_put (fd, fd->log->nbuf);
+        free (fd->log);
+        fd->log = NULL;
+        if ( bLost ) return pfs_error (EIO);
+        }
+    int r2 = lfs_file_close (&ffs->base, &fd->ft);
+    return pfs_error (( r < 0 ) ? r : r2);
     }
 
 STATIC int ffs_read (struct pfs_file *pfs_fd, char *buffer, int length)
     {
     struct ffs_file *fd = (struct ffs_file *) pfs_fd;
     struct ffs_pfs *ffs = fd->ffs;
+    if ( ffs_log_drain (fd) < 0 ) return -1;
     int r = lfs_file_read (&ffs->base, &fd->ft, buffer, length);
     return ( r >= 0 ) ? r : pfs_error (r);
     }
@@ -134,14 +451,38 @@ STATIC int ffs_write (struct pfs_file *pfs_fd, char *buffer, int length)
     {
     struct ffs_file *fd = (struct ffs_file *) pfs_fd;
     struct ffs_pfs *ffs = fd->ffs;
+    if ( fd->log != NULL )
+        {
+        int r = ffs_log_write (fd, buffer, length);
+        if (( r > 0 ) && pfs_sync_due (&fd->sync, r) && ( ffs_fsync (pfs_fd) != 0 )) return -1;
+        return r;
+        }
     int r = lfs_file_write (&ffs->base, &fd->ft, buffer, length);
-    return ( r >= 0 ) ? r : pfs_error (r);
+    if ( r < 0 ) return pfs_error (r);
+    ffs_alloc (ffs, r);
+    if ( pfs_sync_due (&fd->sync, r) && ( ffs_fsync (pfs_fd) != 0 )) return -1;
+    return r;
+    }
+
+// Commits the file to flash, including anything held by write-behind
+STATIC int ffs_fsync (struct pfs_file *pfs_fd)
+    {
+    struct ffs_file *fd = (struct ffs_file *) pfs_fd;
+    struct ffs_pfs *ffs = fd->ffs;
+    if ( ffs_log_drain (fd) < 0 ) return -1;
+    if ( fd->log != NULL ) fd->log->ncommit = 0;
+    pfs_sync_done (&fd->sync);
+    int r = lfs_file_sync (&ffs->base, &fd->ft);
+    if ( r < 0 ) return pfs_error (r);
+    if ( ffs->xip != NULL ) ffs_pico_flush (&ffs->cfg, 0);
+    return 0;
     }
 
 STATIC long ffs_lseek (struct pfs_file *pfs_fd, long pos, int whence)
     {
     struct ffs_file *fd = (struct ffs_file *) pfs_fd;
     struct ffs_pfs *ffs = fd->ffs;
+    if ( ffs_log_drain (fd) < 0 ) return -1;
     switch (whence)
         {
         case SEEK_SET: whence = LFS_SEEK_SET; break;
@@ -162,9 +503,121 @@ STATIC int ffs_isatty (struct pfs_file *fd)
     return 0;
     }
 
+// LFS has no means of reserving space without writing it, so extend the
+// file with zeros. This at least ensures that the space is available.
+STATIC int ffs_allocate (struct pfs_file *pfs_fd, off_t offset, off_t len)
+    {
+    struct ffs_file *fd = (struct ffs_file *) pfs_fd;
+    struct ffs_pfs *ffs = fd->ffs;
+    if ( ! ( fd->ft.flags & LFS_O_WRONLY ) ) return pfs_error (EBADF);
+    if ( len > LONG_MAX - offset ) return pfs_error (EFBIG);
+    if ( ffs_log_drain (fd) < 0 ) return -1;
+    lfs_soff_t size = lfs_file_size (&ffs->base, &fd->ft);
+    if ( size < 0 ) return pfs_error (size);
+    if ( offset + len <= size ) return 0;
+    ffs_alloc (ffs, offset + len - size);
+    return pfs_error (lfs_file_truncate (&ffs->base, &fd->ft, offset + len));
+    }
+
+STATIC int ffs_pread (struct pfs_file *pfs_fd, char *buffer, int length, off_t offset)
+    {
+    struct ffs_file *fd = (struct ffs_file *) pfs_fd;
+    struct ffs_pfs *ffs = fd->ffs;
+    if ( ffs_log_drain (fd) < 0 ) return -1;
+    lfs_soff_t pos = lfs_file_tell (&ffs->base, &fd->ft);
+    if ( pos < 0 ) return pfs_error (pos);
+    lfs_soff_t r = lfs_file_seek (&ffs->base, &fd->ft, offset, LFS_SEEK_SET);
+    if ( r >= 0 ) r = lfs_file_read (&ffs->base, &fd->ft, buffer, length);
+    lfs_file_seek (&ffs->base, &fd->ft, pos, LFS_SEEK_SET);
+    return ( r >= 0 ) ? r : pfs_error (r);
+    }
+
+STATIC int ffs_pwrite (struct pfs_file *pfs_fd, const char *buffer, int length, off_t offset)
+    {
+    struct ffs_file *fd = (struct ffs_file *) pfs_fd;
+    struct ffs_pfs *ffs = fd->ffs;
+    if ( ffs_log_drain (fd) < 0 ) return -1;
+    lfs_soff_t pos = lfs_file_tell (&ffs->base, &fd->ft);
+    if ( pos < 0 ) return pfs_error (pos);
+    lfs_soff_t r = lfs_file_seek (&ffs->base, &fd->ft, offset, LFS_SEEK_SET);
+    if ( r >= 0 ) r = lfs_file_write (&ffs->base, &fd->ft, buffer, length);
+    if ( r > 0 ) ffs_alloc (ffs, r);
+    lfs_file_seek (&ffs->base, &fd->ft, pos, LFS_SEEK_SET);
+    return ( r >= 0 ) ? r : pfs_error (r);
+    }
+
+// Map file data at the current position and advance past it. The run mapped
+// ends at the end of the file or of its current block, as successive blocks
+// of a file are not adjacent in flash. Files small enough to be stored inline
+// in their directory cannot be mapped.
+STATIC int ffs_mmap (struct ffs_file *fd, struct ioc_mmap *pmap)
+    {
+    struct ffs_pfs *ffs = fd->ffs;
+    if (( pmap == NULL ) || ( pmap->length < 0 )) return pfs_error (EINVAL);
+    pmap->addr = NULL;
+    if ( ffs->xip == NULL ) return pfs_error (ENOTSUP);
+    if ( ffs_log_drain (fd) < 0 ) return -1;
+    // Pending writes must be in flash first
+    int r = 0;
+    if ( fd->ft.flags & LFS_F_WRITING ) r = lfs_file_sync (&ffs->base, &fd->ft);
+    if ( r < 0 ) return pfs_error (r);
+    ffs_pico_flush (&ffs->cfg, 0);
+    if ( fd->ft.flags & LFS_F_INLINE ) return pfs_error (ENOTSUP);
+    lfs_soff_t pos = lfs_file_tell (&ffs->base, &fd->ft);
+    lfs_soff_t size = lfs_file_size (&ffs->base, &fd->ft);
+    if (( pos < 0 ) || ( size < 0 )) return pfs_error (( pos < 0 ) ? pos : size);
+    if (( pos >= size ) || ( pmap->length == 0 ))
+        {
+        pmap->length = 0;
+        return 0;
+        }
+    // Reading one byte has littlefs locate the block holding the position
+    char c;
+    r = lfs_file_read (&ffs->base, &fd->ft, &c, 1);
+    if ( r < 0 ) return pfs_error (r);
+    if (( r < 1 ) || ( fd->ft.flags & LFS_F_INLINE )) return pfs_error (ENOTSUP);
+    lfs_off_t off = fd->ft.off - 1;
+    const uint8_t *addr = ffs->xip + fd->ft.block * ffs->cfg.block_size + off;
+    lfs_soff_t len = ffs->cfg.block_size - off;
+    if ( len > size - pos ) len = size - pos;
+    if ( len > pmap->length ) len = pmap->length;
+    r = lfs_file_seek (&ffs->base, &fd->ft, pos + len, LFS_SEEK_SET);
+    if ( r < 0 ) return pfs_error (r);
+    pmap->addr = addr;
+    pmap->length = len;
+    return 0;
+    }
+
+STATIC int ffs_ioctl (struct pfs_file *pfs_fd, unsigned long request, void *argp)
+    {
+    struct ffs_file *fd = (struct ffs_file *) pfs_fd;
+    switch (request)
+        {
+        case IOC_RQ_MMAP:
+            return ffs_mmap (fd, (struct ioc_mmap *) argp);
+        case IOC_RQ_LOG:
+            return ffs_log_mode (fd, (const struct ioc_log *) argp);
+        case IOC_RQ_SYNC:
+            if ( argp == NULL )
+                {
+                pfs_sync_init (&fd->sync);
+                }
+            else
+                {
+                fd->sync.bytes = ((struct ioc_sync *) argp)->bytes;
+                fd->sync.ms = ((struct ioc_sync *) argp)->ms;
+                }
+            return 0;
+        default:
+            break;
+        }
+    return pfs_error (EINVAL);
+    }
+
 STATIC int ffs_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf)
     {
     struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    if ( ffs_ready (ffs) < 0 ) return -1;
     struct lfs_info info;
     int r = lfs_stat (&ffs->base, name, &info);
     if ( r < 0 ) return pfs_error (r);
@@ -183,30 +636,39 @@ STATIC int ffs_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf)
 STATIC int ffs_rename (struct pfs_pfs *pfs, const char *old, const char *new)
     {
     struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    if ( ffs_ready (ffs) < 0 ) return -1;
+    ffs_freed (ffs);        // An existing file called new is replaced
     return pfs_error (lfs_rename (&ffs->base, old, new));
     }
 
 STATIC int ffs_delete (struct pfs_pfs *pfs, const char *name)
     {
     struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    if ( ffs_ready (ffs) < 0 ) return -1;
+    ffs_freed (ffs);
     return pfs_error (lfs_remove (&ffs->base, name));
     }
 
 STATIC int ffs_mkdir (struct pfs_pfs *pfs, const char *pathname, mode_t mode)
     {
     struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    if ( ffs_ready (ffs) < 0 ) return -1;
+    ffs_alloc (ffs, 2 * ffs->cfg.block_size);   // A new metadata pair
     return pfs_error (lfs_mkdir (&ffs->base, pathname));
     }
 
 STATIC int ffs_rmdir (struct pfs_pfs *pfs, const char *pathname)
     {
     struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    if ( ffs_ready (ffs) < 0 ) return -1;
+    ffs_freed (ffs);
     return pfs_error (lfs_remove (&ffs->base, pathname));
     }
 
 STATIC void *ffs_opendir (struct pfs_pfs *pfs, const char *name)
     {
     struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    if ( ffs_ready (ffs) < 0 ) return NULL;
     struct ffs_dir *dd = (struct ffs_dir *) malloc (sizeof (struct ffs_dir));
     if ( dd == NULL )
         {
@@ -229,6 +691,8 @@ STATIC struct dirent *ffs_readdir (void *dirp)
     if ( r < 0 ) pfs_error (r);
     if ( r <= 0 ) return NULL;
     strncpy (dd->de.d_name, info.name, NAME_MAX);
+    dd->de.d_type = ( info.type == LFS_TYPE_DIR ) ? DT_DIR : DT_REG;
+    dd->size = info.size;
     return &dd->de;
     }
 
@@ -244,22 +708,91 @@ STATIC int ffs_chmod (struct pfs_pfs *pfs, const char *pathname, mode_t mode)
     return pfs_error (EINVAL);
     }
 
-struct pfs_pfs *pfs_ffs_create (const struct lfs_config *cfg)
+STATIC int ffs_umount (struct pfs_pfs *pfs)
+    {
+    struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    if ( ffs->bMounted ) lfs_unmount (&ffs->base);
+    // Write out anything still held by write-behind
+    if ( ffs->xip != NULL ) ffs_pico_flush (&ffs->cfg, 0);
+    free (ffs);
+    return 0;
+    }
+
+STATIC int ffs_statvfs (struct pfs_pfs *pfs, struct statvfs *buf)
+    {
+    struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    if ( ffs_ready (ffs) < 0 ) return -1;
+    lfs_size_t nblock = ffs->cfg.block_count;
+    pfs_lock ();
+    lfs_ssize_t nused = ffs->nused;
+    lfs_size_t nalloc = ffs->nalloc;
+    pfs_unlock ();
+    // Count again if the free space could be overstated by more than an eighth
+    if (( nused < 0 ) || ( nused + nalloc > nblock ) || ( 8 * nalloc > nblock - nused ))
+        {
+        nused = lfs_fs_size (&ffs->base);
+        if ( nused < 0 ) return pfs_error (nused);
+        // Writes while counting remain in the bound
+        pfs_lock ();
+        ffs->nused = nused;
+        ffs->nalloc -= nalloc;
+        nalloc = ffs->nalloc;
+        pfs_unlock ();
+        }
+    lfs_size_t nfree = ( nused + nalloc < nblock ) ? nblock - nused - nalloc : 0;
+    memset (buf, 0, sizeof (struct statvfs));
+    buf->f_bsize = ffs->cfg.block_size;
+    buf->f_frsize = ffs->cfg.block_size;
+    buf->f_blocks = nblock;
+    buf->f_bfree = nfree;
+    buf->f_bavail = nfree;
+    buf->f_namemax = ( ffs->cfg.name_max > 0 ) ? ffs->cfg.name_max : LFS_NAME_MAX;
+    return 0;
+    }
+
+// The flash only changes through this volume, so stat results may be cached once it is mounted
+STATIC uint32_t ffs_cache_id (struct pfs_pfs *pfs)
+    {
+    struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    return ffs->bMounted ? ffs->cache_gen : 0;
+    }
+
+// Create the volume. If bLazy, the flash is mounted on first use instead of now.
+STATIC struct pfs_pfs *ffs_create (const struct lfs_config *cfg, bool bLazy)
     {
     struct ffs_pfs *ffs = (struct ffs_pfs *) malloc (sizeof (struct ffs_pfs));
     if ( ffs == NULL ) return NULL;
     ffs->entry = &ffs_v_pfs;
     memcpy (&ffs->cfg, cfg, sizeof (struct lfs_config));
-    int r = lfs_mount (&ffs->base, &ffs->cfg);
-    if ( r < 0 )
-        {
-        r = lfs_format (&ffs->base, &ffs->cfg);
-        if ( r == 0 ) r = lfs_mount (&ffs->base, &ffs->cfg);
-        }
-    if ( r < 0 )
+    ffs->xip = ffs_pico_mmap_base (cfg);
+    ffs->bMounted = false;
+    ffs->cache_gen = 1;
+    if (( ! bLazy ) && ( ffs_mount (ffs) < 0 ))
         {
         free (ffs);
         return NULL;
         }
     return (struct pfs_pfs *) ffs;
     }
+
+struct pfs_pfs *pfs_ffs_create (const struct lfs_config *cfg)
+    {
+    return ffs_create (cfg, false);
+    }
+
+struct pfs_pfs *pfs_ffs_create_lazy (const struct lfs_config *cfg)
+    {
+    return ffs_create (cfg, true);
+    }
+
+int pfs_ffs_preerase (struct pfs_pfs *pfs, int nblk)
+    {
+    struct ffs_pfs *ffs = (struct ffs_pfs *) pfs;
+    if (( pfs == NULL ) || ( pfs->entry != &ffs_v_pfs )) return pfs_error (EINVAL);
+    if ( ffs->xip == NULL ) return pfs_error (ENOTSUP);
+    // Nothing has been released before the first use of a lazy volume
+    if ( ! ffs->bMounted ) return 0;
+    int r = ffs_pico_preerase (&ffs->base, &ffs->cfg, nblk);
+    if ( r < 0 ) return pfs_error (EIO);
+    return r;
+    }
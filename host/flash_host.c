@@ -0,0 +1,92 @@
+// flash_host.c - Simulated flash memory, held in an image file or memory, for host builds
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Implements hardware/flash.h, so that ffs_pico.c runs unchanged on the host.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <hardware/flash.h>
+#include <pico/stdlib.h>
+#include <pfs_host.h>
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+STATIC uint8_t *flash_mem = NULL;
+STATIC struct pfs_host_latency flash_lat;
+
+bool flash_host_image (const char *path)
+    {
+    if ( flash_mem != NULL ) return false;
+    // The C library stream functions reach the host files, as open and
+    // so on are the pico-filesystem ones
+    FILE *f = fopen (path, "r+b");
+    if ( f == NULL ) f = fopen (path, "w+b");
+    if ( f == NULL ) return false;
+    fseek (f, 0, SEEK_END);
+    long size = ftell (f);
+    if (( size < PICO_FLASH_SIZE_BYTES ) && ( ftruncate (fileno (f), PICO_FLASH_SIZE_BYTES) != 0 ))
+        {
+        fclose (f);
+        return false;
+        }
+    uint8_t *mem = (uint8_t *) mmap (NULL, PICO_FLASH_SIZE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fileno (f), 0);
+    fclose (f);
+    if ( mem == MAP_FAILED ) return false;
+    // New flash is erased
+    if ( size < PICO_FLASH_SIZE_BYTES ) memset (mem + size, 0xFF, PICO_FLASH_SIZE_BYTES - size);
+    flash_mem = mem;
+    return true;
+    }
+
+void flash_host_latency (const struct pfs_host_latency *lat)
+    {
+    if ( lat != NULL ) flash_lat = *lat;
+    else memset (&flash_lat, 0, sizeof (flash_lat));
+    }
+
+uint8_t *flash_host_base (void)
+    {
+    if ( flash_mem == NULL )
+        {
+        flash_mem = (uint8_t *) malloc (PICO_FLASH_SIZE_BYTES);
+        if ( flash_mem == NULL )
+            {
+            fprintf (stderr, "Unable to allocate simulated flash\n");
+            exit (1);
+            }
+        memset (flash_mem, 0xFF, PICO_FLASH_SIZE_BYTES);
+        }
+    return flash_mem;
+    }
+
+// Check the arguments as the boot ROM would, rather than corrupt memory
+STATIC void flash_host_check (uint32_t flash_offs, size_t count, uint32_t align)
+    {
+    if (( flash_offs % align != 0 ) || ( count % align != 0 ) || ( flash_offs + count > PICO_FLASH_SIZE_BYTES ))
+        {
+        fprintf (stderr, "Invalid flash operation: offset 0x%08X, count 0x%zX\n", flash_offs, count);
+        abort ();
+        }
+    }
+
+void flash_range_erase (uint32_t flash_offs, size_t count)
+    {
+    flash_host_check (flash_offs, count, FLASH_SECTOR_SIZE);
+    memset (flash_host_base () + flash_offs, 0xFF, count);
+    pico_host_delay (flash_lat.op_us + ( count / FLASH_SECTOR_SIZE ) * flash_lat.erase_us);
+    }
+
+// As on the chip, programming can only clear bits
+void flash_range_program (uint32_t flash_offs, const uint8_t *data, size_t count)
+    {
+    flash_host_check (flash_offs, count, FLASH_PAGE_SIZE);
+    uint8_t *dst = flash_host_base () + flash_offs;
+    for (size_t i = 0; i < count; ++i) dst[i] &= data[i];
+    pico_host_delay (flash_lat.op_us + ( count / FLASH_PAGE_SIZE ) * flash_lat.write_us);
+    }
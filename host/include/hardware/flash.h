@@ -0,0 +1,37 @@
+// hardware/flash.h - Simulated flash memory for host builds
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// The flash is held in host memory (see flash_host_image in pfs_host.h), and
+// XIP_BASE is its address. As on the chip, programming can only clear bits,
+// and erasing sets a whole sector to 0xFF.
+
+#ifndef HARDWARE_FLASH_H
+#define HARDWARE_FLASH_H
+
+#include <pico.h>
+
+#define FLASH_PAGE_SIZE             (1u << 8)
+#define FLASH_SECTOR_SIZE           (1u << 12)
+#define FLASH_BLOCK_SIZE            (1u << 16)
+
+#ifndef PICO_FLASH_SIZE_BYTES
+#define PICO_FLASH_SIZE_BYTES       (2 * 1024 * 1024)
+#endif
+
+#define XIP_BASE                    ((uintptr_t) flash_host_base ())
+#define XIP_NOCACHE_NOALLOC_BASE    XIP_BASE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint8_t *flash_host_base (void);
+void flash_range_erase (uint32_t flash_offs, size_t count);
+void flash_range_program (uint32_t flash_offs, const uint8_t *data, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,27 @@
+// hardware/gpio.h - GPIO inputs for host builds, set by pico_host_gpio
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HARDWARE_GPIO_H
+#define HARDWARE_GPIO_H
+
+#include <pico/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GPIO_IN     false
+#define GPIO_OUT    true
+
+void gpio_init (uint gpio);
+void gpio_set_dir (uint gpio, bool out);
+void gpio_pull_up (uint gpio);
+void gpio_pull_down (uint gpio);
+bool gpio_get (uint gpio);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,15 @@
+// hardware/pio.h - PIO types for host builds (only so that sd_spi.h compiles)
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HARDWARE_PIO_H
+#define HARDWARE_PIO_H
+
+#include <pico.h>
+
+typedef struct pio_hw pio_hw_t;
+typedef pio_hw_t *PIO;
+
+#define pio0    ((PIO) NULL)
+
+#endif
@@ -0,0 +1,21 @@
+// hardware/rtc.h - Real time clock for host builds, giving the host's local time
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HARDWARE_RTC_H
+#define HARDWARE_RTC_H
+
+#include <pico/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool rtc_running (void);
+bool rtc_get_datetime (datetime_t *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
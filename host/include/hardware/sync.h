@@ -0,0 +1,20 @@
+// hardware/sync.h - Interrupt control for host builds (there are no interrupts)
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef HARDWARE_SYNC_H
+#define HARDWARE_SYNC_H
+
+#include <pico.h>
+
+static inline uint32_t save_and_disable_interrupts (void)
+    {
+    return 0;
+    }
+
+static inline void restore_interrupts (uint32_t status)
+    {
+    (void) status;
+    }
+
+#endif
@@ -0,0 +1,34 @@
+// pico.h - Pico SDK definitions used by pico-filesystem, for host builds
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef PICO_H
+#define PICO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+
+#define NUM_CORES                               2
+#define PICO_ERROR_TIMEOUT                      (-1)
+#define __not_in_flash_func(f)                  f
+#define __no_inline_not_in_flash_func(f)        __attribute__((noinline)) f
+#define __compiler_memory_barrier()             __asm__ volatile ("" : : : "memory")
+#define __sev()
+#define __wfe()
+#define __dmb()                                 __sync_synchronize ()
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The simulated core (always 0)
+uint get_core_num (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
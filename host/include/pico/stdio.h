@@ -0,0 +1,24 @@
+// pico/stdio.h - Console input and output for host builds
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef PICO_STDIO_H
+#define PICO_STDIO_H
+
+#include <pico.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool stdio_init_all (void);
+bool stdio_usb_connected (void);
+void stdio_flush (void);
+int putchar_raw (int c);
+int getchar_timeout_us (uint32_t timeout_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,12 @@
+// pico/stdlib.h - Pico SDK standard functions for host builds
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef PICO_STDLIB_H
+#define PICO_STDLIB_H
+
+#include <pico.h>
+#include <pico/time.h>
+#include <pico/stdio.h>
+
+#endif
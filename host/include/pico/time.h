@@ -0,0 +1,36 @@
+// pico/time.h - Time functions for host builds
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Time is that of the host's monotonic clock, plus any delays added by the
+// latency models of the simulated devices (see pfs_host.h).
+
+#ifndef PICO_TIME_H
+#define PICO_TIME_H
+
+#include <pico.h>
+
+typedef uint64_t absolute_time_t;
+
+#define at_the_end_of_time      ((absolute_time_t) UINT64_MAX)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint64_t time_us_64 (void);
+uint32_t time_us_32 (void);
+void sleep_us (uint64_t us);
+void sleep_ms (uint32_t ms);
+void busy_wait_us_32 (uint32_t us);
+absolute_time_t get_absolute_time (void);
+absolute_time_t make_timeout_time_us (uint64_t us);
+absolute_time_t make_timeout_time_ms (uint32_t ms);
+uint32_t to_ms_since_boot (absolute_time_t t);
+bool best_effort_wfe_or_timeout (absolute_time_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
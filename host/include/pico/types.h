@@ -0,0 +1,21 @@
+// pico/types.h - Pico SDK types for host builds
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef PICO_TYPES_H
+#define PICO_TYPES_H
+
+#include <pico.h>
+
+typedef struct
+    {
+    int16_t     year;
+    int8_t      month;
+    int8_t      day;
+    int8_t      dotw;
+    int8_t      hour;
+    int8_t      min;
+    int8_t      sec;
+    } datetime_t;
+
+#endif
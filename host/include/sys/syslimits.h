@@ -0,0 +1,10 @@
+// sys/syslimits.h - NEWLIB header, provided for host builds
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef SYS_SYSLIMITS_H
+#define SYS_SYSLIMITS_H
+
+#include <limits.h>
+
+#endif
@@ -0,0 +1,57 @@
+// pfs_host.h - Simulated SD cards and flash for running pico-filesystem on a host computer
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef PFS_HOST_H
+#define PFS_HOST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sd_spi.h>
+
+// Time taken by the simulated devices. Each delay either advances the
+// simulated clock (time_us_64 and friends), so that runs are quick and
+// repeatable, or with pico_host_sleep (true) really sleeps.
+struct pfs_host_latency
+    {
+    uint32_t    op_us;          // Fixed time for each command or flash operation
+    uint32_t    read_us;        // Time for each sector read (SD card only)
+    uint32_t    write_us;       // Time for each sector written, or page programmed
+    uint32_t    erase_us;       // Time for each sector erased (flash, or SD card trim)
+    uint32_t    fail_every;     // Fail every n'th SD card command (0 = never)
+    uint32_t    init_us;        // Time for an SD card to become ready after initialisation starts
+    };
+
+// Select whether device latencies sleep (true) or advance the simulated clock (false, the default)
+void pico_host_sleep (bool bSleep);
+
+// Wait for us microseconds of device time
+void pico_host_delay (uint64_t us);
+
+// Drive GPIO input gpio to level (0 or 1), for example a card detect
+// switch, or with level -1 leave it to its pull up or down
+void pico_host_gpio (uint gpio, int level);
+
+// Create a simulated SD card of nsector 512 byte sectors. The contents are
+// kept in the image file path, which is created or extended as required, or
+// in memory if path is NULL. The first card created is the one returned by
+// sd_spi_default, others may be given to ff_disk_attach. Returns NULL if the
+// image file cannot be used.
+SD_SPI *sd_host_create (const char *path, uint32_t nsector);
+
+// Set the latency model of a simulated card (NULL for none, the default)
+void sd_host_latency (SD_SPI *sd, const struct pfs_host_latency *lat);
+
+// Attach card sd as physical drive pdrv, and format it with a FAT volume.
+// Only available with FF_USE_MKFS. Returns false on failure.
+bool sd_host_format (uint8_t pdrv, SD_SPI *sd);
+
+// Keep the simulated flash (PICO_FLASH_SIZE_BYTES) in the image file path,
+// which is created if required. Must be called before any other use of the
+// flash, otherwise it is held in memory. Returns false if the file cannot be used.
+bool flash_host_image (const char *path);
+
+// Set the latency model of the simulated flash (NULL for none, the default)
+void flash_host_latency (const struct pfs_host_latency *lat);
+
+#endif
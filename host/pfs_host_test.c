@@ -0,0 +1,584 @@
+// pfs_host_test.c - Tests of pico-filesystem volumes, run on the host by ctest
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Usage: pfs_host_test <test>
+//
+// Each test mounts one volume and exits with a non-zero status if any
+// check failed.
+
+#include <ff_disk.h>        // Include this before PFS header files to avoid conflicting DIR definitions
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <pfs.h>
+#include <pico/stdlib.h>
+#include <pfs_host.h>
+#include <pfs_dev_gdd.h>
+#include <pfs_dev_stat.h>
+#include <pfs_aio.h>
+#include <ioctl.h>
+#if HAVE_LFS
+#include <ffs_pico.h>
+#endif
+#if HAVE_ROM
+extern const uint32_t rom_image[];
+#endif
+
+#define TEST_SIZE       10000
+#define TEST_CHUNK      333
+
+static int nfail = 0;
+static uint8_t data[TEST_SIZE];
+static uint8_t buff[TEST_SIZE];
+
+static void check (bool bOK, const char *what, const char *path)
+    {
+    if ( bOK ) return;
+    printf ("FAILED: %s %s (errno = %d)\n", what, path, errno);
+    ++nfail;
+    }
+
+// Write, read back, rename, list and delete a file in directory dir
+static void test_files (const char *dir)
+    {
+    char sDir[64];
+    char sFile[80];
+    char sNew[80];
+    snprintf (sDir, sizeof (sDir), "%s/sub", dir);
+    snprintf (sFile, sizeof (sFile), "%s/a.txt", sDir);
+    snprintf (sNew, sizeof (sNew), "%s/b.txt", sDir);
+    for (int i = 0; i < TEST_SIZE; ++i) data[i] = (uint8_t) ( i * 7 + ( i >> 8 ));
+    check ( mkdir (sDir, 0777) == 0, "mkdir", sDir);
+
+    int fd = open (sFile, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    check ( fd >= 0, "create", sFile);
+    for (int done = 0; done < TEST_SIZE; done += TEST_CHUNK)
+        {
+        int n = ( TEST_SIZE - done < TEST_CHUNK ) ? TEST_SIZE - done : TEST_CHUNK;
+        check ( write (fd, &data[done], n) == n, "write", sFile);
+        }
+    check ( close (fd) == 0, "close", sFile);
+
+    struct stat st;
+    check (( stat (sFile, &st) == 0 ) && ( st.st_size == TEST_SIZE ), "stat", sFile);
+
+    fd = open (sFile, O_RDONLY);
+    check ( fd >= 0, "open", sFile);
+    memset (buff, 0, sizeof (buff));
+    check (( read (fd, buff, TEST_SIZE) == TEST_SIZE ) && ( memcmp (buff, data, TEST_SIZE) == 0 ), "read", sFile);
+    check ( read (fd, buff, 1) == 0, "read at end", sFile);
+    check (( lseek (fd, 5000, SEEK_SET) == 5000 ) && ( read (fd, buff, 100) == 100 )
+        && ( memcmp (buff, &data[5000], 100) == 0 ), "seek and read", sFile);
+    check (( pread (fd, buff, 100, 1234) == 100 ) && ( memcmp (buff, &data[1234], 100) == 0 ), "pread", sFile);
+    check ( close (fd) == 0, "close", sFile);
+
+    check ( rename (sFile, sNew) == 0, "rename", sFile);
+    check (( stat (sFile, &st) != 0 ) && ( errno == ENOENT ), "renamed away", sFile);
+    check (( stat (sNew, &st) == 0 ) && ( st.st_size == TEST_SIZE ), "stat", sNew);
+
+    DIR *dp = opendir (sDir);
+    check ( dp != NULL, "opendir", sDir);
+    bool bFound = false;
+    struct dirent *de;
+    while (( dp != NULL ) && (( de = readdir (dp) ) != NULL ))
+        {
+        if ( strcmp (de->d_name, "b.txt") == 0 ) bFound = true;
+        }
+    if ( dp != NULL ) closedir (dp);
+    check ( bFound, "readdir", sDir);
+
+    // Reading past the end of a file open for writing does not extend it
+    fd = open (sNew, O_RDWR);
+    check (( fd >= 0 ) && ( pread (fd, buff, 10, 100000) == 0 ), "pread past end", sNew);
+    check (( fstat (fd, &st) == 0 ) && ( st.st_size == TEST_SIZE ) && ( close (fd) == 0 ), "size unchanged", sNew);
+    check (( stat (sNew, &st) == 0 ) && ( st.st_size == TEST_SIZE ), "stat", sNew);
+
+    // Space may only be allocated through a descriptor open for writing
+    fd = open (sNew, O_RDONLY);
+    check (( fd >= 0 ) && ( posix_fallocate (fd, 0, 2 * TEST_SIZE) == EBADF ), "allocate read only", sNew);
+    check (( fstat (fd, &st) == 0 ) && ( st.st_size == TEST_SIZE ) && ( close (fd) == 0 ), "size unchanged", sNew);
+
+    // Allocated space reads as zeros
+    fd = open (sNew, O_RDWR);
+    check (( fd >= 0 ) && ( posix_fallocate (fd, 0, 2 * TEST_SIZE) == 0 ), "allocate", sNew);
+    memset (buff, 0xA5, 10);
+    check (( pread (fd, buff, 10, 2 * TEST_SIZE - 10) == 10 ) && ( buff[0] == 0 ) && ( buff[9] == 0 ),
+        "allocated zeros", sNew);
+    check ( posix_fallocate (fd, 1, LONG_MAX) == EFBIG, "allocate too large", sNew);
+    check (( fstat (fd, &st) == 0 ) && ( st.st_size == 2 * TEST_SIZE ) && ( close (fd) == 0 ), "allocated size", sNew);
+
+    check ( unlink (sNew) == 0, "unlink", sNew);
+    check ( rmdir (sDir) == 0, "rmdir", sDir);
+    check (( stat (sDir, &st) != 0 ) && ( errno == ENOENT ), "removed", sDir);
+
+    struct pfs_stats ps;
+    check (( pfs_stats_volume (dir, &ps, false) == 0 ) && ( ps.nread > 0 ) && ( ps.wbytes == TEST_SIZE ),
+        "statistics", dir);
+    }
+
+static void test_ram (void)
+    {
+    check ( pfs_mount (pfs_ram_create (65536, 16), "/") == 0, "mount", "ram");
+    test_files ("/");
+
+    // Offsets are limited by the 32 bit file size
+    int fd = open ("/big.dat", O_CREAT | O_RDWR, 0666);
+    off_t off = 0xFFFFFFF0;
+    check (( fd >= 0 ) && ( pwrite (fd, data, 32, off) == -1 ) && ( errno == EFBIG ), "pwrite past 4GB", "/big.dat");
+    check ( posix_fallocate (fd, off, 32) == EFBIG, "allocate past 4GB", "/big.dat");
+    if ( sizeof (long) > 4 )
+        check (( lseek (fd, 0x100000000L, SEEK_SET) == -1 ) && ( errno == EINVAL ), "lseek past 4GB", "/big.dat");
+    struct stat st;
+    check (( fstat (fd, &st) == 0 ) && ( st.st_size == 0 ), "size unchanged", "/big.dat");
+    check (( close (fd) == 0 ) && ( unlink ("/big.dat") == 0 ), "unlink", "/big.dat");
+
+    // Calls which fail still release the volume
+    check (( open ("/none/x", O_RDONLY) < 0 ) && ( stat ("/none", &st) != 0 ) && ( unlink ("/none") != 0 )
+        && ( rmdir ("/none") != 0 ) && ( opendir ("/none") == NULL ), "missing", "/none");
+    check ( pfs_umount ("/") == 0, "unmount", "ram");
+    }
+
+// Simulated SD card in memory, formatted as FAT
+static bool fat_mount (const struct pfs_host_latency *lat)
+    {
+    SD_SPI *sd = sd_host_create (NULL, 65536);
+    check ( sd != NULL, "create", "SD card");
+    if ( sd == NULL ) return false;
+    check ( sd_host_format (0, sd), "format", "SD card");
+    sd_host_latency (sd, lat);
+    struct pfs_pfs *pfs = pfs_fat_create ();
+    check ( pfs != NULL, "create", "fat");
+    if ( pfs == NULL ) return false;
+    check ( pfs_mount (pfs, "/") == 0, "mount", "fat");
+    return true;
+    }
+
+static void test_fat (void)
+    {
+    if ( ! fat_mount (NULL) ) return;
+    test_files ("/");
+
+    // Allocating more than the card holds fails with ENOSPC
+    int fd = open ("/big.dat", O_CREAT | O_WRONLY, 0666);
+    check (( fd >= 0 ) && ( posix_fallocate (fd, 0, 65536L * 512) == ENOSPC ), "allocate disk full", "/big.dat");
+    check (( close (fd) == 0 ) && ( unlink ("/big.dat") == 0 ), "unlink", "/big.dat");
+
+    FF_DISK_STATS st;
+    check ( ff_disk_stats (0, &st, false) && ( st.reads > 0 ) && ( st.writes > 0 ) && ( st.errors == 0 ),
+        "disk statistics", "fat");
+    }
+
+// With a latency model the simulated clock advances by the device time
+static void test_latency (void)
+    {
+    struct pfs_host_latency lat = { 100, 10, 200, 0, 0, 0 };
+    if ( ! fat_mount (&lat) ) return;
+    ff_disk_stats (0, NULL, true);
+    uint64_t t0 = time_us_64 ();
+    test_files ("/");
+    uint64_t t = time_us_64 () - t0;
+    FF_DISK_STATS st;
+    ff_disk_stats (0, &st, false);
+    uint64_t tmin = (uint64_t) ( st.reads + st.writes ) * lat.op_us
+        + (uint64_t) st.rd_sectors * lat.read_us + (uint64_t) st.wr_sectors * lat.write_us;
+    check (( tmin > 0 ) && ( t >= tmin ), "simulated time", "fat");
+    check (( st.read_us >= (uint64_t) st.rd_sectors * lat.read_us ) && ( st.busy_us >= (uint64_t) st.wr_sectors * lat.write_us ),
+        "command times", "fat");
+    }
+
+// Read failures are retried by ff_disk.c
+static void test_retry (void)
+    {
+    if ( ! fat_mount (NULL) ) return;
+    int fd = open ("/retry.dat", O_CREAT | O_WRONLY, 0666);
+    check (( fd >= 0 ) && ( write (fd, data, TEST_SIZE) == TEST_SIZE ) && ( close (fd) == 0 ), "write", "/retry.dat");
+    struct pfs_host_latency lat = { 0, 0, 0, 0, 3, 0 };
+    sd_host_latency (sd_spi_default (), &lat);
+    ff_disk_stats (0, NULL, true);
+    fd = open ("/retry.dat", O_RDONLY);
+    check (( fd >= 0 ) && ( read (fd, buff, TEST_SIZE) == TEST_SIZE ) && ( memcmp (buff, data, TEST_SIZE) == 0 ),
+        "read", "/retry.dat");
+    if ( fd >= 0 ) close (fd);
+    FF_DISK_STATS st;
+    ff_disk_stats (0, &st, false);
+    check (( st.retries > 0 ) && ( st.crc_errors == st.retries ) && ( st.errors == 0 ), "retries", "fat");
+    }
+
+// A lazily mounted card is not touched until first used, and its
+// initialisation may be started early and overlapped with other work
+static void test_lazy (void)
+    {
+    SD_SPI *sd = sd_host_create (NULL, 65536);
+    check (( sd != NULL ) && sd_host_format (0, sd), "format", "SD card");
+    if ( sd == NULL ) return;
+    struct pfs_host_latency lat = { 100, 0, 0, 0, 0, 250000 };
+    sd_host_latency (sd, &lat);
+    ff_disk_stats (0, NULL, true);
+    uint64_t t0 = time_us_64 ();
+    check ( ff_disk_init_start (0), "init start", "SD card");
+    check ( ff_disk_init_poll (0) == 0, "init pending", "SD card");
+    check ( pfs_mount (pfs_fat_create_lazy (0, 0), "/") == 0, "mount", "fat");
+    FF_DISK_STATS st;
+    ff_disk_stats (0, &st, false);
+    check (( st.reads == 0 ) && ( time_us_64 () - t0 < lat.init_us ), "no card access", "fat");
+    test_files ("/");
+    check (( ff_disk_init_poll (0) == 1 ) && ( time_us_64 () - t0 >= lat.init_us ), "init complete", "SD card");
+    }
+
+// With a card detect switch the volume is remounted when the card returns,
+// and pfs_umount releases it so that it can be created again
+#define CD_GPIO     7
+
+static void test_hotplug (void)
+    {
+    if ( ! fat_mount (NULL) ) return;
+    pico_host_gpio (CD_GPIO, 0);
+    check ( ff_disk_card_detect (0, CD_GPIO, false) && ff_disk_present (0), "card detect", "SD card");
+    int fd = open ("/hot.dat", O_CREAT | O_WRONLY, 0666);
+    check (( fd >= 0 ) && ( write (fd, data, TEST_SIZE) == TEST_SIZE ) && ( close (fd) == 0 ), "write", "/hot.dat");
+    struct stat st;
+    pico_host_gpio (CD_GPIO, 1);
+    check (( ! ff_disk_present (0) ) && ( stat ("/hot.dat", &st) != 0 ), "card removed", "/hot.dat");
+    pico_host_gpio (CD_GPIO, 0);
+    check (( stat ("/hot.dat", &st) == 0 ) && ( st.st_size == TEST_SIZE ), "card inserted", "/hot.dat");
+
+    fd = open ("/hot.dat", O_RDONLY);
+    check (( pfs_umount ("/") != 0 ) && ( errno == EBUSY ), "busy", "/");
+    if ( fd >= 0 ) close (fd);
+    check ( pfs_umount ("/") == 0, "unmount", "/");
+    check (( stat ("/hot.dat", &st) != 0 ), "unmounted", "/hot.dat");
+    check ( pfs_mount (pfs_fat_create (), "/") == 0, "mount again", "fat");
+    check (( stat ("/hot.dat", &st) == 0 ) && ( st.st_size == TEST_SIZE ), "stat", "/hot.dat");
+    }
+
+// Repeated stats of a FAT file are answered without reading the card, and
+// changes through any call are seen
+static void test_statcache (void)
+    {
+    if ( ! fat_mount (NULL) ) return;
+    pico_host_gpio (CD_GPIO, 0);
+    check ( ff_disk_card_detect (0, CD_GPIO, false), "card detect", "SD card");
+    check ( mkdir ("/etc", 0777) == 0, "mkdir", "/etc");
+    int fd = open ("/etc/a.cfg", O_CREAT | O_WRONLY, 0666);
+    check (( fd >= 0 ) && ( write (fd, data, 100) == 100 ) && ( close (fd) == 0 ), "write", "/etc/a.cfg");
+    struct stat st;
+    // chdir looks up the directory, so comes first to leave the file as the latest entry
+    check ( chdir ("/etc") == 0, "chdir", "/etc");
+    check (( stat ("/etc/a.cfg", &st) == 0 ) && ( st.st_size == 100 ), "stat", "/etc/a.cfg");
+    ff_disk_stats (0, NULL, true);
+    check (( stat ("a.cfg", &st) == 0 ) && ( st.st_size == 100 ), "stat", "a.cfg");
+#if PFS_STAT_CACHE > 0
+    FF_DISK_STATS ds;
+    ff_disk_stats (0, &ds, false);
+    check (( ds.reads == 0 ) && ( ds.cache_hits == 0 ), "no card access", "a.cfg");
+#endif
+
+    // Writes are seen once the file is opened for writing, and after it is closed
+    fd = open ("/etc/a.cfg", O_WRONLY | O_APPEND);
+    check (( fd >= 0 ) && ( write (fd, data, 100) == 100 ), "append", "/etc/a.cfg");
+    check (( stat ("/etc/a.cfg", &st) == 0 ) && ( stat ("/etc/a.cfg", &st) == 0 ), "stat open file", "/etc/a.cfg");
+    check ( close (fd) == 0, "close", "/etc/a.cfg");
+    check (( stat ("/etc/a.cfg", &st) == 0 ) && ( st.st_size == 200 ), "size after close", "/etc/a.cfg");
+
+    check (( rename ("/etc", "/cfg") == 0 ) && ( stat ("/etc/a.cfg", &st) != 0 ) && ( errno == ENOENT )
+        && ( stat ("/cfg/a.cfg", &st) == 0 ), "rename", "/cfg/a.cfg");
+    check (( stat ("/cfg/a.cfg", &st) == 0 ) && ( unlink ("/cfg/a.cfg") == 0 ) && ( stat ("/cfg/a.cfg", &st) != 0 ), "unlink", "/cfg/a.cfg");
+
+    // A card change is seen by the card detect switch
+    fd = open ("/b.cfg", O_CREAT | O_WRONLY, 0666);
+    check (( fd >= 0 ) && ( close (fd) == 0 ) && ( stat ("/b.cfg", &st) == 0 ), "stat", "/b.cfg");
+    pico_host_gpio (CD_GPIO, 1);
+    check ( stat ("/b.cfg", &st) != 0, "card removed", "/b.cfg");
+    pico_host_gpio (CD_GPIO, 0);
+    }
+
+// Free space is kept by FatFs once known, so later queries need no card access
+static void test_statvfs (void)
+    {
+    if ( ! fat_mount (NULL) ) return;
+    struct statvfs sv0, sv;
+    check (( statvfs ("/", &sv0) == 0 ) && ( sv0.f_bsize > 0 ) && ( sv0.f_bfree > 0 )
+        && ( sv0.f_bfree <= sv0.f_blocks ), "statvfs", "/");
+    int fd = open ("/big.dat", O_CREAT | O_WRONLY, 0666);
+    for (int i = 0; i < 10; ++i) check ( write (fd, data, TEST_SIZE) == TEST_SIZE, "write", "/big.dat");
+    check (( fstatvfs (fd, &sv) == 0 ) && ( sv0.f_bfree - sv.f_bfree >= 10 * TEST_SIZE / sv.f_bsize ), "fstatvfs", "/big.dat");
+    check ( close (fd) == 0, "close", "/big.dat");
+    ff_disk_stats (0, NULL, true);
+    check ( statvfs ("/", &sv) == 0, "statvfs", "/");
+    FF_DISK_STATS st;
+    ff_disk_stats (0, &st, false);
+    check (( st.reads == 0 ) && ( st.cache_hits == 0 ), "no card access", "/");
+    check (( unlink ("/big.dat") == 0 ) && ( statvfs ("/", &sv) == 0 ) && ( sv.f_bfree == sv0.f_bfree ), "space freed", "/");
+    }
+
+// Read the whole of file path into buff, returning its length or -1
+static int read_file (const char *path)
+    {
+    int fd = open (path, O_RDONLY);
+    if ( fd < 0 ) return -1;
+    int n = read (fd, buff, sizeof (buff));
+    close (fd);
+    return n;
+    }
+
+// Clusters freed by FATFS are erased on the card (FF_USE_TRIM)
+static void test_trim (void)
+    {
+    if ( ! fat_mount (NULL) ) return;
+    for (int i = 0; i < TEST_SIZE; ++i) data[i] = (uint8_t) ( i * 7 + 1 );
+    int fd = open ("/trim.dat", O_CREAT | O_WRONLY, 0666);
+    for (int i = 0; i < 10; ++i) check ( write (fd, data, TEST_SIZE) == TEST_SIZE, "write", "/trim.dat");
+    check ( close (fd) == 0, "close", "/trim.dat");
+    ff_disk_stats (0, NULL, true);
+    check ( unlink ("/trim.dat") == 0, "unlink", "/trim.dat");
+    FF_DISK_STATS st;
+    ff_disk_stats (0, &st, false);
+    check (( st.erases > 0 ) && ( st.er_sectors >= 10 * TEST_SIZE / 512 ) && ( st.errors == 0 ), "erase", "/trim.dat");
+    // The freed space is used again as usual
+    fd = open ("/trim.dat", O_CREAT | O_WRONLY, 0666);
+    check (( fd >= 0 ) && ( write (fd, data, TEST_SIZE) == TEST_SIZE ) && ( close (fd) == 0 ), "write", "/trim.dat");
+    check (( read_file ("/trim.dat") == TEST_SIZE ) && ( memcmp (buff, data, TEST_SIZE) == 0 ), "read", "/trim.dat");
+    }
+
+// Copies between a RAM volume and FAT, and within FAT
+static void test_copy (void)
+    {
+    if ( ! fat_mount (NULL) ) return;
+    check ( pfs_mount (pfs_ram_create (65536, 16), "/ram") == 0, "mount", "ram");
+    for (int i = 0; i < TEST_SIZE; ++i) data[i] = (uint8_t) ( i * 13 + ( i >> 8 ));
+    int fd = open ("/ram/a.dat", O_CREAT | O_WRONLY, 0666);
+    check (( fd >= 0 ) && ( write (fd, data, TEST_SIZE) == TEST_SIZE ) && ( close (fd) == 0 ), "write", "/ram/a.dat");
+    check ( pfs_copy ("/ram/a.dat", "/b.dat", 0) == 0, "copy", "/b.dat");
+    check (( read_file ("/b.dat") == TEST_SIZE ) && ( memcmp (buff, data, TEST_SIZE) == 0 ), "read", "/b.dat");
+    check (( pfs_copy ("/b.dat", "/b.dat", 0) < 0 ) && ( errno == EINVAL ), "copy to itself", "/b.dat");
+
+    // A range, at given offsets, leaves the file positions alone
+    int fd_in = open ("/b.dat", O_RDONLY);
+    int fd_out = open ("/ram/c.dat", O_CREAT | O_WRONLY, 0666);
+    off_t off_in = 1000;
+    off_t off_out = 0;
+    check ( copy_file_range (fd_in, &off_in, fd_out, &off_out, 5000, 0) == 5000, "copy_file_range", "/ram/c.dat");
+    check (( off_in == 6000 ) && ( off_out == 5000 ) && ( lseek (fd_in, 0, SEEK_CUR) == 0 )
+        && ( lseek (fd_out, 0, SEEK_CUR) == 0 ), "offsets", "/ram/c.dat");
+    check (( read_file ("/ram/c.dat") == 5000 ) && ( memcmp (buff, data + 1000, 5000) == 0 ), "read", "/ram/c.dat");
+    // Otherwise from and to the file positions
+    check (( lseek (fd_in, 2000, SEEK_SET) == 2000 ) && ( lseek (fd_out, 1000, SEEK_SET) == 1000 )
+        && ( copy_file_range (fd_in, NULL, fd_out, NULL, TEST_SIZE, 0) == TEST_SIZE - 2000 ), "copy_file_range", "/ram/c.dat");
+    check ( copy_file_range (fd_in, NULL, fd_out, NULL, TEST_SIZE, 0) == 0, "end of file", "/ram/c.dat");
+    close (fd_in);
+    close (fd_out);
+    check (( read_file ("/ram/c.dat") == TEST_SIZE - 1000 ) && ( memcmp (buff, data + 1000, 1000) == 0 )
+        && ( memcmp (buff + 1000, data + 2000, TEST_SIZE - 2000) == 0 ), "read", "/ram/c.dat");
+
+    // A move within a volume is a rename, between volumes a copy and delete
+    struct stat st;
+    check ( pfs_copy ("/b.dat", "/d.dat", PFS_COPY_MOVE) == 0, "move", "/d.dat");
+    check (( stat ("/b.dat", &st) != 0 ) && ( read_file ("/d.dat") == TEST_SIZE ), "rename", "/d.dat");
+    check ( pfs_copy ("/d.dat", "/ram/e.dat", PFS_COPY_MOVE) == 0, "move", "/ram/e.dat");
+    check (( stat ("/d.dat", &st) != 0 ) && ( read_file ("/ram/e.dat") == TEST_SIZE )
+        && ( memcmp (buff, data, TEST_SIZE) == 0 ), "read", "/ram/e.dat");
+    }
+
+static int aio_count = 0;
+
+static void aio_done (struct pfs_aiocb *cb)
+    {
+    ++aio_count;
+    }
+
+// Requests queue without waiting, and complete when the service runs them
+static void test_aio (void)
+    {
+    static const struct pfs_host_latency lat = { 100, 50, 200, 0, 0, 0 };
+    if ( ! fat_mount (&lat) ) return;
+    for (int i = 0; i < TEST_SIZE; ++i) data[i] = (uint8_t) ( i * 11 + ( i >> 8 ));
+    int fd = open ("/aio.dat", O_CREAT | O_RDWR, 0666);
+    check ( fd >= 0, "open", "/aio.dat");
+    struct pfs_aiocb cb[PFS_AIO_QUEUE + 1];
+    memset (cb, 0, sizeof (cb));
+    int nchunk = TEST_SIZE / PFS_AIO_QUEUE;
+    for (int i = 0; i < PFS_AIO_QUEUE; ++i)
+        {
+        cb[i].fd = fd;
+        cb[i].buf = data + i * nchunk;
+        cb[i].nbyte = nchunk;
+        cb[i].offset = i * nchunk;
+        cb[i].callback = aio_done;
+        check ( pfs_aio_write (&cb[i]) == 0, "pfs_aio_write", "/aio.dat");
+        }
+    struct stat st;
+    check (( fstat (fd, &st) == 0 ) && ( st.st_size == 0 ) && ( pfs_aio_error (&cb[0]) == EINPROGRESS ), "queued", "/aio.dat");
+    check (( pfs_aio_write (&cb[PFS_AIO_QUEUE]) < 0 ) && ( errno == EAGAIN ), "queue full", "/aio.dat");
+    check ( pfs_aio_run () == PFS_AIO_QUEUE, "pfs_aio_run", "/aio.dat");
+    check (( fstat (fd, &st) == 0 ) && ( st.st_size == PFS_AIO_QUEUE * nchunk ) && ( aio_count == 0 ), "completed", "/aio.dat");
+    check (( pfs_aio_poll () == PFS_AIO_QUEUE ) && ( aio_count == PFS_AIO_QUEUE ), "pfs_aio_poll", "/aio.dat");
+    for (int i = 0; i < PFS_AIO_QUEUE; ++i)
+        check (( pfs_aio_error (&cb[i]) == 0 ) && ( pfs_aio_return (&cb[i]) == nchunk ), "result", "/aio.dat");
+
+    // Read back at the file position, and sync
+    memset (buff, 0, sizeof (buff));
+    struct pfs_aiocb rd = { .fd = fd, .buf = buff, .nbyte = PFS_AIO_QUEUE * nchunk, .offset = -1 };
+    struct pfs_aiocb sy = { .fd = fd };
+    check (( lseek (fd, 0, SEEK_SET) == 0 ) && ( pfs_aio_read (&rd) == 0 ) && ( pfs_aio_fsync (&sy) == 0 ), "submit", "/aio.dat");
+    check (( pfs_aio_suspend (&rd) == PFS_AIO_QUEUE * nchunk ) && ( memcmp (buff, data, PFS_AIO_QUEUE * nchunk) == 0 ), "read", "/aio.dat");
+    check ( pfs_aio_suspend (&sy) == 0, "fsync", "/aio.dat");
+    check ( pfs_aio_poll () == 2, "pfs_aio_poll", "/aio.dat");
+    close (fd);
+    struct pfs_aiocb bad = { .fd = fd, .buf = buff, .nbyte = 1, .offset = -1 };
+    check (( pfs_aio_read (&bad) == 0 ) && ( pfs_aio_suspend (&bad) < 0 ) && ( pfs_aio_error (&bad) == EBADF ), "closed file", "/aio.dat");
+    pfs_aio_poll ();
+    }
+
+static int dev_count = 0;
+
+static void dev_output (char ch)
+    {
+    ++dev_count;
+    }
+
+static void test_dev (void)
+    {
+    check ( pfs_mount (pfs_ram_create (16384, 8), "/") == 0, "mount", "ram");
+    check ( mkdir ("/dev", 0777) == 0, "mkdir", "/dev");
+    check ( pfs_mknod ("out", 0, pfs_dev_gdd_create (dev_output)) == 0, "mknod", "out");
+    check ( pfs_mknod ("pfsstat", 0, pfs_dev_stat_fetch ()) == 0, "mknod", "pfsstat");
+    check ( pfs_mount (pfs_dev_fetch (), "/dev") == 0, "mount", "dev");
+    int fd = open ("/dev/out", O_WRONLY);
+    check (( fd >= 0 ) && ( write (fd, "Hello", 5) == 5 ) && ( dev_count == 5 ), "write", "/dev/out");
+    // Positional I/O needs a device which can seek. The refused call is not counted.
+    struct pfs_stats ps;
+    check (( pwrite (fd, "Hello", 5, 0) < 0 ) && ( errno == ESPIPE ) && ( pfs_stats_fd (fd, &ps, false) == 0 )
+        && ( ps.nwrite == 1 ) && ( ps.nerror == 0 ), "pwrite", "/dev/out");
+    if ( fd >= 0 ) close (fd);
+    fd = open ("/dev/pfsstat", O_RDONLY);
+    int n = ( fd >= 0 ) ? read (fd, buff, sizeof (buff) - 1) : -1;
+    if ( n >= 0 ) buff[n] = '\0';
+    check (( n > 0 ) && ( strstr ((char *) buff, "/dev") != NULL ), "read", "/dev/pfsstat");
+    if ( fd >= 0 ) close (fd);
+    }
+
+#if HAVE_ROM
+// The image holds hello.txt ("Hello, world\n") and dir/empty
+static void test_rom (void)
+    {
+    check ( pfs_mount (pfs_rom_create (rom_image), "/") == 0, "mount", "rom");
+    int fd = open ("/hello.txt", O_RDONLY);
+    int n = ( fd >= 0 ) ? read (fd, buff, sizeof (buff)) : -1;
+    check (( n == 13 ) && ( memcmp (buff, "Hello, world\n", 13) == 0 ), "read", "/hello.txt");
+    if ( sizeof (long) > 4 )
+        check (( lseek (fd, 0x100000000L, SEEK_SET) == -1 ) && ( errno == EINVAL ), "lseek past 4GB", "/hello.txt");
+    if ( fd >= 0 ) close (fd);
+    struct stat st;
+    check (( stat ("/dir/empty", &st) == 0 ) && ( st.st_size == 0 ), "stat", "/dir/empty");
+    check (( open ("/new.txt", O_CREAT | O_WRONLY, 0666) < 0 ) && ( errno == EROFS ), "read only", "/new.txt");
+    check ( pfs_umount ("/") == 0, "unmount", "rom");
+    }
+#endif
+
+#if HAVE_LFS
+static void test_lfs (void)
+    {
+    static struct lfs_config cfg;
+    check ( ffs_pico_createcfg (&cfg, 0x00100000, 0x00080000) == 0, "create", "flash");
+    struct pfs_pfs *pfs = pfs_ffs_create (&cfg);
+    check ( pfs_mount (pfs, "/") == 0, "mount", "lfs");
+    test_files ("/");
+    struct ffs_pico_stats st;
+    ffs_pico_stats (&cfg, &st, false);
+    check (( st.progs > 0 ) && ( st.erases > 0 ), "flash statistics", "lfs");
+    struct statvfs sv;
+    check (( statvfs ("/", &sv) == 0 ) && ( sv.f_bfree > 0 ) && ( sv.f_bfree < sv.f_blocks ), "statvfs", "lfs");
+
+    // Blocks released by a deleted file are erased while idle, and not again when reused
+    int fd = open ("/pre.dat", O_CREAT | O_WRONLY, 0666);
+    check (( fd >= 0 ) && ( write (fd, data, TEST_SIZE) == TEST_SIZE ) && ( close (fd) == 0 ), "write", "/pre.dat");
+    check ( unlink ("/pre.dat") == 0, "unlink", "/pre.dat");
+    check ( pfs_ffs_preerase (pfs, 0) > 0, "preerase", "lfs");
+    ffs_pico_stats (&cfg, &st, true);
+    fd = open ("/pre.dat", O_CREAT | O_WRONLY, 0666);
+    check (( fd >= 0 ) && ( write (fd, data, TEST_SIZE) == TEST_SIZE ) && ( close (fd) == 0 ), "write", "/pre.dat");
+    ffs_pico_stats (&cfg, &st, false);
+    check ( st.skipped > 0, "erases skipped", "lfs");
+    }
+
+// Log mode: buffered appends, committed at block ends, in rotated segments
+static void test_lfslog (void)
+    {
+    static struct lfs_config cfg;
+    check ( ffs_pico_createcfg (&cfg, 0x00100000, 0x00080000) == 0, "create", "flash");
+    check ( pfs_mount (pfs_ffs_create (&cfg), "/") == 0, "mount", "lfs");
+    int fd = open ("/log.txt", O_CREAT | O_WRONLY | O_APPEND, 0666);
+    struct ioc_log log = { 512, 4096, 8000, 2 };
+    check (( fd >= 0 ) && ( ioctl (fd, IOC_RQ_LOG, &log) == 0 ), "ioctl", "/log.txt");
+    char rec[100];
+    for (int i = 0; i < 250; ++i)
+        {
+        memset (rec, 'a' + i % 26, sizeof (rec));
+        check ( write (fd, rec, sizeof (rec)) == sizeof (rec), "write", "/log.txt");
+        }
+    check ( close (fd) == 0, "close", "/log.txt");
+    // 25000 bytes in segments of 80 records: 10 in the file, 80 in each of .1 and .2
+    struct stat st;
+    check (( stat ("/log.txt", &st) == 0 ) && ( st.st_size == 1000 ), "stat", "/log.txt");
+    check (( stat ("/log.txt.1", &st) == 0 ) && ( st.st_size == 8000 ), "stat", "/log.txt.1");
+    check (( stat ("/log.txt.2", &st) == 0 ) && ( st.st_size == 8000 ), "stat", "/log.txt.2");
+    check ( stat ("/log.txt.3", &st) < 0, "oldest deleted", "/log.txt.3");
+    check (( read_file ("/log.txt") == 1000 ) && ( buff[0] == 'a' + 240 % 26 ) && ( buff[999] == 'a' + 249 % 26 ),
+        "read", "/log.txt");
+    // Data held in RAM is seen by other operations on the file
+    fd = open ("/log.txt", O_RDWR | O_APPEND);
+    check (( fd >= 0 ) && ( ioctl (fd, IOC_RQ_LOG, &log) == 0 ), "ioctl", "/log.txt");
+    check (( write (fd, rec, 10) == 10 ) && ( lseek (fd, 0, SEEK_END) == 1010 ), "lseek", "/log.txt");
+    check (( ioctl (fd, IOC_RQ_LOG, NULL) == 0 ) && ( close (fd) == 0 ), "close", "/log.txt");
+    }
+#endif
+
+static const struct
+    {
+    const char *name;
+    void (*test)(void);
+    } tests[] =
+    {
+    { "ram", test_ram },
+    { "fat", test_fat },
+    { "latency", test_latency },
+    { "retry", test_retry },
+    { "lazy", test_lazy },
+    { "hotplug", test_hotplug },
+    { "statvfs", test_statvfs },
+    { "statcache", test_statcache },
+    { "trim", test_trim },
+    { "copy", test_copy },
+    { "aio", test_aio },
+    { "dev", test_dev },
+#if HAVE_ROM
+    { "rom", test_rom },
+#endif
+#if HAVE_LFS
+    { "lfs", test_lfs },
+    { "lfslog", test_lfslog },
+#endif
+    };
+
+int main (int argc, const char *argv[])
+    {
+    for (int i = 0; i < (int) ( sizeof (tests) / sizeof (tests[0]) ); ++i)
+        {
+        if (( argc > 1 ) && ( strcmp (argv[1], tests[i].name) == 0 ))
+            {
+            tests[i].test ();
+            printf ("%s: %d failures\n", tests[i].name, nfail);
+            return ( nfail > 0 ) ? 1 : 0;
+            }
+        }
+    printf ("Usage: pfs_host_test <test>\n");
+    return 2;
+    }
@@ -0,0 +1,258 @@
+// pico_host.c - The parts of the Pico SDK and C library glue used by pico-filesystem, for host builds
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <pico/stdlib.h>
+#include <hardware/rtc.h>
+#include <hardware/gpio.h>
+#include <pfs_host.h>
+
+// The file functions implemented by pfs_base.c, which newlib calls on the Pico
+int _open (const char *fn, int oflag, ...);
+int _close (int fd);
+int _read (int handle, char *buffer, int length);
+int _write (int handle, char *buffer, int length);
+long _lseek (int fd, long pos, int whence);
+int _fstat (int fd, struct stat *buf);
+int _stat (const char *name, struct stat *buf);
+int _link (const char *old, const char *new);
+int _unlink (const char *name);
+
+static bool host_bSleep = false;
+static uint64_t host_t0 = 0;
+static uint64_t host_delay_us = 0;
+
+static uint64_t host_clock_us (void)
+    {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+void pico_host_sleep (bool bSleep)
+    {
+    host_bSleep = bSleep;
+    }
+
+void pico_host_delay (uint64_t us)
+    {
+    if ( host_bSleep ) sleep_us (us);
+    else host_delay_us += us;
+    }
+
+uint64_t time_us_64 (void)
+    {
+    if ( host_t0 == 0 ) host_t0 = host_clock_us ();
+    return host_clock_us () - host_t0 + host_delay_us;
+    }
+
+uint32_t time_us_32 (void)
+    {
+    return (uint32_t) time_us_64 ();
+    }
+
+void sleep_us (uint64_t us)
+    {
+    struct timespec ts = { us / 1000000, ( us % 1000000 ) * 1000 };
+    while ( nanosleep (&ts, &ts) != 0 );
+    }
+
+void sleep_ms (uint32_t ms)
+    {
+    sleep_us ((uint64_t) ms * 1000);
+    }
+
+void busy_wait_us_32 (uint32_t us)
+    {
+    uint64_t tend = time_us_64 () + us;
+    while ( time_us_64 () < tend );
+    }
+
+absolute_time_t get_absolute_time (void)
+    {
+    return time_us_64 ();
+    }
+
+absolute_time_t make_timeout_time_us (uint64_t us)
+    {
+    return time_us_64 () + us;
+    }
+
+absolute_time_t make_timeout_time_ms (uint32_t ms)
+    {
+    return time_us_64 () + (uint64_t) ms * 1000;
+    }
+
+uint32_t to_ms_since_boot (absolute_time_t t)
+    {
+    return (uint32_t) ( t / 1000 );
+    }
+
+bool best_effort_wfe_or_timeout (absolute_time_t timeout)
+    {
+    return time_us_64 () >= timeout;
+    }
+
+uint get_core_num (void)
+    {
+    return 0;
+    }
+
+bool rtc_running (void)
+    {
+    return true;
+    }
+
+bool rtc_get_datetime (datetime_t *t)
+    {
+    time_t now = time (NULL);
+    struct tm tm;
+    localtime_r (&now, &tm);
+    t->year = tm.tm_year + 1900;
+    t->month = tm.tm_mon + 1;
+    t->day = tm.tm_mday;
+    t->dotw = tm.tm_wday;
+    t->hour = tm.tm_hour;
+    t->min = tm.tm_min;
+    t->sec = tm.tm_sec;
+    return true;
+    }
+
+// GPIO inputs read the level set by pico_host_gpio, or else the pull up or down
+#define HOST_NGPIO  30
+
+static int8_t host_gpio[HOST_NGPIO];    // Level driven plus one (0 = not driven)
+static bool host_pull[HOST_NGPIO];
+
+void pico_host_gpio (uint gpio, int level)
+    {
+    if ( gpio < HOST_NGPIO ) host_gpio[gpio] = ( level < 0 ) ? 0 : ( level != 0 ) + 1;
+    }
+
+void gpio_init (uint gpio)
+    {
+    }
+
+void gpio_set_dir (uint gpio, bool out)
+    {
+    }
+
+void gpio_pull_up (uint gpio)
+    {
+    if ( gpio < HOST_NGPIO ) host_pull[gpio] = true;
+    }
+
+void gpio_pull_down (uint gpio)
+    {
+    if ( gpio < HOST_NGPIO ) host_pull[gpio] = false;
+    }
+
+bool gpio_get (uint gpio)
+    {
+    if ( gpio >= HOST_NGPIO ) return false;
+    return ( host_gpio[gpio] != 0 ) ? ( host_gpio[gpio] > 1 ) : host_pull[gpio];
+    }
+
+// The console is the host's standard input and output. The C library's own
+// buffered I/O (printf and so on) goes straight to the host, not through
+// pico-filesystem, but the pfs devices use these.
+
+bool stdio_init_all (void)
+    {
+    return true;
+    }
+
+bool stdio_usb_connected (void)
+    {
+    return true;
+    }
+
+void stdio_flush (void)
+    {
+    fflush (stdout);
+    }
+
+int putchar_raw (int c)
+    {
+    return putchar (c);
+    }
+
+int getchar_timeout_us (uint32_t timeout_us)
+    {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    fflush (stdout);
+    if ( poll (&pfd, 1, ( timeout_us == 0xFFFFFFFF ) ? -1 : (int) ( timeout_us / 1000 )) <= 0 )
+        return PICO_ERROR_TIMEOUT;
+    // The system call, as read is the pico-filesystem one below
+    unsigned char ch;
+    if ( syscall (SYS_read, STDIN_FILENO, &ch, 1) != 1 ) return PICO_ERROR_TIMEOUT;
+    return ch;
+    }
+
+// The POSIX functions which newlib implements with the _open etc. system
+// calls, so that on the host, as on the Pico, they use pico-filesystem.
+
+int open (const char *fn, int oflag, ...)
+    {
+    va_list va;
+    va_start (va, oflag);
+    int mode = ( oflag & O_CREAT ) ? va_arg (va, int) : 0;
+    va_end (va);
+    return _open (fn, oflag, mode);
+    }
+
+int close (int fd)
+    {
+    return _close (fd);
+    }
+
+ssize_t read (int fd, void *buf, size_t nbyte)
+    {
+    return _read (fd, (char *) buf, (int) nbyte);
+    }
+
+ssize_t write (int fd, const void *buf, size_t nbyte)
+    {
+    return _write (fd, (char *) buf, (int) nbyte);
+    }
+
+off_t lseek (int fd, off_t pos, int whence)
+    {
+    return _lseek (fd, pos, whence);
+    }
+
+int fstat (int fd, struct stat *buf)
+    {
+    return _fstat (fd, buf);
+    }
+
+int stat (const char *name, struct stat *buf)
+    {
+    return _stat (name, buf);
+    }
+
+int link (const char *old, const char *new)
+    {
+    return _link (old, new);
+    }
+
+int unlink (const char *name)
+    {
+    return _unlink (name);
+    }
+
+int rename (const char *old, const char *new)
+    {
+    if ( _link (old, new) != 0 ) return -1;
+    return _unlink (old);
+    }
@@ -0,0 +1,325 @@
+// sd_host.c - Simulated SD cards, held in image files or memory, for host builds
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Implements the sd_spi.h interface, so that ff_disk.c, with its sector
+// cache and statistics, runs unchanged on the host.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pico/stdlib.h>
+#include <ff.h>
+#include <ff_disk.h>
+#include <pfs_trace.h>
+#include <pfs_host.h>
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+#define SD_SECTOR   512
+
+// A simulated card. The SD_SPI comes first, as that is what the rest of
+// the filesystem sees.
+typedef struct
+    {
+    SD_SPI      sd;
+    uint8_t *   data;                   // Card contents (mapped image file, or memory)
+    uint32_t    nsector;                // Size of the card in sectors
+    uint32_t    ncmd;                   // Commands received, for fail_every
+    struct pfs_host_latency lat;        // Latency model
+    uint64_t    t_init;                 // Time at which initialisation started
+    uint32_t    serial;                 // Card serial number
+    } SD_HOST;
+
+STATIC SD_HOST *sd_first = NULL;
+STATIC uint32_t sd_serial = 0;
+
+SD_SPI *sd_host_create (const char *path, uint32_t nsector)
+    {
+    size_t size = (size_t) nsector * SD_SECTOR;
+    uint8_t *data;
+    if ( path != NULL )
+        {
+        // The C library stream functions reach the host files, as open and
+        // so on are the pico-filesystem ones
+        FILE *f = fopen (path, "r+b");
+        if ( f == NULL ) f = fopen (path, "w+b");
+        if ( f == NULL ) return NULL;
+        fseek (f, 0, SEEK_END);
+        if (( ftell (f) < (long) size ) && ( ftruncate (fileno (f), (off_t) size) != 0 ))
+            {
+            fclose (f);
+            return NULL;
+            }
+        data = (uint8_t *) mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno (f), 0);
+        fclose (f);
+        if ( data == MAP_FAILED ) return NULL;
+        }
+    else
+        {
+        data = (uint8_t *) calloc (nsector, SD_SECTOR);
+        if ( data == NULL ) return NULL;
+        }
+    SD_HOST *sdh = (SD_HOST *) calloc (1, sizeof (SD_HOST));
+    if ( sdh == NULL ) return NULL;
+    sdh->sd.sm = -1;
+    sdh->sd.dma_tx = -1;
+    sdh->sd.dma_rx = -1;
+    sdh->data = data;
+    sdh->nsector = nsector;
+    sdh->serial = ++sd_serial;
+    if ( sd_first == NULL ) sd_first = sdh;
+    return &sdh->sd;
+    }
+
+void sd_host_latency (SD_SPI *sd, const struct pfs_host_latency *lat)
+    {
+    SD_HOST *sdh = (SD_HOST *) sd;
+    if ( lat != NULL ) sdh->lat = *lat;
+    else memset (&sdh->lat, 0, sizeof (sdh->lat));
+    }
+
+bool sd_host_format (uint8_t pdrv, SD_SPI *sd)
+    {
+#if FF_USE_MKFS
+    if ( ! ff_disk_attach (pdrv, sd) ) return false;
+    char sDrive[3] = { '0' + pdrv, ':', '\0' };
+    MKFS_PARM opt = { FM_ANY | FM_SFD, 0, 0, 0, 0 };
+    void *work = malloc (FF_MAX_SS * 8);
+    if ( work == NULL ) return false;
+    FRESULT r = f_mkfs (sDrive, &opt, work, FF_MAX_SS * 8);
+    free (work);
+    return ( r == FR_OK );
+#else
+    return false;
+#endif
+    }
+
+// Start a command, returning false if the latency model says it fails
+STATIC bool sd_host_cmd (SD_HOST *sdh, uint lba, uint count)
+    {
+    pfs_trace (PFS_TR_SD_CMD, count, lba);
+    ++sdh->ncmd;
+    pico_host_delay (sdh->lat.op_us);
+    if (( sdh->lat.fail_every > 0 ) && ( sdh->ncmd % sdh->lat.fail_every == 0 ))
+        {
+        ++sdh->sd.busy.crc_errors;
+        pfs_trace (PFS_TR_SD_CRC, 0, lba);
+        return false;
+        }
+    return (( lba < sdh->nsector ) && ( count <= sdh->nsector - lba ));
+    }
+
+STATIC void sd_host_get (SD_HOST *sdh, uint lba, uint8_t *buff)
+    {
+    pico_host_delay (sdh->lat.read_us);
+    memcpy (buff, &sdh->data[(size_t) lba * SD_SECTOR], SD_SECTOR);
+    }
+
+// Programming time is reported as busy time, as it is for a real card
+STATIC void sd_host_put (SD_HOST *sdh, uint lba, const uint8_t *buff)
+    {
+    uint64_t t0 = time_us_64 ();
+    memcpy (&sdh->data[(size_t) lba * SD_SECTOR], buff, SD_SECTOR);
+    pico_host_delay (sdh->lat.write_us);
+    uint32_t dt = (uint32_t) ( time_us_64 () - t0 );
+    pfs_trace (PFS_TR_SD_BUSY, true, dt);
+    ++sdh->sd.busy.count;
+    if ( dt > sdh->sd.busy.max_us ) sdh->sd.busy.max_us = dt;
+    sdh->sd.busy.total_us += dt;
+    }
+
+SD_SPI *sd_spi_default (void)
+    {
+    return ( sd_first != NULL ) ? &sd_first->sd : NULL;
+    }
+
+void sd_spi_create (SD_SPI *sd, PIO pio, uint clk_pin, uint mosi_pin, uint miso_pin, uint cs_pin)
+    {
+    // Only simulated cards, from sd_host_create, may be used
+    }
+
+bool sd_spi_init_start (SD_SPI *sd)
+    {
+    if ( sd == NULL ) return false;
+    SD_HOST *sdh = (SD_HOST *) sd;
+    sd->type = sdtpUnk;
+    sd->bInit = true;
+    sdh->t_init = time_us_64 ();
+    return true;
+    }
+
+// The card is ready once lat.init_us has passed, each poll being one command
+int sd_spi_init_poll (SD_SPI *sd)
+    {
+    if ( ! sd->bInit ) return ( sd->type == sdtpUnk ) ? -1 : 1;
+    SD_HOST *sdh = (SD_HOST *) sd;
+    pico_host_delay (sdh->lat.op_us);
+    if ( time_us_64 () - sdh->t_init < sdh->lat.init_us ) return 0;
+    sd->bInit = false;
+    sd->type = sdtpHigh;
+    sd->freq_act = sd->freq_tgt;
+    return 1;
+    }
+
+bool sd_spi_init (SD_SPI *sd)
+    {
+    if ( ! sd_spi_init_start (sd) ) return false;
+    int r;
+    while (( r = sd_spi_init_poll (sd) ) == 0);
+    return ( r > 0 );
+    }
+
+void sd_spi_term (SD_SPI *sd)
+    {
+    sd->type = sdtpUnk;
+    sd->bInit = false;
+    }
+
+bool sd_spi_read_multi (SD_SPI *sd, uint lba, uint8_t *buff, uint count)
+    {
+    SD_HOST *sdh = (SD_HOST *) sd;
+    if ( ! sd_host_cmd (sdh, lba, count) ) return false;
+    for (uint i = 0; i < count; ++i) sd_host_get (sdh, lba + i, buff + i * SD_SECTOR);
+    return true;
+    }
+
+bool sd_spi_read (SD_SPI *sd, uint lba, uint8_t *buff)
+    {
+    return sd_spi_read_multi (sd, lba, buff, 1);
+    }
+
+bool sd_spi_write_multi (SD_SPI *sd, uint lba, const uint8_t *buff, uint count)
+    {
+    SD_HOST *sdh = (SD_HOST *) sd;
+    if ( ! sd_host_cmd (sdh, lba, count) ) return false;
+    for (uint i = 0; i < count; ++i) sd_host_put (sdh, lba + i, buff + i * SD_SECTOR);
+    return true;
+    }
+
+bool sd_spi_write (SD_SPI *sd, uint lba, const uint8_t *buff)
+    {
+    return sd_spi_write_multi (sd, lba, buff, 1);
+    }
+
+// Erased sectors read as zero. The erase time is busy time, as for a write.
+bool sd_spi_erase (SD_SPI *sd, uint first, uint last)
+    {
+    SD_HOST *sdh = (SD_HOST *) sd;
+    if (( last < first ) || ( ! sd_host_cmd (sdh, first, last - first + 1) )) return false;
+    uint64_t t0 = time_us_64 ();
+    memset (&sdh->data[(size_t) first * SD_SECTOR], 0, (size_t) ( last - first + 1 ) * SD_SECTOR);
+    pico_host_delay ((uint64_t) sdh->lat.erase_us * ( last - first + 1 ));
+    uint32_t dt = (uint32_t) ( time_us_64 () - t0 );
+    pfs_trace (PFS_TR_SD_BUSY, true, dt);
+    ++sdh->sd.busy.count;
+    if ( dt > sdh->sd.busy.max_us ) sdh->sd.busy.max_us = dt;
+    sdh->sd.busy.total_us += dt;
+    return true;
+    }
+
+// Asynchronous transfers are completed before returning, with the same use
+// of the buffer (two alternating blocks when there is a callback)
+STATIC uint8_t *sd_host_job_buff (SD_SPI *sd, uint blk)
+    {
+    if ( sd->job.cb != NULL ) return sd->job.buff + SD_SECTOR * ( blk & 1 );
+    return sd->job.buff + SD_SECTOR * blk;
+    }
+
+STATIC void sd_host_job_init (SD_SPI *sd, uint8_t *buff, uint count, SD_SPI_BLOCK_CB cb, void *ctx)
+    {
+    sd->job.state = sdjsIdle;
+    sd->job.bOK = true;
+    sd->job.bStop = false;
+    sd->job.count = count;
+    sd->job.nblk = 0;
+    sd->job.buff = buff;
+    sd->job.cb = cb;
+    sd->job.ctx = ctx;
+    }
+
+bool sd_spi_read_async (SD_SPI *sd, uint lba, uint8_t *buff, uint count, SD_SPI_BLOCK_CB cb, void *ctx)
+    {
+    SD_HOST *sdh = (SD_HOST *) sd;
+    if (( count == 0 ) || ( ! sd_host_cmd (sdh, lba, count) )) return false;
+    sd_host_job_init (sd, buff, count, cb, ctx);
+    for ( ; sd->job.nblk < count; ++sd->job.nblk)
+        {
+        uint8_t *pblk = sd_host_job_buff (sd, sd->job.nblk);
+        sd_host_get (sdh, lba + sd->job.nblk, pblk);
+        if (( cb != NULL ) && ( ! cb (ctx, pblk, sd->job.nblk) ))
+            {
+            ++sd->job.nblk;
+            break;
+            }
+        }
+    return true;
+    }
+
+bool sd_spi_write_async (SD_SPI *sd, uint lba, const uint8_t *buff, uint count, SD_SPI_BLOCK_CB cb, void *ctx)
+    {
+    SD_HOST *sdh = (SD_HOST *) sd;
+    if (( count == 0 ) || ( ! sd_host_cmd (sdh, lba, count) )) return false;
+    sd_host_job_init (sd, (uint8_t *) buff, count, cb, ctx);
+    for ( ; sd->job.nblk < count; ++sd->job.nblk)
+        {
+        uint8_t *pblk = sd_host_job_buff (sd, sd->job.nblk);
+        if (( cb != NULL ) && ( ! cb (ctx, pblk, sd->job.nblk) )) break;
+        sd_host_put (sdh, lba + sd->job.nblk, pblk);
+        }
+    return true;
+    }
+
+bool sd_spi_busy (SD_SPI *sd)
+    {
+    return false;
+    }
+
+bool sd_spi_wait (SD_SPI *sd)
+    {
+    return sd->job.bOK;
+    }
+
+void sd_spi_set_idle (SD_SPI *sd, void (*idle)(void))
+    {
+    sd->idle = idle;
+    }
+
+void sd_spi_set_timeout (SD_SPI *sd, uint rd_ms, uint wr_ms)
+    {
+    sd->rd_timeout = rd_ms;
+    sd->wr_timeout = wr_ms;
+    }
+
+void sd_spi_set_freq (SD_SPI *sd, uint freq, bool bProbe)
+    {
+    sd->freq_tgt = freq;
+    sd->freq_probe = bProbe;
+    }
+
+uint sd_spi_get_freq (SD_SPI *sd)
+    {
+    return (uint) sd->freq_act;
+    }
+
+uint32_t sd_spi_sectors (SD_SPI *sd)
+    {
+    return ((SD_HOST *) sd)->nsector;
+    }
+
+uint32_t sd_spi_card_id (SD_SPI *sd)
+    {
+    SD_HOST *sdh = (SD_HOST *) sd;
+    if ( ! sd_host_cmd (sdh, 0, 0) ) return 0;
+    return sdh->serial;
+    }
+
+void sd_spi_busy_stats (SD_SPI *sd, SD_BUSY_STATS *stats, bool bReset)
+    {
+    if ( stats != NULL ) *stats = sd->busy;
+    if ( bReset ) memset (&sd->busy, 0, sizeof (sd->busy));
+    }
@@ -10,6 +10,14 @@
 #define DIR void
 #endif
 
+// Values for d_type
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN  0
+#define DT_CHR      2
+#define DT_DIR      4
+#define DT_REG      8
+#endif
+
 struct dirent {
     ino_t          d_ino;       /* Inode number */
     off_t          d_off;       /* Not an offset */
@@ -18,6 +26,13 @@ struct dirent {
     char           d_name[256]; /* Null-terminated filename */
 };
 
+/* Directory entry with the details otherwise requiring a stat */
+struct pfs_direntx {
+    mode_t         d_mode;      /* File type and permissions, as st_mode */
+    long long      d_size;      /* File size in bytes */
+    char           d_name[256]; /* Null-terminated filename */
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -25,6 +40,7 @@ extern "C" {
 DIR *opendir (const char *name);
 struct dirent *readdir (DIR *dirp);
 int closedir (DIR *dirp);
+int pfs_readdirx (DIR *dirp, struct pfs_direntx *ent, int nent);
 
 #ifdef __cplusplus
 }
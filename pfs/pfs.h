@@ -5,6 +5,41 @@
 #ifndef PFS_H
 #define PFS_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#if __has_include(<sys/uio.h>)
+#include <sys/uio.h>
+#else
+// Scatter / gather element for readv and writev
+struct iovec
+    {
+    void *      iov_base;
+    size_t      iov_len;
+    };
+#endif
+
+// Number of latency histogram buckets. Bucket 0 counts calls taking under
+// 1us, bucket i calls taking from 2^(i-1) to under 2^i us, and the last
+// bucket any longer calls.
+#define PFS_STAT_NHIST  20
+
+// Counts of read and write calls (including readv, writev, pread and pwrite)
+struct pfs_stats
+    {
+    uint32_t    nread;                  // Read calls
+    uint32_t    nwrite;                 // Write calls
+    uint32_t    nerror;                 // Calls which failed
+    uint32_t    rmax_us;                // Longest read call
+    uint32_t    wmax_us;                // Longest write call
+    uint64_t    rbytes;                 // Bytes read
+    uint64_t    wbytes;                 // Bytes written
+    uint64_t    rtime_us;               // Total time in read calls
+    uint64_t    wtime_us;               // Total time in write calls
+    uint32_t    rhist[PFS_STAT_NHIST];  // Read latency histogram
+    uint32_t    whist[PFS_STAT_NHIST];  // Write latency histogram
+    };
+
 struct pfs_pfs;
 struct lfs_config;
 struct pfs_device;
@@ -47,6 +82,13 @@ int pfs_init (void);
 // code on failure.
 int pfs_mount (struct pfs_pfs *pfs, const char *name);
 
+// Unmounts the volume mounted at name, which is given as for pfs_mount.
+// FAT and LFS volumes are synced and their volume definitions freed, so that
+// they may be created again (for example after an SD card is changed).
+// Fails with EBUSY while a file on the volume, or any directory, is open.
+// Returns zero on success, or -1 with errno set.
+int pfs_umount (const char *name);
+
 // Initialises a lfs_config structure which is then used to inform
 // littlefs where and how to write to Pico flash memory.
 
@@ -69,13 +111,52 @@ int ffs_pico_createcfg (struct lfs_config *cfg, int offset, int size);
 // call has returned.
 struct pfs_pfs *pfs_ffs_create (const struct lfs_config *cfg);
 
-// Creates a pfs_pfs structure which defines an SD card storage volume
-// to mount.
+// As pfs_ffs_create, but the flash is not mounted (or formatted if it holds
+// no valid filesystem) until the first operation on the volume.
+struct pfs_pfs *pfs_ffs_create_lazy (const struct lfs_config *cfg);
+
+// Erases up to nblk (0 = all) blocks which littlefs has released on a
+// flash volume, so that later writes do not wait for them to be erased.
+// Call when idle, for example from the main loop. Returns the number of
+// blocks erased, or -1 with errno set.
+int pfs_ffs_preerase (struct pfs_pfs *pfs, int nblk);
 
-// The FATFS code maintains global state, so it is not currently
-// possible to have multiple FAT volumes.
+// Creates a pfs_pfs structure which defines an SD card storage volume
+// to mount, on the first FAT partition of drive 0.
 struct pfs_pfs *pfs_fat_create (void);
 
+// Creates a pfs_pfs structure for a FAT volume on another drive or partition.
+
+// *   drive = Physical drive number (SD card), 0 to SD_DRIVES - 1.
+// *   part = Partition number 1 to 4 (requires FF_MULTI_PARTITION), or 0
+//     for the first FAT partition found.
+
+// Up to FF_VOLUMES volumes may be created.
+struct pfs_pfs *pfs_fat_create_drive (int drive, int part);
+
+// As pfs_fat_create_drive, but without accessing the card. The card is
+// initialised and the volume mounted by the first operation on it, so that
+// startup is not delayed. A missing or unreadable card is then reported as
+// an error by that operation. See also ff_disk_init_start.
+struct pfs_pfs *pfs_fat_create_lazy (int drive, int part);
+
+// Creates a pfs_pfs structure for a volume held in RAM, for temporary files.
+
+// *   size = Total memory to use, in bytes, including the file table.
+// *   nnode = Maximum number of files and directories.
+
+// The memory is taken from the heap once, here. The contents are lost on reset.
+struct pfs_pfs *pfs_ram_create (int size, int nnode);
+
+// Creates a pfs_pfs structure for a read-only volume from an image built
+// by rom/mkromfs.py.
+
+// *   image = Start of the image, which must be 4-byte aligned. This is
+//     normally in flash, and must persist while the volume is mounted.
+
+// Returns NULL and sets errno to EINVAL if there is no valid image there.
+struct pfs_pfs *pfs_rom_create (const void *image);
+
 // There is only ever one device filesystem. This routine gets
 // the pfs_pfs structure needed to mount the filesystem.
 
@@ -96,6 +177,88 @@ struct pfs_pfs *pfs_dev_fetch (void);
 // configure the device.
 int pfs_mknod (const char *name, int mode, const struct pfs_device *dev);
 
+// Reserves storage for an open file, so that it is at least
+// (offset + len) bytes long.
+
+// *   fd = File handle.
+// *   offset = Start of the region to reserve.
+// *   len = Length of the region to reserve.
+
+// On all volumes the file is extended with zeros. On a FAT volume an
+// empty file is first made contiguous using f_expand. If there is not
+// enough space, ENOSPC is returned and the file keeps its original length.
+
+// As per Posix, the routine returns zero on success, or an error
+// number on failure.
+int posix_fallocate (int fd, off_t offset, off_t len);
+
+// Version of lseek with a 64-bit file position, for FAT (exFAT) files
+// larger than 2GB. For a volume that does not support large files
+// this calls the normal lseek.
+
+// Returns the new file position, or -1 and sets errno on failure.
+long long lseek64 (int fd, long long pos, int whence);
+
+// Read into, or write from, a list of buffers with a single call.
+
+// *   fd = File handle.
+// *   iov = Array of buffers.
+// *   iovcnt = Number of buffers, 1 to PFS_IOV_MAX.
+
+// Returns the total number of bytes transferred, or -1 and sets errno.
+// A read stops early at the end of the file.
+ssize_t readv (int fd, const struct iovec *iov, int iovcnt);
+ssize_t writev (int fd, const struct iovec *iov, int iovcnt);
+
+// Read or write at a given position in a file, without using or changing
+// the file position.
+
+// *   fd = File handle.
+// *   buf = Data buffer.
+// *   nbyte = Number of bytes to read or write.
+// *   offset = Position in the file.
+
+// Returns the number of bytes transferred, or -1 and sets errno.
+ssize_t pread (int fd, void *buf, size_t nbyte, off_t offset);
+ssize_t pwrite (int fd, const void *buf, size_t nbyte, off_t offset);
+
+// Commit data written to a file to the storage medium. On both FAT and
+// littlefs the directory entry is always updated along with the data, so
+// fdatasync is the same as fsync.
+int fsync (int fd);
+int fdatasync (int fd);
+
+// Copy up to len bytes from one file to another, which may be on different
+// volumes, without passing the data through the caller's buffers.
+
+// *   fd_in, fd_out = File handles, open for reading and writing.
+// *   off_in, off_out = If not NULL, the position to start at in that file,
+//     which is advanced by the length copied. The file position is unchanged.
+//     If NULL, the file position is used and advanced.
+// *   len = Maximum number of bytes to copy.
+// *   flags = Must be zero.
+
+// Returns the number of bytes copied (zero at the end of the input), or -1
+// and sets errno.
+ssize_t copy_file_range (int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+
+// Copy the file from to a new or truncated file to, on any volumes. With
+// PFS_COPY_MOVE the source is then deleted, or if both are on the same volume
+// the file is simply renamed. If the copy fails the partial destination is
+// deleted, and the source kept. Returns zero, or -1 and sets errno.
+#define PFS_COPY_MOVE   0x01
+int pfs_copy (const char *from, const char *to, int flags);
+
+// I/O statistics (unless built with PFS_STATS = 0), for a volume given by the
+// name it is mounted at, or for an open file handle. They are optionally
+// reset. Returns zero, or -1 and sets errno.
+int pfs_stats_volume (const char *name, struct pfs_stats *stats, bool bReset);
+int pfs_stats_fd (int fd, struct pfs_stats *stats, bool bReset);
+
+// Writes a text report of the statistics of all mounted volumes to buf
+// (len bytes, including terminator). Returns the length of the report.
+int pfs_stats_print (char *buf, int len);
+
 #ifdef __cplusplus
 }
 #endif
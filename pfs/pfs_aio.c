@@ -0,0 +1,172 @@
+/* pfs_aio.c - Asynchronous file I/O, run by a service on the other core */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <unistd.h>
+#include <errno.h>
+#include <pico.h>
+#include <hardware/sync.h>
+#if PFS_MULTICORE
+#include <pico/multicore.h>
+#endif
+#include <pfs.h>
+#include <pfs_aio.h>
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+#if PFS_AIO_QUEUE & ( PFS_AIO_QUEUE - 1 )
+#error PFS_AIO_QUEUE must be a power of two
+#endif
+
+// Each ring index is written by one side only, and counts up without
+// wrapping, so that head - tail is the number of entries. A full
+// submission ring is prevented by the limit on requests not yet collected,
+// so the completion ring cannot overflow and the service never waits.
+STATIC struct pfs_aiocb *volatile aio_sq[PFS_AIO_QUEUE];
+STATIC struct pfs_aiocb *volatile aio_cq[PFS_AIO_QUEUE];
+STATIC volatile uint32_t sq_head = 0;       // Written by the submitting core
+STATIC volatile uint32_t sq_tail = 0;       // Written by the service
+STATIC volatile uint32_t cq_head = 0;       // Written by the service
+STATIC volatile uint32_t cq_tail = 0;       // Written by the submitting core
+STATIC volatile bool bServer = false;
+
+STATIC int aio_submit (struct pfs_aiocb *cb, int op)
+    {
+    if ( cb == NULL )
+        {
+        errno = EINVAL;
+        return -1;
+        }
+    if ( sq_head - cq_tail >= PFS_AIO_QUEUE )
+        {
+        errno = EAGAIN;
+        return -1;
+        }
+    cb->op = op;
+    cb->result = -1;
+    cb->error = EINPROGRESS;
+    aio_sq[sq_head & ( PFS_AIO_QUEUE - 1 )] = cb;
+    // The request must be visible before the service sees the new head
+    __dmb ();
+    ++sq_head;
+    __sev ();
+    return 0;
+    }
+
+int pfs_aio_read (struct pfs_aiocb *cb)
+    {
+    return aio_submit (cb, PFS_AIO_READ);
+    }
+
+int pfs_aio_write (struct pfs_aiocb *cb)
+    {
+    return aio_submit (cb, PFS_AIO_WRITE);
+    }
+
+int pfs_aio_fsync (struct pfs_aiocb *cb)
+    {
+    return aio_submit (cb, PFS_AIO_FSYNC);
+    }
+
+int pfs_aio_error (const struct pfs_aiocb *cb)
+    {
+    return cb->error;
+    }
+
+ssize_t pfs_aio_return (const struct pfs_aiocb *cb)
+    {
+    return cb->result;
+    }
+
+int pfs_aio_poll (void)
+    {
+    int n = 0;
+    while ( cq_tail != cq_head )
+        {
+        __dmb ();
+        struct pfs_aiocb *cb = aio_cq[cq_tail & ( PFS_AIO_QUEUE - 1 )];
+        ++cq_tail;
+        ++n;
+        if ( cb->callback != NULL ) cb->callback (cb);
+        }
+    return n;
+    }
+
+ssize_t pfs_aio_suspend (const struct pfs_aiocb *cb)
+    {
+    while ( cb->error == EINPROGRESS )
+        {
+        // Without the service the request would never complete
+        if ( bServer ) __wfe ();
+        else pfs_aio_run ();
+        }
+    __dmb ();
+    return cb->result;
+    }
+
+// Carry out one request through the usual calls, so that it is counted in
+// the statistics and trace as any other
+STATIC void aio_do (struct pfs_aiocb *cb)
+    {
+    ssize_t n;
+    switch (cb->op)
+        {
+        case PFS_AIO_READ:
+            n = ( cb->offset < 0 ) ? read (cb->fd, cb->buf, cb->nbyte) : pread (cb->fd, cb->buf, cb->nbyte, cb->offset);
+            break;
+        case PFS_AIO_WRITE:
+            n = ( cb->offset < 0 ) ? write (cb->fd, cb->buf, cb->nbyte) : pwrite (cb->fd, cb->buf, cb->nbyte, cb->offset);
+            break;
+        case PFS_AIO_FSYNC:
+            n = fsync (cb->fd);
+            break;
+        default:
+            errno = EINVAL;
+            n = -1;
+            break;
+        }
+    cb->result = n;
+    int err = ( n < 0 ) ? errno : 0;
+    if ( err == EINPROGRESS ) err = EIO;
+    // The result must be visible before the request is seen to be complete
+    __dmb ();
+    cb->error = err;
+    }
+
+int pfs_aio_run (void)
+    {
+    int n = 0;
+    while ( sq_tail != sq_head )
+        {
+        __dmb ();
+        struct pfs_aiocb *cb = aio_sq[sq_tail & ( PFS_AIO_QUEUE - 1 )];
+        ++sq_tail;
+        aio_do (cb);
+        aio_cq[cq_head & ( PFS_AIO_QUEUE - 1 )] = cb;
+        __dmb ();
+        ++cq_head;
+        ++n;
+        __sev ();
+        }
+    return n;
+    }
+
+#if PFS_MULTICORE
+STATIC void aio_server (void)
+    {
+    while ( true )
+        {
+        // An event sent after the check and before the wait ends the wait at once
+        if ( pfs_aio_run () == 0 ) __wfe ();
+        }
+    }
+
+void pfs_aio_start (void)
+    {
+    if ( bServer ) return;
+    bServer = true;
+    multicore_launch_core1 (aio_server);
+    }
+#endif
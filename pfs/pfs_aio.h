@@ -0,0 +1,89 @@
+// pfs_aio.h - Asynchronous file I/O, run by a service on the other core
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Requests are queued by one core and carried out by pfs_aio_run, normally
+// in the service started on core 1 by pfs_aio_start, so that the submitting
+// core does not wait for SD card transfers or flash programming. The
+// submission and completion queues are rings with one writer each, so
+// neither core takes a lock to pass requests over. All requests must be
+// submitted, and pfs_aio_poll called, from the same core.
+
+#ifndef PFS_AIO_H
+#define PFS_AIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maximum number of requests submitted and not yet returned by pfs_aio_poll (a power of two)
+#ifndef PFS_AIO_QUEUE
+#define PFS_AIO_QUEUE       8
+#endif
+
+// Operations
+#define PFS_AIO_READ        1
+#define PFS_AIO_WRITE       2
+#define PFS_AIO_FSYNC       3
+
+struct pfs_aiocb;
+typedef void (*pfs_aio_callback)(struct pfs_aiocb *cb);
+
+// A request. The structure, and the data buffer, must not be used by the
+// caller between submission and completion.
+struct pfs_aiocb
+    {
+    int                 fd;         // File handle
+    void *              buf;        // Data buffer
+    size_t              nbyte;      // Number of bytes to read or write
+    off_t               offset;     // Position in the file, or -1 for the file position
+    pfs_aio_callback    callback;   // Called by pfs_aio_poll on completion (may be NULL)
+    void *              user;       // For the caller
+    // Set by the service
+    int                 op;         // Operation
+    volatile int        error;      // Zero, errno if failed, or EINPROGRESS until complete
+    ssize_t             result;     // As returned by read, write or fsync
+    };
+
+// Queue a request to read, write or sync a file. Returns zero if queued,
+// or -1 and sets errno to EAGAIN if PFS_AIO_QUEUE requests are outstanding.
+int pfs_aio_read (struct pfs_aiocb *cb);
+int pfs_aio_write (struct pfs_aiocb *cb);
+int pfs_aio_fsync (struct pfs_aiocb *cb);
+
+// Zero if the request has completed successfully, EINPROGRESS if it has
+// not yet completed, or the errno of a failed request
+int pfs_aio_error (const struct pfs_aiocb *cb);
+
+// The result of a completed request
+ssize_t pfs_aio_return (const struct pfs_aiocb *cb);
+
+// Collect the requests completed since the last call, freeing their places
+// in the queue and calling their callbacks, on the calling core. Returns
+// the number collected.
+int pfs_aio_poll (void);
+
+// Wait for a request to complete, returning its result. The request must
+// still be collected by pfs_aio_poll.
+ssize_t pfs_aio_suspend (const struct pfs_aiocb *cb);
+
+// Carry out all queued requests on the calling core, returning the number
+// done. This is the body of the core 1 service, and may instead be called
+// from an async_context worker or idle loop.
+int pfs_aio_run (void);
+
+#if PFS_MULTICORE
+// Launch the service on core 1, which then runs requests as they are
+// submitted, waiting for an event (__wfe) in between. Requires PFS_MULTICORE.
+void pfs_aio_start (void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
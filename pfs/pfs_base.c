@@ -3,39 +3,143 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <sys/syslimits.h>
 #include <pico/stdio.h>
 #include <pico/time.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <errno.h>
 #include <pfs_private.h>
 #include <dirent.h>
 #include <pname.h>
+#include <pfs_trace.h>
 #include <../device/pfs_dev_tty.h>
+#include <../device/ioctl.h>
+#if PFS_MULTICORE
+#include <pico/sync.h>
+#endif
 
+#if ! PFS_HOST
+// The C library on the host has its own (thread local) errno
 #undef errno
 extern int errno;
+#endif
 
 #define STDIO_HANDLE_STDIN  0
 #define STDIO_HANDLE_STDOUT 1
 #define STDIO_HANDLE_STDERR 2
 
+#ifndef PFS_MAX_HANDLES
+#define PFS_MAX_HANDLES     0       // Fixed number of file handles (0 = grow as required)
+#endif
+#define PFS_INIT_HANDLES    8       // Initial number of file handles if not fixed
+
+#if ( PFS_MAX_HANDLES > 0 ) && ( PFS_MAX_HANDLES < 3 )
+#error PFS_MAX_HANDLES must allow for stdin, stdout and stderr
+#endif
+
+#ifndef PFS_IOV_BUF
+#define PFS_IOV_BUF         128     // Size of buffer for gathering small writev buffers
+#endif
+
+#ifndef PFS_COPY_BUF
+#define PFS_COPY_BUF        4096    // Size of the buffer for copy_file_range and pfs_copy (a multiple of 512)
+#endif
+
+#ifndef PFS_STATS
+#define PFS_STATS           1       // Set to 0 to omit I/O statistics
+#endif
+
+#ifndef PFS_STAT_CACHE
+#define PFS_STAT_CACHE      8       // Number of stat results kept for FAT and LFS volumes (0 = none)
+#endif
+#define PFS_STAT_NAME       64      // Size of the longest full path name cached, including terminator
+
+#ifndef PFS_MOUNT_HASH
+#define PFS_MOUNT_HASH      16      // Number of buckets in mount table (must be a power of 2)
+#endif
+
 struct pfs_mount
     {
-    struct pfs_mount *          next;
+    struct pfs_mount *          next;       // All mounts, in reverse order of mounting
+    struct pfs_mount *          hnext;      // Mounts in the same hash bucket
     struct pfs_pfs *            pfs;
     const char *                moved;
+#if PFS_STATS
+    struct pfs_stats            st;         // Statistics for all files on the volume
+#endif
+    int                         nbusy;      // Calls using the volume, which prevent unmounting
+    unsigned int                hash;
     int                         nlen;
     char                        name[];
     };
 
+// Default sync policy for files on FAT and LFS volumes (0 = only on close or fsync)
+#ifndef PFS_SYNC_BYTES
+#define PFS_SYNC_BYTES  0
+#endif
+#ifndef PFS_SYNC_MS
+#define PFS_SYNC_MS     0
+#endif
+
 static struct pfs_mount *mounts = NULL;
+static struct pfs_mount *mount_root = NULL;
+static struct pfs_mount *mount_hash[PFS_MOUNT_HASH];
+#if PFS_STATS
+// Statistics kept for each handle
+struct pfs_fd_stats
+    {
+    struct pfs_stats            st;
+    };
+#endif
+#if PFS_MAX_HANDLES > 0
+static struct pfs_file *files[PFS_MAX_HANDLES];
+static int fd_link[PFS_MAX_HANDLES];        // Next free handle
+static struct pfs_mount *fd_mount[PFS_MAX_HANDLES];     // Volume holding the file (NULL for stdio)
+#if PFS_STAT_CACHE > 0
+static bool fd_write[PFS_MAX_HANDLES];      // Opened for writing, so its stat cache entry is dropped on close
+#endif
+#if PFS_STATS
+static struct pfs_fd_stats fd_stats[PFS_MAX_HANDLES];
+#endif
+#else
 static struct pfs_file ** files = NULL;
+static int *fd_link = NULL;
+static struct pfs_mount **fd_mount = NULL;
+#if PFS_STAT_CACHE > 0
+static bool *fd_write = NULL;
+#endif
+#if PFS_STATS
+static struct pfs_fd_stats *fd_stats = NULL;
+#endif
+#endif
 static int num_handle = 0;
+static int fd_free = -1;                    // First free handle
+static int ndir_open = 0;                   // Directories open (on any volume)
+static bool pfs_ready = false;
 static const char *cwd = NULL;
-static char rootdir = '/';
+static const char rootdir[] = "/";
+
+#if PFS_MULTICORE
+// Protects the handle table, mount table and current directory. Each volume
+// has its own lock, so that I/O on different volumes may proceed in parallel.
+auto_init_recursive_mutex (pfs_mutex);
+
+void pfs_lock (void)
+    {
+    recursive_mutex_enter_blocking (&pfs_mutex);
+    }
+
+void pfs_unlock (void)
+    {
+    recursive_mutex_exit (&pfs_mutex);
+    }
+#endif
 
 int pfs_error (int ierr)
     {
@@ -43,32 +147,198 @@ int pfs_error (int ierr)
     return ( ierr != 0 ) ? -1 : 0;
     }
 
-int pfs_init (void)
+// Add handles [nh0, nh1) to the free list, lowest first
+static void handle_link (int nh0, int nh1)
+    {
+    for (int fd = nh1 - 1; fd >= nh0; --fd)
+        {
+        files[fd] = NULL;
+        fd_mount[fd] = NULL;
+        fd_link[fd] = fd_free;
+        fd_free = fd;
+        }
+    }
+
+// Enlarge the handle table. Returns false if this is not possible
+static bool handle_grow (void)
+    {
+#if PFS_MAX_HANDLES > 0
+    return false;
+#else
+    int nh = ( num_handle > 0 ) ? 2 * num_handle : PFS_INIT_HANDLES;
+    struct pfs_file ** fi2 = (struct pfs_file **) realloc (files, nh * sizeof (struct pfs_file *));
+    if ( fi2 == NULL ) return false;
+    files = fi2;
+    int *fl2 = (int *) realloc (fd_link, nh * sizeof (int));
+    if ( fl2 == NULL ) return false;
+    fd_link = fl2;
+    struct pfs_mount **fm2 = (struct pfs_mount **) realloc (fd_mount, nh * sizeof (struct pfs_mount *));
+    if ( fm2 == NULL ) return false;
+    fd_mount = fm2;
+#if PFS_STAT_CACHE > 0
+    bool *fw2 = (bool *) realloc (fd_write, nh * sizeof (bool));
+    if ( fw2 == NULL ) return false;
+    fd_write = fw2;
+#endif
+#if PFS_STATS
+    struct pfs_fd_stats *fs2 = (struct pfs_fd_stats *) realloc (fd_stats, nh * sizeof (struct pfs_fd_stats));
+    if ( fs2 == NULL ) return false;
+    fd_stats = fs2;
+    memset (&fd_stats[num_handle], 0, ( nh - num_handle ) * sizeof (struct pfs_fd_stats));
+#endif
+    handle_link (num_handle, nh);
+    num_handle = nh;
+    return true;
+#endif
+    }
+
+static int pfs_init_locked (void)
     {
-    if ( num_handle != 0 ) return 0;
-    num_handle = 3;
-    files = (struct pfs_file **) malloc (num_handle * sizeof (struct pfs_file *));
-    if ( files == NULL ) return -2;
+    if ( pfs_ready ) return 0;
+    if ( num_handle == 0 )
+        {
+#if PFS_MAX_HANDLES > 0
+        num_handle = PFS_MAX_HANDLES;
+        handle_link (0, num_handle);
+#else
+        if ( ! handle_grow () ) return -2;
+#endif
+        }
     const struct pfs_device *tty = pfs_dev_tty_fetch ();
-    files[0] = tty->open (tty, NULL, O_RDWR);
-    if ( files[0] == NULL ) return -3;
-    files[1] = tty->open (tty, NULL, O_RDWR);
-    if ( files[1] == NULL ) return -4;
-    files[2] = tty->open (tty, NULL, O_RDWR);
-    if ( files[2] == NULL ) return -5;
-    cwd = strdup ("/");
+    for (int fd = STDIO_HANDLE_STDIN; fd <= STDIO_HANDLE_STDERR; ++fd)
+        {
+        if ( files[fd] == NULL )
+            {
+            files[fd] = tty->open (tty, NULL, O_RDWR);
+            if ( files[fd] == NULL ) return -3 - fd;
+            }
+        }
+    // The free list is in ascending order, so stdio handles are at the front
+    fd_free = fd_link[STDIO_HANDLE_STDERR];
+    if ( cwd == NULL ) cwd = strdup ("/");
+    if ( cwd == NULL ) return -6;
+    pfs_ready = true;
     return 0;
     }
 
-int pfs_mount (struct pfs_pfs *pfs, const char *psMount)
+int pfs_init (void)
+    {
+    pfs_lock ();
+    int ierr = pfs_init_locked ();
+    pfs_unlock ();
+    return ierr;
+    }
+
+// Returns the open file for a handle, or NULL (setting errno) if the handle is invalid
+static struct pfs_file *handle_get (int fd)
+    {
+    struct pfs_file *f = NULL;
+    pfs_lock ();
+    if (( fd >= 0 ) && ( fd < num_handle )) f = files[fd];
+    pfs_unlock ();
+    if ( f == NULL ) errno = EBADF;
+    return f;
+    }
+
+// Skip the call to pfs_init once initialisation is complete
+static inline int pfs_check (void)
+    {
+    return pfs_ready ? 0 : pfs_init ();
+    }
+
+// Start timing and tracing a read or write call
+static inline uint64_t io_start (int fd, bool bWrite, int length)
+    {
+    pfs_trace (( bWrite ? PFS_TR_WRITE : PFS_TR_READ ), fd, length);
+#if PFS_STATS
+    return time_us_64 ();
+#else
+    return 0;
+#endif
+    }
+
+#if PFS_STATS
+static void stats_add (struct pfs_stats *st, bool bWrite, int n, uint32_t t)
+    {
+    int ih = 0;
+    while (( ih < PFS_STAT_NHIST - 1 ) && ( t >= ( 1u << ih ))) ++ih;
+    if ( n < 0 ) ++st->nerror;
+    if ( bWrite )
+        {
+        ++st->nwrite;
+        if ( n > 0 ) st->wbytes += n;
+        st->wtime_us += t;
+        if ( t > st->wmax_us ) st->wmax_us = t;
+        ++st->whist[ih];
+        }
+    else
+        {
+        ++st->nread;
+        if ( n > 0 ) st->rbytes += n;
+        st->rtime_us += t;
+        if ( t > st->rmax_us ) st->rmax_us = t;
+        ++st->rhist[ih];
+        }
+    }
+#endif
+
+// Record a completed read or write call against its handle and volume. Returns n.
+static int io_end (int fd, bool bWrite, int n, uint64_t t0)
+    {
+    pfs_trace (PFS_TR_DONE, fd, n);
+#if PFS_STATS
+    uint32_t t = (uint32_t) ( time_us_64 () - t0 );
+    pfs_lock ();
+    if (( fd >= 0 ) && ( fd < num_handle ))
+        {
+        stats_add (&fd_stats[fd].st, bWrite, n, t);
+        if ( fd_mount[fd] != NULL ) stats_add (&fd_mount[fd]->st, bWrite, n, t);
+        }
+    pfs_unlock ();
+#endif
+    return n;
+    }
+
+// Hash a mount point name, which ends at the first slash or the end of the string
+static unsigned int mount_hash_name (const char *ps, int *plen)
+    {
+    unsigned int hash = 2166136261u;
+    const char *ps1 = ps;
+    while (( *ps1 != '\0' ) && ( *ps1 != '/' ))
+        {
+        hash = ( hash ^ (unsigned char) *ps1 ) * 16777619u;
+        ++ps1;
+        }
+    *plen = ps1 - ps;
+    return hash;
+    }
+
+// Find the mount point (other than root) with the given name. The name
+// does not include the leading slash, and may be followed by the rest of a path.
+static struct pfs_mount *mount_find (const char *ps)
+    {
+    int nlen;
+    unsigned int hash = mount_hash_name (ps, &nlen);
+    if ( nlen == 0 ) return NULL;
+    for (struct pfs_mount *m = mount_hash[hash & (PFS_MOUNT_HASH - 1)]; m != NULL; m = m->hnext)
+        {
+        if (( m->hash == hash ) && ( m->nlen == nlen + 1 ) && ( strncmp (ps, &m->name[1], nlen) == 0 ))
+            return m;
+        }
+    return NULL;
+    }
+
+static int pfs_mount_locked (struct pfs_pfs *pfs, const char *psMount)
     {
-    int ierr = pfs_init ();
-    if ( ierr != 0 ) return ierr;
     if ( pfs == NULL ) return -6;
     int nlen = strlen (psMount);
     struct pfs_mount *m = (struct pfs_mount *) malloc (sizeof (struct pfs_mount) + nlen + 2);
     if ( m == NULL ) return -7;
     m->moved = NULL;
+    m->nbusy = 0;
+#if PFS_STATS
+    memset (&m->st, 0, sizeof (m->st));
+#endif
     const char *ps1 = psMount;
     char *ps2 = m->name;
     *ps2 = '/';
@@ -101,198 +371,619 @@ int pfs_mount (struct pfs_pfs *pfs, const char *psMount)
         --ps2;
         *ps2 = '\0';
         }
-    struct pfs_mount *m2 = mounts;
-    while ( m2 != NULL )
+    m->nlen = ps2 - m->name;
+    m->pfs = pfs;
+    if ( m->nlen == 0 )
         {
-        if ( strcmp (m->name, m2->name) == 0 )
+        m->hash = 0;
+        m->hnext = NULL;
+        mount_root = m;
+        }
+    else
+        {
+        if ( mount_find (&m->name[1]) != NULL )
             {
             free (m);
             return -10;
             }
-        m2 = m2->next;
+        int nlen;
+        m->hash = mount_hash_name (&m->name[1], &nlen);
+        struct pfs_mount **pm = &mount_hash[m->hash & (PFS_MOUNT_HASH - 1)];
+        m->hnext = *pm;
+        *pm = m;
         }
-    m->nlen = ps2 - m->name;
-    m->pfs = pfs;
     m->next = mounts;
     mounts = m;
     return 0;
     }
 
+int pfs_mount (struct pfs_pfs *pfs, const char *psMount)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    pfs_lock ();
+    ierr = pfs_mount_locked (pfs, psMount);
+    pfs_unlock ();
+    return ierr;
+    }
+
+#if PFS_STAT_CACHE > 0
+// Recent stat results for volumes whose driver supplies cache_id. An entry
+// is dropped by any change made through its name, and is not used after
+// the volume's cache_id changes. Nothing is cached for a file that is open,
+// and its entry is dropped when it is opened and closed, so that writes
+// through the handle are seen.
+struct stat_cache
+    {
+    struct pfs_mount *          m;          // Volume (NULL if the entry is unused)
+    uint32_t                    id;         // Volume cache_id when the entry was made
+    uint32_t                    used;       // When last used, to replace the least recent
+    struct stat                 st;
+    char                        name[PFS_STAT_NAME];
+    };
+
+static struct stat_cache stat_cache[PFS_STAT_CACHE];
+static uint32_t stat_clock = 0;
+static uint32_t stat_gen = 0;               // Count of entries dropped
+
+static uint32_t stat_cache_id (struct pfs_mount *m)
+    {
+    return ( m->pfs->entry->cache_id != NULL ) ? m->pfs->entry->cache_id (m->pfs) : 0;
+    }
+
+// Look up a full path name, also returning the count of entries dropped,
+// to be given to stat_cache_put
+static bool stat_cache_get (struct pfs_mount *m, uint32_t id, const char *ps, struct stat *buf, uint32_t *pgen)
+    {
+    bool bFound = false;
+    pfs_lock ();
+    *pgen = stat_gen;
+    for (int i = 0; i < PFS_STAT_CACHE; ++i)
+        {
+        struct stat_cache *sc = &stat_cache[i];
+        if (( sc->m == m ) && ( strcmp (sc->name, ps) == 0 ))
+            {
+            if ( sc->id == id )
+                {
+                *buf = sc->st;
+                sc->used = ++stat_clock;
+                bFound = true;
+                }
+            else
+                {
+                sc->m = NULL;
+                }
+            break;
+            }
+        }
+    pfs_unlock ();
+    return bFound;
+    }
+
+// Cache a stat result, unless an entry was dropped since gen was read (the
+// result may predate the change) or the file is open
+static void stat_cache_put (struct pfs_mount *m, uint32_t id, uint32_t gen, const char *ps, const struct stat *buf)
+    {
+    if ( strlen (ps) >= PFS_STAT_NAME ) return;
+    pfs_lock ();
+    if ( gen != stat_gen ) id = 0;
+    for (int fd = 0; ( id != 0 ) && ( fd < num_handle ); ++fd)
+        {
+        if (( fd_mount[fd] == m ) && ( strcmp (files[fd]->pn, ps) == 0 )) id = 0;
+        }
+    if ( id != 0 )
+        {
+        struct stat_cache *sc = &stat_cache[0];
+        for (int i = 1; i < PFS_STAT_CACHE; ++i)
+            {
+            if ( sc->m == NULL ) break;
+            if (( stat_cache[i].m == NULL ) || ( stat_cache[i].used < sc->used )) sc = &stat_cache[i];
+            }
+        sc->m = m;
+        sc->id = id;
+        sc->used = ++stat_clock;
+        sc->st = *buf;
+        strcpy (sc->name, ps);
+        }
+    pfs_unlock ();
+    }
+
+// Drop the entry for a full path name and, with bTree, those for anything
+// below it. With m not NULL, drop all those for the volume instead.
+static void stat_cache_drop (struct pfs_mount *m, const char *ps, bool bTree)
+    {
+    int nlen = ( ps != NULL ) ? strlen (ps) : 0;
+    pfs_lock ();
+    ++stat_gen;
+    for (int i = 0; i < PFS_STAT_CACHE; ++i)
+        {
+        struct stat_cache *sc = &stat_cache[i];
+        if ( sc->m == NULL ) continue;
+        if ( m != NULL )
+            {
+            if ( sc->m == m ) sc->m = NULL;
+            }
+        else if (( strncmp (sc->name, ps, nlen) == 0 )
+            && (( sc->name[nlen] == '\0' ) || ( bTree && ( sc->name[nlen] == '/' ))))
+            {
+            sc->m = NULL;
+            }
+        }
+    pfs_unlock ();
+    }
+#else
+#define stat_cache_drop(m, ps, bTree)
+#endif
+
+static int pfs_umount_locked (const char *psMount)
+    {
+    if (( *psMount == '/' ) || ( *psMount == '\\' )) ++psMount;
+    struct pfs_mount *m = ( *psMount == '\0' ) ? mount_root : mount_find (psMount);
+    if ( m == NULL ) return pfs_error (EINVAL);
+    // Open directories may be listing the mount points, so any of them prevents unmounting
+    if (( ndir_open > 0 ) || ( m->nbusy > 0 )) return pfs_error (EBUSY);
+    for (int fd = 0; fd < num_handle; ++fd)
+        {
+        if (( files[fd] != NULL ) && ( fd_mount[fd] == m )) return pfs_error (EBUSY);
+        }
+    if (( m->pfs->entry->umount != NULL ) && ( m->pfs->entry->umount (m->pfs) != 0 )) return -1;
+    // A later mount may be given the same address
+    stat_cache_drop (m, NULL, false);
+    if ( m == mount_root )
+        {
+        mount_root = NULL;
+        }
+    else
+        {
+        struct pfs_mount **pm = &mount_hash[m->hash & (PFS_MOUNT_HASH - 1)];
+        while ( *pm != m ) pm = &(*pm)->hnext;
+        *pm = m->hnext;
+        }
+    struct pfs_mount **pm = &mounts;
+    while ( *pm != m ) pm = &(*pm)->next;
+    *pm = m->next;
+    free (m);
+    return 0;
+    }
+
+int pfs_umount (const char *psMount)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    pfs_lock ();
+    ierr = pfs_umount_locked (psMount);
+    pfs_unlock ();
+    return ierr;
+    }
+
 int _read (int handle, char *buffer, int length)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
-    if (( handle >= 0 ) && ( handle < num_handle ) && ( files[handle] != NULL ))
+    struct pfs_file *f = handle_get (handle);
+    if ( f != NULL )
         {
-        struct pfs_file *f = files[handle];
         if ( f->entry->read == NULL ) return pfs_error (EINVAL);
-        return f->entry->read (f, buffer, length);
+        uint64_t t0 = io_start (handle, false, length);
+        return io_end (handle, false, f->entry->read (f, buffer, length), t0);
         }
-    errno = EBADF;
     return -1;
     }
 
 int _write (int handle, char *buffer, int length)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
-    if (( handle >= 0 ) && ( handle < num_handle ) && ( files[handle] != NULL ))
+    struct pfs_file *f = handle_get (handle);
+    if ( f != NULL )
         {
-        struct pfs_file *f = files[handle];
         if ( f->entry->write == NULL ) return pfs_error (EINVAL);
-        return f->entry->write (f, buffer, length);
+        uint64_t t0 = io_start (handle, true, length);
+        return io_end (handle, true, f->entry->write (f, buffer, length), t0);
+        }
+    return -1;
+    }
+
+int pfs_readv_rtn (struct pfs_file *fd, const struct iovec *iov, int iovcnt, pfs_rw_rtn read)
+    {
+    int ntotal = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        {
+        if ( iov[i].iov_len == 0 ) continue;
+        int n = read (fd, (char *) iov[i].iov_base, iov[i].iov_len);
+        if ( n < 0 ) return ( ntotal > 0 ) ? ntotal : n;
+        ntotal += n;
+        if ( (size_t) n < iov[i].iov_len ) break;
+        }
+    return ntotal;
+    }
+
+int pfs_writev_rtn (struct pfs_file *fd, const struct iovec *iov, int iovcnt, pfs_rw_rtn write)
+    {
+    char buf[PFS_IOV_BUF];
+    int nbuf = 0;
+    int ntotal = 0;
+    for (int i = 0; i <= iovcnt; ++i)
+        {
+        int len = ( i < iovcnt ) ? iov[i].iov_len : 0;
+        // Send the gathered data before a buffer that does not fit, and at the end
+        if (( nbuf > 0 ) && (( i == iovcnt ) || ( nbuf + len > PFS_IOV_BUF )))
+            {
+            int n = write (fd, buf, nbuf);
+            if ( n < 0 ) return ( ntotal > 0 ) ? ntotal : n;
+            ntotal += n;
+            if ( n < nbuf ) return ntotal;
+            nbuf = 0;
+            }
+        if ( len == 0 ) continue;
+        if ( len <= PFS_IOV_BUF / 2 )
+            {
+            memcpy (&buf[nbuf], iov[i].iov_base, len);
+            nbuf += len;
+            }
+        else
+            {
+            int n = write (fd, (char *) iov[i].iov_base, len);
+            if ( n < 0 ) return ( ntotal > 0 ) ? ntotal : n;
+            ntotal += n;
+            if ( n < len ) return ntotal;
+            }
+        }
+    return ntotal;
+    }
+
+// Check a buffer list for readv or writev
+static int iov_check (const struct iovec *iov, int iovcnt)
+    {
+    if (( iovcnt <= 0 ) || ( iovcnt > PFS_IOV_MAX )) return pfs_error (EINVAL);
+    size_t ntotal = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        {
+        if ( iov[i].iov_len > INT_MAX - ntotal ) return pfs_error (EINVAL);
+        ntotal += iov[i].iov_len;
+        }
+    return 0;
+    }
+
+ssize_t readv (int fd, const struct iovec *iov, int iovcnt)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    if ( iov_check (iov, iovcnt) != 0 ) return -1;
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
+        {
+        if (( f->entry->readv == NULL ) && ( f->entry->read == NULL )) return pfs_error (EINVAL);
+        uint64_t t0 = io_start (fd, false, iovcnt);
+        int n = ( f->entry->readv != NULL ) ? f->entry->readv (f, iov, iovcnt)
+            : pfs_readv_rtn (f, iov, iovcnt, f->entry->read);
+        return io_end (fd, false, n, t0);
+        }
+    return -1;
+    }
+
+ssize_t writev (int fd, const struct iovec *iov, int iovcnt)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    if ( iov_check (iov, iovcnt) != 0 ) return -1;
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
+        {
+        if (( f->entry->writev == NULL ) && ( f->entry->write == NULL )) return pfs_error (EINVAL);
+        uint64_t t0 = io_start (fd, true, iovcnt);
+        int n = ( f->entry->writev != NULL ) ? f->entry->writev (f, iov, iovcnt)
+            : pfs_writev_rtn (f, iov, iovcnt, f->entry->write);
+        return io_end (fd, true, n, t0);
+        }
+    return -1;
+    }
+
+// Without driver support, positional I/O is a seek either side of the transfer.
+// For a read, returns 1 (and leaves the position alone) if offset is at or
+// past the end of the file, as seeking there may extend a file open for writing.
+static int pio_seek (struct pfs_file *f, off_t offset, off_t *psave, bool bRead)
+    {
+    if ( f->entry->lseek == NULL ) return pfs_error (ESPIPE);
+    *psave = f->entry->lseek (f, 0, SEEK_CUR);
+    if ( *psave < 0 ) return -1;
+    if ( bRead )
+        {
+        long size = f->entry->lseek (f, 0, SEEK_END);
+        if ( size < 0 ) return -1;
+        if ( offset >= size )
+            {
+            f->entry->lseek (f, *psave, SEEK_SET);
+            return 1;
+            }
+        }
+    if ( f->entry->lseek (f, offset, SEEK_SET) < 0 ) return -1;
+    return 0;
+    }
+
+ssize_t pread (int fd, void *buf, size_t nbyte, off_t offset)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    if (( offset < 0 ) || ( nbyte > INT_MAX )) return pfs_error (EINVAL);
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
+        {
+        if ( f->entry->pread == NULL )
+            {
+            if ( f->entry->read == NULL ) return pfs_error (EINVAL);
+            if ( f->entry->lseek == NULL ) return pfs_error (ESPIPE);
+            }
+        uint64_t t0 = io_start (fd, false, nbyte);
+        if ( f->entry->pread != NULL ) return io_end (fd, false, f->entry->pread (f, (char *) buf, nbyte, offset), t0);
+        off_t save;
+        int r = pio_seek (f, offset, &save, true);
+        if ( r < 0 ) return io_end (fd, false, -1, t0);
+        if ( r > 0 ) return io_end (fd, false, 0, t0);
+        int n = f->entry->read (f, (char *) buf, nbyte);
+        f->entry->lseek (f, save, SEEK_SET);
+        return io_end (fd, false, n, t0);
         }
-    errno = EBADF;
     return -1;
     }
 
-static struct pfs_mount *reference (const char **pn, const char **pr)
+ssize_t pwrite (int fd, const void *buf, size_t nbyte, off_t offset)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    if (( offset < 0 ) || ( nbyte > INT_MAX )) return pfs_error (EINVAL);
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
+        {
+        if ( f->entry->pwrite == NULL )
+            {
+            if ( f->entry->write == NULL ) return pfs_error (EINVAL);
+            if ( f->entry->lseek == NULL ) return pfs_error (ESPIPE);
+            }
+        uint64_t t0 = io_start (fd, true, nbyte);
+        if ( f->entry->pwrite != NULL ) return io_end (fd, true, f->entry->pwrite (f, (const char *) buf, nbyte, offset), t0);
+        off_t save;
+        if ( pio_seek (f, offset, &save, false) != 0 ) return io_end (fd, true, -1, t0);
+        int n = f->entry->write (f, (char *) buf, nbyte);
+        f->entry->lseek (f, save, SEEK_SET);
+        return io_end (fd, true, n, t0);
+        }
+    return -1;
+    }
+
+int fsync (int fd)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
+        {
+        if ( f->entry->fsync == NULL ) return pfs_error (EINVAL);
+        return f->entry->fsync (f);
+        }
+    return -1;
+    }
+
+int fdatasync (int fd)
+    {
+    return fsync (fd);
+    }
+
+void pfs_sync_init (struct pfs_sync *ps)
+    {
+    ps->bytes = PFS_SYNC_BYTES;
+    ps->ms = PFS_SYNC_MS;
+    ps->count = 0;
+    ps->t0 = 0;
+    }
+
+bool pfs_sync_due (struct pfs_sync *ps, int nbyte)
+    {
+    if ( nbyte <= 0 ) return false;
+    uint32_t tnow = to_ms_since_boot (get_absolute_time ());
+    if ( ps->count == 0 ) ps->t0 = tnow;
+    ps->count += nbyte;
+    if (( ps->bytes > 0 ) && ( ps->count >= ps->bytes )) return true;
+    if (( ps->ms > 0 ) && ( tnow - ps->t0 >= (uint32_t) ps->ms )) return true;
+    return false;
+    }
+
+void pfs_sync_done (struct pfs_sync *ps)
     {
+    ps->count = 0;
+    }
+
+// Finds the volume containing a file. The full path name is written to
+// psFull (PFS_PATH_MAX characters), and *pr is set to the name relative
+// to the volume.
+static struct pfs_mount *reference (const char *pn, char *psFull, const char **pr)
+    {
+    psFull[0] = '\0';
+    pfs_lock ();
     if (( mounts == NULL ) || ( cwd == NULL ))
         {
+        pfs_unlock ();
         errno = ENOENT;
         return NULL;
         }
-    *pn = pname_append (cwd, *pn);
-    if ( *pn == NULL )
+    if ( pname_normalize (psFull, PFS_PATH_MAX, cwd, pn) < 0 )
         {
+        pfs_unlock ();
         errno = ENAMETOOLONG;
         return NULL;
         }
-    int nlen = strlen (*pn);
-    for (struct pfs_mount *m = mounts; m != NULL; m = m->next)
+    struct pfs_mount *m = mount_find (psFull + 1);
+    if ( m != NULL )
         {
-        if ( strncmp (*pn, m->name, m->nlen) == 0 )
-            {
-            if ( (*pn)[m->nlen] == '\0' )
-                {
-                *pr = &rootdir;
-                return m;
-                }
-            if ( (*pn)[m->nlen] == '/' )
-                {
-                *pr = *pn + m->nlen;
-                return m;
-                }
-            }
+        *pr = ( psFull[m->nlen] == '\0' ) ? rootdir : psFull + m->nlen;
         }
-    *pr = *pn;
-    return NULL;
+    else
+        {
+        *pr = psFull;
+        m = mount_root;
+        }
+    // The volume cannot be unmounted until the caller calls release
+    if ( m != NULL ) ++m->nbusy;
+    pfs_unlock ();
+    if ( m != NULL ) pfs_trace (PFS_TR_RESOLVE, m->nlen, strlen (psFull));
+    return m;
+    }
+
+// End the use of a volume returned by reference
+static void release (struct pfs_mount *m)
+    {
+    if ( m == NULL ) return;
+    pfs_lock ();
+    --m->nbusy;
+    pfs_unlock ();
     }
 
 int _open (const char *fn, int oflag, ...)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
+    char sName[PFS_PATH_MAX];
     const char *rn;
-    struct pfs_mount *m = reference (&fn, &rn);
+    struct pfs_mount *m = reference (fn, sName, &rn);
     if ( m == NULL ) return -1;
     struct pfs_file *f = m->pfs->entry->open (m->pfs, rn, oflag);
     if ( f == NULL )
         {
-        free ((void *)fn);
+        release (m);
         return -1;
         }
-    f->pn = fn;
-    for ( int fd = 0; fd < num_handle; ++fd )
+    f->pn = pfs_path_alloc (sName);
+    if ( f->pn == NULL )
         {
-        if ( files[fd] == NULL )
-            {
-            files[fd] = f;
-            return fd;
-            }
+        if ( f->entry->close != NULL ) f->entry->close (f);
+        pfs_file_free (f);
+        release (m);
+        errno = ENOMEM;
+        return -1;
         }
-    int nh = 2 * num_handle;
-    struct pfs_file ** fi2 = (struct pfs_file **) realloc (files, nh * sizeof (struct pfs_file *));
-    if ( fi2 == NULL )
+    pfs_lock ();
+    if (( fd_free < 0 ) && ( ! handle_grow () ))
         {
+        --m->nbusy;
+        pfs_unlock ();
         if ( f->entry->close != NULL ) f->entry->close (f);
-        free ((void *) f->pn);
-        free (f);
+        pfs_path_free (f->pn);
+        pfs_file_free (f);
         errno = ENFILE;
         return -1;
         }
-    files = fi2;
-    for (int fd = num_handle; fd < nh; ++fd)
-        {
-        files[fd] = NULL;
-        }
-    int fd = num_handle;
+    int fd = fd_free;
+    fd_free = fd_link[fd];
     files[fd] = f;
-    num_handle = nh;
+    fd_mount[fd] = m;
+    // The open handle now keeps the volume mounted
+    --m->nbusy;
+#if PFS_STAT_CACHE > 0
+    // Dropped once the handle is listed, so that a stat on the other core cannot cache it again
+    fd_write[fd] = ((( oflag & O_ACCMODE ) != O_RDONLY ) || ( oflag & ( O_CREAT | O_TRUNC )));
+    if ( fd_write[fd] ) stat_cache_drop (NULL, sName, false);
+#endif
+#if PFS_STATS
+    memset (&fd_stats[fd].st, 0, sizeof (struct pfs_stats));
+#endif
+    pfs_unlock ();
+    pfs_trace (PFS_TR_OPEN, fd, oflag);
     return fd;
     }
 
 int _close (int fd)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
-    if (( fd >= 0 ) && ( fd < num_handle ) && ( files[fd] != NULL ))
+    pfs_lock ();
+    struct pfs_file *f = handle_get (fd);
+#if PFS_STAT_CACHE > 0
+    bool bWrite = ( f != NULL ) && fd_write[fd];
+#endif
+    if ( f != NULL )
         {
-        struct pfs_file *f = files[fd];
-        int ierr = ( f->entry->close != NULL ) ? f->entry->close (f) : 0;
-        free ((void *)files[fd]->pn);
-        free (files[fd]);
         files[fd] = NULL;
-        return ierr;
+        fd_mount[fd] = NULL;
+        fd_link[fd] = fd_free;
+        fd_free = fd;
         }
-    errno = EBADF;
-    return -1;
+    pfs_unlock ();
+    if ( f == NULL ) return -1;
+    pfs_trace (PFS_TR_CLOSE, fd, 0);
+    ierr = ( f->entry->close != NULL ) ? f->entry->close (f) : 0;
+    // The directory entry is only up to date once the file is closed
+#if PFS_STAT_CACHE > 0
+    if ( bWrite ) stat_cache_drop (NULL, f->pn, false);
+#endif
+    pfs_path_free (f->pn);
+    pfs_file_free (f);
+    return ierr;
     }
 
 long _lseek (int fd, long pos, int whence)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
-    if (( fd >= 0 ) && ( fd < num_handle ) && ( files[fd] != NULL ))
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
         {
-        struct pfs_file *f = files[fd];
         if ( f->entry->lseek == NULL ) return pfs_error (EINVAL);
         return f->entry->lseek (f, pos, whence);
         }
-    errno = EBADF;
+    return -1;
+    }
+
+long long lseek64 (int fd, long long pos, int whence)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
+        {
+        if ( f->entry->lseek64 != NULL ) return f->entry->lseek64 (f, pos, whence);
+        if ( f->entry->lseek == NULL ) return pfs_error (EINVAL);
+        if (( pos < LONG_MIN ) || ( pos > LONG_MAX )) return pfs_error (EOVERFLOW);
+        return f->entry->lseek (f, (long) pos, whence);
+        }
     return -1;
     }
 
 int _fstat (int fd, struct stat *buf)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
-    if (( fd >= 0 ) && ( fd < num_handle ) && ( files[fd] != NULL ))
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
         {
-        struct pfs_file *f = files[fd];
         if ( f->entry->fstat == NULL ) return pfs_error (EINVAL);
         return f->entry->fstat (f, buf);
         }
-    errno = EBADF;
     return -1;
     }
 
 int _isatty (int fd)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
-    if (( fd >= 0 ) && ( fd < num_handle ) && ( files[fd] != NULL ))
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
         {
-        struct pfs_file *f = files[fd];
         if ( f->entry->isatty == NULL ) return 0;
         return f->entry->isatty (f);
         }
-    errno = EBADF;
     return -1;
     }
 
 int _ioctl (int fd, unsigned long request, void *argp)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
-    if (( fd >= 0 ) && ( fd < num_handle ) && ( files[fd] != NULL ))
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
         {
-        struct pfs_file *f = files[fd];
         if ( f->entry->ioctl == NULL ) return pfs_error (EINVAL);
         return f->entry->ioctl (f, request, argp);
         }
-    errno = EBADF;
     return -1;
     }
 
@@ -301,35 +992,98 @@ int ioctl (int fd, unsigned long request, void *argp)
     return _ioctl (fd, request, argp);
     }
 
+int posix_fallocate (int fd, off_t offset, off_t len)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ENOMEM;
+    if (( offset < 0 ) || ( len <= 0 )) return EINVAL;
+    struct pfs_file *f = handle_get (fd);
+    if ( f != NULL )
+        {
+        if ( f->entry->allocate == NULL ) return ENODEV;
+        if ( f->entry->allocate (f, offset, len) != 0 ) return errno;
+        return 0;
+        }
+    return EBADF;
+    }
+
 int _stat (const char *name, struct stat *buf)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
+    char sName[PFS_PATH_MAX];
     const char *rname;
-    struct pfs_mount *m = reference (&name, &rname);
+    struct pfs_mount *m = reference (name, sName, &rname);
     if ( m == NULL ) return pfs_error (EINVAL);
+#if PFS_STAT_CACHE > 0
+    uint32_t gen;
+    if ( stat_cache_get (m, stat_cache_id (m), sName, buf, &gen) )
+        {
+        release (m);
+        return 0;
+        }
+#endif
     ierr = ( m->pfs->entry->stat != NULL ) ? m->pfs->entry->stat (m->pfs, rname, buf) : pfs_error (EINVAL);
-    free ((void *)name);
+#if PFS_STAT_CACHE > 0
+    // The identity is read afterwards, as a lazily mounted volume only has one now
+    if ( ierr == 0 ) stat_cache_put (m, stat_cache_id (m), gen, sName, buf);
+#endif
+    release (m);
+    return ierr;
+    }
+
+int statvfs (const char *name, struct statvfs *buf)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    char sName[PFS_PATH_MAX];
+    const char *rname;
+    struct pfs_mount *m = reference (name, sName, &rname);
+    if ( m == NULL ) return pfs_error (EINVAL);
+    ierr = ( m->pfs->entry->statvfs != NULL ) ? m->pfs->entry->statvfs (m->pfs, buf) : pfs_error (ENOSYS);
+    release (m);
+    return ierr;
+    }
+
+int fstatvfs (int fd, struct statvfs *buf)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    pfs_lock ();
+    struct pfs_file *f = handle_get (fd);
+    struct pfs_mount *m = ( f != NULL ) ? fd_mount[fd] : NULL;
+    // The file may be closed on the other core while this is in progress
+    if ( m != NULL ) ++m->nbusy;
+    pfs_unlock ();
+    if ( f == NULL ) return -1;
+    // Standard I/O handles are not on a volume
+    if ( m == NULL ) return pfs_error (ENOSYS);
+    ierr = ( m->pfs->entry->statvfs != NULL ) ? m->pfs->entry->statvfs (m->pfs, buf) : pfs_error (ENOSYS);
+    release (m);
     return ierr;
     }
 
 int _link (const char *old, const char *new)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
+    char sOld[PFS_PATH_MAX];
+    char sNew[PFS_PATH_MAX];
     const char *rold;
-    struct pfs_mount *m1 = reference (&old, &rold);
+    struct pfs_mount *m1 = reference (old, sOld, &rold);
     if ( m1 == NULL ) return -1;
     const char *rnew;
-    struct pfs_mount *m2 = reference (&new, &rnew);
+    struct pfs_mount *m2 = reference (new, sNew, &rnew);
     if ( m2 == NULL )
         {
-        free ((void *)old);
+        release (m1);
         return -1;
         }
     if ( m2 == m1 )
         {
         ierr = ( m1->pfs->entry->rename != NULL ) ? m1->pfs->entry->rename (m1->pfs, rold, rnew) : pfs_error (EPERM);
+        stat_cache_drop (NULL, sOld, true);
+        stat_cache_drop (NULL, sNew, true);
         }
     else
         {
@@ -337,49 +1091,227 @@ int _link (const char *old, const char *new)
         }
     if ( ierr == 0 )
         {
+        // Remembered so that the unlink done by rename succeeds
+        pfs_lock ();
         if ( m1->moved != NULL ) free ((void *)m1->moved);
-        m1->moved = old;
-        }
-    else
-        {
-        free ((void *)old);
+        m1->moved = strdup (sOld);
+        pfs_unlock ();
         }
-    free ((void *)new);
+    release (m1);
+    release (m2);
     return ierr;
     }
 
 int _unlink (const char *name)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
+    char sName[PFS_PATH_MAX];
     const char *rname;
-    struct pfs_mount *m = reference (&name, &rname);
+    struct pfs_mount *m = reference (name, sName, &rname);
     if ( m == NULL ) return -1;
     ierr = ( m->pfs->entry->delete != NULL ) ? m->pfs->entry->delete (m->pfs, rname) : pfs_error (EPERM);
+    stat_cache_drop (NULL, sName, false);
+    pfs_lock ();
     if ( m->moved != NULL )
         {
-        if (( ierr == -1 ) && ( strcmp (m->moved, name) == 0 )) ierr = 0;
+        if (( ierr == -1 ) && ( strcmp (m->moved, sName) == 0 )) ierr = 0;
         free ((void *)m->moved);
         m->moved = NULL;
         }
-    free ((void *)name);
+    --m->nbusy;
+    pfs_unlock ();
     return ierr;
     }
+// Word aligned for DMA, and shared by all copies to save RAM
+static uint32_t copy_buf[PFS_COPY_BUF / 4];
+#if PFS_MULTICORE
+auto_init_mutex (copy_mutex);
+#endif
+
+// Copy up to len bytes from the position of fd_in to that of fd_out. Data
+// which the source volume can map in flash (LFS) is written directly from
+// there, everything else goes through one sector aligned buffer, so that FAT
+// reads and writes of whole sectors go straight to the card.
+static ssize_t copy_data (int fd_in, int fd_out, size_t len)
+    {
+    bool bMap = true;
+    ssize_t ndone = 0;
+#if PFS_MULTICORE
+    mutex_enter_blocking (&copy_mutex);
+#endif
+    while ( (size_t) ndone < len )
+        {
+        size_t nreq = len - ndone;
+        if ( nreq > INT_MAX ) nreq = INT_MAX;
+        const char *src = (const char *) copy_buf;
+        int n = -1;
+        if ( bMap )
+            {
+            struct ioc_mmap map = { NULL, (int) nreq };
+            if ( _ioctl (fd_in, IOC_RQ_MMAP, &map) == 0 )
+                {
+                src = (const char *) map.addr;
+                n = map.length;
+                }
+            else
+                {
+                bMap = false;
+                }
+            }
+        if ( ! bMap )
+            {
+            if ( nreq > sizeof (copy_buf) ) nreq = sizeof (copy_buf);
+            n = _read (fd_in, (char *) copy_buf, nreq);
+            }
+        if ( n <= 0 )
+            {
+            if (( n < 0 ) && ( ndone == 0 )) ndone = -1;
+            break;
+            }
+        int nw = _write (fd_out, (char *) src, n);
+        if ( nw < n )
+            {
+            // Leave the source positioned after the data copied
+            if ( nw > 0 ) ndone += nw;
+            else if ( ndone == 0 ) ndone = -1;
+            _lseek (fd_in, ( nw > 0 ) ? nw - n : -n, SEEK_CUR);
+            break;
+            }
+        ndone += n;
+        }
+#if PFS_MULTICORE
+    mutex_exit (&copy_mutex);
+#endif
+    return ndone;
+    }
+
+ssize_t copy_file_range (int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    if ( flags != 0 ) return pfs_error (EINVAL);
+    if ((( off_in != NULL ) && ( *off_in < 0 )) || (( off_out != NULL ) && ( *off_out < 0 ))) return pfs_error (EINVAL);
+    struct pfs_file *fin = handle_get (fd_in);
+    if ( fin == NULL ) return -1;
+    struct pfs_file *fout = handle_get (fd_out);
+    if ( fout == NULL ) return -1;
+    if ( fin == fout ) return pfs_error (EINVAL);
+    off_t save_in = 0;
+    off_t save_out = 0;
+    if ( off_in != NULL )
+        {
+        // Nothing to copy from past the end of the source
+        int r = pio_seek (fin, *off_in, &save_in, true);
+        if ( r != 0 ) return ( r > 0 ) ? 0 : -1;
+        }
+    if (( off_out != NULL ) && ( pio_seek (fout, *off_out, &save_out, false) != 0 ))
+        {
+        if ( off_in != NULL ) fin->entry->lseek (fin, save_in, SEEK_SET);
+        return -1;
+        }
+    ssize_t n = copy_data (fd_in, fd_out, len);
+    if ( off_in != NULL )
+        {
+        if ( n > 0 ) *off_in += n;
+        fin->entry->lseek (fin, save_in, SEEK_SET);
+        }
+    if ( off_out != NULL )
+        {
+        if ( n > 0 ) *off_out += n;
+        fout->entry->lseek (fout, save_out, SEEK_SET);
+        }
+    return n;
+    }
+
+int pfs_copy (const char *from, const char *to, int flags)
+    {
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    if ( flags & ~PFS_COPY_MOVE ) return pfs_error (EINVAL);
+    char sFrom[PFS_PATH_MAX];
+    char sTo[PFS_PATH_MAX];
+    const char *rfrom;
+    const char *rto;
+    struct pfs_mount *m1 = reference (from, sFrom, &rfrom);
+    if ( m1 == NULL ) return -1;
+    struct pfs_mount *m2 = reference (to, sTo, &rto);
+    if ( m2 == NULL )
+        {
+        release (m1);
+        return -1;
+        }
+    // Opening the destination would truncate the source
+    if ( strcmp (sFrom, sTo) == 0 )
+        {
+        ierr = pfs_error (EINVAL);
+        }
+    // On the same volume a move is a rename, without copying any data
+    else if (( flags & PFS_COPY_MOVE ) && ( m1 == m2 ) && ( m1->pfs->entry->rename != NULL ))
+        {
+        ierr = m1->pfs->entry->rename (m1->pfs, rfrom, rto);
+        stat_cache_drop (NULL, sFrom, true);
+        stat_cache_drop (NULL, sTo, true);
+        }
+    else
+        {
+        ierr = 1;
+        }
+    // Copying opens the files, which looks up the volumes again
+    release (m1);
+    release (m2);
+    if ( ierr <= 0 ) return ierr;
+    int fd_in = _open (sFrom, O_RDONLY);
+    if ( fd_in < 0 ) return -1;
+    int fd_out = _open (sTo, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if ( fd_out < 0 )
+        {
+        _close (fd_in);
+        return -1;
+        }
+    ssize_t n;
+    do
+        {
+        n = copy_data (fd_in, fd_out, INT_MAX);
+        }
+    while ( n == INT_MAX );
+    ierr = ( n < 0 ) ? -1 : 0;
+    if ( n >= 0 )
+        {
+        // A short copy with data left in the source means the destination is full
+        char c;
+        if ( _read (fd_in, &c, 1) != 0 ) ierr = pfs_error (ENOSPC);
+        }
+    _close (fd_in);
+    if (( _close (fd_out) != 0 ) && ( ierr == 0 )) ierr = -1;
+    if ( ierr != 0 )
+        {
+        int err = errno;
+        _unlink (sTo);
+        errno = err;
+        return -1;
+        }
+    if ( flags & PFS_COPY_MOVE ) return _unlink (sFrom);
+    return 0;
+    }
 
 int chdir (const char *path)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
-    const char *olddir = cwd;
+    pfs_lock ();
     const char *pn = pname_append (cwd, path);
+    pfs_unlock ();
     if ( pn == NULL ) return -1;
     struct stat sbuf;
     ierr = stat (pn, &sbuf);
     if (( ierr == 0 ) && ( (sbuf.st_mode & S_IFDIR) == 0 )) ierr = ENOTDIR;
     if ( ierr == 0 )
         {
+        pfs_lock ();
         free ((void *)cwd);
         cwd = pn;
+        pfs_unlock ();
         }
     else
         {
@@ -390,60 +1322,74 @@ int chdir (const char *path)
 
 int mkdir (const char *name, mode_t mode)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
+    char sName[PFS_PATH_MAX];
     const char *rname;
-    struct pfs_mount *m = reference (&name, &rname);
+    struct pfs_mount *m = reference (name, sName, &rname);
     if ( m == NULL ) return -1;
     ierr = ( m->pfs->entry->mkdir != NULL ) ? m->pfs->entry->mkdir (m->pfs, rname, mode) : pfs_error (EPERM);
-    free ((void *)name);
+    stat_cache_drop (NULL, sName, false);
+    release (m);
     return ierr;
     }
 
 int rmdir (const char *name)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
+    char sName[PFS_PATH_MAX];
     const char *rname;
-    struct pfs_mount *m = reference (&name, &rname);
+    struct pfs_mount *m = reference (name, sName, &rname);
     if ( m == NULL ) return -1;
-    if ( strcmp (name, cwd) == 0 )
-        {
-        free ((void *)name);
-        return pfs_error (EBUSY);
-        }
-    ierr = ( m->pfs->entry->rmdir != NULL ) ? m->pfs->entry->rmdir (m->pfs, rname) : pfs_error (EPERM);
-    free ((void *)name);
+    pfs_lock ();
+    bool bCwd = ( strcmp (sName, cwd) == 0 );
+    pfs_unlock ();
+    if ( bCwd ) ierr = pfs_error (EBUSY);
+    else ierr = ( m->pfs->entry->rmdir != NULL ) ? m->pfs->entry->rmdir (m->pfs, rname) : pfs_error (EPERM);
+    stat_cache_drop (NULL, sName, true);
+    release (m);
     return ierr;
     }
 
 char *getcwd (char *buf, size_t size)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return NULL;
-    if ( buf == NULL ) return strdup (cwd);
-    if ( size < strlen (cwd) + 1 ) return NULL;
-    strcpy (buf, cwd);
+    pfs_lock ();
+    if ( buf == NULL )
+        {
+        buf = strdup (cwd);
+        }
+    else if ( size < strlen (cwd) + 1 )
+        {
+        buf = NULL;
+        }
+    else
+        {
+        strcpy (buf, cwd);
+        }
+    pfs_unlock ();
     return buf;
     }
 
 void *opendir (const char *name)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return NULL;
+    char sName[PFS_PATH_MAX];
     const char *rname;
     struct pfs_dir *d = NULL;
-    struct pfs_mount *m = reference (&name, &rname);
+    struct pfs_mount *m = reference (name, sName, &rname);
     if ( m == NULL )
         {
-        if ( strcmp (name, "/") == 0 )
+        if ( strcmp (sName, "/") == 0 )
             {
             d = (struct pfs_dir *) malloc (sizeof (struct pfs_dir));
             if ( d != NULL )
                 {
                 d->entry = NULL;
                 d->flags = PFS_DF_DOT | PFS_DF_DEV | PFS_DF_ROOT;
-                d->m = mounts;
                 }
             }
         }
@@ -453,10 +1399,9 @@ void *opendir (const char *name)
         if ( d != NULL )
             {
             d->flags = PFS_DF_DOT | PFS_DF_FS;
-            if ( strcmp (name, "/") == 0 )
+            if ( strcmp (sName, "/") == 0 )
                 {
                 d->flags |= PFS_DF_DEV | PFS_DF_ROOT;
-                d->m = mounts;
                 }
             else
                 {
@@ -464,106 +1409,226 @@ void *opendir (const char *name)
                 }
             }
         }
-    free ((void *)name);
+    // Once the directory is counted as open, it keeps the volume mounted
+    pfs_lock ();
+    if ( d != NULL )
+        {
+        if ( d->flags & PFS_DF_ROOT ) d->m = mounts;
+        ++ndir_open;
+        }
+    if ( m != NULL ) --m->nbusy;
+    pfs_unlock ();
     return d;
     }
 
-static bool pfs_special (const char *name)
+// Entries returned by the filesystem which are hidden. In the root folder
+// this includes any names which are mount points.
+static bool pfs_special (const char *name, bool bRoot)
     {
-    if ( strcmp (name, ".") == 0 ) return true;
-    if ( strcmp (name, "..") == 0 ) return true;
-    for (struct pfs_mount *m = mounts; m != NULL; m = m->next)
-        {
-        if ( strcmp (name, m->name) == 0 ) return true;
-        }
-    return false;
+    if (( name[0] == '.' ) && (( name[1] == '\0' ) || (( name[1] == '.' ) && ( name[2] == '\0' ))))
+        return true;
+    return bRoot && ( mount_find (name) != NULL );
     }
 
 struct dirent *readdir (void *dirp)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return NULL;
     struct pfs_dir *d = (struct pfs_dir *) dirp;
     memset (&d->de, 0, sizeof (struct dirent));
+    d->size = 0;
     if ( d->flags & PFS_DF_DOT )
         {
         strcpy (d->de.d_name, ".");
+        d->de.d_type = DT_DIR;
         d->flags &= ~ PFS_DF_DOT;
         return &d->de;
         }
     if ( d->flags & PFS_DF_DDOT )
         {
         strcpy (d->de.d_name, "..");
+        d->de.d_type = DT_DIR;
         d->flags &= ~ PFS_DF_DDOT;
         return &d->de;
         }
     if ( d->flags & PFS_DF_DEV )
         {
-        strcpy (d->de.d_name, &d->m->name[1]);
-        while (true)
+        while (( d->m != NULL ) && ( d->m->nlen == 0 )) d->m = d->m->next;
+        if ( d->m != NULL )
             {
+            strcpy (d->de.d_name, &d->m->name[1]);
+            d->de.d_type = DT_DIR;
             d->m = d->m->next;
-            if ( d->m == NULL )
-                {
-                d->flags &= ~ PFS_DF_DEV;
-                break;
-                }
-            if ( d->m->nlen > 0 ) break;
+            return &d->de;
             }
-        return &d->de;
+        d->flags &= ~ PFS_DF_DEV;
         }
     if ( d->flags & PFS_DF_FS )
         {
+        bool bRoot = (( d->flags & PFS_DF_ROOT ) != 0 );
         while (true)
             {
             if ( d->entry->readdir (d) == NULL ) break;
-            if ( ! pfs_special (d->de.d_name) ) return &d->de;
+            if ( ! pfs_special (d->de.d_name, bRoot) ) return &d->de;
             }
         }
     return NULL;
     }
 
+// The mode follows from the type, as all the drivers give full permissions
+int pfs_readdirx (void *dirp, struct pfs_direntx *ent, int nent)
+    {
+    if ( nent <= 0 ) return pfs_error (EINVAL);
+    struct pfs_dir *d = (struct pfs_dir *) dirp;
+    int n = 0;
+    errno = 0;
+    while ( n < nent )
+        {
+        if ( readdir (dirp) == NULL )
+            {
+            if (( n == 0 ) && ( errno != 0 )) return -1;
+            break;
+            }
+        switch (d->de.d_type)
+            {
+            case DT_DIR: ent->d_mode = S_IFDIR; break;
+            case DT_CHR: ent->d_mode = S_IFCHR; break;
+            case DT_REG: ent->d_mode = S_IFREG; break;
+            default:     ent->d_mode = 0;       break;
+            }
+        ent->d_mode |= S_IRWXU | S_IRWXG | S_IRWXO;
+        ent->d_size = d->size;
+        strcpy (ent->d_name, d->de.d_name);
+        ++ent;
+        ++n;
+        }
+    return n;
+    }
+
 int closedir (void *dirp)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
     struct pfs_dir *d = (struct pfs_dir *) dirp;
     if ( d->entry != NULL ) ierr = ( d->entry->closedir != NULL ) ? d->entry->closedir (d) : 0;
     free (d);
+    pfs_lock ();
+    --ndir_open;
+    pfs_unlock ();
     return ierr;
     }
 
 int chmod (const char *name, mode_t mode)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return ierr;
+    char sName[PFS_PATH_MAX];
     const char *rname;
-    struct pfs_mount *m = reference (&name, &rname);
+    struct pfs_mount *m = reference (name, sName, &rname);
     if ( m == NULL ) return -1;
     ierr = ( m->pfs->entry->chmod != NULL ) ? m->pfs->entry->chmod (m->pfs, rname, mode) : 0;
-    free ((void *)name);
+    stat_cache_drop (NULL, sName, false);
+    release (m);
     return ierr;
     }
 
 char *realpath (const char *path, char *resolved_path)
     {
-    int ierr = pfs_init ();
+    int ierr = pfs_check ();
     if ( ierr != 0 ) return NULL;
+    pfs_lock ();
     char *ps = resolved_path;
-    const char *pn = pname_append (cwd, path);
-    if ( resolved_path == NULL )
-        {
-        ps = strdup (pn);
-        }
-    else if ( strlen (pn) >= PATH_MAX )
+    if ( resolved_path == NULL ) ps = pname_append (cwd, path);
+    else if ( pname_normalize (resolved_path, PATH_MAX, cwd, path) < 0 ) ps = NULL;
+    pfs_unlock ();
+    if ( ps == NULL ) errno = ENAMETOOLONG;
+    return ps;
+    }
+
+#if PFS_STATS
+static void stats_copy (struct pfs_stats *st, struct pfs_stats *stats, bool bReset)
+    {
+    if ( stats != NULL ) memcpy (stats, st, sizeof (struct pfs_stats));
+    if ( bReset ) memset (st, 0, sizeof (struct pfs_stats));
+    }
+#endif
+
+int pfs_stats_volume (const char *name, struct pfs_stats *stats, bool bReset)
+    {
+#if PFS_STATS
+    if ( name == NULL ) return pfs_error (EINVAL);
+    while ( *name == '/' ) ++name;
+    pfs_lock ();
+    struct pfs_mount *m = ( *name == '\0' ) ? mount_root : mount_find (name);
+    if ( m != NULL ) stats_copy (&m->st, stats, bReset);
+    pfs_unlock ();
+    return ( m != NULL ) ? 0 : pfs_error (ENOENT);
+#else
+    return pfs_error (ENOTSUP);
+#endif
+    }
+
+int pfs_stats_fd (int fd, struct pfs_stats *stats, bool bReset)
+    {
+#if PFS_STATS
+    int ierr = pfs_check ();
+    if ( ierr != 0 ) return ierr;
+    pfs_lock ();
+    bool bOK = (( fd >= 0 ) && ( fd < num_handle ) && ( files[fd] != NULL ));
+    if ( bOK ) stats_copy (&fd_stats[fd].st, stats, bReset);
+    pfs_unlock ();
+    return bOK ? 0 : pfs_error (EBADF);
+#else
+    return pfs_error (ENOTSUP);
+#endif
+    }
+
+#if PFS_STATS
+// Append to a report, never overrunning the buffer
+static int stats_fmt (char *buf, int len, int n, const char *fmt, ...)
+    {
+    if ( n >= len - 1 ) return n;
+    va_list va;
+    va_start (va, fmt);
+    int nf = vsnprintf (buf + n, len - n, fmt, va);
+    va_end (va);
+    if ( nf < 0 ) return n;
+    return ( n + nf < len ) ? n + nf : len - 1;
+    }
+
+static int stats_dir (char *buf, int len, int n, const char *name, const char *dir,
+    uint32_t nop, uint64_t bytes, uint64_t time_us, uint32_t max_us, const uint32_t *hist)
+    {
+    n = stats_fmt (buf, len, n, "%s %s %lu calls %llu bytes", name, dir, (unsigned long) nop,
+        (unsigned long long) bytes);
+    if ( nop > 0 ) n = stats_fmt (buf, len, n, " %llu us avg %lu us max",
+        (unsigned long long) ( time_us / nop ), (unsigned long) max_us);
+    for (int ih = 0; ih < PFS_STAT_NHIST; ++ih)
         {
-        ps = NULL;
+        if ( hist[ih] == 0 ) continue;
+        if ( ih < PFS_STAT_NHIST - 1 ) n = stats_fmt (buf, len, n, " <%luus:%lu", 1ul << ih, (unsigned long) hist[ih]);
+        else n = stats_fmt (buf, len, n, " >=%luus:%lu", 1ul << ( ih - 1 ), (unsigned long) hist[ih]);
         }
-    else
+    return stats_fmt (buf, len, n, "\n");
+    }
+#endif
+
+int pfs_stats_print (char *buf, int len)
+    {
+    if (( buf == NULL ) || ( len <= 0 )) return 0;
+    buf[0] = '\0';
+    int n = 0;
+#if PFS_STATS
+    pfs_lock ();
+    for (const struct pfs_mount *m = mounts; m != NULL; m = m->next)
         {
-        strncpy (ps, pn, PATH_MAX - 1);
-        ps[PATH_MAX - 1] = '\0';
+        const char *name = ( m->nlen > 0 ) ? m->name : rootdir;
+        const struct pfs_stats *st = &m->st;
+        n = stats_dir (buf, len, n, name, "read", st->nread, st->rbytes, st->rtime_us, st->rmax_us, st->rhist);
+        n = stats_dir (buf, len, n, name, "write", st->nwrite, st->wbytes, st->wtime_us, st->wmax_us, st->whist);
+        if ( st->nerror > 0 ) n = stats_fmt (buf, len, n, "%s errors %lu\n", name, (unsigned long) st->nerror);
         }
-    free ((void *)pn);
-    return ps;
+    pfs_unlock ();
+#endif
+    return n;
     }
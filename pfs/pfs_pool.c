@@ -0,0 +1,187 @@
+/* pfs_pool.c - Fixed pools for open file structures and path names */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pfs_private.h>
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+// Pool of small slots, for device file structures
+#ifndef PFS_POOL_SMALL
+#define PFS_POOL_SMALL          8
+#endif
+#ifndef PFS_POOL_SMALL_SIZE
+#define PFS_POOL_SMALL_SIZE     32
+#endif
+
+// Pool of large slots, for FAT and LFS file structures
+#ifndef PFS_POOL_LARGE
+#define PFS_POOL_LARGE          0
+#endif
+#ifndef PFS_POOL_LARGE_SIZE
+#define PFS_POOL_LARGE_SIZE     672
+#endif
+
+// Pool of path name buffers
+#ifndef PFS_POOL_PATH
+#define PFS_POOL_PATH           8
+#endif
+#ifndef PFS_POOL_PATH_SIZE
+#define PFS_POOL_PATH_SIZE      64
+#endif
+
+// Set to 1 to fail rather than use the heap when a pool is exhausted
+#ifndef PFS_NO_MALLOC
+#define PFS_NO_MALLOC           0
+#endif
+
+// Slots are a multiple of 8 bytes to keep 64-bit members aligned
+#define POOL_ROUND(size)        (((size) + 7) & ~7)
+#define POOL_WORDS(n, size)     ((n) * POOL_ROUND (size) / sizeof (long long))
+
+struct pfs_pool
+    {
+    void *          free;       // First free slot (the slot holds the link to the next)
+    char *          base;       // Start of storage
+    size_t          size;       // Size of each slot
+    int             count;      // Number of slots
+    };
+
+#if PFS_POOL_SMALL > 0
+STATIC long long pool_small[POOL_WORDS (PFS_POOL_SMALL, PFS_POOL_SMALL_SIZE)];
+#endif
+#if PFS_POOL_LARGE > 0
+STATIC long long pool_large[POOL_WORDS (PFS_POOL_LARGE, PFS_POOL_LARGE_SIZE)];
+#endif
+#if PFS_POOL_PATH > 0
+STATIC long long pool_path[POOL_WORDS (PFS_POOL_PATH, PFS_POOL_PATH_SIZE)];
+#endif
+
+// File pools, in order of increasing slot size
+STATIC struct pfs_pool file_pool[] =
+    {
+#if PFS_POOL_SMALL > 0
+    { NULL, (char *) pool_small, POOL_ROUND (PFS_POOL_SMALL_SIZE), PFS_POOL_SMALL },
+#endif
+#if PFS_POOL_LARGE > 0
+    { NULL, (char *) pool_large, POOL_ROUND (PFS_POOL_LARGE_SIZE), PFS_POOL_LARGE },
+#endif
+    { NULL, NULL, 0, 0 }
+    };
+
+STATIC struct pfs_pool path_pool =
+#if PFS_POOL_PATH > 0
+    { NULL, (char *) pool_path, POOL_ROUND (PFS_POOL_PATH_SIZE), PFS_POOL_PATH };
+#else
+    { NULL, NULL, 0, 0 };
+#endif
+
+STATIC bool bPoolInit = false;
+
+STATIC void pool_init (struct pfs_pool *pool)
+    {
+    pool->free = NULL;
+    for (int i = pool->count - 1; i >= 0; --i)
+        {
+        void **slot = (void **) (pool->base + i * pool->size);
+        *slot = pool->free;
+        pool->free = slot;
+        }
+    }
+
+STATIC void pool_init_all (void)
+    {
+    for (struct pfs_pool *pool = file_pool; pool->count > 0; ++pool) pool_init (pool);
+    pool_init (&path_pool);
+    bPoolInit = true;
+    }
+
+STATIC void *pool_get (struct pfs_pool *pool, size_t size)
+    {
+    if (( size > pool->size ) || ( pool->free == NULL )) return NULL;
+    void **slot = (void **) pool->free;
+    pool->free = *slot;
+    return slot;
+    }
+
+STATIC bool pool_put (struct pfs_pool *pool, void *p)
+    {
+    char *ps = (char *) p;
+    if (( ps < pool->base ) || ( ps >= pool->base + pool->count * pool->size )) return false;
+    void **slot = (void **) p;
+    *slot = pool->free;
+    pool->free = slot;
+    return true;
+    }
+
+STATIC void *pool_malloc (size_t size)
+    {
+#if PFS_NO_MALLOC
+    return NULL;
+#else
+    return malloc (size);
+#endif
+    }
+
+void *pfs_file_alloc (size_t size)
+    {
+    void *p = NULL;
+    pfs_lock ();
+    if ( ! bPoolInit ) pool_init_all ();
+    for (struct pfs_pool *pool = file_pool; pool->count > 0; ++pool)
+        {
+        p = pool_get (pool, size);
+        if ( p != NULL ) break;
+        }
+    pfs_unlock ();
+    if ( p != NULL ) return p;
+    p = pool_malloc (size);
+    if ( p == NULL ) errno = ENOMEM;
+    return p;
+    }
+
+void pfs_file_free (void *p)
+    {
+    if ( p == NULL ) return;
+    bool bPool = false;
+    pfs_lock ();
+    for (struct pfs_pool *pool = file_pool; pool->count > 0; ++pool)
+        {
+        bPool = pool_put (pool, p);
+        if ( bPool ) break;
+        }
+    pfs_unlock ();
+    if ( ! bPool ) free (p);
+    }
+
+char *pfs_path_alloc (const char *ps)
+    {
+    size_t nlen = strlen (ps) + 1;
+    pfs_lock ();
+    if ( ! bPoolInit ) pool_init_all ();
+    char *p = (char *) pool_get (&path_pool, nlen);
+    pfs_unlock ();
+    if ( p == NULL ) p = (char *) pool_malloc (nlen);
+    if ( p == NULL )
+        {
+        errno = ENOMEM;
+        return NULL;
+        }
+    memcpy (p, ps, nlen);
+    return p;
+    }
+
+void pfs_path_free (const char *ps)
+    {
+    if ( ps == NULL ) return;
+    pfs_lock ();
+    bool bPool = pool_put (&path_pool, (void *) ps);
+    pfs_unlock ();
+    if ( ! bPool ) free ((void *) ps);
+    }
@@ -5,6 +5,8 @@
 #ifndef PFS_PRIVATE_H
 #define PFS_PRIVATE_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <pfs.h>
@@ -13,6 +15,7 @@ struct pfs_pfs;
 struct pfs_file;
 struct pfs_dir;
 struct pfs_mount;
+struct statvfs;
 
 struct pfs_v_pfs
     {
@@ -24,6 +27,9 @@ struct pfs_v_pfs
     int (*rmdir)(struct pfs_pfs *pfs, const char *pathname);
     void *(*opendir)(struct pfs_pfs *pfs, const char *name);
     int (*chmod)(struct pfs_pfs *pfs, const char *pathname, mode_t mode);
+    int (*umount)(struct pfs_pfs *pfs);     // Release the volume (NULL if it is kept)
+    int (*statvfs)(struct pfs_pfs *pfs, struct statvfs *buf);
+    uint32_t (*cache_id)(struct pfs_pfs *pfs);  // Changes if the media may have changed, 0 = do not cache stat (NULL = never)
     };
 
 struct pfs_pfs
@@ -40,6 +46,13 @@ struct pfs_v_file
     int (*fstat)(struct pfs_file *fd, struct stat *buf);
     int (*isatty)(struct pfs_file *fd);
     int (*ioctl)(struct pfs_file *fd, unsigned long request, void *argp);
+    int (*allocate)(struct pfs_file *fd, off_t offset, off_t len);
+    long long (*lseek64)(struct pfs_file *fd, long long pos, int whence);
+    int (*readv)(struct pfs_file *fd, const struct iovec *iov, int iovcnt);
+    int (*writev)(struct pfs_file *fd, const struct iovec *iov, int iovcnt);
+    int (*pread)(struct pfs_file *fd, char *buffer, int length, off_t offset);
+    int (*pwrite)(struct pfs_file *fd, const char *buffer, int length, off_t offset);
+    int (*fsync)(struct pfs_file *fd);
     };
 
 struct pfs_file
@@ -68,6 +81,7 @@ struct pfs_dir
     int                         flags;
     const struct pfs_mount *    m;
     struct dirent               de;
+    long long                   size;       // Size of the file in de (0 if not known)
     };
 
 struct pfs_device
@@ -76,6 +90,51 @@ struct pfs_device
     };
 
 int pfs_error (int ierr);
+
+// Largest number of buffers for readv and writev
+#ifndef PFS_IOV_MAX
+#define PFS_IOV_MAX     1024
+#endif
+
+// Perform readv / writev using a driver's read or write routine. For writes,
+// runs of small buffers are first copied together, so that they reach the
+// driver in one call. Drivers may use these for their own readv and writev.
+typedef int (*pfs_rw_rtn)(struct pfs_file *fd, char *buffer, int length);
+int pfs_readv_rtn (struct pfs_file *fd, const struct iovec *iov, int iovcnt, pfs_rw_rtn read);
+int pfs_writev_rtn (struct pfs_file *fd, const struct iovec *iov, int iovcnt, pfs_rw_rtn write);
+
+// Policy for syncing a file while it is being written, so bounding the
+// data lost on power failure without closing and reopening the file.
+// Drivers keep one of these in their open file structure, set it up with
+// pfs_sync_init, and after each write call their sync routine when
+// pfs_sync_due returns true. The age limit is only checked on writing.
+struct pfs_sync
+    {
+    int             bytes;      // Sync after this many bytes written (0 = never)
+    int             ms;         // Sync when written data is this old (0 = never)
+    int             count;      // Bytes written since the last sync
+    uint32_t        t0;         // Time (ms since boot) of the first write since the last sync
+    };
+
+void pfs_sync_init (struct pfs_sync *ps);
+bool pfs_sync_due (struct pfs_sync *ps, int nbyte);
+void pfs_sync_done (struct pfs_sync *ps);
+
+// Lock the PFS global state (handle and mount tables). The lock may be nested.
+#if PFS_MULTICORE
+void pfs_lock (void);
+void pfs_unlock (void);
+#else
+#define pfs_lock()
+#define pfs_unlock()
+#endif
+
+// Allocate and free open file structures. These come from fixed pools
+// when possible (see pfs_pool.c), to avoid heap fragmentation.
+void *pfs_file_alloc (size_t size);
+void pfs_file_free (void *fd);
+char *pfs_path_alloc (const char *ps);
+void pfs_path_free (const char *ps);
 struct pfs_file *pfs_stdio (int fd);
 
 #endif
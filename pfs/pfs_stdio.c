@@ -22,12 +22,20 @@ static const struct pfs_v_file sio_v_file =
     sio_write,
     sio_lseek,
     sio_fstat,
-    sio_isatty
+    sio_isatty,
+    NULL,           // ioctl
+    NULL,           // allocate
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    NULL,           // pread
+    NULL,           // pwrite
+    NULL            // fsync
     };
 
 struct pfs_file * pfs_stdio (int fd)
     {
-    struct pfs_file *f = (struct pfs_file *) malloc (sizeof (struct pfs_file));
+    struct pfs_file *f = (struct pfs_file *) pfs_file_alloc (sizeof (struct pfs_file));
     if ( f == NULL ) return NULL;
     f->entry = &sio_v_file;
     return f;
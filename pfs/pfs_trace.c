@@ -0,0 +1,140 @@
+/* pfs_trace.c - Trace of timestamped events, kept in memory */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <string.h>
+#include <pico.h>
+#include <pico/time.h>
+#include <hardware/sync.h>
+#include <pfs_trace.h>
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+#if PFS_TRACE
+#if PFS_TRACE_SIZE & ( PFS_TRACE_SIZE - 1 )
+#error PFS_TRACE_SIZE must be a power of two
+#endif
+
+// Each core has its own ring, so no lock is needed between cores. Entries
+// are numbered from the start of the trace, the ring holding the latest.
+STATIC struct pfs_trace_entry trace_ring[NUM_CORES][PFS_TRACE_SIZE];
+STATIC uint32_t trace_next[NUM_CORES];      // Number of next entry
+STATIC uint32_t trace_first[NUM_CORES];     // Number of first entry not cleared
+#endif
+STATIC volatile uint32_t trace_enable = 0xFFFFFFFF;
+
+// Names of the events, indexed by event class and number
+STATIC const char *trace_pfs[] = { "resolve", "open", "close", "read", "write", "done" };
+STATIC const char *trace_disk[] = { "disk_read", "disk_write", "disk_hit", "disk_done", "disk_trim" };
+STATIC const char *trace_sd[] = { "sd_cmd", "sd_resp", "sd_token", "sd_dma", "sd_busy", "sd_crc", "sd_remove", "sd_probe" };
+STATIC const char *trace_flash[] = { "flash_prog", "flash_erase", "flash_done" };
+STATIC const char *trace_kbd[] = { "kbd_mount", "kbd_umount", "kbd_report", "kbd_press", "kbd_release" };
+
+#define NAMES(n)    { n, sizeof (n) / sizeof (n[0]) }
+STATIC const struct
+    {
+    const char **   names;
+    int             count;
+    } trace_names[] =
+    {
+    { NULL, 0 },
+    NAMES (trace_pfs),
+    NAMES (trace_disk),
+    NAMES (trace_sd),
+    NAMES (trace_flash),
+    NAMES (trace_kbd),
+    };
+#undef NAMES
+
+#if PFS_TRACE
+void __not_in_flash_func(pfs_trace) (int event, uint32_t aux, uint32_t arg)
+    {
+    if (( trace_enable & ( 1u << (( event >> 8 ) & 0x1F ))) == 0 ) return;
+    uint core = get_core_num ();
+    uint32_t ints = save_and_disable_interrupts ();
+    struct pfs_trace_entry *te = &trace_ring[core][trace_next[core] & ( PFS_TRACE_SIZE - 1 )];
+    te->time = time_us_32 ();
+    te->event = event;
+    te->core = core;
+    te->aux = aux;
+    te->arg = arg;
+    ++trace_next[core];
+    restore_interrupts (ints);
+    }
+#endif
+
+void pfs_trace_mask (uint32_t mask)
+    {
+    trace_enable = mask;
+    }
+
+#if PFS_TRACE
+#define trace_entry(core, num)  trace_ring[core][( num ) & ( PFS_TRACE_SIZE - 1 )]
+
+// The core with the oldest entry remaining to be read
+STATIC int trace_oldest (const uint32_t *pos, const uint32_t *next)
+    {
+    int iOld = -1;
+    for (int core = 0; core < NUM_CORES; ++core)
+        {
+        if (( pos[core] != next[core] ) && (( iOld < 0 )
+            || ( (int32_t) ( trace_entry (core, pos[core]).time - trace_entry (iOld, pos[iOld]).time ) < 0 )))
+            iOld = core;
+        }
+    return iOld;
+    }
+#endif
+
+int pfs_trace_read (struct pfs_trace_entry *ent, int nent, bool bClear)
+    {
+    int nread = 0;
+#if PFS_TRACE
+    // Position in each ring, after skipping the older entries which will not fit
+    uint32_t next[NUM_CORES];
+    uint32_t pos[NUM_CORES];
+    int ntotal = 0;
+    for (int core = 0; core < NUM_CORES; ++core)
+        {
+        next[core] = trace_next[core];
+        pos[core] = trace_first[core];
+        if ( next[core] - pos[core] > PFS_TRACE_SIZE ) pos[core] = next[core] - PFS_TRACE_SIZE;
+        ntotal += next[core] - pos[core];
+        if ( bClear ) trace_first[core] = next[core];
+        }
+    while ( ntotal > nent )
+        {
+        // Drop the oldest entry
+        int iOld = trace_oldest (pos, next);
+        ++pos[iOld];
+        --ntotal;
+        }
+    // Merge the rings in time order
+    while ( nread < ntotal )
+        {
+        int iOld = trace_oldest (pos, next);
+        ent[nread] = trace_entry (iOld, pos[iOld]);
+        ++pos[iOld];
+        ++nread;
+        }
+#endif
+    return nread;
+    }
+
+int pfs_trace_format (const struct pfs_trace_entry *ent, char *buf, int len)
+    {
+    int iClass = ent->event >> 8;
+    int iEvent = ( ent->event & 0xFF ) - 1;
+    int n;
+    if (( iClass < (int) ( sizeof (trace_names) / sizeof (trace_names[0]) ))
+        && ( iEvent >= 0 ) && ( iEvent < trace_names[iClass].count ))
+        n = snprintf (buf, len, "%10lu %d %-11s %10lu 0x%08lX\n", (unsigned long) ent->time, ent->core,
+            trace_names[iClass].names[iEvent], (unsigned long) ent->aux, (unsigned long) ent->arg);
+    else
+        n = snprintf (buf, len, "%10lu %d 0x%04X      %10lu 0x%08lX\n", (unsigned long) ent->time, ent->core,
+            ent->event, (unsigned long) ent->aux, (unsigned long) ent->arg);
+    if ( n < 0 ) return 0;
+    return ( n < len ) ? n : len - 1;
+    }
@@ -0,0 +1,97 @@
+// pfs_trace.h - Trace of timestamped events, kept in memory
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// With PFS_TRACE set to 1 the filesystem, SD card and flash drivers record
+// events in a ring buffer of PFS_TRACE_SIZE entries for each core. Recording
+// an event takes a few cycles, so unlike printf tracing this hardly changes
+// the timing of the code being traced. The trace may be read back with
+// pfs_trace_read, or as text from the pfstrace device (see pfs_dev_trace.h).
+// With PFS_TRACE 0 (the default) the calls to pfs_trace compile to nothing.
+
+#ifndef PFS_TRACE_H
+#define PFS_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of entries kept for each core (a power of two)
+#ifndef PFS_TRACE_SIZE
+#define PFS_TRACE_SIZE      256
+#endif
+
+// Event classes, the top byte of an event code. Bit n of the mask given to
+// pfs_trace_mask enables the events of class n.
+#define PFS_TRC_PFS         0x01    // Calls to pico-filesystem
+#define PFS_TRC_DISK        0x02    // FATFS disk interface
+#define PFS_TRC_SD          0x03    // SD card driver
+#define PFS_TRC_FLASH       0x04    // Flash program and erase
+#define PFS_TRC_KBD         0x05    // USB keyboard
+#define PFS_TRC_USER        0x10    // Classes 0x10 to 0x1F are for application events
+
+// Event codes, with the meaning of their aux and arg values
+#define PFS_TR_RESOLVE      0x0101  // Path resolved to a mount: aux = mount name length, arg = path length
+#define PFS_TR_OPEN         0x0102  // File opened: aux = handle, arg = flags
+#define PFS_TR_CLOSE        0x0103  // File closed: aux = handle
+#define PFS_TR_READ         0x0104  // Read call: aux = handle, arg = length (buffer count for readv)
+#define PFS_TR_WRITE        0x0105  // Write call: aux = handle, arg = length (buffer count for writev)
+#define PFS_TR_DONE         0x0106  // End of read or write: aux = handle, arg = result
+#define PFS_TR_DISK_READ    0x0201  // Card read: aux = sectors, arg = first sector
+#define PFS_TR_DISK_WRITE   0x0202  // Card write: aux = sectors, arg = first sector
+#define PFS_TR_DISK_HIT     0x0203  // Sector read from cache: arg = sector
+#define PFS_TR_DISK_DONE    0x0204  // End of card transfer: aux = success, arg = time (us)
+#define PFS_TR_DISK_TRIM    0x0205  // Card erase (FF_USE_TRIM): aux = sectors, arg = first sector
+#define PFS_TR_SD_CMD       0x0301  // Command sent: aux = command index, arg = argument
+#define PFS_TR_SD_RESP      0x0302  // Command response: aux = R1 (card status on the 4-bit bus, 0xFF if none)
+#define PFS_TR_SD_TOKEN     0x0303  // Data token or write data response: aux = token (0xFF on timeout), arg = wait (us)
+#define PFS_TR_SD_DMA       0x0304  // Block DMA complete: aux = channel, arg = bytes (0 from interrupt)
+#define PFS_TR_SD_BUSY      0x0305  // End of busy: aux = success, arg = time (us)
+#define PFS_TR_SD_CRC       0x0306  // CRC mismatch: aux = 0 read, 1 write
+#define PFS_TR_SD_REMOVE    0x0307  // Card removed (card detect switch)
+#define PFS_TR_SD_PROBE     0x0308  // Clock speed tried: aux = success of test reads, arg = frequency (kHz)
+#define PFS_TR_FLASH_PROG   0x0401  // Program: aux = 0, arg = flash offset
+#define PFS_TR_FLASH_ERASE  0x0402  // Erase: aux = 0, arg = flash offset
+#define PFS_TR_FLASH_DONE   0x0403  // End of program or erase: arg = time interrupts were off (us)
+#define PFS_TR_KBD_MOUNT    0x0501  // HID device attached: aux = device address, arg = protocol
+#define PFS_TR_KBD_UMOUNT   0x0502  // HID device removed: aux = device address, arg = instance
+#define PFS_TR_KBD_REPORT   0x0503  // HID report: aux = instance, arg = length
+#define PFS_TR_KBD_PRESS    0x0504  // Key pressed: aux = key code, arg = modifiers
+#define PFS_TR_KBD_RELEASE  0x0505  // Key released: aux = key code
+
+struct pfs_trace_entry
+    {
+    uint32_t    time;               // Time of event (us, from time_us_32)
+    uint16_t    event;              // Event code
+    uint16_t    core;               // Core on which the event occurred
+    uint32_t    aux;                // Event detail
+    uint32_t    arg;                // Event detail
+    };
+
+#if PFS_TRACE
+// Record an event. May be called from interrupt handlers on either core.
+void pfs_trace (int event, uint32_t aux, uint32_t arg);
+#else
+#define pfs_trace(event, aux, arg)  ((void) 0)
+#endif
+
+// Select the classes of event recorded (initially all)
+void pfs_trace_mask (uint32_t mask);
+
+// Copy up to nent of the most recent events, oldest first, to ent, and
+// optionally discard all recorded events. Returns the number copied,
+// which is zero without PFS_TRACE.
+int pfs_trace_read (struct pfs_trace_entry *ent, int nent, bool bClear);
+
+// Format an event as a line of text in buf (len bytes, including
+// terminator), returning its length
+int pfs_trace_format (const struct pfs_trace_entry *ent, char *buf, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
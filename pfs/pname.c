@@ -11,173 +11,59 @@
 #define STATIC  static
 #endif
 
-typedef struct s_pname
+STATIC bool pname_sep (char ch)
     {
-    struct s_pname *    prev;
-    struct s_pname *    next;
-    const char *        name;
-    int                 len;
-    } PNAME;
-
-STATIC char rootdir = '/';
-
-STATIC void pname_clean (PNAME *pn)
-    {
-    PNAME *pe1 = pn->next;
-    PNAME *pe2;
-    while (( pe1 != pn ) && ( pe1 != NULL ))
-        {
-        pe2 = pe1->next;
-        free (pe1);
-        pe1 = pe2;
-        }
-    pn->prev = pn;
-    pn->next = pn;
-    }
-
-STATIC void pname_delete (PNAME *pn)
-    {
-    pname_clean (pn);
-    free (pn);
-    }
-
-STATIC void pname_link (PNAME *pn, PNAME *pe)
-    {
-    pe->prev = pn->prev;
-    pe->next = pn;
-    pn->prev->next = pe;
-    pn->prev = pe;
-    }
-
-STATIC PNAME * pname_unlink (PNAME *pe)
-    {
-    PNAME *pep = pe->prev;
-    PNAME *pen = pe->next;
-    pep->next = pen;
-    pen->prev = pep;
-    pe->prev = NULL;
-    pe->next = NULL;
-    return pe;
+    return ( ch == '/' ) || ( ch == '\\' );
     }
 
-STATIC bool pname_scan (PNAME *pn)
+// Append the components of a path to the normalised path in psOut (nlen characters).
+// Returns the new length, or -1 if the result does not fit in nOut characters.
+STATIC int pname_scan (char *psOut, int nOut, int nlen, const char *psPath)
     {
-    const char * pend = pn->name + pn->len;
-    const char * ps1 = pn->name;
-    if (( *ps1 == '/' ) || ( *ps1 == '\\' ))
-        {
-        PNAME *pe = (PNAME *) malloc (sizeof (PNAME));
-        if ( pe == NULL ) return false;
-        pe->name = &rootdir;
-        pe->len = 1;
-        pname_link (pn, pe);
-        ++ps1;
-        }
+    const char *ps1 = psPath;
     while ( true )
         {
-        while (( *ps1 == '/' ) || ( *ps1 == '\\' )) ++ps1;
-        if ( ps1 >= pend ) break;
+        while ( pname_sep (*ps1) ) ++ps1;
+        if ( *ps1 == '\0' ) break;
         const char *ps2 = ps1;
-        while (( *ps2 != '/' ) && ( *ps2 != '\\' ) && ( ps2 < pend )) ++ps2;
-        if (( ps2 > ps1 + 1 ) || ( *ps1 != '.' ))
-            {
-            PNAME *pe = (PNAME *) malloc (sizeof (PNAME));
-            if ( pe == NULL ) return false;
-            pe->name = ps1;
-            pe->len = ps2 - ps1;
-            pname_link (pn, pe);
-            }
-        ps1 = ps2 + 1;
-        }
-    return true;
-    }
-
-STATIC PNAME * pname_create (const char *psPath)
-    {
-    PNAME *pn = (PNAME *) malloc (sizeof (PNAME));
-    if ( pn == NULL ) return NULL;
-    pn->prev = pn;
-    pn->next = pn;
-    pn->name = psPath;
-    pn->len = strlen (psPath);
-    if ( ! pname_scan (pn) )
-        {
-        pname_delete (pn);
-        return NULL;
-        }
-    return pn;
-    }
-
-STATIC void pname_join (PNAME *pn1, PNAME *pn2)
-    {
-    while (( pn2->next != pn2 ) && ( pn2->next != NULL ))
-        {
-        PNAME *pe2 = pn2->next;
-        pname_unlink (pe2);
-        if (( pe2->len == 2 ) && ( pe2->name[0] == '.' ) && ( pe2->name[1] == '.' ))
+        while (( *ps2 != '\0' ) && ( ! pname_sep (*ps2) )) ++ps2;
+        int clen = ps2 - ps1;
+        if (( clen == 2 ) && ( ps1[0] == '.' ) && ( ps1[1] == '.' ))
             {
-            PNAME *pe1 = pn1->prev;
-            if (( pe1 != pn1 ) && ( pe1->name[0] != '/' ))
-                {
-                pname_unlink (pe1);
-                free (pe1);
-                }
-            free (pe2);
+            // Remove the last component (if any)
+            while (( nlen > 0 ) && ( psOut[nlen - 1] != '/' )) --nlen;
+            if ( nlen > 0 ) --nlen;
             }
-        else
+        else if (( clen != 1 ) || ( ps1[0] != '.' ))
             {
-            if ( pe2->name[0] == '/' ) pname_clean (pn1);
-            pname_link (pn1, pe2);
+            if ( nlen + clen + 1 >= nOut ) return -1;
+            psOut[nlen] = '/';
+            memcpy (&psOut[nlen + 1], ps1, clen);
+            nlen += clen + 1;
             }
+        ps1 = ps2;
         }
+    return nlen;
     }
 
-char * pname_mkname (PNAME *pn)
+int pname_normalize (char *psOut, int nOut, const char *psPath1, const char *psPath2)
     {
+    if ( nOut < 2 ) return -1;
     int nlen = 0;
-    PNAME *pe = pn->next;
-    while (( pe != pn ) && ( pe != NULL ))
-        {
-        nlen += pe->len + 1;
-        pe = pe->next;
-        }
-    char *psName = (char *) malloc (nlen + 1);
-    if ( psName == NULL ) return NULL;
-    char *ps = psName;
-    pe = pn->next;
-    while (( pe != pn ) && ( pe != NULL ))
+    if (( psPath2 == NULL ) || ( ! pname_sep (*psPath2) ))
         {
-        if ( pe->name[0] != '/' )
-            {
-            *ps = '/';
-            ++ps;
-            strncpy (ps, pe->name, pe->len);
-            ps += pe->len;
-            }
-        pe = pe->next;
+        if ( psPath1 != NULL ) nlen = pname_scan (psOut, nOut, nlen, psPath1);
         }
-    if ( ps == psName )
-        {
-        *ps = '/';
-        ++ps;
-        }
-    *ps = '\0';
-    return psName;
+    if (( nlen >= 0 ) && ( psPath2 != NULL )) nlen = pname_scan (psOut, nOut, nlen, psPath2);
+    if ( nlen < 0 ) return -1;
+    if ( nlen == 0 ) psOut[nlen++] = '/';
+    psOut[nlen] = '\0';
+    return nlen;
     }
 
 char * pname_append (const char *psPath1, const char *psPath2)
     {
-    PNAME *pn1 = pname_create (psPath1);
-    if ( pn1 == NULL ) return NULL;
-    PNAME *pn2 = pname_create (psPath2);
-    if ( pn2 == NULL )
-        {
-        pname_delete (pn1);
-        return NULL;
-        }
-    pname_join (pn1, pn2);
-    char *ps = pname_mkname (pn1);
-    pname_delete (pn1);
-    pname_delete (pn2);
-    return ps;
+    char psName[PFS_PATH_MAX];
+    if ( pname_normalize (psName, sizeof (psName), psPath1, psPath2) < 0 ) return NULL;
+    return strdup (psName);
     }
@@ -5,6 +5,17 @@
 #ifndef PNAME_H
 #define PNAME_H
 
+#ifndef PFS_PATH_MAX
+#define PFS_PATH_MAX    256     // Size of buffer for a full path name (including terminator)
+#endif
+
+// Combines a (current) directory and a path, which may be relative or absolute,
+// into an absolute path, resolving "." and ".." components. The result is
+// written to psOut, which is nOut characters long. No memory is allocated.
+// Returns the length of the result, or -1 if it does not fit.
+int pname_normalize (char *psOut, int nOut, const char *psPath1, const char *psPath2);
+
+// As above, but returns the result in allocated memory, or NULL on failure.
 char * pname_append (const char *psPath1, const char *psPath2);
 
 #endif
@@ -0,0 +1,776 @@
+/* pfs_ram.c - A PFS filesystem held in RAM, for temporary files */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
+#include <fcntl.h>
+#include <pfs_private.h>
+#include <../device/ioctl.h>
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+// Size of a storage block (a multiple of 4). File data is held in runs of
+// contiguous blocks (extents).
+#ifndef RAM_BLOCK_SIZE
+#define RAM_BLOCK_SIZE  256
+#endif
+
+// Maximum number of extents in one file. If a file needs more, because the
+// free space has become fragmented, writing fails with ENOSPC.
+#ifndef RAM_NEXTENT
+#define RAM_NEXTENT     8
+#endif
+
+// Maximum length of a file or directory name (excluding the terminator)
+#ifndef RAM_NAME_MAX
+#define RAM_NAME_MAX    31
+#endif
+
+// Node types
+#define RAM_FREE        0
+#define RAM_FILE        1
+#define RAM_DIR         2
+
+STATIC struct pfs_file *ram_open (struct pfs_pfs *pfs, const char *fn, int oflag);
+STATIC int ram_close (struct pfs_file *pfs_fd);
+STATIC int ram_read (struct pfs_file *pfs_fd, char *buffer, int length);
+STATIC int ram_write (struct pfs_file *pfs_fd, char *buffer, int length);
+STATIC long ram_lseek (struct pfs_file *pfs_fd, long pos, int whence);
+STATIC int ram_fstat (struct pfs_file *pfs_fd, struct stat *buf);
+STATIC int ram_ioctl (struct pfs_file *pfs_fd, unsigned long request, void *argp);
+STATIC int ram_allocate (struct pfs_file *pfs_fd, off_t offset, off_t len);
+STATIC int ram_pread (struct pfs_file *pfs_fd, char *buffer, int length, off_t offset);
+STATIC int ram_pwrite (struct pfs_file *pfs_fd, const char *buffer, int length, off_t offset);
+STATIC int ram_fsync (struct pfs_file *pfs_fd);
+STATIC int ram_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf);
+STATIC int ram_rename (struct pfs_pfs *pfs, const char *old, const char *new);
+STATIC int ram_delete (struct pfs_pfs *pfs, const char *name);
+STATIC int ram_mkdir (struct pfs_pfs *pfs, const char *pathname, mode_t mode);
+STATIC int ram_rmdir (struct pfs_pfs *pfs, const char *pathname);
+STATIC void *ram_opendir (struct pfs_pfs *pfs, const char *name);
+STATIC struct dirent *ram_readdir (void *dirp);
+STATIC int ram_chmod (struct pfs_pfs *pfs, const char *pathname, mode_t mode);
+STATIC int ram_umount (struct pfs_pfs *pfs);
+
+STATIC const struct pfs_v_pfs ram_v_pfs =
+    {
+    ram_open,
+    ram_stat,
+    ram_rename,
+    ram_delete,
+    ram_mkdir,
+    ram_rmdir,
+    ram_opendir,
+    ram_chmod,
+    ram_umount,
+    NULL,           // statvfs
+    NULL            // cache_id
+    };
+
+STATIC const struct pfs_v_file ram_v_file =
+    {
+    ram_close,
+    ram_read,
+    ram_write,
+    ram_lseek,
+    ram_fstat,
+    NULL,           // isatty
+    ram_ioctl,
+    ram_allocate,
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    ram_pread,
+    ram_pwrite,
+    ram_fsync
+    };
+
+STATIC const struct pfs_v_dir ram_v_dir =
+    {
+    ram_readdir,
+    NULL            // closedir
+    };
+
+struct ram_extent
+    {
+    uint16_t            start;      // First block
+    uint16_t            count;      // Number of blocks (0 = not in use)
+    };
+
+// A file or directory. Node 0 is the root directory.
+struct ram_node
+    {
+    char                name[RAM_NAME_MAX + 1];
+    int16_t             parent;     // Node of the containing directory (-1 for the root)
+    uint8_t             type;       // RAM_FREE, RAM_FILE or RAM_DIR
+    uint8_t             nopen;      // Number of times the file is open
+    uint32_t            size;       // Length of the file in bytes
+    struct ram_extent   ext[RAM_NEXTENT];   // Blocks holding the data, in order
+    };
+
+struct ram_pfs
+    {
+    const struct pfs_v_pfs *    entry;
+    uint8_t *                   data;       // Storage blocks
+    struct ram_node *           node;       // Table of files and directories
+    uint32_t *                  map;        // Bitmap of blocks in use
+    int                         nblock;     // Number of storage blocks
+    int                         nnode;      // Number of nodes
+    };
+
+struct ram_file
+    {
+    const struct pfs_v_file *   entry;
+    struct ram_pfs *            ram;
+    const char *                pn;
+    int                         ind;        // Node of the file
+    uint32_t                    pos;        // File position
+    int                         oflag;      // Flags given to open
+    };
+
+struct ram_dir
+    {
+    const struct pfs_v_dir *    entry;
+    struct ram_pfs *            ram;
+    int                         flags;
+    struct pfs_mount *          m;
+    struct dirent               de;
+    long long                   size;       // Size of the file in de (0 if not known)
+    int                         ind;        // Node of the directory
+    int                         next;       // Next node to examine
+    };
+
+STATIC bool ram_used (const struct ram_pfs *ram, int blk)
+    {
+    return ( ram->map[blk / 32] & ( 1u << ( blk % 32 ))) != 0;
+    }
+
+STATIC void ram_mark (struct ram_pfs *ram, int blk, bool bUsed)
+    {
+    if ( bUsed ) ram->map[blk / 32] |= 1u << ( blk % 32 );
+    else ram->map[blk / 32] &= ~ ( 1u << ( blk % 32 ));
+    }
+
+STATIC int ram_nblock (const struct ram_node *nd)
+    {
+    int nblk = 0;
+    for (int ie = 0; ie < RAM_NEXTENT; ++ie) nblk += nd->ext[ie].count;
+    return nblk;
+    }
+
+// Finds the first run of nneed free blocks or, failing that, the longest run
+STATIC bool ram_run (const struct ram_pfs *ram, int nneed, int *pstart, int *pcount)
+    {
+    int nbest = 0;
+    int blk = 0;
+    while ( blk < ram->nblock )
+        {
+        if ( ram_used (ram, blk) )
+            {
+            ++blk;
+            continue;
+            }
+        int start = blk;
+        while (( blk < ram->nblock ) && ( ! ram_used (ram, blk) ) && ( blk - start < nneed )) ++blk;
+        if ( blk - start > nbest )
+            {
+            *pstart = start;
+            nbest = blk - start;
+            if ( nbest >= nneed ) break;
+            }
+        }
+    *pcount = nbest;
+    return ( nbest > 0 );
+    }
+
+// Allocates blocks so that the file can hold size bytes. The last extent is
+// extended in place when the following blocks are free, otherwise new
+// extents are taken from the first sufficiently large free run.
+STATIC bool ram_grow (struct ram_pfs *ram, struct ram_node *nd, uint32_t size)
+    {
+    int nneed = ( size + RAM_BLOCK_SIZE - 1 ) / RAM_BLOCK_SIZE - ram_nblock (nd);
+    int ie = RAM_NEXTENT - 1;
+    while (( ie >= 0 ) && ( nd->ext[ie].count == 0 )) --ie;
+    while ( nneed > 0 )
+        {
+        if ( ie >= 0 )
+            {
+            struct ram_extent *pe = &nd->ext[ie];
+            int blk = pe->start + pe->count;
+            while (( nneed > 0 ) && ( blk < ram->nblock ) && ( pe->count < UINT16_MAX ) && ( ! ram_used (ram, blk) ))
+                {
+                ram_mark (ram, blk, true);
+                ++pe->count;
+                ++blk;
+                --nneed;
+                }
+            if ( nneed == 0 ) break;
+            }
+        if ( ++ie >= RAM_NEXTENT ) return false;
+        int start;
+        int count;
+        if ( ! ram_run (ram, ( nneed < UINT16_MAX ) ? nneed : UINT16_MAX, &start, &count) ) return false;
+        nd->ext[ie].start = start;
+        nd->ext[ie].count = count;
+        for (int blk = start; blk < start + count; ++blk) ram_mark (ram, blk, true);
+        nneed -= count;
+        }
+    return true;
+    }
+
+// Releases any blocks not required to hold size bytes
+STATIC void ram_shrink (struct ram_pfs *ram, struct ram_node *nd, uint32_t size)
+    {
+    int nkeep = ( size + RAM_BLOCK_SIZE - 1 ) / RAM_BLOCK_SIZE;
+    for (int ie = 0; ie < RAM_NEXTENT; ++ie)
+        {
+        struct ram_extent *pe = &nd->ext[ie];
+        if ( nkeep >= pe->count )
+            {
+            nkeep -= pe->count;
+            continue;
+            }
+        for (int blk = pe->start + nkeep; blk < pe->start + pe->count; ++blk) ram_mark (ram, blk, false);
+        pe->count = nkeep;
+        nkeep = 0;
+        }
+    }
+
+// Address of the data at position pos in a file, and the number of
+// contiguous bytes held from there to the end of the extent
+STATIC uint8_t *ram_addr (const struct ram_pfs *ram, const struct ram_node *nd, uint32_t pos, int *plen)
+    {
+    uint32_t blk = pos / RAM_BLOCK_SIZE;
+    for (int ie = 0; ie < RAM_NEXTENT; ++ie)
+        {
+        const struct ram_extent *pe = &nd->ext[ie];
+        if ( blk < pe->count )
+            {
+            *plen = ( pe->count - blk ) * RAM_BLOCK_SIZE - pos % RAM_BLOCK_SIZE;
+            return ram->data + ( pe->start + blk ) * RAM_BLOCK_SIZE + pos % RAM_BLOCK_SIZE;
+            }
+        blk -= pe->count;
+        }
+    *plen = 0;
+    return NULL;
+    }
+
+// Copies data between a buffer and a file, one extent at a time. The file must
+// already hold the blocks. When writing, a NULL buffer fills with zeros.
+STATIC void ram_copy (const struct ram_pfs *ram, const struct ram_node *nd, uint32_t pos,
+    char *buffer, int length, bool bWrite)
+    {
+    while ( length > 0 )
+        {
+        int nspan;
+        uint8_t *pd = ram_addr (ram, nd, pos, &nspan);
+        if ( nspan > length ) nspan = length;
+        if ( ! bWrite ) memcpy (buffer, pd, nspan);
+        else if ( buffer == NULL ) memset (pd, 0, nspan);
+        else memcpy (pd, buffer, nspan);
+        if ( buffer != NULL ) buffer += nspan;
+        pos += nspan;
+        length -= nspan;
+        }
+    }
+
+// Finds a node within a directory
+STATIC int ram_child (const struct ram_pfs *ram, int dir, const char *ps, int nlen)
+    {
+    if ( nlen > RAM_NAME_MAX ) return -1;
+    for (int ind = 1; ind < ram->nnode; ++ind)
+        {
+        const struct ram_node *nd = &ram->node[ind];
+        if (( nd->type != RAM_FREE ) && ( nd->parent == dir ) && ( strncmp (nd->name, ps, nlen) == 0 )
+            && ( nd->name[nlen] == '\0' )) return ind;
+        }
+    return -1;
+    }
+
+// Finds the node for a path name, or returns -1. If pdir is not NULL it is set
+// to the directory which does, or would, contain the final part of the name
+// (-1 if there is no such directory), and *pleaf to that final part.
+STATIC int ram_find (const struct ram_pfs *ram, const char *name, int *pdir, const char **pleaf)
+    {
+    int ind = 0;
+    int dir = -1;
+    const char *leaf = name;
+    while ( *name == '/' ) ++name;
+    while (( *name != '\0' ) && ( ind >= 0 ))
+        {
+        const char *ps = name;
+        while (( *name != '\0' ) && ( *name != '/' )) ++name;
+        int nlen = name - ps;
+        while ( *name == '/' ) ++name;
+        if ( ram->node[ind].type != RAM_DIR )
+            {
+            ind = -1;
+            dir = -1;
+            break;
+            }
+        dir = ( *name == '\0' ) ? ind : -1;
+        leaf = ps;
+        ind = ram_child (ram, ind, ps, nlen);
+        }
+    if ( pdir != NULL )
+        {
+        *pdir = dir;
+        *pleaf = leaf;
+        }
+    return ind;
+    }
+
+// Copies the final part of a path name into a node
+STATIC int ram_name (struct ram_node *nd, const char *leaf)
+    {
+    int nlen = strcspn (leaf, "/");
+    if ( nlen > RAM_NAME_MAX ) return ENAMETOOLONG;
+    memcpy (nd->name, leaf, nlen);
+    nd->name[nlen] = '\0';
+    return 0;
+    }
+
+// Creates a file or directory, returning the node or a negated error number
+STATIC int ram_new (struct ram_pfs *ram, int dir, const char *leaf, int type)
+    {
+    for (int ind = 1; ind < ram->nnode; ++ind)
+        {
+        struct ram_node *nd = &ram->node[ind];
+        if ( nd->type == RAM_FREE )
+            {
+            memset (nd, 0, sizeof (struct ram_node));
+            int ierr = ram_name (nd, leaf);
+            if ( ierr != 0 ) return - ierr;
+            nd->parent = dir;
+            nd->type = type;
+            return ind;
+            }
+        }
+    return - ENOSPC;
+    }
+
+STATIC void ram_fill_stat (const struct ram_node *nd, struct stat *buf)
+    {
+    memset (buf, 0, sizeof (struct stat));
+    buf->st_size = nd->size;
+    buf->st_blksize = RAM_BLOCK_SIZE;
+    buf->st_blocks = ram_nblock (nd) * ( RAM_BLOCK_SIZE / 512 );
+    buf->st_nlink = 1;
+    buf->st_mode = S_IRWXU | S_IRWXG | S_IRWXO;
+    if ( nd->type == RAM_DIR ) buf->st_mode |= S_IFDIR;
+    else buf->st_mode |= S_IFREG;
+    }
+
+STATIC struct pfs_file *ram_open (struct pfs_pfs *pfs, const char *fn, int oflag)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    struct ram_file *fd = NULL;
+    int dir;
+    const char *leaf;
+    int ierr = 0;
+    pfs_lock ();
+    int ind = ram_find (ram, fn, &dir, &leaf);
+    if ( ind < 0 )
+        {
+        if (( ! ( oflag & O_CREAT )) || ( dir < 0 )) ierr = ENOENT;
+        else ind = ram_new (ram, dir, leaf, RAM_FILE);
+        if ( ind < 0 ) ierr = ( ierr != 0 ) ? ierr : - ind;
+        }
+    else if (( oflag & O_CREAT ) && ( oflag & O_EXCL )) ierr = EEXIST;
+    else if ( ram->node[ind].type == RAM_DIR ) ierr = EISDIR;
+    else if ( ram->node[ind].nopen == UINT8_MAX ) ierr = ENFILE;
+    if ( ierr == 0 )
+        {
+        fd = (struct ram_file *) pfs_file_alloc (sizeof (struct ram_file));
+        if ( fd == NULL ) ierr = ENOMEM;
+        }
+    if ( ierr == 0 )
+        {
+        struct ram_node *nd = &ram->node[ind];
+        fd->entry = &ram_v_file;
+        fd->ram = ram;
+        fd->ind = ind;
+        fd->pos = 0;
+        fd->oflag = oflag;
+        if (( oflag & O_TRUNC ) && (( oflag & O_ACCMODE ) != O_RDONLY ))
+            {
+            ram_shrink (ram, nd, 0);
+            nd->size = 0;
+            }
+        ++nd->nopen;
+        }
+    pfs_unlock ();
+    if ( ierr != 0 ) pfs_error (ierr);
+    return (struct pfs_file *) fd;
+    }
+
+STATIC int ram_close (struct pfs_file *pfs_fd)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    pfs_lock ();
+    --fd->ram->node[fd->ind].nopen;
+    pfs_unlock ();
+    return 0;
+    }
+
+STATIC int ram_pread (struct pfs_file *pfs_fd, char *buffer, int length, off_t offset)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    if (( fd->oflag & O_ACCMODE ) == O_WRONLY ) return pfs_error (EBADF);
+    pfs_lock ();
+    const struct ram_node *nd = &fd->ram->node[fd->ind];
+    if ( offset >= nd->size ) length = 0;
+    else if ( length > nd->size - offset ) length = nd->size - offset;
+    ram_copy (fd->ram, nd, offset, buffer, length, false);
+    pfs_unlock ();
+    return length;
+    }
+
+// Writing beyond the end of the file fills the gap with zeros
+STATIC int ram_pwrite (struct pfs_file *pfs_fd, const char *buffer, int length, off_t offset)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    if (( fd->oflag & O_ACCMODE ) == O_RDONLY ) return pfs_error (EBADF);
+    if ( length <= 0 ) return 0;
+    // The size of a file is held in 32 bits
+    if (( offset < 0 ) || ( (uint64_t) offset + length > UINT32_MAX )) return pfs_error (EFBIG);
+    struct ram_pfs *ram = fd->ram;
+    int ierr = 0;
+    pfs_lock ();
+    struct ram_node *nd = &ram->node[fd->ind];
+    uint32_t fend = (uint32_t) offset + length;
+    if ( fend > nd->size )
+        {
+        if ( ram_grow (ram, nd, fend) )
+            {
+            if ( offset > nd->size ) ram_copy (ram, nd, nd->size, NULL, offset - nd->size, true);
+            nd->size = fend;
+            }
+        else
+            {
+            ram_shrink (ram, nd, nd->size);
+            ierr = ENOSPC;
+            }
+        }
+    if ( ierr == 0 ) ram_copy (ram, nd, offset, (char *) buffer, length, true);
+    pfs_unlock ();
+    return ( ierr == 0 ) ? length : pfs_error (ierr);
+    }
+
+STATIC int ram_read (struct pfs_file *pfs_fd, char *buffer, int length)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    int n = ram_pread (pfs_fd, buffer, length, fd->pos);
+    if ( n > 0 ) fd->pos += n;
+    return n;
+    }
+
+STATIC int ram_write (struct pfs_file *pfs_fd, char *buffer, int length)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    if ( fd->oflag & O_APPEND ) fd->pos = fd->ram->node[fd->ind].size;
+    int n = ram_pwrite (pfs_fd, buffer, length, fd->pos);
+    if ( n > 0 ) fd->pos += n;
+    return n;
+    }
+
+STATIC long ram_lseek (struct pfs_file *pfs_fd, long pos, int whence)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    long long r = pos;
+    switch (whence)
+        {
+        case SEEK_SET: break;
+        case SEEK_CUR: r += fd->pos; break;
+        case SEEK_END: r += fd->ram->node[fd->ind].size; break;
+        default: return pfs_error (EINVAL);
+        }
+    if (( r < 0 ) || ( r > LONG_MAX ) || ( r > UINT32_MAX )) return pfs_error (EINVAL);
+    fd->pos = r;
+    return (long) r;
+    }
+
+STATIC int ram_fstat (struct pfs_file *pfs_fd, struct stat *buf)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    ram_fill_stat (&fd->ram->node[fd->ind], buf);
+    return 0;
+    }
+
+// The data is already in memory, so is mapped in place up to the end of
+// the extent holding the file position
+STATIC int ram_mmap (struct ram_file *fd, struct ioc_mmap *pmap)
+    {
+    if (( pmap == NULL ) || ( pmap->length < 0 )) return pfs_error (EINVAL);
+    pfs_lock ();
+    const struct ram_node *nd = &fd->ram->node[fd->ind];
+    int nspan = 0;
+    pmap->addr = NULL;
+    if ( fd->pos < nd->size )
+        {
+        pmap->addr = ram_addr (fd->ram, nd, fd->pos, &nspan);
+        if ( (uint32_t) nspan > nd->size - fd->pos ) nspan = nd->size - fd->pos;
+        if ( nspan > pmap->length ) nspan = pmap->length;
+        fd->pos += nspan;
+        }
+    pmap->length = nspan;
+    pfs_unlock ();
+    return 0;
+    }
+
+STATIC int ram_ioctl (struct pfs_file *pfs_fd, unsigned long request, void *argp)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    switch (request)
+        {
+        case IOC_RQ_MMAP:
+            return ram_mmap (fd, (struct ioc_mmap *) argp);
+        default:
+            break;
+        }
+    return pfs_error (EINVAL);
+    }
+
+// Reserves the space and extends the file with zeros
+STATIC int ram_allocate (struct pfs_file *pfs_fd, off_t offset, off_t len)
+    {
+    struct ram_file *fd = (struct ram_file *) pfs_fd;
+    if (( fd->oflag & O_ACCMODE ) == O_RDONLY ) return pfs_error (EBADF);
+    if ( (uint64_t) offset + len > UINT32_MAX ) return pfs_error (EFBIG);
+    struct ram_pfs *ram = fd->ram;
+    int ierr = 0;
+    pfs_lock ();
+    struct ram_node *nd = &ram->node[fd->ind];
+    uint32_t fend = (uint32_t) offset + (uint32_t) len;
+    if ( fend > nd->size )
+        {
+        if ( ram_grow (ram, nd, fend) )
+            {
+            ram_copy (ram, nd, nd->size, NULL, fend - nd->size, true);
+            nd->size = fend;
+            }
+        else
+            {
+            ram_shrink (ram, nd, nd->size);
+            ierr = ENOSPC;
+            }
+        }
+    pfs_unlock ();
+    return pfs_error (ierr);
+    }
+
+// There is nowhere more durable to put the data
+STATIC int ram_fsync (struct pfs_file *pfs_fd)
+    {
+    return 0;
+    }
+
+STATIC int ram_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    pfs_lock ();
+    int ind = ram_find (ram, name, NULL, NULL);
+    if ( ind >= 0 ) ram_fill_stat (&ram->node[ind], buf);
+    pfs_unlock ();
+    return ( ind >= 0 ) ? 0 : pfs_error (ENOENT);
+    }
+
+STATIC int ram_rename (struct pfs_pfs *pfs, const char *old, const char *new)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    int dir;
+    const char *leaf;
+    int ierr = 0;
+    pfs_lock ();
+    int ind = ram_find (ram, old, NULL, NULL);
+    if ( ind < 0 ) ierr = ENOENT;
+    else if ( ind == 0 ) ierr = EBUSY;
+    else if ( ram_find (ram, new, &dir, &leaf) >= 0 ) ierr = EEXIST;
+    else if ( dir < 0 ) ierr = ENOENT;
+    else
+        {
+        // A directory may not be moved into itself
+        for (int up = dir; up >= 0; up = ram->node[up].parent)
+            {
+            if ( up == ind ) ierr = EINVAL;
+            }
+        }
+    if ( ierr == 0 ) ierr = ram_name (&ram->node[ind], leaf);
+    if ( ierr == 0 ) ram->node[ind].parent = dir;
+    pfs_unlock ();
+    return pfs_error (ierr);
+    }
+
+STATIC int ram_delete (struct pfs_pfs *pfs, const char *name)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    int ierr = 0;
+    pfs_lock ();
+    int ind = ram_find (ram, name, NULL, NULL);
+    if ( ind < 0 ) ierr = ENOENT;
+    else if ( ram->node[ind].type == RAM_DIR ) ierr = EISDIR;
+    else if ( ram->node[ind].nopen > 0 ) ierr = EBUSY;
+    else
+        {
+        ram_shrink (ram, &ram->node[ind], 0);
+        ram->node[ind].type = RAM_FREE;
+        }
+    pfs_unlock ();
+    return pfs_error (ierr);
+    }
+
+STATIC int ram_mkdir (struct pfs_pfs *pfs, const char *pathname, mode_t mode)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    int dir;
+    const char *leaf;
+    int ierr = 0;
+    pfs_lock ();
+    if ( ram_find (ram, pathname, &dir, &leaf) >= 0 ) ierr = EEXIST;
+    else if ( dir < 0 ) ierr = ENOENT;
+    else
+        {
+        int ind = ram_new (ram, dir, leaf, RAM_DIR);
+        if ( ind < 0 ) ierr = - ind;
+        }
+    pfs_unlock ();
+    return pfs_error (ierr);
+    }
+
+STATIC int ram_rmdir (struct pfs_pfs *pfs, const char *pathname)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    int ierr = 0;
+    pfs_lock ();
+    int ind = ram_find (ram, pathname, NULL, NULL);
+    if ( ind < 0 ) ierr = ENOENT;
+    else if ( ram->node[ind].type != RAM_DIR ) ierr = ENOTDIR;
+    else if ( ind == 0 ) ierr = EBUSY;
+    else
+        {
+        for (int i = 1; i < ram->nnode; ++i)
+            {
+            if (( ram->node[i].type != RAM_FREE ) && ( ram->node[i].parent == ind )) ierr = ENOTEMPTY;
+            }
+        }
+    if ( ierr == 0 ) ram->node[ind].type = RAM_FREE;
+    pfs_unlock ();
+    return pfs_error (ierr);
+    }
+
+STATIC void *ram_opendir (struct pfs_pfs *pfs, const char *name)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    pfs_lock ();
+    int ind = ram_find (ram, name, NULL, NULL);
+    int type = ( ind >= 0 ) ? ram->node[ind].type : RAM_FREE;
+    pfs_unlock ();
+    if ( ind < 0 )
+        {
+        pfs_error (ENOENT);
+        return NULL;
+        }
+    if ( type != RAM_DIR )
+        {
+        pfs_error (ENOTDIR);
+        return NULL;
+        }
+    struct ram_dir *dd = (struct ram_dir *) malloc (sizeof (struct ram_dir));
+    if ( dd == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    dd->entry = &ram_v_dir;
+    dd->ram = ram;
+    dd->ind = ind;
+    dd->next = 1;
+    return (void *) dd;
+    }
+
+STATIC struct dirent *ram_readdir (void *dirp)
+    {
+    struct ram_dir *dd = (struct ram_dir *) dirp;
+    struct ram_pfs *ram = dd->ram;
+    struct dirent *de = NULL;
+    pfs_lock ();
+    while ( dd->next < ram->nnode )
+        {
+        const struct ram_node *nd = &ram->node[dd->next];
+        ++dd->next;
+        if (( nd->type != RAM_FREE ) && ( nd->parent == dd->ind ))
+            {
+            strcpy (dd->de.d_name, nd->name);
+            dd->de.d_type = ( nd->type == RAM_DIR ) ? DT_DIR : DT_REG;
+            dd->size = nd->size;
+            de = &dd->de;
+            break;
+            }
+        }
+    pfs_unlock ();
+    return de;
+    }
+
+STATIC int ram_chmod (struct pfs_pfs *pfs, const char *pathname, mode_t mode)
+    {
+    return pfs_error (EINVAL);
+    }
+
+struct pfs_pfs *pfs_ram_create (int size, int nnode)
+    {
+    if (( nnode < 1 ) || ( nnode > INT16_MAX ) || ( size <= (int) ( nnode * sizeof (struct ram_node) )))
+        {
+        pfs_error (EINVAL);
+        return NULL;
+        }
+    // Each block takes RAM_BLOCK_SIZE bytes of storage plus one bit of the map
+    int nmeta = nnode * sizeof (struct ram_node);
+    int nblock = (int) ((long long) ( size - nmeta ) * 8 / ( 8 * RAM_BLOCK_SIZE + 1 ));
+    if ( nblock > UINT16_MAX ) nblock = UINT16_MAX;
+    while (( nblock > 0 ) && ( nblock * RAM_BLOCK_SIZE + nmeta + 4 * (( nblock + 31 ) / 32 ) > size )) --nblock;
+    if ( nblock < 1 )
+        {
+        pfs_error (EINVAL);
+        return NULL;
+        }
+    struct ram_pfs *ram = (struct ram_pfs *) malloc (sizeof (struct ram_pfs));
+    if ( ram == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    ram->data = (uint8_t *) malloc (size);
+    if ( ram->data == NULL )
+        {
+        free (ram);
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    ram->entry = &ram_v_pfs;
+    ram->nblock = nblock;
+    ram->nnode = nnode;
+    ram->node = (struct ram_node *) ( ram->data + nblock * RAM_BLOCK_SIZE );
+    ram->map = (uint32_t *) ( ram->data + nblock * RAM_BLOCK_SIZE + nmeta );
+    memset (ram->node, 0, nmeta + 4 * (( nblock + 31 ) / 32 ));
+    ram->node[0].parent = -1;
+    ram->node[0].type = RAM_DIR;
+    return (struct pfs_pfs *) ram;
+    }
+
+// The contents are lost
+STATIC int ram_umount (struct pfs_pfs *pfs)
+    {
+    struct ram_pfs *ram = (struct ram_pfs *) pfs;
+    free (ram->data);
+    free (ram);
+    return 0;
+    }
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+# mkromfs.py - Build a read-only filesystem image for pfs_rom_create
+# Copyright (c) 2023, Memotech-Bill
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Usage: mkromfs.py [--name symbol] directory output
+#
+# If the output name ends in ".c" a C source file is written, defining
+# the image as a constant array (so placed in flash) named by --name.
+# Otherwise the raw image is written, for example to be loaded into
+# flash separately.
+#
+# Image layout (little-endian 32-bit words, offsets from the image start):
+#
+#   Header:          magic "PFSR", version, image size, root table offset
+#   Directory table: entry count, then entries sorted by name (bytewise)
+#   Entry:           name offset, flags (1 = directory), data or table offset, size
+#
+# Tables and file data are 4-byte aligned. Names are null terminated.
+
+import argparse
+import os
+import struct
+import sys
+
+ROM_MAGIC = 0x52534650
+ROM_VERSION = 1
+ROM_DIR = 0x01
+
+class Image:
+    def __init__ (self):
+        self.data = bytearray (16)
+
+    def add (self, blob, align = 4):
+        while len (self.data) % align:
+            self.data.append (0)
+        offset = len (self.data)
+        self.data += blob
+        return offset
+
+    def add_dir (self, path):
+        entries = []
+        for name in sorted (os.listdir (path), key = lambda s: s.encode ()):
+            full = os.path.join (path, name)
+            noff = self.add (name.encode () + b'\0', 1)
+            if os.path.isdir (full):
+                entries.append ((noff, ROM_DIR, self.add_dir (full), 0))
+            else:
+                with open (full, 'rb') as f:
+                    blob = f.read ()
+                entries.append ((noff, 0, self.add (blob), len (blob)))
+        table = struct.pack ('<I', len (entries))
+        for e in entries:
+            table += struct.pack ('<IIII', *e)
+        return self.add (table)
+
+    def build (self, path):
+        root = self.add_dir (path)
+        self.add (b'')
+        struct.pack_into ('<IIII', self.data, 0, ROM_MAGIC, ROM_VERSION, len (self.data), root)
+        return bytes (self.data)
+
+def write_c (f, image, name, source):
+    f.write ('// Generated by mkromfs.py from {:s} - do not edit\n\n'.format (source))
+    f.write ('#include <stdint.h>\n\n')
+    f.write ('const uint32_t {:s}[{:d}] =\n    {{\n'.format (name, len (image) // 4))
+    words = struct.unpack ('<{:d}I'.format (len (image) // 4), image)
+    for i in range (0, len (words), 8):
+        f.write ('    ' + ', '.join ('0x{:08X}'.format (w) for w in words[i:i+8]) + ',\n')
+    f.write ('    };\n')
+
+def main ():
+    parser = argparse.ArgumentParser (description = 'Build a read-only filesystem image for pfs_rom_create')
+    parser.add_argument ('--name', default = 'rom_image', help = 'Name of the array in C output')
+    parser.add_argument ('directory', help = 'Directory holding the files to include')
+    parser.add_argument ('output', help = 'Output file (.c for C source, otherwise raw image)')
+    args = parser.parse_args ()
+    if not os.path.isdir (args.directory):
+        sys.exit ('mkromfs.py: {:s} is not a directory'.format (args.directory))
+    image = Image ().build (args.directory)
+    if args.output.endswith ('.c'):
+        with open (args.output, 'w') as f:
+            write_c (f, image, args.name, args.directory)
+    else:
+        with open (args.output, 'wb') as f:
+            f.write (image)
+
+if __name__ == '__main__':
+    main ()
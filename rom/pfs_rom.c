@@ -0,0 +1,396 @@
+/* pfs_rom.c - A read-only PFS filesystem from an image in memory mapped flash */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
+#include <fcntl.h>
+#include <pfs_private.h>
+#include <../device/ioctl.h>
+
+#ifndef STATIC
+#define STATIC  static
+#endif
+
+// Image layout, as written by mkromfs.py. All values are little-endian
+// 32-bit words, and all offsets are from the start of the image.
+#define ROM_MAGIC       0x52534650      // "PFSR"
+#define ROM_VERSION     1
+#define ROM_DIR         0x01            // Entry flag: entry is a directory
+
+struct rom_header
+    {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            size;           // Length of the whole image
+    uint32_t            root;           // Offset of the root directory table
+    };
+
+// A directory table is a count followed by that many entries, sorted by name
+struct rom_entry
+    {
+    uint32_t            name;           // Offset of the name (null terminated)
+    uint32_t            flags;          // ROM_DIR for a directory
+    uint32_t            offset;         // Offset of the file data, or of the directory table
+    uint32_t            size;           // Length of the file (zero for a directory)
+    };
+
+STATIC struct pfs_file *rom_open (struct pfs_pfs *pfs, const char *fn, int oflag);
+STATIC int rom_close (struct pfs_file *pfs_fd);
+STATIC int rom_read (struct pfs_file *pfs_fd, char *buffer, int length);
+STATIC int rom_write (struct pfs_file *pfs_fd, char *buffer, int length);
+STATIC long rom_lseek (struct pfs_file *pfs_fd, long pos, int whence);
+STATIC int rom_fstat (struct pfs_file *pfs_fd, struct stat *buf);
+STATIC int rom_ioctl (struct pfs_file *pfs_fd, unsigned long request, void *argp);
+STATIC int rom_pread (struct pfs_file *pfs_fd, char *buffer, int length, off_t offset);
+STATIC int rom_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf);
+STATIC int rom_rename (struct pfs_pfs *pfs, const char *old, const char *new);
+STATIC int rom_delete (struct pfs_pfs *pfs, const char *name);
+STATIC int rom_mkdir (struct pfs_pfs *pfs, const char *pathname, mode_t mode);
+STATIC int rom_rmdir (struct pfs_pfs *pfs, const char *pathname);
+STATIC void *rom_opendir (struct pfs_pfs *pfs, const char *name);
+STATIC struct dirent *rom_readdir (void *dirp);
+STATIC int rom_chmod (struct pfs_pfs *pfs, const char *pathname, mode_t mode);
+STATIC int rom_umount (struct pfs_pfs *pfs);
+
+STATIC const struct pfs_v_pfs rom_v_pfs =
+    {
+    rom_open,
+    rom_stat,
+    rom_rename,
+    rom_delete,
+    rom_mkdir,
+    rom_rmdir,
+    rom_opendir,
+    rom_chmod,
+    rom_umount,
+    NULL,           // statvfs
+    NULL            // cache_id
+    };
+
+STATIC const struct pfs_v_file rom_v_file =
+    {
+    rom_close,
+    rom_read,
+    rom_write,
+    rom_lseek,
+    rom_fstat,
+    NULL,           // isatty
+    rom_ioctl,
+    NULL,           // allocate
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    rom_pread,
+    NULL,           // pwrite
+    NULL            // fsync
+    };
+
+STATIC const struct pfs_v_dir rom_v_dir =
+    {
+    rom_readdir,
+    NULL            // closedir
+    };
+
+struct rom_pfs
+    {
+    const struct pfs_v_pfs *    entry;
+    const uint8_t *             base;       // Start of the image
+    struct rom_entry            root;       // Entry for the root directory
+    };
+
+struct rom_file
+    {
+    const struct pfs_v_file *   entry;
+    struct rom_pfs *            rom;
+    const char *                pn;
+    const struct rom_entry *    pe;         // Directory entry of the file
+    uint32_t                    pos;        // File position
+    };
+
+struct rom_dir
+    {
+    const struct pfs_v_dir *    entry;
+    struct rom_pfs *            rom;
+    int                         flags;
+    struct pfs_mount *          m;
+    struct dirent               de;
+    long long                   size;       // Size of the file in de (0 if not known)
+    const struct rom_entry *    pe;         // Entries of the directory
+    int                         count;      // Number of entries
+    int                         next;       // Next entry to return
+    };
+
+// Binary search of a directory table for a name of nlen characters
+STATIC const struct rom_entry *rom_search (const struct rom_pfs *rom, uint32_t table, const char *ps, int nlen)
+    {
+    const uint32_t *pt = (const uint32_t *) ( rom->base + table );
+    const struct rom_entry *pe = (const struct rom_entry *) ( pt + 1 );
+    int lo = 0;
+    int hi = pt[0] - 1;
+    while ( lo <= hi )
+        {
+        int mid = ( lo + hi ) / 2;
+        const char *pn = (const char *) ( rom->base + pe[mid].name );
+        int cmp = strncmp (pn, ps, nlen);
+        if (( cmp == 0 ) && ( pn[nlen] != '\0' )) cmp = 1;
+        if ( cmp == 0 ) return &pe[mid];
+        if ( cmp < 0 ) lo = mid + 1;
+        else hi = mid - 1;
+        }
+    return NULL;
+    }
+
+// Finds the entry for a path name, one directory level at a time
+STATIC const struct rom_entry *rom_find (const struct rom_pfs *rom, const char *name)
+    {
+    const struct rom_entry *pe = &rom->root;
+    while ( *name == '/' ) ++name;
+    while (( *name != '\0' ) && ( pe != NULL ))
+        {
+        const char *ps = name;
+        while (( *name != '\0' ) && ( *name != '/' )) ++name;
+        int nlen = name - ps;
+        while ( *name == '/' ) ++name;
+        if ( pe->flags & ROM_DIR ) pe = rom_search (rom, pe->offset, ps, nlen);
+        else pe = NULL;
+        }
+    return pe;
+    }
+
+STATIC void rom_fill_stat (const struct rom_entry *pe, struct stat *buf)
+    {
+    memset (buf, 0, sizeof (struct stat));
+    buf->st_size = pe->size;
+    buf->st_blksize = 1;
+    buf->st_blocks = pe->size;
+    buf->st_nlink = 1;
+    buf->st_mode = S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    if ( pe->flags & ROM_DIR ) buf->st_mode |= S_IFDIR;
+    else buf->st_mode |= S_IFREG;
+    }
+
+STATIC struct pfs_file *rom_open (struct pfs_pfs *pfs, const char *fn, int oflag)
+    {
+    struct rom_pfs *rom = (struct rom_pfs *) pfs;
+    const struct rom_entry *pe = rom_find (rom, fn);
+    if ( pe == NULL )
+        {
+        pfs_error (( oflag & O_CREAT ) ? EROFS : ENOENT);
+        return NULL;
+        }
+    if (( ( oflag & O_ACCMODE ) != O_RDONLY ) || ( oflag & O_TRUNC ))
+        {
+        pfs_error (EROFS);
+        return NULL;
+        }
+    if ( pe->flags & ROM_DIR )
+        {
+        pfs_error (EISDIR);
+        return NULL;
+        }
+    struct rom_file *fd = (struct rom_file *) pfs_file_alloc (sizeof (struct rom_file));
+    if ( fd == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    fd->entry = &rom_v_file;
+    fd->rom = rom;
+    fd->pe = pe;
+    fd->pos = 0;
+    return (struct pfs_file *) fd;
+    }
+
+STATIC int rom_close (struct pfs_file *pfs_fd)
+    {
+    return 0;
+    }
+
+STATIC int rom_pread (struct pfs_file *pfs_fd, char *buffer, int length, off_t offset)
+    {
+    struct rom_file *fd = (struct rom_file *) pfs_fd;
+    const struct rom_entry *pe = fd->pe;
+    if ( offset >= pe->size ) return 0;
+    if ( length > pe->size - offset ) length = pe->size - offset;
+    memcpy (buffer, fd->rom->base + pe->offset + offset, length);
+    return length;
+    }
+
+STATIC int rom_read (struct pfs_file *pfs_fd, char *buffer, int length)
+    {
+    struct rom_file *fd = (struct rom_file *) pfs_fd;
+    int n = rom_pread (pfs_fd, buffer, length, fd->pos);
+    fd->pos += n;
+    return n;
+    }
+
+STATIC int rom_write (struct pfs_file *pfs_fd, char *buffer, int length)
+    {
+    return pfs_error (EBADF);
+    }
+
+STATIC long rom_lseek (struct pfs_file *pfs_fd, long pos, int whence)
+    {
+    struct rom_file *fd = (struct rom_file *) pfs_fd;
+    long long r = pos;
+    switch (whence)
+        {
+        case SEEK_SET: break;
+        case SEEK_CUR: r += fd->pos; break;
+        case SEEK_END: r += fd->pe->size; break;
+        default: return pfs_error (EINVAL);
+        }
+    if (( r < 0 ) || ( r > LONG_MAX ) || ( r > UINT32_MAX )) return pfs_error (EINVAL);
+    fd->pos = r;
+    return (long) r;
+    }
+
+STATIC int rom_fstat (struct pfs_file *pfs_fd, struct stat *buf)
+    {
+    struct rom_file *fd = (struct rom_file *) pfs_fd;
+    rom_fill_stat (fd->pe, buf);
+    return 0;
+    }
+
+// Files are stored contiguously, so the rest of the file is mapped at once
+STATIC int rom_mmap (struct rom_file *fd, struct ioc_mmap *pmap)
+    {
+    if (( pmap == NULL ) || ( pmap->length < 0 )) return pfs_error (EINVAL);
+    const struct rom_entry *pe = fd->pe;
+    int nlen = 0;
+    pmap->addr = NULL;
+    if ( fd->pos < pe->size )
+        {
+        pmap->addr = fd->rom->base + pe->offset + fd->pos;
+        nlen = pe->size - fd->pos;
+        if ( nlen > pmap->length ) nlen = pmap->length;
+        fd->pos += nlen;
+        }
+    pmap->length = nlen;
+    return 0;
+    }
+
+STATIC int rom_ioctl (struct pfs_file *pfs_fd, unsigned long request, void *argp)
+    {
+    struct rom_file *fd = (struct rom_file *) pfs_fd;
+    switch (request)
+        {
+        case IOC_RQ_MMAP:
+            return rom_mmap (fd, (struct ioc_mmap *) argp);
+        default:
+            break;
+        }
+    return pfs_error (EINVAL);
+    }
+
+STATIC int rom_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf)
+    {
+    const struct rom_entry *pe = rom_find ((struct rom_pfs *) pfs, name);
+    if ( pe == NULL ) return pfs_error (ENOENT);
+    rom_fill_stat (pe, buf);
+    return 0;
+    }
+
+STATIC int rom_rename (struct pfs_pfs *pfs, const char *old, const char *new)
+    {
+    return pfs_error (EROFS);
+    }
+
+STATIC int rom_delete (struct pfs_pfs *pfs, const char *name)
+    {
+    return pfs_error (EROFS);
+    }
+
+STATIC int rom_mkdir (struct pfs_pfs *pfs, const char *pathname, mode_t mode)
+    {
+    return pfs_error (EROFS);
+    }
+
+STATIC int rom_rmdir (struct pfs_pfs *pfs, const char *pathname)
+    {
+    return pfs_error (EROFS);
+    }
+
+STATIC void *rom_opendir (struct pfs_pfs *pfs, const char *name)
+    {
+    struct rom_pfs *rom = (struct rom_pfs *) pfs;
+    const struct rom_entry *pe = rom_find (rom, name);
+    if ( pe == NULL )
+        {
+        pfs_error (ENOENT);
+        return NULL;
+        }
+    if ( ! ( pe->flags & ROM_DIR ))
+        {
+        pfs_error (ENOTDIR);
+        return NULL;
+        }
+    struct rom_dir *dd = (struct rom_dir *) malloc (sizeof (struct rom_dir));
+    if ( dd == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    const uint32_t *pt = (const uint32_t *) ( rom->base + pe->offset );
+    dd->entry = &rom_v_dir;
+    dd->rom = rom;
+    dd->count = pt[0];
+    dd->pe = (const struct rom_entry *) ( pt + 1 );
+    dd->next = 0;
+    return (void *) dd;
+    }
+
+STATIC struct dirent *rom_readdir (void *dirp)
+    {
+    struct rom_dir *dd = (struct rom_dir *) dirp;
+    if ( dd->next >= dd->count ) return NULL;
+    const struct rom_entry *pe = &dd->pe[dd->next];
+    ++dd->next;
+    strncpy (dd->de.d_name, (const char *) ( dd->rom->base + pe->name ), NAME_MAX);
+    dd->de.d_type = ( pe->flags & ROM_DIR ) ? DT_DIR : DT_REG;
+    dd->size = pe->size;
+    return &dd->de;
+    }
+
+STATIC int rom_chmod (struct pfs_pfs *pfs, const char *pathname, mode_t mode)
+    {
+    return pfs_error (EROFS);
+    }
+
+struct pfs_pfs *pfs_rom_create (const void *image)
+    {
+    const struct rom_header *hdr = (const struct rom_header *) image;
+    if (( hdr == NULL ) || ( ((uintptr_t) image) & 3 ) || ( hdr->magic != ROM_MAGIC )
+        || ( hdr->version != ROM_VERSION ))
+        {
+        pfs_error (EINVAL);
+        return NULL;
+        }
+    struct rom_pfs *rom = (struct rom_pfs *) malloc (sizeof (struct rom_pfs));
+    if ( rom == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
+    rom->entry = &rom_v_pfs;
+    rom->base = (const uint8_t *) image;
+    rom->root.name = 0;
+    rom->root.flags = ROM_DIR;
+    rom->root.offset = hdr->root;
+    rom->root.size = 0;
+    return (struct pfs_pfs *) rom;
+    }
+
+// The image itself is left in place
+STATIC int rom_umount (struct pfs_pfs *pfs)
+    {
+    free (pfs);
+    return 0;
+    }
@@ -2,19 +2,23 @@
 // Copyright (c) 2023, Memotech-Bill
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <stdio.h>
+#include <string.h>
 #include <pico.h>
 #include <pico/stdlib.h>
 #include <pico/types.h>
 #include <hardware/rtc.h>
+#include <hardware/gpio.h>
 #include <../fatfs/ff.h>
 #include <../fatfs/diskio.h>
-
-#define USE_SPI     // Never managed to make SD card mode from Pico SDK work
-static uint32_t lba_base = 0;
+#include "ff_disk.h"
+#include <pfs_trace.h>
+#if PFS_MULTICORE
+#include <pico/sync.h>
+#endif
 
 // #define DEBUG
 #ifdef DEBUG
-#include <stdio.h>
 
 void hexline (BYTE *ptr, int n)
     {
@@ -47,25 +51,382 @@ void hexdump (BYTE *ptr, int n)
     }
 #endif
 
-#ifdef USE_SPI
+// Select the SD card interface: 4-bit SD bus (SD_SDIO=1) or SPI
+#if SD_SDIO
+#include "sd_sdio.h"
+#define sd_card_init(dk)                        sd_sdio_init ()
+#define sd_card_init_start(dk)                  sd_sdio_init_start ()
+#define sd_card_init_poll(dk)                   sd_sdio_init_poll ()
+#define sd_card_read(dk, lba, buff)             sd_sdio_read (lba, buff)
+#define sd_card_read_multi(dk, lba, buff, n)    sd_sdio_read_multi (lba, buff, n)
+#define sd_card_write(dk, lba, buff)            sd_sdio_write (lba, buff)
+#define sd_card_write_multi(dk, lba, buff, n)   sd_sdio_write_multi (lba, buff, n)
+#define sd_card_erase(dk, first, last)          sd_sdio_erase (first, last)
+#define sd_card_sectors(dk)                     0
+#define sd_card_id(dk)                          sd_sdio_card_id ()
+#define sd_card_term(dk)                        sd_sdio_term ()
+#if SD_DRIVES > 1
+#error Only one SD card is supported on the 4-bit SD bus
+#endif
+#else
 #include "sd_spi.h"
+#define sd_card_init(dk)                        sd_spi_init (dk->card)
+#define sd_card_init_start(dk)                  sd_spi_init_start (dk->card)
+#define sd_card_init_poll(dk)                   sd_spi_init_poll (dk->card)
+#define sd_card_read(dk, lba, buff)             sd_spi_read (dk->card, lba, buff)
+#define sd_card_read_multi(dk, lba, buff, n)    sd_spi_read_multi (dk->card, lba, buff, n)
+#define sd_card_write(dk, lba, buff)            sd_spi_write (dk->card, lba, buff)
+#define sd_card_write_multi(dk, lba, buff, n)   sd_spi_write_multi (dk->card, lba, buff, n)
+#define sd_card_erase(dk, first, last)          sd_spi_erase (dk->card, first, last)
+#define sd_card_sectors(dk)                     sd_spi_sectors (dk->card)
+#define sd_card_id(dk)                          sd_spi_card_id (dk->card)
+#define sd_card_term(dk)                        sd_spi_term (dk->card)
+#endif
 
-static int iStat = STA_NOINIT;
+// Number of sectors held in the LRU sector cache of each drive (0 to disable)
+#ifndef SD_CACHE_SECTORS
+#define SD_CACHE_SECTORS    8
+#endif
+// Set to 1 to hold single sector writes in the cache until CTRL_SYNC or eviction
+#ifndef SD_CACHE_WRITEBACK
+#define SD_CACHE_WRITEBACK  0
+#endif
+// Number of times a failed read command is repeated before giving up. Most
+// read failures are CRC errors from noise on the bus, which do not recur.
+#ifndef SD_READ_RETRIES
+#define SD_READ_RETRIES     2
+#endif
 
-DSTATUS disk_status (BYTE pdrv)
+#if SD_CACHE_SECTORS > 0
+// Sector cache. Only single sector transfers (FAT, directory and FatFs window
+// sectors) are cached. Multiple sector transfers are file data, and go direct
+// to the card so as not to flush the cache.
+typedef struct
     {
-#ifdef DEBUG
-    printf ("disk_status (%d) = 0x%02X\n", pdrv, iStat);
+    LBA_t       sector;                 // Card sector (including lba_base)
+    uint32_t    used;                   // Time of last use
+    bool        bValid;                 // Entry holds a copy of the sector
+    bool        bDirty;                 // Entry has been written but not yet saved to card
+    } CACHE_ENTRY;
 #endif
-    return iStat;
+
+// State of each physical drive (SD card)
+typedef struct
+    {
+#if SD_SDIO
+    bool        bAttached;              // Drive state has been initialised
+#else
+    SD_SPI *    card;                   // Card interface (NULL if not attached)
+#endif
+    LBA_t       lba_base;               // First sector of the FAT partition
+    int         iStat;                  // Disk status
+    int         iInit;                  // Card initialisation by ff_disk_init_start (INIT_...)
+    bool        bDetect;                // Card detect switch on cd_gpio
+    bool        cd_level;               // Pin level when a card is present
+    uint        cd_gpio;
+    uint32_t    card_id;                // Identity of the last card initialised (0 if not known)
+    LBA_t       card_lba;               // and its FAT partition, from the MBR
+#if PFS_MULTICORE
+    recursive_mutex_t   lock;           // Card access from FatFs, initialisation polls and card detect
+#endif
+#if SD_CACHE_SECTORS > 0
+    CACHE_ENTRY cache[SD_CACHE_SECTORS];
+    uint32_t    cache_data[SD_CACHE_SECTORS][128];  // Word aligned for DMA
+    uint32_t    cache_clock;
+#endif
+    FF_DISK_STATS   stats;              // Command counts and times
+    } SD_DISK;
+
+static SD_DISK sd_disk[SD_DRIVES];
+
+// Values of iInit
+#define INIT_NONE       0               // No initialisation started by ff_disk_init_start
+#define INIT_PENDING    1               // Card initialisation in progress
+#define INIT_DONE       2               // Complete, result in iStat for the next disk_initialize
+
+#if PFS_MULTICORE
+#define disk_lock(dk)       recursive_mutex_enter_blocking (&dk->lock)
+#define disk_unlock(dk)     recursive_mutex_exit (&dk->lock)
+#else
+#define disk_lock(dk)
+#define disk_unlock(dk)
+#endif
+
+// Record the time taken by a command
+static void disk_time (uint64_t *total, uint32_t *tmax, uint64_t t0)
+    {
+    uint32_t t = (uint32_t) ( time_us_64 () - t0 );
+    *total += t;
+    if ( t > *tmax ) *tmax = t;
     }
 
-DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+// Read sectors from the card, retrying on failure
+static bool disk_card_read (SD_DISK *dk, LBA_t sector, BYTE *buff, UINT count)
+    {
+    bool bOK = false;
+    for (int iTry = 0; ( ! bOK ) && ( iTry <= SD_READ_RETRIES ); ++iTry)
+        {
+        if ( iTry > 0 ) ++dk->stats.retries;
+        pfs_trace (PFS_TR_DISK_READ, count, sector);
+        uint64_t t0 = time_us_64 ();
+        bOK = ( count > 1 ) ? sd_card_read_multi (dk, sector, buff, count) : sd_card_read (dk, sector, buff);
+        ++dk->stats.reads;
+        disk_time (&dk->stats.read_us, &dk->stats.read_max_us, t0);
+        pfs_trace (PFS_TR_DISK_DONE, bOK, time_us_64 () - t0);
+        }
+    if ( bOK ) dk->stats.rd_sectors += count;
+    else ++dk->stats.errors;
+    return bOK;
+    }
+
+// Write sectors to the card
+static bool disk_card_write (SD_DISK *dk, LBA_t sector, const BYTE *buff, UINT count)
+    {
+    pfs_trace (PFS_TR_DISK_WRITE, count, sector);
+    uint64_t t0 = time_us_64 ();
+    bool bOK = ( count > 1 ) ? sd_card_write_multi (dk, sector, buff, count) : sd_card_write (dk, sector, buff);
+    ++dk->stats.writes;
+    disk_time (&dk->stats.write_us, &dk->stats.write_max_us, t0);
+    pfs_trace (PFS_TR_DISK_DONE, bOK, time_us_64 () - t0);
+    if ( bOK ) dk->stats.wr_sectors += count;
+    else ++dk->stats.errors;
+    return bOK;
+    }
+
+#if FF_USE_TRIM
+// Erase sectors first to last (inclusive) of the card
+static bool disk_card_erase (SD_DISK *dk, LBA_t first, LBA_t last)
+    {
+    pfs_trace (PFS_TR_DISK_TRIM, last - first + 1, first);
+    uint64_t t0 = time_us_64 ();
+    bool bOK = sd_card_erase (dk, first, last);
+    ++dk->stats.erases;
+    disk_time (&dk->stats.erase_us, &dk->stats.erase_max_us, t0);
+    pfs_trace (PFS_TR_DISK_DONE, bOK, time_us_64 () - t0);
+    if ( bOK ) dk->stats.er_sectors += last - first + 1;
+    else ++dk->stats.errors;
+    return bOK;
+    }
+#endif
+
+#if SD_CACHE_SECTORS > 0
+#define cache           dk->cache
+#define cache_data      dk->cache_data
+#define cache_clock     dk->cache_clock
+
+static int cache_find (SD_DISK *dk, LBA_t sector)
     {
+    for (int i = 0; i < SD_CACHE_SECTORS; ++i)
+        {
+        if (( cache[i].bValid ) && ( cache[i].sector == sector ))
+            {
+            cache[i].used = ++cache_clock;
+            return i;
+            }
+        }
+    return -1;
+    }
+
+static void cache_invalidate (SD_DISK *dk)
+    {
+    for (int i = 0; i < SD_CACHE_SECTORS; ++i)
+        {
+        cache[i].bValid = false;
+        cache[i].bDirty = false;
+        }
+    }
+
+// Write all dirty sectors to the card. The dirty entries are first sorted into
+// sector order at the start of the cache, so that runs of consecutive sectors
+// are contiguous in memory and can each be written with a single multiple block write.
+static bool cache_flush (SD_DISK *dk)
+    {
+    int nDirty = 0;
+    for (int i = 0; i < SD_CACHE_SECTORS; ++i)
+        {
+        int iMin = -1;
+        for (int j = i; j < SD_CACHE_SECTORS; ++j)
+            {
+            if (( cache[j].bDirty ) && (( iMin < 0 ) || ( cache[j].sector < cache[iMin].sector ))) iMin = j;
+            }
+        if ( iMin < 0 ) break;
+        if ( iMin != i )
+            {
+            CACHE_ENTRY ce = cache[i];
+            uint32_t data[128];
+            cache[i] = cache[iMin];
+            cache[iMin] = ce;
+            memcpy (data, cache_data[i], sizeof (data));
+            memcpy (cache_data[i], cache_data[iMin], sizeof (data));
+            memcpy (cache_data[iMin], data, sizeof (data));
+            }
+        ++nDirty;
+        }
+    bool bOK = true;
+    int iRun = 0;
+    while ( iRun < nDirty )
+        {
+        int nRun = 1;
+        while (( iRun + nRun < nDirty ) && ( cache[iRun + nRun].sector == cache[iRun].sector + nRun )) ++nRun;
+        const uint8_t *data = (const uint8_t *) cache_data[iRun];
+        if ( disk_card_write (dk, cache[iRun].sector, data, nRun) )
+            {
+            for (int i = iRun; i < iRun + nRun; ++i) cache[i].bDirty = false;
+            }
+        else
+            {
+            bOK = false;
+            }
+        iRun += nRun;
+        }
+    return bOK;
+    }
+
+// Find an entry to hold a new sector: an unused one, or else the least recently used.
+// Returns -1 if dirty sectors have to be saved and this fails.
+static int cache_slot (SD_DISK *dk)
+    {
+    int iSlot = 0;
+    for (int i = 0; i < SD_CACHE_SECTORS; ++i)
+        {
+        if ( ! cache[i].bValid )
+            {
+            iSlot = i;
+            break;
+            }
+        if ( cache[i].used < cache[iSlot].used ) iSlot = i;
+        }
+    if ( cache[iSlot].bDirty )
+        {
+        // Saving all dirty sectors together gives the best chance of coalescing them
+        LBA_t sector = cache[iSlot].sector;
+        if ( ! cache_flush (dk) ) return -1;
+        iSlot = cache_find (dk, sector);    // Flush may have moved the entry
+        }
+    cache[iSlot].bValid = false;
+    return iSlot;
+    }
+
+// Place a copy of a sector in the cache
+static bool cache_store (SD_DISK *dk, LBA_t sector, const BYTE *buff, bool bDirty)
+    {
+    int iSlot = cache_find (dk, sector);
+    if ( iSlot < 0 ) iSlot = cache_slot (dk);
+    if ( iSlot < 0 ) return false;
+    memcpy (cache_data[iSlot], buff, 512);
+    cache[iSlot].sector = sector;
+    cache[iSlot].used = ++cache_clock;
+    cache[iSlot].bValid = true;
+    cache[iSlot].bDirty = cache[iSlot].bDirty || bDirty;
+    return true;
+    }
+
+// Apply the cache to a multiple sector transfer: copy newer (dirty) cached data into a read
+// buffer, or discard cached copies which are overwritten
+static void cache_overlap (SD_DISK *dk, LBA_t sector, BYTE *buff, UINT count, bool bWrite)
+    {
+    for (int i = 0; i < SD_CACHE_SECTORS; ++i)
+        {
+        if (( cache[i].bValid ) && ( cache[i].sector >= sector ) && ( cache[i].sector < sector + count ))
+            {
+            if ( bWrite )
+                {
+                cache[i].bValid = false;
+                cache[i].bDirty = false;
+                }
+            else if ( cache[i].bDirty )
+                {
+                memcpy (buff + 512 * ( cache[i].sector - sector ), cache_data[i], 512);
+                }
+            }
+        }
+    }
+
+#undef cache
+#undef cache_data
+#undef cache_clock
+#endif
+
+bool ff_disk_attach (BYTE pdrv, SD_CARD *card)
+    {
+    if ( pdrv >= SD_DRIVES ) return false;
+    SD_DISK *dk = &sd_disk[pdrv];
+#if SD_SDIO
+    // There is only the one card interface
+    if ( dk->bAttached ) return true;
+    dk->bAttached = true;
+#else
+    if ( card == NULL )
+        {
+        if ( dk->card != NULL ) return true;
+        if ( pdrv == 0 ) card = sd_spi_default ();
+        if ( card == NULL ) return false;
+        }
+    dk->card = card;
+#endif
+    dk->lba_base = 0;
+    dk->iStat = STA_NOINIT;
+    dk->iInit = INIT_NONE;
+#if PFS_MULTICORE
+    if ( ! recursive_mutex_is_initialized (&dk->lock) ) recursive_mutex_init (&dk->lock);
+#endif
+    return true;
+    }
+
+// Drive state, or NULL if the drive has no card attached
+static SD_DISK *disk_get (BYTE pdrv)
+    {
+    if ( pdrv >= SD_DRIVES ) return NULL;
+    SD_DISK *dk = &sd_disk[pdrv];
+#if SD_SDIO
+    if ( ! dk->bAttached ) return NULL;
+#else
+    if ( dk->card == NULL ) return NULL;
+#endif
+    return dk;
+    }
+
+// Check the card detect switch. When the card has been removed the drive is
+// reset and reports STA_NODISK. Once a card is inserted again, FatFs sees
+// STA_NOINIT on its next access, and remounts the volume.
+static void disk_detect (SD_DISK *dk)
+    {
+    if ( ! dk->bDetect ) return;
+    if ( gpio_get (dk->cd_gpio) == dk->cd_level )
+        {
+        dk->iStat &= ~ STA_NODISK;
+        return;
+        }
+    if ( dk->iStat & STA_NODISK ) return;
+    pfs_trace (PFS_TR_SD_REMOVE, 0, 0);
+#if SD_CACHE_SECTORS > 0
+    // Any sectors not yet written are lost with the card
+    cache_invalidate (dk);
+#endif
+    sd_card_term (dk);
+    dk->iInit = INIT_NONE;
+    dk->iStat = STA_NOINIT | STA_NODISK;
+    }
+
+DSTATUS disk_status (BYTE pdrv)
+    {
+    SD_DISK *dk = disk_get (pdrv);
+    if ( dk == NULL ) return STA_NOINIT;
+    if ( dk->bDetect )
+        {
+        disk_lock (dk);
+        disk_detect (dk);
+        disk_unlock (dk);
+        }
 #ifdef DEBUG
-    printf ("disk_read (%d, %p, 0x%04X, %d)\n", pdrv, buff, sector, count);
+    printf ("disk_status (%d) = 0x%02X\n", pdrv, dk->iStat);
 #endif
-    if ( iStat & STA_NOINIT )
+    return dk->iStat;
+    }
+
+static DRESULT disk_read_locked (SD_DISK *dk, BYTE* buff, LBA_t sector, UINT count)
+    {
+    if ( dk->iStat & STA_NOINIT )
         {
 #ifdef DEBUG
         printf ("Media not ready\n");
@@ -79,36 +440,45 @@ DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
 #endif
         return RES_PARERR;
         }
-    sector += lba_base;
-    for (int i = 0; i < count; ++i)
+#if FF_LBA64
+    // SD card commands only have a 32-bit block address
+    if ( sector + dk->lba_base + count > 0x100000000ULL ) return RES_PARERR;
+#endif
+    sector += dk->lba_base;
+    if ( count > 1 )
+        {
+        // Read a contiguous run with a single CMD18
+        if ( ! disk_card_read (dk, sector, buff, count) ) return RES_ERROR;
+#if SD_CACHE_SECTORS > 0
+        cache_overlap (dk, sector, buff, count, false);
+#endif
+        return RES_OK;
+        }
+#if SD_CACHE_SECTORS > 0
+    int iSlot = cache_find (dk, sector);
+    if ( iSlot >= 0 )
         {
-#ifdef DEBUG
-        printf ("Read sector 0x%04X\n", sector);
+        memcpy (buff, dk->cache_data[iSlot], 512);
+        ++dk->stats.cache_hits;
+        pfs_trace (PFS_TR_DISK_HIT, 1, sector);
+        return RES_OK;
+        }
 #endif
-        if ( ! sd_spi_read (sector, buff) )
-            {
-#ifdef DEBUG
-            printf ("Read error\n");
+    if ( ! disk_card_read (dk, sector, buff, 1) ) return RES_ERROR;
+#if SD_CACHE_SECTORS > 0
+    cache_store (dk, sector, buff, false);
 #endif
-            return RES_ERROR;
-            }
 #ifdef DEBUG
-        printf ("Sector 0x%04X: ");
-        hexline (buff, 16);
-        // hexdump (buff, 512);
+    printf ("Sector 0x%04X: ", sector);
+    hexline (buff, 16);
+    // hexdump (buff, 512);
 #endif
-        ++sector;
-        buff += 512;
-        }
     return RES_OK;
     }
 
-DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+static DRESULT disk_write_locked (SD_DISK *dk, const BYTE* buff, LBA_t sector, UINT count)
     {
-#ifdef DEBUG
-    printf ("disk_write (%d, %p, 0x%04X, %d)\n", pdrv, buff, sector, count);
-#endif
-    if ( iStat & STA_NOINIT )
+    if ( dk->iStat & STA_NOINIT )
         {
 #ifdef DEBUG
         printf ("Media not ready\n");
@@ -122,209 +492,392 @@ DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
 #endif
         return RES_PARERR;
         }
-    sector += lba_base;
-    for (int i = 0; i < count; ++i)
+#if FF_LBA64
+    // SD card commands only have a 32-bit block address
+    if ( sector + dk->lba_base + count > 0x100000000ULL ) return RES_PARERR;
+#endif
+    sector += dk->lba_base;
+    if ( count > 1 )
+        {
+        // Stream a contiguous run with a single CMD25
+#if SD_CACHE_SECTORS > 0
+        cache_overlap (dk, sector, (BYTE *) buff, count, true);
+#endif
+        if ( ! disk_card_write (dk, sector, buff, count) ) return RES_ERROR;
+        return RES_OK;
+        }
+#if SD_CACHE_SECTORS > 0 && SD_CACHE_WRITEBACK
+    if ( ! cache_store (dk, sector, buff, true) ) return RES_ERROR;
+#else
+    if ( ! disk_card_write (dk, sector, buff, 1) )
         {
+#if SD_CACHE_SECTORS > 0
+        cache_overlap (dk, sector, (BYTE *) buff, 1, true);
+#endif
+        return RES_ERROR;
+        }
+#if SD_CACHE_SECTORS > 0
+    cache_store (dk, sector, buff, false);
+#endif
+#endif
+    return RES_OK;
+    }
+
+DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+    {
 #ifdef DEBUG
-        printf ("Write sector 0x%04X\n", sector);
+    printf ("disk_read (%d, %p, 0x%04X, %d)\n", pdrv, buff, sector, count);
 #endif
-        if ( ! sd_spi_write (sector, buff) )
-            {
+    SD_DISK *dk = disk_get (pdrv);
+    if ( dk == NULL ) return RES_NOTRDY;
+    disk_lock (dk);
+    DRESULT res = disk_read_locked (dk, buff, sector, count);
+    disk_unlock (dk);
+    return res;
+    }
+
+DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+    {
 #ifdef DEBUG
-            printf ("Write error\n");
+    printf ("disk_write (%d, %p, 0x%04X, %d)\n", pdrv, buff, sector, count);
+#endif
+    SD_DISK *dk = disk_get (pdrv);
+    if ( dk == NULL ) return RES_NOTRDY;
+    disk_lock (dk);
+    DRESULT res = disk_write_locked (dk, buff, sector, count);
+    disk_unlock (dk);
+    return res;
+    }
+
+// Partition types which may hold a FAT or exFAT volume
+static bool fat_partition (int iType)
+    {
+    switch (iType)
+        {
+        case 0x01:                      // FAT12
+        case 0x04:                      // FAT16 (< 32MB)
+        case 0x06:                      // FAT16
+        case 0x0E:                      // FAT16 (LBA)
+        case 0x0B:                      // FAT32
+        case 0x0C:                      // FAT32 (LBA)
+            return true;
+#if FF_FS_EXFAT
+        case 0x07:                      // exFAT (SDXC cards are formatted this way)
+            return true;
 #endif
-            return RES_ERROR;
-            }
-        ++sector;
-        buff += 512;
         }
-    return RES_OK;
+    return false;
     }
 
-DSTATUS disk_initialize (BYTE pdrv)
+#if ! FF_MULTI_PARTITION
+// Test for a FAT boot sector (jump instruction and signature)
+static bool disk_boot_sector (const uint8_t *bs)
     {
-#ifdef DEBUG
-    printf ("disk_initialize (%d)\n", pdrv);
+    return (( bs[0] == 0xEB ) || ( bs[0] == 0xE9 ) || ( bs[0] == 0xE8 )) && ( bs[0x1FE] == 0x55 ) && ( bs[0x1FF] == 0xAA );
+    }
 #endif
-    if ( sd_spi_init () )
+
+// Set up the drive once the card has been initialised (bOK true) or has failed
+static void disk_init_card (SD_DISK *dk, bool bOK)
+    {
+    if ( ! bOK )
         {
-        iStat = 0;
-        uint8_t mbr[512];
+        dk->iStat = STA_NOINIT;
+        return;
+        }
+    dk->iStat = 0;
+#if ! FF_MULTI_PARTITION
+    // With FF_MULTI_PARTITION, FatFs selects the partition itself
+    uint8_t mbr[512];
+    uint32_t id = sd_card_id (dk);
+    if (( id != 0 ) && ( id == dk->card_id ))
+        {
+        // The same card again: check that its boot sector is still where it
+        // was rather than read the MBR. With the sector cache this read also
+        // serves FatFs when it mounts the volume.
+        dk->lba_base = dk->card_lba;
+        if (( disk_read_locked (dk, mbr, 0u, 1) == RES_OK ) && disk_boot_sector (mbr)) return;
+        dk->lba_base = 0;
+        }
+    dk->card_id = 0;
 #ifdef DEBUG
-        printf ("Reading first sector\n");
+    printf ("Reading first sector\n");
 #endif
-        lba_base = 0;
-        if ( disk_read (0, mbr, 0u, 1) == RES_OK )
+    if ( disk_read_locked (dk, mbr, 0u, 1) == RES_OK )
+        {
+        if (( mbr[0x1FE] == 0x55 ) && ( mbr[0x1FF] == 0xAA ))
             {
-            if (( mbr[0x1FE] == 0x55 ) && ( mbr[0x1FF] == 0xAA ))
-                {
 #ifdef DEBUG
-                printf ("Found partition table\n");
+            printf ("Found partition table\n");
 #endif
-                for (int iPar = 0; iPar < 4; ++iPar)
-                    {
-                    int iPTA = 0x1BE + ( iPar << 4 );
-                    int iType = mbr[iPTA + 0x04];
+            for (int iPar = 0; iPar < 4; ++iPar)
+                {
+                int iPTA = 0x1BE + ( iPar << 4 );
+                int iType = mbr[iPTA + 0x04];
 #ifdef DEBUG
-                    printf ("Partition %d type = 0x%02X\n", iPar, iType);
+                printf ("Partition %d type = 0x%02X\n", iPar, iType);
 #endif
-                    if (( iType == 0x0C ) && ( lba_base == 0 ))
-                        {
-                        lba_base = ( mbr[iPTA + 0x0B] << 24 ) | ( mbr[iPTA + 0x0A] << 16 )
-                            | ( mbr[iPTA + 0x09] << 8 ) | mbr[iPTA + 0x08];
+                if ( fat_partition (iType) && ( dk->lba_base == 0 ))
+                    {
+                    dk->lba_base = ( mbr[iPTA + 0x0B] << 24 ) | ( mbr[iPTA + 0x0A] << 16 )
+                        | ( mbr[iPTA + 0x09] << 8 ) | mbr[iPTA + 0x08];
 #ifdef DEBUG
-                        printf ("   Mounting this partition: LBA = 0x%X", lba_base);
+                    printf ("   Mounting this partition: LBA = 0x%X", dk->lba_base);
 #endif
-                        }
                     }
                 }
-#ifdef DEBUG
-            else
-                {
-                printf ("No partition table - Assuming super-floppy\n");
-                }
-#endif
             }
+#ifdef DEBUG
         else
             {
-#ifdef DEBUG
-            printf ("Error reading first sector\n");
-#endif
-            iStat = STA_NOINIT;
+            printf ("No partition table - Assuming super-floppy\n");
             }
+#endif
         }
-    else iStat = STA_NOINIT;
+    else
+        {
 #ifdef DEBUG
-    printf ("disk_initialize: iStat = 0x%02X\n", iStat);
+        printf ("Error reading first sector\n");
+#endif
+        dk->iStat = STA_NOINIT;
+        }
+    if ( dk->iStat == 0 )
+        {
+        dk->card_id = id;
+        dk->card_lba = dk->lba_base;
+        }
 #endif
-    return iStat;
     }
 
-#else
-#include "pico/sd_card.h"
-
-// Work around stuck dma channel 11 rem 00000002 1 @ 12
-#define MAX_BLOCKS  1
+// Clear the drive state before initialising the card
+static void disk_init_reset (SD_DISK *dk)
+    {
+#if SD_CACHE_SECTORS > 0
+    cache_invalidate (dk);
+#endif
+    dk->lba_base = 0;
+    dk->iStat = STA_NOINIT;
+    }
 
-static int iStat = SD_ERR_STUCK;
+// Continue an initialisation begun by ff_disk_init_start. Returns 1 when the
+// drive is ready, 0 if still initialising, or -1 on failure.
+static int disk_init_poll (SD_DISK *dk)
+    {
+    if ( dk->iInit == INIT_PENDING )
+        {
+        int r = sd_card_init_poll (dk);
+        if ( r == 0 ) return 0;
+        disk_init_card (dk, r > 0);
+        dk->iInit = INIT_DONE;
+        }
+    return ( dk->iStat & STA_NOINIT ) ? -1 : 1;
+    }
 
-DSTATUS disk_status (BYTE pdrv)
+bool ff_disk_init_start (BYTE pdrv)
     {
-    if ( iStat == SD_OK )
+    if ( ! ff_disk_attach (pdrv, NULL) ) return false;
+    SD_DISK *dk = disk_get (pdrv);
+    if ( dk == NULL ) return false;
+    disk_lock (dk);
+    disk_detect (dk);
+    if ( dk->iStat & STA_NODISK )
         {
-#ifdef DEBUG
-        printf ("disk_status: OK\n");
-#endif
-        return 0;
+        disk_unlock (dk);
+        return false;
         }
-#ifdef DEBUG
-    printf ("disk_status: Not initialised\n");
-#endif
-    return STA_NOINIT;
+    disk_init_reset (dk);
+    bool bOK = sd_card_init_start (dk);
+    dk->iInit = bOK ? INIT_PENDING : INIT_NONE;
+    disk_unlock (dk);
+    return bOK;
+    }
+
+int ff_disk_init_poll (BYTE pdrv)
+    {
+    SD_DISK *dk = disk_get (pdrv);
+    if ( dk == NULL ) return -1;
+    disk_lock (dk);
+    disk_detect (dk);
+    int r = disk_init_poll (dk);
+    disk_unlock (dk);
+    return r;
+    }
+
+bool ff_disk_card_detect (BYTE pdrv, uint gpio, bool bLevel)
+    {
+    if ( ! ff_disk_attach (pdrv, NULL) ) return false;
+    SD_DISK *dk = disk_get (pdrv);
+    if ( dk == NULL ) return false;
+    gpio_init (gpio);
+    gpio_set_dir (gpio, GPIO_IN);
+    // Pull the pin to the level of an empty socket
+    if ( bLevel ) gpio_pull_down (gpio);
+    else gpio_pull_up (gpio);
+    disk_lock (dk);
+    dk->cd_gpio = gpio;
+    dk->cd_level = bLevel;
+    dk->bDetect = true;
+    disk_detect (dk);
+    disk_unlock (dk);
+    return true;
+    }
+
+bool ff_disk_present (BYTE pdrv)
+    {
+    SD_DISK *dk = disk_get (pdrv);
+    if ( dk == NULL ) return false;
+    return ( ( disk_status (pdrv) & STA_NODISK ) == 0 );
     }
 
 DSTATUS disk_initialize (BYTE pdrv)
     {
-#ifdef SD_4PINS
-#ifdef DEBUG
-    printf ("disk_initialize: 4 pins\n");
-    sleep_ms(500);
-#endif
-    iStat = sd_init_4pins();
-#else
 #ifdef DEBUG
-    printf ("disk_initialize: 1 pin\n");
-    sleep_ms(500);
-#endif
-    iStat = sd_init_1pin();
-#endif
-    setup_default_uart();
-#ifdef DEBUG
-    printf ("disk_initialise: iStat = %d\n", iStat);
-#endif
-    uint8_t mbr[512];
-#ifdef DEBUG
-    printf ("Reading first sector\n");
+    printf ("disk_initialize (%d)\n", pdrv);
 #endif
-    int iRes = sd_readblocks_sync((uint32_t *)mbr, 0u, 1u);
-    if (( mbr[510] == 0x55 ) && ( mbr[511] == 0xAA ))
+    SD_DISK *dk = disk_get (pdrv);
+    if ( dk == NULL ) return STA_NOINIT;
+    disk_lock (dk);
+    disk_detect (dk);
+    // Finish any initialisation begun by ff_disk_init_start, and use its result once
+    while ( disk_init_poll (dk) == 0 );
+    if ( dk->iStat & STA_NODISK )
         {
-        lba_base = ( mbr[457] << 24 ) | ( mbr[456] << 16 ) | ( mbr[455] << 8 ) | mbr[454];
+        // No card to initialise
+        }
+    else if ( dk->iInit == INIT_DONE )
+        {
+        dk->iInit = INIT_NONE;
+        }
+    else
+        {
+        disk_init_reset (dk);
+        disk_init_card (dk, sd_card_init (dk));
+        }
 #ifdef DEBUG
-        printf ("Found partition table: First partition at %d\n", lba_base);
+    printf ("disk_initialize: iStat = 0x%02X\n", dk->iStat);
 #endif
-        }
-    return disk_status (pdrv);
+    DSTATUS stat = dk->iStat;
+    disk_unlock (dk);
+    return stat;
     }
 
-DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+
+DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff)
     {
-#ifdef DEBUG
-    printf ("disk_read: sector = %d, count = %d\n", sector, count);
-#endif
-    int iRes = SD_OK;
-    sector += lba_base;
-    while (( count > 0 ) && ( iRes == SD_OK ))
+    SD_DISK *dk = disk_get (pdrv);
+    if ( dk == NULL ) return RES_NOTRDY;
+    if ( cmd == CTRL_SYNC )
         {
-        sleep_ms(1);
-        UINT nBlk = count;
-        if ( nBlk > MAX_BLOCKS ) nBlk = MAX_BLOCKS;
-        iRes = sd_readblocks_sync((uint32_t *)buff, (uint32_t) sector, nBlk);
-#ifdef DEBUG
-        printf ("Sector %d:\n", sector);
-        hexdump (buff, 512);
-        // hexline (buff, 16);
+#if SD_CACHE_SECTORS > 0
+        if ( dk->iStat & STA_NOINIT ) return RES_NOTRDY;
+        disk_lock (dk);
+        bool bOK = cache_flush (dk);
+        disk_unlock (dk);
+        if ( ! bOK ) return RES_ERROR;
 #endif
-        buff += nBlk * SD_SECTOR_SIZE;
-        sector += nBlk;
-        count -= nBlk;
+        return RES_OK;
         }
-    if ( iRes == SD_OK )
+#if FF_USE_TRIM
+    // Sectors no longer in use, from clusters freed by FATFS or a volume being formatted
+    if ( cmd == CTRL_TRIM )
         {
-#ifdef DEBUG
-        printf ("Status OK\n");
+        if ( dk->iStat & STA_NOINIT ) return RES_NOTRDY;
+        LBA_t first = ((LBA_t *) buff)[0];
+        LBA_t last = ((LBA_t *) buff)[1];
+        if ( last < first ) return RES_PARERR;
+#if FF_LBA64
+        if ( last + dk->lba_base >= 0x100000000ULL ) return RES_PARERR;
+#endif
+        first += dk->lba_base;
+        last += dk->lba_base;
+        disk_lock (dk);
+#if SD_CACHE_SECTORS > 0
+        // Cached copies, even unsaved ones, are of data which has been discarded
+        cache_overlap (dk, first, NULL, last - first + 1, true);
+#endif
+        bool bOK = disk_card_erase (dk, first, last);
+        disk_unlock (dk);
+        if ( ! bOK ) return RES_ERROR;
+        return RES_OK;
+        }
 #endif
+#if FF_USE_MKFS
+    // Used by f_mkfs
+    if ( cmd == GET_SECTOR_COUNT )
+        {
+        if ( dk->iStat & STA_NOINIT ) return RES_NOTRDY;
+        disk_lock (dk);
+        LBA_t nsec = sd_card_sectors (dk);
+        disk_unlock (dk);
+        if ( nsec == 0 ) return RES_ERROR;
+        *((LBA_t *) buff) = nsec;
+        return RES_OK;
+        }
+    if ( cmd == GET_BLOCK_SIZE )
+        {
+        // Erase block size not known
+        *((DWORD *) buff) = 1;
         return RES_OK;
         }
-#ifdef DEBUG
-    printf ("Status = %d\n", iRes);
 #endif
-    return RES_ERROR;
+    return RES_PARERR;
     }
 
-DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+bool ff_disk_stats (BYTE pdrv, FF_DISK_STATS *stats, bool bReset)
     {
-#ifdef DEBUG
-    printf ("disk_write: sector = %d, count = %d\n", sector, count);
-#endif
-    sector += lba_base;
-    int iRes = sd_writeblocks_async((const uint32_t *)buff, (uint32_t) sector, count);
-    if ( iRes == SD_OK )
+    SD_DISK *dk = disk_get (pdrv);
+    if ( dk == NULL ) return false;
+    disk_lock (dk);
+    if ( stats != NULL )
         {
-#ifdef DEBUG
-        printf ("Waiting for completion\n");
-#endif
-        while ( ! sd_write_complete (&iRes) )
-            {
-            tight_loop_contents();
-            }
-#ifdef DEBUG
-        printf ("Completed\n");
+        *stats = dk->stats;
+#if ! SD_SDIO
+        SD_BUSY_STATS busy;
+        sd_spi_busy_stats (dk->card, &busy, false);
+        stats->crc_errors = busy.crc_errors;
+        stats->busy_count = busy.count;
+        stats->busy_max_us = busy.max_us;
+        stats->busy_us = busy.total_us;
 #endif
-        return RES_OK;
         }
-#ifdef DEBUG
-    printf ("Status = %d\n", iRes);
+    if ( bReset )
+        {
+        memset (&dk->stats, 0, sizeof (dk->stats));
+#if ! SD_SDIO
+        sd_spi_busy_stats (dk->card, NULL, true);
 #endif
-    return RES_ERROR;
+        }
+    disk_unlock (dk);
+    return true;
     }
 
-#endif
-
-DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff)
+int ff_disk_stats_print (void *ctx, char *buf, int len)
     {
-    if ( cmd == CTRL_SYNC ) return RES_OK;
-    return RES_PARERR;
+    int n = 0;
+    if (( buf == NULL ) || ( len <= 0 )) return 0;
+    buf[0] = '\0';
+    for (BYTE pdrv = 0; pdrv < SD_DRIVES; ++pdrv)
+        {
+        FF_DISK_STATS st;
+        if ( ! ff_disk_stats (pdrv, &st, false) ) continue;
+        int nf = snprintf (buf + n, len - n,
+            "sd%d read %lu cmds %lu sectors %lu cached %llu us %lu us max\n"
+            "sd%d write %lu cmds %lu sectors %llu us %lu us max\n"
+            "sd%d erase %lu cmds %lu sectors %llu us %lu us max\n"
+            "sd%d errors %lu retries %lu crc %lu busy %lu %llu us %lu us max\n",
+            pdrv, (unsigned long) st.reads, (unsigned long) st.rd_sectors, (unsigned long) st.cache_hits,
+            (unsigned long long) st.read_us, (unsigned long) st.read_max_us,
+            pdrv, (unsigned long) st.writes, (unsigned long) st.wr_sectors,
+            (unsigned long long) st.write_us, (unsigned long) st.write_max_us,
+            pdrv, (unsigned long) st.erases, (unsigned long) st.er_sectors,
+            (unsigned long long) st.erase_us, (unsigned long) st.erase_max_us,
+            pdrv, (unsigned long) st.errors, (unsigned long) st.retries, (unsigned long) st.crc_errors,
+            (unsigned long) st.busy_count, (unsigned long long) st.busy_us, (unsigned long) st.busy_max_us);
+        if ( nf < 0 ) break;
+        n += nf;
+        if ( n >= len - 1 ) return len - 1;
+        }
+    return n;
     }
 
 DWORD get_fattime (void)
@@ -0,0 +1,88 @@
+/* ff_disk.h - SD card drives used by FatFS */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef FF_DISK_H
+#define FF_DISK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pico/types.h>
+#include <ff.h>
+
+// Number of SD cards (FatFs physical drives)
+#ifndef SD_DRIVES
+#define SD_DRIVES   1
+#endif
+
+#if SD_SDIO
+typedef void SD_CARD;
+#else
+#include "sd_spi.h"
+typedef SD_SPI SD_CARD;
+#endif
+
+// Attach a card as physical drive pdrv, before creating any volume on it.
+// With card NULL, drive 0 is given the board's own SD card if it does not
+// already have one. Returns false if there is no such drive or card.
+bool ff_disk_attach (BYTE pdrv, SD_CARD *card);
+
+// Begin initialising the card of drive pdrv (attaching the board's card to
+// drive 0 if necessary) without waiting for it to become ready, which can
+// take several hundred milliseconds. Call ff_disk_init_poll from the main
+// loop until it returns non-zero, or leave the first access to the volume
+// (for example after pfs_fat_create_lazy) to wait for it. Must be called
+// before the volume is first used. Returns false if there is no card.
+bool ff_disk_init_start (BYTE pdrv);
+
+// Continue the initialisation begun by ff_disk_init_start. Returns 1 once
+// the drive is ready, 0 while the card is still initialising, or -1 if the
+// initialisation failed.
+int ff_disk_init_poll (BYTE pdrv);
+
+// Use GPIO pin gpio as the card detect switch of drive pdrv, reading bLevel
+// when a card is present. While the socket is empty the drive reports
+// STA_NODISK. After a card is inserted, the next access to the volume
+// initialises the card and FatFs mounts the volume again. A card seen
+// before is recognised by its serial number, and its partition table is
+// not read again. Returns false if there is no such drive.
+bool ff_disk_card_detect (BYTE pdrv, uint gpio, bool bLevel);
+
+// Returns true if drive pdrv has a card, as far as is known (always true
+// for an attached card without a card detect switch)
+bool ff_disk_present (BYTE pdrv);
+
+// Counts and times (microseconds) of the commands sent to a card
+typedef struct
+    {
+    uint32_t    reads;                  // Read commands (single or multiple sector)
+    uint32_t    writes;                 // Write commands (single or multiple sector)
+    uint32_t    rd_sectors;             // Sectors read from the card
+    uint32_t    wr_sectors;             // Sectors written to the card
+    uint32_t    cache_hits;             // Sector reads satisfied from the sector cache
+    uint32_t    retries;                // Read commands repeated after a failure
+    uint32_t    errors;                 // Transfers which failed (after any retries)
+    uint32_t    read_max_us;            // Longest read command
+    uint32_t    write_max_us;           // Longest write command
+    uint64_t    read_us;                // Total time in read commands
+    uint64_t    write_us;               // Total time in write commands
+    uint32_t    crc_errors;             // Blocks with a CRC mismatch (SPI only)
+    uint32_t    busy_count;             // Busy waits after writing (SPI only)
+    uint32_t    busy_max_us;            // Longest busy wait (SPI only)
+    uint64_t    busy_us;                // Total time busy (SPI only)
+    uint32_t    erases;                 // Erase commands, for sectors trimmed by FATFS (FF_USE_TRIM)
+    uint32_t    er_sectors;             // Sectors erased
+    uint32_t    erase_max_us;           // Longest erase command
+    uint64_t    erase_us;               // Total time in erase commands
+    } FF_DISK_STATS;
+
+// Get the statistics of physical drive pdrv, optionally resetting them.
+// Returns false if there is no such drive.
+bool ff_disk_stats (BYTE pdrv, FF_DISK_STATS *stats, bool bReset);
+
+// Write a text report of the statistics of all drives to buf (len bytes,
+// including terminator), returning its length. The ctx argument is unused,
+// this may be given to pfs_dev_stat_source.
+int ff_disk_stats_print (void *ctx, char *buf, int len);
+
+#endif
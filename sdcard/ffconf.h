@@ -30,15 +30,17 @@
 /  f_findnext(). (0:Disable, 1:Enable 2:Enable with matching altname[] too) */
 
 
+#ifndef FF_USE_MKFS
 #define FF_USE_MKFS		0
+#endif
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FASTSEEK	0
+#define FF_USE_FASTSEEK	1
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_EXPAND	0
+#define FF_USE_EXPAND	1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
@@ -166,7 +168,9 @@
 / Drive/Volume Configurations
 /---------------------------------------------------------------------------*/
 
+#ifndef FF_VOLUMES
 #define FF_VOLUMES		1
+#endif
 #define FF_STR_VOLUME_ID	0
 #define FF_VOLUME_STRS		""
 /* FF_VOLUMES = Number of volumes (logical drives) to be used. (1-10) */
@@ -182,7 +186,9 @@
 */
 
 
+#ifndef FF_MULTI_PARTITION
 #define FF_MULTI_PARTITION	0
+#endif
 /* This option switches support for multiple volumes on the physical drive.
 /  By default (0), each logical drive number is bound to the same physical drive
 /  number and only an FAT volume found on the physical drive will be mounted.
@@ -201,7 +207,9 @@
 /  GET_SECTOR_SIZE command. */
 
 
+#ifndef FF_LBA64
 #define FF_LBA64		0
+#endif
 /* This option switches support for 64-bit LBA. (0:Disable or 1:Enable)
 /  To enable the 64-bit LBA, also exFAT needs to be enabled. (FF_FS_EXFAT == 1) */
 
@@ -211,7 +219,9 @@
 /  f_fdisk function. 0x100000000 max. This option has no effect when FF_LBA64 == 0. */
 
 
+#ifndef FF_USE_TRIM
 #define FF_USE_TRIM		0
+#endif
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -229,7 +239,9 @@
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
 
-#define FF_FS_EXFAT		0
+#ifndef FF_FS_EXFAT
+#define FF_FS_EXFAT		1
+#endif
 /* This option switches support for exFAT filesystem. (0:Disable or 1:Enable)
 /  To enable exFAT, also LFN needs to be enabled. (FF_USE_LFN >= 1)
 /  Note that enabling exFAT discards ANSI C (C89) compatibility. */
@@ -273,10 +285,14 @@
 /      lock control is independent of re-entrancy. */
 
 
-/* #include <somertos.h>	// O/S definitions */
+#ifndef FF_FS_REENTRANT
 #define FF_FS_REENTRANT	0
+#endif
 #define FF_FS_TIMEOUT	1000
-#define FF_SYNC_t		HANDLE
+#if FF_FS_REENTRANT
+#include <pico/sync.h>	// Pico SDK mutexes, FF_FS_TIMEOUT is in milliseconds
+#endif
+#define FF_SYNC_t		mutex_t *
 /* The option FF_FS_REENTRANT switches the re-entrancy (thread safe) of the FatFs
 /  module itself. Note that regardless of this option, file access to different
 /  volume is always re-entrant and volume control functions, f_mount(), f_mkfs()
@@ -3,20 +3,38 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/syslimits.h>
 #include <fcntl.h>
 #include <ff.h>             // Include this before PFS header files to avoid conflicting DIR definitions
+#include <diskio.h>
 #include <pfs_private.h>
+#include <pname.h>
+#include <../device/ioctl.h>
+#include "ff_disk.h"
 
 #ifndef STATIC
 #define STATIC  static
 #endif
 
+#ifndef FAT_CLMT_INIT
+#define FAT_CLMT_INIT   32      // Initial size (in DWORDs) of a fast seek cluster link map table
+#endif
+
+// With more than one volume, path names passed to FatFs start with the drive number
+#if FF_VOLUMES > 1
+#define FAT_PATH_MAX    ( PFS_PATH_MAX + 2 )
+#else
+#define FAT_PATH_MAX    1
+#endif
+
 STATIC struct pfs_file *fat_open (struct pfs_pfs *pfs, const char *fn, int oflag);
 STATIC int fat_close (struct pfs_file *pfs_fd);
 STATIC int fat_read (struct pfs_file *pfs_fd, char *buffer, int length);
@@ -24,6 +42,13 @@ STATIC int fat_write (struct pfs_file *pfs_fd, char *buffer, int length);
 STATIC long fat_lseek (struct pfs_file *pfs_fd, long pos, int whence);
 STATIC int fat_fstat (struct pfs_file *pfs_fd, struct stat *buf);
 STATIC int fat_isatty (struct pfs_file *fd);
+STATIC int fat_ioctl (struct pfs_file *pfs_fd, unsigned long request, void *argp);
+STATIC int fat_allocate (struct pfs_file *pfs_fd, off_t offset, off_t len);
+STATIC long long fat_lseek64 (struct pfs_file *pfs_fd, long long pos, int whence);
+STATIC int fat_writev (struct pfs_file *pfs_fd, const struct iovec *iov, int iovcnt);
+STATIC int fat_pread (struct pfs_file *pfs_fd, char *buffer, int length, off_t offset);
+STATIC int fat_pwrite (struct pfs_file *pfs_fd, const char *buffer, int length, off_t offset);
+STATIC int fat_fsync (struct pfs_file *pfs_fd);
 STATIC int fat_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf);
 STATIC int fat_rename (struct pfs_pfs *pfs, const char *old, const char *new);
 STATIC int fat_delete (struct pfs_pfs *pfs, const char *name);
@@ -33,6 +58,9 @@ STATIC void *fat_opendir (struct pfs_pfs *pfs, const char *name);
 STATIC struct dirent *fat_readdir (void *dirp);
 STATIC int fat_closedir (void *dirp);
 STATIC int fat_chmod (struct pfs_pfs *pfs, const char *pathname, mode_t mode);
+STATIC int fat_umount (struct pfs_pfs *pfs);
+STATIC int fat_statvfs (struct pfs_pfs *pfs, struct statvfs *buf);
+STATIC uint32_t fat_cache_id (struct pfs_pfs *pfs);
 
 STATIC const struct pfs_v_pfs fat_v_pfs =
     {
@@ -43,7 +71,10 @@ STATIC const struct pfs_v_pfs fat_v_pfs =
     fat_mkdir,
     fat_rmdir,
     fat_opendir,
-    fat_chmod
+    fat_chmod,
+    fat_umount,
+    fat_statvfs,
+    fat_cache_id
     };
     
 STATIC struct pfs_v_file fat_v_file =
@@ -54,7 +85,14 @@ STATIC struct pfs_v_file fat_v_file =
     fat_lseek,
     fat_fstat,
     NULL,           // isatty
-    NULL            // ioctl
+    fat_ioctl,
+    fat_allocate,
+    fat_lseek64,
+    NULL,           // readv
+    fat_writev,
+    fat_pread,
+    fat_pwrite,
+    fat_fsync
     };
 
 STATIC struct pfs_v_dir fat_v_dir =
@@ -67,14 +105,28 @@ struct fat_pfs
     {
     const struct pfs_v_pfs *    entry;
     FATFS                       vol;
+    BYTE                        ldrv;       // FatFs logical drive number
     };
 
+// Volumes mounted on each logical drive
+STATIC struct fat_pfs *fat_ldrv[FF_VOLUMES];
+
+#if FF_MULTI_PARTITION
+// Physical drive and partition of each logical drive, filled in by pfs_fat_create_drive
+PARTITION VolToPart[FF_VOLUMES];
+#endif
+
 struct fat_file
     {
     const struct pfs_v_file *   entry;
     struct fat_pfs *            fat;
     const char *                pn;
     FIL                         fil;
+    struct pfs_sync             sync;       // When to sync while writing
+#if FF_USE_FASTSEEK
+    DWORD *                     cltbl;      // Fast seek cluster link map table
+    bool                        bNoFast;    // Do not build the table on first seek
+#endif
     };
 
 struct fat_dir
@@ -84,6 +136,7 @@ struct fat_dir
     int                         flags;
     struct pfs_mount *          m;
     struct dirent               de;
+    long long                   size;       // Size of the file in de (0 if not known)
     DIR                         dir;
     };
 
@@ -115,10 +168,24 @@ STATIC int fat_error (FRESULT r)
     return ( r == FR_OK ) ? 0 : -1;
     }
 
+// Path name for FatFs of a file on the volume
+STATIC const char *fat_path (struct fat_pfs *fat, char *psPath, const char *name)
+    {
+#if FF_VOLUMES > 1
+    psPath[0] = '0' + fat->ldrv;
+    psPath[1] = ':';
+    strncpy (psPath + 2, name, PFS_PATH_MAX);
+    psPath[FAT_PATH_MAX - 1] = '\0';
+    return psPath;
+#else
+    return name;
+#endif
+    }
+
 STATIC struct pfs_file *fat_open (struct pfs_pfs *pfs, const char *fn, int oflag)
     {
     struct fat_pfs *fat = (struct fat_pfs *) pfs;
-    struct fat_file *fd = (struct fat_file *) malloc (sizeof (struct fat_file));
+    struct fat_file *fd = (struct fat_file *) pfs_file_alloc (sizeof (struct fat_file));
     if ( fd == NULL )
         {
         pfs_error (ENOMEM);
@@ -126,6 +193,11 @@ STATIC struct pfs_file *fat_open (struct pfs_pfs *pfs, const char *fn, int oflag
         }
     fd->entry = &fat_v_file;
     fd->fat = fat;
+    pfs_sync_init (&fd->sync);
+#if FF_USE_FASTSEEK
+    fd->cltbl = NULL;
+    fd->bNoFast = false;
+#endif
     unsigned char of = 0;
     switch ( oflag & O_ACCMODE )
         {
@@ -136,31 +208,76 @@ STATIC struct pfs_file *fat_open (struct pfs_pfs *pfs, const char *fn, int oflag
     if ( oflag & O_APPEND ) of |= FA_OPEN_APPEND;
     if ( oflag & O_CREAT )  of |= FA_OPEN_ALWAYS;
     if ( oflag & O_TRUNC )  of |= FA_CREATE_ALWAYS;
-    FRESULT r = f_open (&fd->fil, fn, of);
+    char sPath[FAT_PATH_MAX];
+    FRESULT r = f_open (&fd->fil, fat_path (fat, sPath, fn), of);
     if ( r == FR_OK )
         {
         return (struct pfs_file *) fd;
         }
-    free (fd);
+    pfs_file_free (fd);
     fat_error (r);
     return NULL;
     }
 
+#if FF_USE_FASTSEEK
+// Leave fast seek mode. FatFs cannot extend a file while in fast seek mode,
+// so this must be done before writing or seeking beyond the end of the file.
+STATIC void fat_clmt_free (struct fat_file *fd)
+    {
+    fd->fil.cltbl = NULL;
+    if ( fd->cltbl != NULL )
+        {
+        free (fd->cltbl);
+        fd->cltbl = NULL;
+        }
+    }
+
+// Build the cluster link map table, enlarging it until the whole cluster chain fits
+STATIC FRESULT fat_clmt_create (struct fat_file *fd)
+    {
+    DWORD nclmt = FAT_CLMT_INIT;
+    while (true)
+        {
+        DWORD *cltbl = (DWORD *) realloc (fd->cltbl, nclmt * sizeof (DWORD));
+        if ( cltbl == NULL )
+            {
+            fat_clmt_free (fd);
+            return FR_NOT_ENOUGH_CORE;
+            }
+        fd->cltbl = cltbl;
+        cltbl[0] = nclmt;
+        fd->fil.cltbl = cltbl;
+        FRESULT r = f_lseek (&fd->fil, CREATE_LINKMAP);
+        if ( r == FR_OK ) return r;
+        if (( r != FR_NOT_ENOUGH_CORE ) || ( cltbl[0] <= nclmt ))
+            {
+            fat_clmt_free (fd);
+            return r;
+            }
+        nclmt = cltbl[0];
+        }
+    }
+#endif
+
 STATIC int fat_close (struct pfs_file *pfs_fd)
     {
     struct fat_file *fd = (struct fat_file *) pfs_fd;
-    return fat_error (f_close (&fd->fil));
+    FRESULT r = f_close (&fd->fil);
+#if FF_USE_FASTSEEK
+    fat_clmt_free (fd);
+#endif
+    return fat_error (r);
     }
 
 STATIC int fat_read (struct pfs_file *pfs_fd, char *buffer, int length)
     {
     struct fat_file *fd = (struct fat_file *) pfs_fd;
     UINT nread;
-    FRESULT r = fat_error (f_read (&fd->fil, buffer, length, &nread));
+    FRESULT r = f_read (&fd->fil, buffer, length, &nread);
     return ( r == FR_OK ) ? nread : fat_error (r);
     }
 
-STATIC int fat_write (struct pfs_file *pfs_fd, char *buffer, int length)
+STATIC int fat_fwrite (struct pfs_file *pfs_fd, char *buffer, int length)
     {
     struct fat_file *fd = (struct fat_file *) pfs_fd;
     UINT nwrite;
@@ -168,21 +285,136 @@ STATIC int fat_write (struct pfs_file *pfs_fd, char *buffer, int length)
     return ( r == FR_OK ) ? nwrite : fat_error (r);
     }
 
-STATIC long fat_lseek (struct pfs_file *pfs_fd, long pos, int whence)
+// Sync the file if the sync policy requires it after writing n bytes
+STATIC int fat_sync_check (struct fat_file *fd, int n)
+    {
+    if ( pfs_sync_due (&fd->sync, n) && ( fat_fsync ((struct pfs_file *) fd) != 0 )) return -1;
+    return n;
+    }
+
+STATIC int fat_write (struct pfs_file *pfs_fd, char *buffer, int length)
+    {
+    struct fat_file *fd = (struct fat_file *) pfs_fd;
+#if FF_USE_FASTSEEK
+    if (( fd->cltbl != NULL ) && ( f_tell (&fd->fil) + length > f_size (&fd->fil) )) fat_clmt_free (fd);
+#endif
+    return fat_sync_check (fd, fat_fwrite (pfs_fd, buffer, length));
+    }
+
+// Checks whether the fast seek table is still valid once, for the whole
+// list, then writes the buffers gathered into as few f_write calls as possible
+STATIC int fat_writev (struct pfs_file *pfs_fd, const struct iovec *iov, int iovcnt)
+    {
+    struct fat_file *fd = (struct fat_file *) pfs_fd;
+#if FF_USE_FASTSEEK
+    if ( fd->cltbl != NULL )
+        {
+        FSIZE_t length = 0;
+        for (int i = 0; i < iovcnt; ++i) length += iov[i].iov_len;
+        if ( f_tell (&fd->fil) + length > f_size (&fd->fil) ) fat_clmt_free (fd);
+        }
+#endif
+    return fat_sync_check (fd, pfs_writev_rtn (pfs_fd, iov, iovcnt, fat_fwrite));
+    }
+
+// f_sync flushes the sector buffer and updates the directory entry,
+// leaving the file open
+STATIC int fat_fsync (struct pfs_file *pfs_fd)
+    {
+    struct fat_file *fd = (struct fat_file *) pfs_fd;
+    pfs_sync_done (&fd->sync);
+    return fat_error (f_sync (&fd->fil));
+    }
+
+STATIC long long fat_lseek64 (struct pfs_file *pfs_fd, long long pos, int whence)
     {
     struct fat_file *fd = (struct fat_file *) pfs_fd;
     switch (whence)
         {
-        case SEEK_CUR: whence += f_tell (&fd->fil); break;
-        case SEEK_END: whence += f_size (&fd->fil); break;
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            // Used by ftell, so avoid calling f_lseek
+            if ( pos == 0 ) return f_tell (&fd->fil);
+            pos += f_tell (&fd->fil);
+            break;
+        case SEEK_END:
+            pos += f_size (&fd->fil);
+            break;
+        default:
+            return pfs_error (EINVAL);
+        }
+    if ( pos < 0 ) return pfs_error (EINVAL);
+#if FF_FS_EXFAT == 0
+    if ( pos > 0xFFFFFFFFLL ) return pfs_error (EFBIG);
+#endif
+    if ( (FSIZE_t) pos == f_tell (&fd->fil) ) return pos;
+#if FF_USE_FASTSEEK
+    if ( (FSIZE_t) pos > f_size (&fd->fil) )
+        {
+        fat_clmt_free (fd);
+        }
+    else if (( fd->cltbl == NULL ) && ( ! fd->bNoFast )
+        && ( f_size (&fd->fil) > (FSIZE_t) fd->fat->vol.csize * FF_MIN_SS ))
+        {
+        // Only worth building the table if the file spans more than one cluster.
+        // Failure is not fatal, the seek just follows the cluster chain.
+        fat_clmt_create (fd);
+        }
+#endif
+    FRESULT r = f_lseek (&fd->fil, (FSIZE_t) pos);
+    return ( r == FR_OK ) ? (long long) f_tell (&fd->fil) : fat_error (r);
+    }
+
+STATIC long fat_lseek (struct pfs_file *pfs_fd, long pos, int whence)
+    {
+    struct fat_file *fd = (struct fat_file *) pfs_fd;
+    FSIZE_t fptr = f_tell (&fd->fil);
+    long long r = fat_lseek64 (pfs_fd, pos, whence);
+    if ( r > LONG_MAX )
+        {
+        // Position cannot be returned, so leave the file where it was
+        f_lseek (&fd->fil, fptr);
+        return pfs_error (EOVERFLOW);
         }
-    FRESULT r = f_lseek (&fd->fil, whence);
-    return ( r == FR_OK ) ? f_tell (&fd->fil) : fat_error (r);
+    return (long) r;
+    }
+
+// Positional transfers use fat_lseek64, so that the fast seek table is
+// used both to reach the offset and to return to the file position
+STATIC int fat_pread (struct pfs_file *pfs_fd, char *buffer, int length, off_t offset)
+    {
+    struct fat_file *fd = (struct fat_file *) pfs_fd;
+    // On a file open for writing, seeking past the end would extend it
+    if ( (FSIZE_t) offset >= f_size (&fd->fil) ) return 0;
+    FSIZE_t fptr = f_tell (&fd->fil);
+    if ( fat_lseek64 (pfs_fd, offset, SEEK_SET) < 0 ) return -1;
+    int n = fat_read (pfs_fd, buffer, length);
+    fat_lseek64 (pfs_fd, fptr, SEEK_SET);
+    return n;
+    }
+
+STATIC int fat_pwrite (struct pfs_file *pfs_fd, const char *buffer, int length, off_t offset)
+    {
+    struct fat_file *fd = (struct fat_file *) pfs_fd;
+    FSIZE_t fptr = f_tell (&fd->fil);
+    if ( fat_lseek64 (pfs_fd, offset, SEEK_SET) < 0 ) return -1;
+    int n = fat_write (pfs_fd, (char *) buffer, length);
+    fat_lseek64 (pfs_fd, fptr, SEEK_SET);
+    return n;
     }
 
 STATIC int fat_fstat (struct pfs_file *pfs_fd, struct stat *buf)
     {
-    return fat_stat (pfs_fd->pfs, pfs_fd->pn, buf);
+    // Taken from the open file, as pfs_fd->pn is the full path name not the volume one
+    struct fat_file *fd = (struct fat_file *) pfs_fd;
+    memset (buf, 0, sizeof (struct stat));
+    buf->st_size = f_size (&fd->fil);
+    buf->st_blksize = 512;
+    buf->st_blocks = buf->st_size / 512;
+    buf->st_nlink = 1;
+    buf->st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFREG;
+    return 0;
     }
 
 STATIC int fat_isatty (struct pfs_file *fd)
@@ -190,11 +422,101 @@ STATIC int fat_isatty (struct pfs_file *fd)
     return 0;
     }
 
+STATIC int fat_ioctl (struct pfs_file *pfs_fd, unsigned long request, void *argp)
+    {
+    int ierr = 0;
+    struct fat_file *fd = (struct fat_file *) pfs_fd;
+    switch (request)
+        {
+        case IOC_RQ_SYNC:
+            if ( argp == NULL )
+                {
+                pfs_sync_init (&fd->sync);
+                }
+            else
+                {
+                fd->sync.bytes = ((struct ioc_sync *) argp)->bytes;
+                fd->sync.ms = ((struct ioc_sync *) argp)->ms;
+                }
+            break;
+#if FF_USE_FASTSEEK
+        case IOC_RQ_FSEEK:
+            if (( argp == NULL ) || ( *((int *) argp) != 0 ))
+                {
+                fd->bNoFast = false;
+                ierr = fat_error (fat_clmt_create (fd));
+                }
+            else
+                {
+                fd->bNoFast = true;
+                fat_clmt_free (fd);
+                }
+            break;
+#endif
+        default:
+            ierr = pfs_error (EINVAL);
+            break;
+        }
+    return ierr;
+    }
+
+// Zeros written to extend a file. Only ever read, so may be shared by all volumes.
+static BYTE fat_zero[512];
+
+// Reserve space for the file and extend it with zeros. An empty file is first
+// given a single contiguous run of clusters, so that writing it does not
+// require any FAT updates. Otherwise the cluster chain grows as the zeros are
+// written. If the disk fills, the file is restored to its original length.
+STATIC int fat_allocate (struct pfs_file *pfs_fd, off_t offset, off_t len)
+    {
+    struct fat_file *fd = (struct fat_file *) pfs_fd;
+    if ( ! ( fd->fil.flag & FA_WRITE ) ) return pfs_error (EBADF);
+    if ( len > LONG_MAX - offset ) return pfs_error (EFBIG);
+#if ( ! FF_FS_EXFAT ) && ( LONG_MAX > 0xFFFFFFFF )
+    if ( offset + len > 0xFFFFFFFF ) return pfs_error (EFBIG);
+#endif
+    FSIZE_t fsz = offset + len;
+    FSIZE_t fold = f_size (&fd->fil);
+    if ( fsz <= fold ) return 0;
+#if FF_USE_FASTSEEK
+    fat_clmt_free (fd);
+#endif
+    FRESULT r;
+#if FF_USE_EXPAND
+    if ( fold == 0 )
+        {
+        r = f_expand (&fd->fil, fsz, 1);
+        if (( r != FR_OK ) && ( r != FR_DENIED )) return fat_error (r);
+        }
+#endif
+    FSIZE_t fptr = f_tell (&fd->fil);
+    bool bFull = false;
+    r = f_lseek (&fd->fil, fold);
+    while (( r == FR_OK ) && ( f_tell (&fd->fil) < fsz ))
+        {
+        UINT nwrite = sizeof (fat_zero);
+        if ( fsz - f_tell (&fd->fil) < nwrite ) nwrite = fsz - f_tell (&fd->fil);
+        UINT nw;
+        r = f_write (&fd->fil, fat_zero, nwrite, &nw);
+        if (( r == FR_OK ) && ( nw < nwrite ))
+            {
+            bFull = true;
+            r = f_lseek (&fd->fil, fold);
+            if ( r == FR_OK ) r = f_truncate (&fd->fil);
+            break;
+            }
+        }
+    if ( r == FR_OK ) r = f_lseek (&fd->fil, fptr);
+    if (( r == FR_OK ) && bFull ) return pfs_error (ENOSPC);
+    return fat_error (r);
+    }
+
 STATIC int fat_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf)
     {
     struct fat_pfs *fat = (struct fat_pfs *) pfs;
     FILINFO info;
-    FRESULT r = f_stat (name, &info);
+    char sPath[FAT_PATH_MAX];
+    FRESULT r = f_stat (fat_path (fat, sPath, name), &info);
     if ( r != FR_OK ) return fat_error (r);
     memset (buf, 0, sizeof (struct stat));
     buf->st_size = info.fsize;
@@ -210,22 +532,27 @@ STATIC int fat_stat (struct pfs_pfs *pfs, const char *name, struct stat *buf)
 
 STATIC int fat_rename (struct pfs_pfs *pfs, const char *old, const char *new)
     {
-    return fat_error (f_rename (old, new));
+    // FatFs takes the drive of the new name from the old one
+    char sPath[FAT_PATH_MAX];
+    return fat_error (f_rename (fat_path ((struct fat_pfs *) pfs, sPath, old), new));
     }
 
 STATIC int fat_delete (struct pfs_pfs *pfs, const char *name)
     {
-    return fat_error (f_unlink (name));
+    char sPath[FAT_PATH_MAX];
+    return fat_error (f_unlink (fat_path ((struct fat_pfs *) pfs, sPath, name)));
     }
 
 STATIC int fat_mkdir (struct pfs_pfs *pfs, const char *name, mode_t mode)
     {
-    return fat_error (f_mkdir (name));
+    char sPath[FAT_PATH_MAX];
+    return fat_error (f_mkdir (fat_path ((struct fat_pfs *) pfs, sPath, name)));
     }
 
 STATIC int fat_rmdir (struct pfs_pfs *pfs, const char *name)
     {
-    return fat_error (f_unlink (name));
+    char sPath[FAT_PATH_MAX];
+    return fat_error (f_unlink (fat_path ((struct fat_pfs *) pfs, sPath, name)));
     }
 
 STATIC void *fat_opendir (struct pfs_pfs *pfs, const char *name)
@@ -239,7 +566,8 @@ STATIC void *fat_opendir (struct pfs_pfs *pfs, const char *name)
         }
     dd->entry = &fat_v_dir;
     dd->fat = fat;
-    FRESULT r = f_opendir (&dd->dir, name);
+    char sPath[FAT_PATH_MAX];
+    FRESULT r = f_opendir (&dd->dir, fat_path (fat, sPath, name));
     if ( r == FR_OK ) return (void *) dd;
     free (dd);
     fat_error (r);
@@ -258,6 +586,8 @@ STATIC struct dirent *fat_readdir (void *dirp)
         }
     if ( info.fname[0] == '\0' ) return NULL;
     strncpy (dd->de.d_name, info.fname, NAME_MAX);
+    dd->de.d_type = ( info.fattrib & AM_DIR ) ? DT_DIR : DT_REG;
+    dd->size = info.fsize;
     return &dd->de;
     }
 
@@ -272,17 +602,132 @@ STATIC int fat_chmod (struct pfs_pfs *pfs, const char *name, mode_t mode)
     return pfs_error (EINVAL);
     }
 
-struct pfs_pfs *pfs_fat_create (void)
+// Create the volume. If bLazy, FatFs mounts it on first access instead of now.
+STATIC struct pfs_pfs *fat_create (int drive, int part, bool bLazy)
     {
+    // Choose the logical drive. Without FF_MULTI_PARTITION it is the same as the physical drive.
+    int ldrv = drive;
+#if FF_MULTI_PARTITION
+    if (( part < 0 ) || ( part > 4 ))
+        {
+        pfs_error (EINVAL);
+        return NULL;
+        }
+    for (ldrv = 0; ldrv < FF_VOLUMES; ++ldrv)
+        {
+        if ( fat_ldrv[ldrv] == NULL ) break;
+        }
+    if ( ldrv >= FF_VOLUMES )
+        {
+        pfs_error (ENFILE);
+        return NULL;
+        }
+#else
+    if (( part != 0 ) || ( ldrv < 0 ) || ( ldrv >= FF_VOLUMES ))
+        {
+        pfs_error (EINVAL);
+        return NULL;
+        }
+    if ( fat_ldrv[ldrv] != NULL )
+        {
+        pfs_error (EBUSY);
+        return NULL;
+        }
+#endif
+    if (( drive < 0 ) || ( ! ff_disk_attach (drive, NULL) ))
+        {
+        pfs_error (ENODEV);
+        return NULL;
+        }
     struct fat_pfs *fat = (struct fat_pfs *) malloc (sizeof (struct fat_pfs));
-    if ( fat == NULL ) return NULL;
+    if ( fat == NULL )
+        {
+        pfs_error (ENOMEM);
+        return NULL;
+        }
     fat->entry = &fat_v_pfs;
-    FRESULT r = f_mount (&fat->vol, "0:", 1);
+    fat->ldrv = ldrv;
+#if FF_MULTI_PARTITION
+    VolToPart[ldrv].pd = drive;
+    VolToPart[ldrv].pt = part;
+#endif
+    char sDrive[3] = { '0' + ldrv, ':', '\0' };
+    FRESULT r = f_mount (&fat->vol, sDrive, bLazy ? 0 : 1);
     if ( r != FR_OK )
         {
+        f_mount (NULL, sDrive, 0);
         free (fat);
         fat_error (r);
         return NULL;
         }
+    fat_ldrv[ldrv] = fat;
     return (struct pfs_pfs *) fat;
     }
+
+STATIC int fat_umount (struct pfs_pfs *pfs)
+    {
+    struct fat_pfs *fat = (struct fat_pfs *) pfs;
+    // Write out any sectors held back by the ff_disk cache. If the card has
+    // already gone this fails, but the volume is released anyway.
+    if ( fat->vol.fs_type != 0 ) disk_ioctl (fat->vol.pdrv, CTRL_SYNC, NULL);
+    char sDrive[3] = { '0' + fat->ldrv, ':', '\0' };
+    f_mount (NULL, sDrive, 0);
+    fat_ldrv[fat->ldrv] = NULL;
+    free (fat);
+    return 0;
+    }
+
+// FatFs keeps the free cluster count once it is known, from the FSInfo sector
+// (FAT32) or a scan of the FAT, and updates it as clusters are allocated and
+// freed. So only the first call after mounting can take long.
+STATIC int fat_statvfs (struct pfs_pfs *pfs, struct statvfs *buf)
+    {
+    struct fat_pfs *fat = (struct fat_pfs *) pfs;
+    char sDrive[3] = { '0' + fat->ldrv, ':', '\0' };
+    FATFS *fs;
+    DWORD nfree;
+    FRESULT r = f_getfree (sDrive, &nfree, &fs);
+    if ( r != FR_OK ) return fat_error (r);
+    memset (buf, 0, sizeof (struct statvfs));
+#if FF_MAX_SS != FF_MIN_SS
+    buf->f_bsize = fs->csize * fs->ssize;
+#else
+    buf->f_bsize = fs->csize * FF_MAX_SS;
+#endif
+    buf->f_frsize = buf->f_bsize;
+    buf->f_blocks = fs->n_fatent - 2;
+    buf->f_bfree = nfree;
+    buf->f_bavail = nfree;
+#if FF_USE_LFN
+    buf->f_namemax = FF_LFN_BUF;
+#else
+    buf->f_namemax = 12;
+#endif
+    return 0;
+    }
+
+// FatFs numbers each mount, so a card that has been changed and remounted
+// gets a new identity. A card known to need initialising has none, as it
+// may have been changed (see ff_disk_card_detect).
+STATIC uint32_t fat_cache_id (struct pfs_pfs *pfs)
+    {
+    struct fat_pfs *fat = (struct fat_pfs *) pfs;
+    if ( fat->vol.fs_type == 0 ) return 0;
+    if ( disk_status (fat->vol.pdrv) & STA_NOINIT ) return 0;
+    return fat->vol.id;
+    }
+
+struct pfs_pfs *pfs_fat_create_drive (int drive, int part)
+    {
+    return fat_create (drive, part, false);
+    }
+
+struct pfs_pfs *pfs_fat_create_lazy (int drive, int part)
+    {
+    return fat_create (drive, part, true);
+    }
+
+struct pfs_pfs *pfs_fat_create (void)
+    {
+    return pfs_fat_create_drive (0, 0);
+    }
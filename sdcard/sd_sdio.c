@@ -0,0 +1,713 @@
+/*  sd_sdio.c - Routines for accessing SD card using the 4-bit SD bus */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <string.h>
+#include "pico.h"
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "sd_sdio.pio.h"
+#include "sd_sdio.h"
+#include "pico/binary_info.h"
+#include <pfs_trace.h>
+
+#if ( !defined(PICO_SD_CLK_PIN)) ||  ( !defined(PICO_SD_CMD_PIN)) || ( !defined(PICO_SD_DAT0_PIN))
+#error SD Card connections not defined. Specify a board including SD card.
+#elif ( defined(PICO_SD_DAT_PIN_INCREMENT) && ( PICO_SD_DAT_PIN_INCREMENT != 1 ))
+#error The 4-bit SD bus requires the data pins to be consecutive GPIOs.
+#elif ( defined(PICO_SD_DAT_PIN_COUNT) && ( PICO_SD_DAT_PIN_COUNT != 4 ))
+#error The 4-bit SD bus requires all four data pins to be connected.
+#else
+
+#define SD_CLK_PIN      PICO_SD_CLK_PIN
+#define SD_CMD_PIN      PICO_SD_CMD_PIN
+#define SD_DAT0_PIN     PICO_SD_DAT0_PIN
+#define SD_DAT_MASK     ( 0x0F << SD_DAT0_PIN )
+
+bi_decl (bi_1pin_with_name (SD_CLK_PIN, "SD card clock"));
+bi_decl (bi_1pin_with_name (SD_CMD_PIN, "SD card command"));
+bi_decl (bi_1pin_with_name (SD_DAT0_PIN, "SD card data 0"));
+bi_decl (bi_1pin_with_name (SD_DAT0_PIN + 1, "SD card data 1"));
+bi_decl (bi_1pin_with_name (SD_DAT0_PIN + 2, "SD card data 2"));
+bi_decl (bi_1pin_with_name (SD_DAT0_PIN + 3, "SD card data 3"));
+
+// Target SD bus clock frequency (kHz) once the card is initialised
+#ifndef SD_SDIO_FREQ
+#define SD_SDIO_FREQ    25000
+#endif
+// Clock frequency (kHz) used for card identification
+#define SD_SDIO_INIT_FREQ   400
+// Number of PIO cycles per SD clock in sd_sdio.pio (two instructions, each with 1 delay cycle)
+#define SD_SDIO_PIO_CYCLES  4
+
+// Maximum number of blocks transferred by a single multiple block command
+#ifndef SD_SDIO_MAX_BLOCKS
+#define SD_SDIO_MAX_BLOCKS  32
+#endif
+// Timeout (microseconds) waiting for a command response
+#ifndef SD_CMD_TIMEOUT_US
+#define SD_CMD_TIMEOUT_US   5000
+#endif
+// Timeout (milliseconds) for the card to complete initialisation
+#ifndef SD_INIT_TIMEOUT_MS
+#define SD_INIT_TIMEOUT_MS  1000
+#endif
+// Default timeout (milliseconds) waiting for read data
+#ifndef SD_READ_TIMEOUT_MS
+#define SD_READ_TIMEOUT_MS  100
+#endif
+// Default timeout (milliseconds) waiting for the card to finish being busy
+#ifndef SD_BUSY_TIMEOUT_MS
+#define SD_BUSY_TIMEOUT_MS  500
+#endif
+
+// Nibbles received for each block: 512 bytes of data and 16 bits of CRC per line
+#define SD_RX_NIBBLES   ( 2 * 512 + 16 )
+// Nibbles sent for each block: Idle and start bit (one word), data, CRC and end bit
+#define SD_TX_NIBBLES   ( 8 + 2 * 512 + 16 + 1 )
+// Bits received following the start bit of the CRC status: 3 bit status, end bit and
+// the first bit of the busy period
+#define SD_TX_STATUS    5
+#define SD_STATUS_OK    0x02
+
+// Card status bits (R1 response) which indicate an error
+#define SD_R1_ERRORS    0xFDF98008
+
+static PIO pio_sd = pio1;
+static int sm_cmd = -1;
+static int sm_rx = -1;
+static int sm_tx = -1;
+static uint off_cmd;
+static uint off_rx;
+static uint off_tx;
+static int dma_ctl = -1;
+static int dma_dat = -1;
+SD_TYPE sd_type = sdtpUnk;
+
+static uint32_t sd_rca = 0;
+static uint sd_freq_tgt = SD_SDIO_FREQ;
+static float sd_freq_act = 0.0;
+static uint sd_rd_timeout = SD_READ_TIMEOUT_MS;
+static uint sd_wr_timeout = SD_BUSY_TIMEOUT_MS;
+
+// DMA control blocks (address and count pairs), loaded into the data channel in turn
+static uint32_t sd_dma_list[4 * SD_SDIO_MAX_BLOCKS + 2];
+// Received CRCs (two words per block)
+static uint32_t sd_crc_rx[2 * SD_SDIO_MAX_BLOCKS];
+// CRC and end bit to follow transmitted data
+static uint32_t sd_tail[3];
+// Word aligned copy of a block for buffers which are not
+static uint32_t sd_bounce[128];
+
+// Calculate the CRC16 of each of the four data lines simultaneously. Bit k of each
+// nibble is on data line k, so each bit of a single line CRC becomes a nibble of
+// the result. The most significant nibble of the result is the first sent.
+static uint64_t sd_sdio_crc16 (const uint8_t *buff, int len)
+    {
+    uint64_t crc = 0;
+    for (int i = 0; i < len; i += 4)
+        {
+        // Eight bits from each line, first bit most significant
+        uint32_t din = ( buff[i] << 24 ) | ( buff[i+1] << 16 ) | ( buff[i+2] << 8 ) | buff[i+3];
+        // Polynomial x^16 + x^12 + x^5 + 1 for eight steps at once. The x^12 term
+        // feeds back into the last four of the eight steps.
+        uint32_t fb = (uint32_t)( crc >> 32 ) ^ din;
+        fb ^= fb >> 16;
+        crc = ( crc << 32 ) ^ fb ^ ( ((uint64_t) fb) << 20 ) ^ ( ((uint64_t) fb) << 48 );
+        }
+    return crc;
+    }
+
+// CRC7 for commands and responses
+static uint8_t sd_sdio_crc7 (const uint8_t *data, int len)
+    {
+    uint8_t crc = 0;
+    for (int i = 0; i < len; ++i)
+        {
+        uint8_t v = data[i];
+        for (int j = 0; j < 8; ++j)
+            {
+            if ( ( v ^ crc ) & 0x80 ) crc ^= 0x09;
+            crc <<= 1;
+            v <<= 1;
+            }
+        }
+    return crc >> 1;
+    }
+
+// Load a PIO program, directing the "wait gpio" instructions to the clock pin
+static uint sd_sdio_add_program (const pio_program_t *prog)
+    {
+    uint16_t insn[32];
+    pio_program_t patch = *prog;
+    for (int i = 0; i < prog->length; ++i)
+        {
+        insn[i] = prog->instructions[i];
+        if (( insn[i] & 0xE060 ) == 0x2000 ) insn[i] = ( insn[i] & 0xFFE0 ) | SD_CLK_PIN;
+        }
+    patch.instructions = insn;
+    return pio_add_program (pio_sd, &patch);
+    }
+
+// Load a state machine register (X or Y) from the TX FIFO, leaving the OSR empty
+static void sd_sdio_set_reg (uint sm, enum pio_src_dest reg, uint32_t val)
+    {
+    pio_sm_exec (pio_sd, sm, pio_encode_mov (pio_osr, pio_null));
+    pio_sm_exec (pio_sd, sm, pio_encode_out (pio_null, 32));
+    pio_sm_put (pio_sd, sm, val);
+    pio_sm_exec (pio_sd, sm, pio_encode_pull (false, true));
+    pio_sm_exec (pio_sd, sm, pio_encode_out (reg, 32));
+    }
+
+// Stop a state machine and return it to the start of its program
+static void sd_sdio_sm_reset (uint sm, uint offset)
+    {
+    pio_sm_set_enabled (pio_sd, sm, false);
+    pio_sm_clear_fifos (pio_sd, sm);
+    pio_sm_restart (pio_sd, sm);
+    pio_sm_exec (pio_sd, sm, pio_encode_jmp (offset));
+    }
+
+// (Re)start the command state machine, which also generates the clock
+static void sd_sdio_cmd_start (void)
+    {
+    sd_sdio_sm_reset (sm_cmd, off_cmd);
+    pio_sm_exec (pio_sd, sm_cmd, pio_encode_mov (pio_osr, pio_null));
+    pio_sm_exec (pio_sd, sm_cmd, pio_encode_out (pio_null, 32));
+    pio_sm_exec (pio_sd, sm_cmd, pio_encode_set (pio_pindirs, 1));
+    pio_sm_set_enabled (pio_sd, sm_cmd, true);
+    }
+
+// Set the SD clock frequency (kHz). Returns the nearest achievable frequency.
+// The fastest possible is clk_sys / SD_SDIO_PIO_CYCLES.
+static float sd_sdio_freq (float freq)
+    {
+    float clk = SD_SDIO_PIO_CYCLES * 1000.0 * freq;
+    float div = clock_get_hz (clk_sys) / clk;
+    if ( div < 1.0 ) div = 1.0;
+    pio_sm_set_clkdiv (pio_sd, sm_cmd, div);
+    pio_sm_set_clkdiv (pio_sd, sm_rx, div);
+    pio_sm_set_clkdiv (pio_sd, sm_tx, div);
+    // Keep the data state machines in phase with the clock
+    pio_clkdiv_restart_sm_mask (pio_sd, ( 1u << sm_cmd ) | ( 1u << sm_rx ) | ( 1u << sm_tx ));
+    sd_freq_act = clock_get_hz (clk_sys) / ( SD_SDIO_PIO_CYCLES * 1000.0 * div );
+    return sd_freq_act;
+    }
+
+static bool sd_sdio_load (void)
+    {
+    dma_ctl = dma_claim_unused_channel (false);
+    dma_dat = dma_claim_unused_channel (false);
+    if (( dma_ctl < 0 ) || ( dma_dat < 0 )) return false;
+    gpio_pull_up (SD_CMD_PIN);
+    pio_gpio_init (pio_sd, SD_CLK_PIN);
+    pio_gpio_init (pio_sd, SD_CMD_PIN);
+    for (int i = 0; i < 4; ++i)
+        {
+        gpio_pull_up (SD_DAT0_PIN + i);
+        pio_gpio_init (pio_sd, SD_DAT0_PIN + i);
+        }
+    off_cmd = sd_sdio_add_program (&sd_sdio_cmd_program);
+    off_rx = sd_sdio_add_program (&sd_sdio_rx_program);
+    off_tx = sd_sdio_add_program (&sd_sdio_tx_program);
+    sm_cmd = pio_claim_unused_sm (pio_sd, true);
+    sm_rx = pio_claim_unused_sm (pio_sd, true);
+    sm_tx = pio_claim_unused_sm (pio_sd, true);
+
+    // Clock and command
+    pio_sm_config c = sd_sdio_cmd_program_get_default_config (off_cmd);
+    sm_config_set_sideset_pins (&c, SD_CLK_PIN);
+    sm_config_set_out_pins (&c, SD_CMD_PIN, 1);
+    sm_config_set_set_pins (&c, SD_CMD_PIN, 1);
+    sm_config_set_in_pins (&c, SD_CMD_PIN);
+    sm_config_set_jmp_pin (&c, SD_CMD_PIN);
+    sm_config_set_out_shift (&c, false, true, 32);
+    sm_config_set_in_shift (&c, false, true, 32);
+    sm_config_set_mov_status (&c, STATUS_TX_LESSTHAN, 1);
+    pio_sm_set_pins_with_mask (pio_sd, sm_cmd, 1u << SD_CMD_PIN, ( 1u << SD_CLK_PIN ) | ( 1u << SD_CMD_PIN ));
+    pio_sm_set_pindirs_with_mask (pio_sd, sm_cmd, ( 1u << SD_CLK_PIN ) | ( 1u << SD_CMD_PIN ),
+        ( 1u << SD_CLK_PIN ) | ( 1u << SD_CMD_PIN ));
+    pio_sm_init (pio_sd, sm_cmd, off_cmd, &c);
+
+    // Receive data
+    c = sd_sdio_rx_program_get_default_config (off_rx);
+    sm_config_set_in_pins (&c, SD_DAT0_PIN);
+    sm_config_set_in_shift (&c, false, true, 32);
+    pio_sm_init (pio_sd, sm_rx, off_rx, &c);
+
+    // Transmit data
+    c = sd_sdio_tx_program_get_default_config (off_tx);
+    sm_config_set_out_pins (&c, SD_DAT0_PIN, 4);
+    sm_config_set_set_pins (&c, SD_DAT0_PIN, 4);
+    sm_config_set_in_pins (&c, SD_DAT0_PIN);
+    sm_config_set_out_shift (&c, false, true, 32);
+    sm_config_set_in_shift (&c, false, false, 32);
+    // The FIFOs are not joined: the CRC status is returned through the RX FIFO
+    pio_sm_init (pio_sd, sm_tx, off_tx, &c);
+    pio_sm_set_pins_with_mask (pio_sd, sm_tx, SD_DAT_MASK, SD_DAT_MASK);
+    pio_sm_set_pindirs_with_mask (pio_sd, sm_tx, 0, SD_DAT_MASK);
+    return true;
+    }
+
+static void sd_sdio_unload (void)
+    {
+    pio_sm_set_enabled (pio_sd, sm_cmd, false);
+    pio_sm_set_enabled (pio_sd, sm_rx, false);
+    pio_sm_set_enabled (pio_sd, sm_tx, false);
+    pio_remove_program (pio_sd, &sd_sdio_cmd_program, off_cmd);
+    pio_remove_program (pio_sd, &sd_sdio_rx_program, off_rx);
+    pio_remove_program (pio_sd, &sd_sdio_tx_program, off_tx);
+    pio_sm_unclaim (pio_sd, sm_cmd);
+    pio_sm_unclaim (pio_sd, sm_rx);
+    pio_sm_unclaim (pio_sd, sm_tx);
+    dma_channel_unclaim (dma_ctl);
+    dma_channel_unclaim (dma_dat);
+    sm_cmd = -1;
+    sm_rx = -1;
+    sm_tx = -1;
+    dma_ctl = -1;
+    dma_dat = -1;
+    }
+
+// Send a command. If nword is non-zero, receive that many words of response
+// (the bits following the start bit, padded with ones).
+static bool sd_sdio_cmd (uint idx, uint32_t arg, int nword, uint32_t *resp)
+    {
+    uint8_t frame[5] = { 0x40 | idx, arg >> 24, arg >> 16, arg >> 8, arg };
+    uint8_t crc = sd_sdio_crc7 (frame, sizeof (frame));
+    uint32_t nbit = ( nword > 0 ) ? 32 * nword - 1 : 0;
+    pfs_trace (PFS_TR_SD_CMD, idx, arg);
+    pio_sm_put_blocking (pio_sd, sm_cmd, ( 47u << 24 ) | ( frame[0] << 16 ) | ( frame[1] << 8 ) | frame[2]);
+    pio_sm_put_blocking (pio_sd, sm_cmd, ( frame[3] << 24 ) | ( frame[4] << 16 ) | ( ( crc << 1 | 1 ) << 8 ) | nbit);
+    if ( nword == 0 )
+        {
+        // Allow the command and at least eight further clocks to be sent
+        while ( ! pio_sm_is_tx_fifo_empty (pio_sd, sm_cmd) ) tight_loop_contents ();
+        busy_wait_us (( 56 * 1000 ) / (uint) sd_freq_act + 1);
+        return true;
+        }
+    uint64_t t0 = time_us_64 ();
+    for (int i = 0; i < nword; ++i)
+        {
+        while ( pio_sm_is_rx_fifo_empty (pio_sd, sm_cmd) )
+            {
+            if ( time_us_64 () - t0 > SD_CMD_TIMEOUT_US )
+                {
+                pfs_trace (PFS_TR_SD_RESP, 0xFF, 0);
+                sd_sdio_cmd_start ();
+                return false;
+                }
+            }
+        resp[i] = pio_sm_get (pio_sd, sm_cmd);
+        }
+    return true;
+    }
+
+// Send a command with a 48 bit response and return the 32 bit value of the response.
+// If bCheck is set, also verify the command index and CRC (not valid for R3 response).
+static bool sd_sdio_cmd_r48 (uint idx, uint32_t arg, uint32_t *pval, bool bCheck)
+    {
+    uint32_t resp[2];
+    if ( ! sd_sdio_cmd (idx, arg, 2, resp) ) return false;
+    // Response following the start bit: transmission bit, index (6), value (32), CRC (7), end bit
+    uint32_t val = ( resp[0] << 7 ) | ( resp[1] >> 25 );
+    if ( bCheck )
+        {
+        uint8_t frame[5] = { resp[0] >> 25, val >> 24, val >> 16, val >> 8, val };
+        if (( frame[0] != idx ) || ( sd_sdio_crc7 (frame, sizeof (frame)) != (( resp[1] >> 18 ) & 0x7F )))
+            {
+            pfs_trace (PFS_TR_SD_RESP, 0xFF, 0);
+            return false;
+            }
+        }
+    pfs_trace (PFS_TR_SD_RESP, val, 0);
+    *pval = val;
+    return true;
+    }
+
+// Send a command with an R1 response and check the card status for errors
+static bool sd_sdio_cmd_r1 (uint idx, uint32_t arg)
+    {
+    uint32_t status;
+    if ( ! sd_sdio_cmd_r48 (idx, arg, &status, true) ) return false;
+    return ( status & SD_R1_ERRORS ) == 0;
+    }
+
+// Send an application specific command
+static bool sd_sdio_acmd (uint idx, uint32_t arg, uint32_t *pval, bool bCheck)
+    {
+    uint32_t status;
+    if ( ! sd_sdio_cmd_r48 (55, sd_rca << 16, &status, true) ) return false;
+    return sd_sdio_cmd_r48 (idx, arg, pval, bCheck);
+    }
+
+// Wait for the card to stop signalling busy on DAT0
+static bool sd_sdio_wait_busy_ms (uint timeout_ms)
+    {
+    uint64_t t0 = time_us_64 ();
+    bool bOK = true;
+    while ( bOK && ( ! gpio_get (SD_DAT0_PIN) ))
+        {
+        if ( time_us_64 () - t0 > 1000 * (uint64_t) timeout_ms ) bOK = false;
+        }
+    pfs_trace (PFS_TR_SD_BUSY, bOK, time_us_64 () - t0);
+    return bOK;
+    }
+
+static bool sd_sdio_wait_busy (void)
+    {
+    return sd_sdio_wait_busy_ms (sd_wr_timeout);
+    }
+
+// Terminate a multiple block transfer
+static bool sd_sdio_stop (void)
+    {
+    uint32_t status;
+    // Out of range may legitimately be reported after reading the last block
+    if ( ! sd_sdio_cmd_r48 (12, 0, &status, true) ) return false;
+    return sd_sdio_wait_busy ();
+    }
+
+// Halt the data DMA, ensuring the control channel is not retriggered
+static void sd_sdio_dma_stop (void)
+    {
+    hw_write_masked (&dma_hw->ch[dma_dat].al1_ctrl, dma_dat << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB,
+        DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+    dma_channel_abort (dma_ctl);
+    dma_channel_abort (dma_dat);
+    }
+
+// Start the control channel working through sd_dma_list. Each pair of words is written to
+// two consecutive registers of the data channel, the second of which triggers it. The
+// data channel chains back to the control channel. A pair of zeros ends the list.
+static void sd_sdio_dma_start (volatile void *regs)
+    {
+    dma_channel_config c = dma_channel_get_default_config (dma_ctl);
+    channel_config_set_transfer_data_size (&c, DMA_SIZE_32);
+    channel_config_set_read_increment (&c, true);
+    channel_config_set_write_increment (&c, true);
+    channel_config_set_ring (&c, true, 3);
+    dma_channel_configure (dma_ctl, &c, regs, sd_dma_list, 2, true);
+    }
+
+// True once the data channel has worked through the control list
+static bool sd_sdio_dma_done (uint nctl)
+    {
+    return ( dma_channel_hw_addr (dma_ctl)->read_addr == (uint32_t) &sd_dma_list[2 * nctl] )
+        && ( ! dma_channel_is_busy (dma_ctl) ) && ( ! dma_channel_is_busy (dma_dat) );
+    }
+
+// Read a run of blocks into a word aligned buffer
+static bool sd_sdio_read_blocks (uint lba, uint8_t *buff, uint count)
+    {
+    // Start the receiver before sending the command, as data may follow the response closely
+    sd_sdio_sm_reset (sm_rx, off_rx);
+    sd_sdio_set_reg (sm_rx, pio_y, SD_RX_NIBBLES - 1);
+    uint32_t *pl = sd_dma_list;
+    for (uint i = 0; i < count; ++i)
+        {
+        *(pl++) = (uint32_t) ( buff + 512 * i );
+        *(pl++) = 128;
+        *(pl++) = (uint32_t) &sd_crc_rx[2 * i];
+        *(pl++) = 2;
+        }
+    *(pl++) = 0;
+    *(pl++) = 0;
+    dma_channel_config c = dma_channel_get_default_config (dma_dat);
+    channel_config_set_transfer_data_size (&c, DMA_SIZE_32);
+    channel_config_set_read_increment (&c, false);
+    channel_config_set_write_increment (&c, true);
+    channel_config_set_bswap (&c, true);
+    channel_config_set_dreq (&c, pio_get_dreq (pio_sd, sm_rx, false));
+    channel_config_set_chain_to (&c, dma_ctl);
+    dma_channel_configure (dma_dat, &c, NULL, &pio_sd->rxf[sm_rx], 0, false);
+    sd_sdio_dma_start (&dma_hw->ch[dma_dat].al1_write_addr);
+    pio_sm_set_enabled (pio_sd, sm_rx, true);
+
+    if ( sd_type != sdtpHigh ) lba <<= 9;
+    bool bOK = sd_sdio_cmd_r1 (( count > 1 ) ? 18 : 17, lba);
+    uint64_t t0 = time_us_64 ();
+    while ( bOK && ( ! sd_sdio_dma_done (2 * count + 1) ))
+        {
+        if ( time_us_64 () - t0 > 1000 * sd_rd_timeout * count )
+            {
+            pfs_trace (PFS_TR_SD_TOKEN, 0xFF, time_us_64 () - t0);
+            bOK = false;
+            }
+        }
+    if ( bOK ) pfs_trace (PFS_TR_SD_DMA, dma_dat, 512 * count);
+    pio_sm_set_enabled (pio_sd, sm_rx, false);
+    sd_sdio_dma_stop ();
+    if (( count > 1 ) && ( ! sd_sdio_stop () )) bOK = false;
+    for (uint i = 0; bOK && ( i < count ); ++i)
+        {
+        // The received CRC words were byte swapped by the DMA along with the data
+        uint64_t crc = ( ((uint64_t) __builtin_bswap32 (sd_crc_rx[2 * i])) << 32 )
+            | __builtin_bswap32 (sd_crc_rx[2 * i + 1]);
+        if ( sd_sdio_crc16 (buff + 512 * i, 512) != crc )
+            {
+            pfs_trace (PFS_TR_SD_CRC, 0, 0);
+            bOK = false;
+            }
+        }
+    return bOK;
+    }
+
+// Send one block from a word aligned buffer and wait for the card to accept it
+static bool sd_sdio_write_block (const uint8_t *buff)
+    {
+    // The DMA byte swaps the CRC and end bit, so pre-swap them
+    uint64_t crc = sd_sdio_crc16 (buff, 512);
+    sd_tail[0] = __builtin_bswap32 ((uint32_t) ( crc >> 32 ));
+    sd_tail[1] = __builtin_bswap32 ((uint32_t) crc);
+    sd_tail[2] = 0xFFFFFFFF;
+    sd_sdio_sm_reset (sm_tx, off_tx);
+    sd_sdio_set_reg (sm_tx, pio_x, SD_TX_NIBBLES - 1);
+    pio_sm_exec (pio_sd, sm_tx, pio_encode_set (pio_y, SD_TX_STATUS - 1));
+    pio_sm_put (pio_sd, sm_tx, 0xFFFFFFF0);     // Idle followed by start bit
+    pio_sm_set_pindirs_with_mask (pio_sd, sm_tx, SD_DAT_MASK, SD_DAT_MASK);
+    sd_dma_list[0] = 128;
+    sd_dma_list[1] = (uint32_t) buff;
+    sd_dma_list[2] = 3;
+    sd_dma_list[3] = (uint32_t) sd_tail;
+    sd_dma_list[4] = 0;
+    sd_dma_list[5] = 0;
+    dma_channel_config c = dma_channel_get_default_config (dma_dat);
+    channel_config_set_transfer_data_size (&c, DMA_SIZE_32);
+    channel_config_set_read_increment (&c, true);
+    channel_config_set_write_increment (&c, false);
+    channel_config_set_bswap (&c, true);
+    channel_config_set_dreq (&c, pio_get_dreq (pio_sd, sm_tx, true));
+    channel_config_set_chain_to (&c, dma_ctl);
+    dma_channel_configure (dma_dat, &c, &pio_sd->txf[sm_tx], NULL, 0, false);
+    sd_sdio_dma_start (&dma_hw->ch[dma_dat].al3_transfer_count);
+    pio_sm_set_enabled (pio_sd, sm_tx, true);
+
+    // The status is pushed once the card has finished being busy
+    bool bOK = true;
+    uint64_t t0 = time_us_64 ();
+    while ( pio_sm_is_rx_fifo_empty (pio_sd, sm_tx) )
+        {
+        if ( time_us_64 () - t0 > 1000 * ( sd_rd_timeout + sd_wr_timeout ) )
+            {
+            pfs_trace (PFS_TR_SD_BUSY, false, time_us_64 () - t0);
+            bOK = false;
+            break;
+            }
+        }
+    if ( bOK )
+        {
+        uint32_t status = pio_sm_get (pio_sd, sm_tx);
+        pfs_trace (PFS_TR_SD_TOKEN, status, time_us_64 () - t0);
+        if ((( status >> 2 ) & 0x07 ) != SD_STATUS_OK ) bOK = false;
+        }
+    pio_sm_set_enabled (pio_sd, sm_tx, false);
+    pio_sm_set_pindirs_with_mask (pio_sd, sm_tx, 0, SD_DAT_MASK);
+    sd_sdio_dma_stop ();
+    return bOK;
+    }
+
+// Write a run of blocks from a word aligned buffer
+static bool sd_sdio_write_blocks (uint lba, const uint8_t *buff, uint count)
+    {
+    uint32_t status;
+    if ( sd_type != sdtpHigh ) lba <<= 9;
+    if ( count == 1 )
+        {
+        if ( ! sd_sdio_cmd_r1 (24, lba) ) return false;
+        return sd_sdio_write_block (buff);
+        }
+    // Tell the card how many blocks to pre-erase. Failure is not fatal
+    sd_sdio_acmd (23, count, &status, true);
+    if ( ! sd_sdio_cmd_r1 (25, lba) ) return false;
+    bool bOK = true;
+    for (uint i = 0; bOK && ( i < count ); ++i)
+        {
+        bOK = sd_sdio_write_block (buff + 512 * i);
+        }
+    if ( ! sd_sdio_stop () ) bOK = false;
+    return bOK;
+    }
+
+// State of an initialisation started by sd_sdio_init_start
+static bool sd_bInit = false;
+static SD_TYPE sd_init_type;
+static uint64_t sd_init_t0;
+static uint32_t sd_card_id = 0;         // Signature of the CID of the initialised card
+
+bool sd_sdio_init_start (void)
+    {
+    uint32_t val;
+    sd_bInit = false;
+    if (( sm_cmd < 0 ) && ( ! sd_sdio_load () )) return false;
+    sd_type = sdtpUnk;
+    sd_rca = 0;
+    sd_sdio_freq (SD_SDIO_INIT_FREQ);
+    sd_sdio_cmd_start ();
+    sleep_ms (1);                               // At least 74 clocks before the first command
+    sd_sdio_cmd (0, 0, 0, NULL);                // GO_IDLE_STATE
+    sd_init_type = sdtpVer1;
+    if ( sd_sdio_cmd_r48 (8, 0x1AA, &val, true) )   // SEND_IF_COND
+        {
+        // Unsupported voltage or bad check pattern
+        if (( val & 0xFFF ) != 0x1AA ) return false;
+        sd_init_type = sdtpVer2;
+        }
+    sd_init_t0 = time_us_64 ();
+    sd_bInit = true;
+    return true;
+    }
+
+int sd_sdio_init_poll (void)
+    {
+    uint32_t val;
+    if ( ! sd_bInit ) return ( sd_type == sdtpUnk ) ? -1 : 1;
+    sd_bInit = false;
+    // SD_SEND_OP_COND, requesting high capacity support for version 2 cards
+    SD_TYPE type = sd_init_type;
+    if ( ! sd_sdio_acmd (41, ( type == sdtpVer2 ) ? 0x40FF8000 : 0x00FF8000, &val, false) ) return -1;
+    if ( ! ( val & 0x80000000 ))
+        {
+        if ( time_us_64 () - sd_init_t0 > 1000 * SD_INIT_TIMEOUT_MS ) return -1;
+        sd_bInit = true;
+        return 0;
+        }
+    if (( type == sdtpVer2 ) && ( val & 0x40000000 )) type = sdtpHigh;
+    uint32_t cid[5];
+    if ( ! sd_sdio_cmd (2, 0, 5, cid) ) return -1;              // ALL_SEND_CID
+    sd_card_id = 0;
+    for (int i = 0; i < 5; ++i) sd_card_id = ( sd_card_id << 7 | sd_card_id >> 25 ) ^ cid[i];
+    if ( ! sd_sdio_cmd_r48 (3, 0, &val, true) ) return -1;      // SEND_RELATIVE_ADDR
+    sd_rca = val >> 16;
+    if ( ! sd_sdio_cmd_r1 (7, sd_rca << 16) ) return -1;        // SELECT_CARD
+    if ( ! sd_sdio_wait_busy () ) return -1;
+    if ( ! sd_sdio_acmd (6, 2, &val, true) ) return -1;         // SET_BUS_WIDTH (4 bits)
+    if ( val & SD_R1_ERRORS ) return -1;
+    if ( ! sd_sdio_cmd_r1 (16, 512) ) return -1;                // SET_BLOCKLEN
+    sd_type = type;
+    sd_sdio_freq (sd_freq_tgt);
+    return 1;
+    }
+
+bool sd_sdio_init (void)
+    {
+    if ( ! sd_sdio_init_start () ) return false;
+    int r;
+    while (( r = sd_sdio_init_poll () ) == 0) sleep_ms (10);
+    return ( r > 0 );
+    }
+
+uint32_t sd_sdio_card_id (void)
+    {
+    return ( sd_type == sdtpUnk ) ? 0 : sd_card_id;
+    }
+
+void sd_sdio_term (void)
+    {
+    sd_bInit = false;
+    if ( sm_cmd >= 0 ) sd_sdio_unload ();
+    sd_type = sdtpUnk;
+    }
+
+bool sd_sdio_read (uint lba, uint8_t *buff)
+    {
+    if ( ((uintptr_t) buff) & 0x03 )
+        {
+        if ( ! sd_sdio_read_blocks (lba, (uint8_t *) sd_bounce, 1) ) return false;
+        memcpy (buff, sd_bounce, 512);
+        return true;
+        }
+    return sd_sdio_read_blocks (lba, buff, 1);
+    }
+
+bool sd_sdio_read_multi (uint lba, uint8_t *buff, uint count)
+    {
+    if ( ((uintptr_t) buff) & 0x03 )
+        {
+        // DMA requires a word aligned buffer, so go a block at a time
+        for (uint i = 0; i < count; ++i)
+            {
+            if ( ! sd_sdio_read (lba + i, buff + 512 * i) ) return false;
+            }
+        return true;
+        }
+    while ( count > 0 )
+        {
+        uint nblk = ( count > SD_SDIO_MAX_BLOCKS ) ? SD_SDIO_MAX_BLOCKS : count;
+        if ( ! sd_sdio_read_blocks (lba, buff, nblk) ) return false;
+        lba += nblk;
+        buff += 512 * nblk;
+        count -= nblk;
+        }
+    return true;
+    }
+
+bool sd_sdio_write (uint lba, const uint8_t *buff)
+    {
+    if ( ((uintptr_t) buff) & 0x03 )
+        {
+        memcpy (sd_bounce, buff, 512);
+        buff = (const uint8_t *) sd_bounce;
+        }
+    return sd_sdio_write_blocks (lba, buff, 1);
+    }
+
+bool sd_sdio_write_multi (uint lba, const uint8_t *buff, uint count)
+    {
+    if ( ((uintptr_t) buff) & 0x03 )
+        {
+        for (uint i = 0; i < count; ++i)
+            {
+            if ( ! sd_sdio_write (lba + i, buff + 512 * i) ) return false;
+            }
+        return true;
+        }
+    while ( count > 0 )
+        {
+        uint nblk = ( count > SD_SDIO_MAX_BLOCKS ) ? SD_SDIO_MAX_BLOCKS : count;
+        if ( ! sd_sdio_write_blocks (lba, buff, nblk) ) return false;
+        lba += nblk;
+        buff += 512 * nblk;
+        count -= nblk;
+        }
+    return true;
+    }
+
+// Erase blocks first to last (inclusive). The card may take up to 250ms for
+// each allocation unit (up to 4MB) included.
+bool sd_sdio_erase (uint first, uint last)
+    {
+    uint nau = 1 + ( last - first ) / 8192;
+    if ( sd_type != sdtpHigh )
+        {
+        first <<= 9;
+        last <<= 9;
+        }
+    if ( ! sd_sdio_cmd_r1 (32, first) ) return false;
+    if ( ! sd_sdio_cmd_r1 (33, last) ) return false;
+    if ( ! sd_sdio_cmd_r1 (38, 0) ) return false;
+    // R1b response: wait for the card to release DAT0
+    return sd_sdio_wait_busy_ms (sd_wr_timeout + 250 * nau);
+    }
+
+void sd_sdio_set_timeout (uint rd_ms, uint wr_ms)
+    {
+    sd_rd_timeout = rd_ms;
+    sd_wr_timeout = wr_ms;
+    }
+
+void sd_sdio_set_freq (uint freq)
+    {
+    sd_freq_tgt = freq;
+    if (( sm_cmd >= 0 ) && ( sd_type != sdtpUnk )) sd_sdio_freq (freq);
+    }
+
+uint sd_sdio_get_freq (void)
+    {
+    return (uint) sd_freq_act;
+    }
+
+#endif
@@ -0,0 +1,27 @@
+/* sd_sdio.h - 4-bit SD bus routines to access SD card */
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+#ifndef SD_SDIO_H
+#define SD_SDIO_H
+
+#include <stdint.h>
+#include "sd_spi.h"     // For SD_TYPE
+
+bool sd_sdio_init (void);
+// Initialisation in two parts, as for sd_spi_init_start and sd_spi_init_poll
+bool sd_sdio_init_start (void);
+int sd_sdio_init_poll (void);
+void sd_sdio_term (void);
+bool sd_sdio_read (uint lba, uint8_t *buff);
+bool sd_sdio_read_multi (uint lba, uint8_t *buff, uint count);
+bool sd_sdio_write (uint lba, const uint8_t *buff);
+bool sd_sdio_write_multi (uint lba, const uint8_t *buff, uint count);
+bool sd_sdio_erase (uint first, uint last);
+void sd_sdio_set_timeout (uint rd_ms, uint wr_ms);
+void sd_sdio_set_freq (uint freq);
+uint sd_sdio_get_freq (void);
+// Identity of the card (a signature of its CID), or zero if not initialised
+uint32_t sd_sdio_card_id (void);
+
+#endif
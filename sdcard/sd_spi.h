@@ -6,13 +6,101 @@
 #define SD_SPI_H
 
 #include <stdint.h>
+#include <hardware/pio.h>
 
 typedef enum {sdtpUnk, sdtpVer1, sdtpVer2, sdtpHigh} SD_TYPE;
-extern SD_TYPE sd_type;
 
-bool sd_spi_init (void);
-void sd_spi_term (void);
-bool sd_spi_read (uint lba, uint8_t *buff);
-bool sd_spi_write (uint lba, const uint8_t *buff);
+// Called for each block of an asynchronous transfer, from interrupt context.
+// For a read the block has been received, for a write the block is to be filled.
+// Return false to end the transfer early.
+typedef bool (*SD_SPI_BLOCK_CB)(void *ctx, uint8_t *buff, uint block);
+
+// Statistics on the time the card has spent busy (programming or erasing),
+// and on data blocks corrupted in transfer
+typedef struct
+    {
+    uint32_t    count;          // Number of busy periods
+    uint32_t    timeouts;       // Number of busy periods which timed out
+    uint32_t    max_us;         // Longest busy period (microseconds)
+    uint64_t    total_us;       // Total time busy (microseconds)
+    uint32_t    crc_errors;     // Blocks read or written with a CRC mismatch
+    } SD_BUSY_STATS;
+
+// State of an asynchronous multiple block transfer
+typedef enum {sdjsIdle, sdjsRdToken, sdjsRdData, sdjsWrStart, sdjsWrData, sdjsWrBusy, sdjsWrStop, sdjsRdStop} SD_JOB_STATE;
+
+typedef struct
+    {
+    volatile SD_JOB_STATE   state;      // Current step of the transfer
+    volatile bool           bOK;        // False once an error has occurred
+    bool                    bStop;      // Callback has requested an early finish
+    uint64_t                t0;         // Time at which the current wait started
+    uint                    count;      // Number of blocks to transfer
+    uint                    nblk;       // Number of blocks completed
+    uint8_t *               buff;       // Data buffer
+    SD_SPI_BLOCK_CB         cb;         // Block callback (NULL for a contiguous buffer)
+    void *                  ctx;        // Context for callback
+    } SD_JOB;
+
+// One SD card, on its own PIO state machine and pair of DMA channels.
+// Set up with sd_spi_create, the remaining members are private to the driver.
+typedef struct sd_spi
+    {
+    PIO             pio;            // PIO block to use
+    uint            clk_pin;        // SD card clock
+    uint            mosi_pin;       // SD card command (data in)
+    uint            miso_pin;       // SD card data 0 (data out)
+    uint            cs_pin;         // SD card data 3 (chip select)
+    int             sm;             // State machine (-1 until loaded)
+    int             dma_tx;         // DMA channel feeding the TX FIFO
+    int             dma_rx;         // DMA channel draining the RX FIFO
+    bool            bSniff;         // The card has the DMA sniffer for the current transfer
+    SD_TYPE         type;           // Type of card (sdtpUnk until initialised)
+    bool            bInit;          // Initialisation started by sd_spi_init_start is in progress
+    uint            init_try;       // Checks made for the card to become ready
+    SD_JOB          job;            // Asynchronous transfer in progress
+    void            (*idle)(void);  // Called while waiting for the card
+    uint            freq_tgt;       // Requested clock frequency (kHz)
+    bool            freq_probe;     // Step the clock up to the card's rated speed
+    float           freq_act;       // Clock frequency in use (kHz)
+    uint            rd_timeout;     // Timeout (ms) waiting for read data
+    uint            wr_timeout;     // Timeout (ms) waiting for the card to finish being busy
+    SD_BUSY_STATS   busy;           // Busy time statistics
+    uint8_t         cmd[7];         // Command being sent
+    struct sd_spi * next;           // Next loaded card
+    } SD_SPI;
+
+// The card on the board's PICO_SD_* pins, or NULL if the board does not define them
+SD_SPI *sd_spi_default (void);
+// Describe a card on other pins. cs_pin may be any GPIO.
+void sd_spi_create (SD_SPI *sd, PIO pio, uint clk_pin, uint mosi_pin, uint miso_pin, uint cs_pin);
+
+bool sd_spi_init (SD_SPI *sd);
+// Initialisation in two parts, so that other work may be done while the card
+// powers up. sd_spi_init_start returns false if there is no card. Then call
+// sd_spi_init_poll until it returns 1 (ready) or -1 (failed), 0 meaning that
+// the card is still powering up.
+bool sd_spi_init_start (SD_SPI *sd);
+int sd_spi_init_poll (SD_SPI *sd);
+void sd_spi_term (SD_SPI *sd);
+bool sd_spi_read (SD_SPI *sd, uint lba, uint8_t *buff);
+bool sd_spi_read_multi (SD_SPI *sd, uint lba, uint8_t *buff, uint count);
+bool sd_spi_write (SD_SPI *sd, uint lba, const uint8_t *buff);
+bool sd_spi_write_multi (SD_SPI *sd, uint lba, const uint8_t *buff, uint count);
+// Erase blocks first to last (inclusive), which then read as all zeros or all ones
+bool sd_spi_erase (SD_SPI *sd, uint first, uint last);
+bool sd_spi_read_async (SD_SPI *sd, uint lba, uint8_t *buff, uint count, SD_SPI_BLOCK_CB cb, void *ctx);
+bool sd_spi_write_async (SD_SPI *sd, uint lba, const uint8_t *buff, uint count, SD_SPI_BLOCK_CB cb, void *ctx);
+bool sd_spi_busy (SD_SPI *sd);
+bool sd_spi_wait (SD_SPI *sd);
+void sd_spi_set_idle (SD_SPI *sd, void (*idle)(void));
+void sd_spi_set_timeout (SD_SPI *sd, uint rd_ms, uint wr_ms);
+void sd_spi_set_freq (SD_SPI *sd, uint freq, bool bProbe);
+uint sd_spi_get_freq (SD_SPI *sd);
+void sd_spi_busy_stats (SD_SPI *sd, SD_BUSY_STATS *stats, bool bReset);
+// Capacity of the card in 512 byte sectors, or zero if it cannot be read
+uint32_t sd_spi_sectors (SD_SPI *sd);
+// Identity of the card (from its serial number), or zero if it cannot be read
+uint32_t sd_spi_card_id (SD_SPI *sd);
 
 #endif
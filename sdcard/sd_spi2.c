@@ -2,23 +2,27 @@
 // Copyright (c) 2023, Memotech-Bill
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <string.h>
 #include "pico.h"
 #include "pico/stdlib.h"
 #include "hardware/clocks.h"
 #include "hardware/gpio.h"
 #include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 #include "sd_spi.pio.h"
 #include "sd_spi.h"
 #include "pico/binary_info.h"
+#include <pfs_trace.h>
 
 // #define DEBUG
 #ifdef DEBUG
 #include <stdio.h>
 #endif
 
-#if ( !defined(PICO_SD_CLK_PIN)) ||  ( !defined(PICO_SD_CMD_PIN)) || ( !defined(PICO_SD_DAT0_PIN))
-#error SD Card connections not defined. Specify a board including SD card.
-#else
+// The board's own SD card slot, if it has one
+#if defined(PICO_SD_CLK_PIN) && defined(PICO_SD_CMD_PIN) && defined(PICO_SD_DAT0_PIN)
+#define SD_DEFAULT_CARD
 
 #ifdef PICO_SD_DAT3_PIN
 #define SD_CS_PIN       PICO_SD_DAT3_PIN
@@ -40,132 +44,324 @@ bi_decl (bi_1pin_with_name (SD_MISO_PIN, "SD card data 0 (data out)"));
 bi_decl (bi_1pin_with_name (PICO_SD_DAT1_PIN, "SD card data 1 (unused)"));
 bi_decl (bi_1pin_with_name (PICO_SD_DAT2_PIN, "SD card data 2 (unused)"));
 #endif
+#endif
+
+// Target SPI clock frequency (kHz) once the card is initialised
+#ifndef SD_SPI_FREQ
+#define SD_SPI_FREQ     12500
+#endif
+// Set to 1 to step the clock up towards the card's TRAN_SPEED during initialisation
+#ifndef SD_SPI_PROBE
+#define SD_SPI_PROBE    0
+#endif
+// Number of test reads at each clock frequency tried when probing
+#ifndef SD_SPI_PROBE_READS
+#define SD_SPI_PROBE_READS  4
+#endif
+// Clock frequency (kHz) used for card identification
+#define SD_SPI_INIT_FREQ    200
+// Number of PIO cycles per bit in sd_spi.pio (two instructions, each with 3 delay cycles)
+#define SD_SPI_PIO_CYCLES   8
+
+// DMA interrupt (0 or 1) used to signal completion of asynchronous transfers
+#ifndef SD_DMA_IRQN
+#define SD_DMA_IRQN     1
+#endif
+#define SD_DMA_IRQ      ( DMA_IRQ_0 + SD_DMA_IRQN )
+
+// Number of bytes to poll for a token or busy end before deferring to a timer
+#ifndef SD_ASYNC_POLL
+#define SD_ASYNC_POLL   16
+#endif
+// Delay (microseconds) before polling again
+#ifndef SD_ASYNC_POLL_US
+#define SD_ASYNC_POLL_US    20
+#endif
+// Default timeout (milliseconds) waiting for read data
+#ifndef SD_READ_TIMEOUT_MS
+#define SD_READ_TIMEOUT_MS  100
+#endif
+// Default timeout (milliseconds) waiting for the card to finish being busy
+#ifndef SD_BUSY_TIMEOUT_MS
+#define SD_BUSY_TIMEOUT_MS  500
+#endif
+
+static const uint8_t sd_fill = 0xFF;
+static uint8_t sd_sink;
+static SD_SPI *sd_list = NULL;          // Loaded cards, serviced by the DMA interrupt
+static spin_lock_t *sd_lock = NULL;     // Protects sd_list and sd_sniff
+static SD_SPI *sd_sniff = NULL;         // Card using the DMA sniffer for its CRC
+static int sd_prog[NUM_PIOS] = { -1, -1 };  // Program offset in each PIO, shared by its cards
+
+static void sd_spi_dma_irq (void);
+static void sd_spi_probe (SD_SPI *sd, uint8_t *buff);
 
-static PIO pio_sd = pio1;
-static int sd_sm = -1;
-static int dma_tx = -1;
-static int dma_rx = -1;
-SD_TYPE sd_type = sdtpUnk;
+void sd_spi_create (SD_SPI *sd, PIO pio, uint clk_pin, uint mosi_pin, uint miso_pin, uint cs_pin)
+    {
+    memset (sd, 0, sizeof (SD_SPI));
+    sd->pio = pio;
+    sd->clk_pin = clk_pin;
+    sd->mosi_pin = mosi_pin;
+    sd->miso_pin = miso_pin;
+    sd->cs_pin = cs_pin;
+    sd->sm = -1;
+    sd->dma_tx = -1;
+    sd->dma_rx = -1;
+    sd->type = sdtpUnk;
+    sd->freq_tgt = SD_SPI_FREQ;
+    sd->freq_probe = SD_SPI_PROBE;
+    sd->rd_timeout = SD_READ_TIMEOUT_MS;
+    sd->wr_timeout = SD_BUSY_TIMEOUT_MS;
+    }
 
-bool sd_spi_load (void)
+SD_SPI *sd_spi_default (void)
     {
-    dma_tx = dma_claim_unused_channel (true);
-    dma_rx = dma_claim_unused_channel (true);
-    if (( dma_tx < 0 ) || ( dma_rx < 0 )) return false;
-    gpio_init (SD_CS_PIN);
-    gpio_set_dir (SD_CS_PIN, GPIO_OUT);
-    gpio_pull_up (SD_MISO_PIN);
-    gpio_put (SD_CS_PIN, 1);
+#ifdef SD_DEFAULT_CARD
+    static SD_SPI sd_card;
+    static bool bCreated = false;
+    if ( ! bCreated )
+        {
+        sd_spi_create (&sd_card, pio1, SD_CLK_PIN, SD_MOSI_PIN, SD_MISO_PIN, SD_CS_PIN);
 #if ( PICO_SD_DAT_PIN_COUNT > 1 )
-    // Set the DAT1 and DAT2 pins to input so they don't affect SD card operation
-    gpio_init (PICO_SD_DAT1_PIN);
-    gpio_init (PICO_SD_DAT2_PIN);
-    gpio_pull_up (PICO_SD_DAT1_PIN);
-    gpio_pull_up (PICO_SD_DAT2_PIN);
-#endif
-    uint offset = pio_add_program (pio_sd, &sd_spi_program);
-    sd_sm = pio_claim_unused_sm (pio_sd, true);
+        // Set the DAT1 and DAT2 pins to input so they don't affect SD card operation
+        gpio_init (PICO_SD_DAT1_PIN);
+        gpio_init (PICO_SD_DAT2_PIN);
+        gpio_pull_up (PICO_SD_DAT1_PIN);
+        gpio_pull_up (PICO_SD_DAT2_PIN);
+#endif
+        bCreated = true;
+        }
+    return &sd_card;
+#else
+    return NULL;
+#endif
+    }
+
+bool sd_spi_load (SD_SPI *sd)
+    {
+    sd->dma_tx = dma_claim_unused_channel (false);
+    sd->dma_rx = dma_claim_unused_channel (false);
+    int sm = pio_claim_unused_sm (sd->pio, false);
+    int ipio = pio_get_index (sd->pio);
+    if (( sd->dma_tx < 0 ) || ( sd->dma_rx < 0 ) || ( sm < 0 )
+        || (( sd_prog[ipio] < 0 ) && ( ! pio_can_add_program (sd->pio, &sd_spi_program) )))
+        {
+        if ( sd->dma_tx >= 0 ) dma_channel_unclaim (sd->dma_tx);
+        if ( sd->dma_rx >= 0 ) dma_channel_unclaim (sd->dma_rx);
+        if ( sm >= 0 ) pio_sm_unclaim (sd->pio, sm);
+        sd->dma_tx = -1;
+        sd->dma_rx = -1;
+        return false;
+        }
+    gpio_init (sd->cs_pin);
+    gpio_set_dir (sd->cs_pin, GPIO_OUT);
+    gpio_pull_up (sd->miso_pin);
+    gpio_put (sd->cs_pin, 1);
+    if ( sd_prog[ipio] < 0 ) sd_prog[ipio] = pio_add_program (sd->pio, &sd_spi_program);
+    uint offset = sd_prog[ipio];
     pio_sm_config c = sd_spi_program_get_default_config (offset);
-    sm_config_set_out_pins (&c, SD_MOSI_PIN, 1);
-    sm_config_set_in_pins (&c, SD_MISO_PIN);
-    sm_config_set_sideset_pins (&c, SD_CLK_PIN);
+    sm_config_set_out_pins (&c, sd->mosi_pin, 1);
+    sm_config_set_in_pins (&c, sd->miso_pin);
+    sm_config_set_sideset_pins (&c, sd->clk_pin);
     sm_config_set_out_shift (&c, false, true, 8);
     sm_config_set_in_shift (&c, false, true, 8);
-    pio_sm_set_pins_with_mask(pio_sd, sd_sm, 0, (1 << SD_CLK_PIN) | (1 << SD_MOSI_PIN));
-    pio_sm_set_pindirs_with_mask(pio_sd, sd_sm,  (1 << SD_CLK_PIN) | (1 << SD_MOSI_PIN),
-        (1 << SD_CLK_PIN) | (1 << SD_MOSI_PIN) | (1 << SD_MISO_PIN));
-    pio_gpio_init (pio_sd, SD_CLK_PIN);
-    pio_gpio_init (pio_sd, SD_MOSI_PIN);
-    pio_gpio_init (pio_sd, SD_MISO_PIN);
-    pio_sm_init (pio_sd, sd_sm, offset, &c);
-    pio_sm_set_enabled (pio_sd, sd_sm, true);
+    pio_sm_set_pins_with_mask(sd->pio, sm, 0, (1 << sd->clk_pin) | (1 << sd->mosi_pin));
+    pio_sm_set_pindirs_with_mask(sd->pio, sm,  (1 << sd->clk_pin) | (1 << sd->mosi_pin),
+        (1 << sd->clk_pin) | (1 << sd->mosi_pin) | (1 << sd->miso_pin));
+    pio_gpio_init (sd->pio, sd->clk_pin);
+    pio_gpio_init (sd->pio, sd->mosi_pin);
+    pio_gpio_init (sd->pio, sd->miso_pin);
+    pio_sm_init (sd->pio, sm, offset, &c);
+    pio_sm_set_enabled (sd->pio, sm, true);
+    if ( sd_lock == NULL ) sd_lock = spin_lock_instance (spin_lock_claim_unused (true));
+    uint32_t save = spin_lock_blocking (sd_lock);
+    bool bFirst = ( sd_list == NULL );
+    sd->sm = sm;
+    sd->next = sd_list;
+    sd_list = sd;
+    spin_unlock (sd_lock, save);
+    // One handler serves all cards, on the core which loaded the first card
+    if ( bFirst )
+        {
+        irq_add_shared_handler (SD_DMA_IRQ, sd_spi_dma_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled (SD_DMA_IRQ, true);
+        }
     return true;
     }
 
-void sd_spi_unload (void)
+void sd_spi_unload (SD_SPI *sd)
+    {
+    sd_spi_wait (sd);
+    dma_irqn_set_channel_enabled (SD_DMA_IRQN, sd->dma_rx, false);
+    uint32_t save = spin_lock_blocking (sd_lock);
+    SD_SPI **psd = &sd_list;
+    while ( *psd != NULL )
+        {
+        if ( *psd == sd )
+            {
+            *psd = sd->next;
+            break;
+            }
+        psd = &(*psd)->next;
+        }
+    bool bLast = ( sd_list == NULL );
+    spin_unlock (sd_lock, save);
+    if ( bLast ) irq_remove_handler (SD_DMA_IRQ, sd_spi_dma_irq);
+    pio_sm_set_enabled (sd->pio, sd->sm, false);
+    pio_sm_unclaim (sd->pio, sd->sm);
+    dma_channel_unclaim (sd->dma_tx);
+    dma_channel_unclaim (sd->dma_rx);
+    sd->sm = -1;
+    sd->dma_tx = -1;
+    sd->dma_rx = -1;
+    }
+
+// Set the SPI clock frequency (kHz). Returns the nearest achievable frequency.
+// The fastest possible is clk_sys / SD_SPI_PIO_CYCLES.
+float sd_spi_freq (SD_SPI *sd, float freq)
+    {
+    float clk = SD_SPI_PIO_CYCLES * 1000.0 * freq;
+    float div = clock_get_hz (clk_sys) / clk;
+    if ( div < 1.0 ) div = 1.0;
+    pio_sm_set_clkdiv (sd->pio, sd->sm, div);
+    sd->freq_act = clock_get_hz (clk_sys) / ( SD_SPI_PIO_CYCLES * 1000.0 * div );
+    return sd->freq_act;
+    }
+
+void sd_spi_set_freq (SD_SPI *sd, uint freq, bool bProbe)
+    {
+    sd->freq_tgt = freq;
+    sd->freq_probe = bProbe;
+    if (( sd->sm >= 0 ) && ( sd->type != sdtpUnk ))
+        {
+        sd_spi_wait (sd);
+        float prev = sd->freq_act;
+        sd_spi_freq (sd, freq);
+        if ( bProbe )
+            {
+            // Check the card with a test read at the new speed, and go back
+            // to the old one if it fails. Otherwise step up as far as it goes.
+            uint8_t buff[512];
+            if ( sd_spi_read (sd, 0, buff) ) sd_spi_probe (sd, buff);
+            else sd_spi_freq (sd, prev);
+            }
+        }
+    }
+
+uint sd_spi_get_freq (SD_SPI *sd)
+    {
+    return (uint) sd->freq_act;
+    }
+
+void sd_spi_chpsel (SD_SPI *sd, bool sel)
     {
-    pio_sm_set_enabled (pio_sd, sd_sm, false);
-    pio_sm_unclaim (pio_sd, sd_sm);
-    dma_channel_unclaim (dma_tx);
-    dma_channel_unclaim (dma_rx);
-    sd_sm = -1;
-    dma_tx = -1;
-    dma_rx = -1;
+    gpio_put (sd->cs_pin, ! sel);
     }
 
-void sd_spi_freq (float freq)
+// The DMA sniffer is a single resource shared by all cards. A card claims it for
+// each transfer which needs a CRC. When another card has it, the CRC is instead
+// calculated in software once the transfer is complete.
+static bool sd_spi_sniff_claim (SD_SPI *sd)
     {
-    float div = clock_get_hz (clk_sys) / ( 4000.0 * freq );
-    pio_sm_set_clkdiv (pio_sd, sd_sm, div);
+    uint32_t save = spin_lock_blocking (sd_lock);
+    if ( sd_sniff == NULL ) sd_sniff = sd;
+    spin_unlock (sd_lock, save);
+    return ( sd_sniff == sd );
     }
 
-void sd_spi_chpsel (bool sel)
+// CRC16 (CCITT) of a data block that has just been transferred, releasing the sniffer
+static uint16_t sd_spi_crc (SD_SPI *sd, const uint8_t *data, size_t len)
     {
-    gpio_put (SD_CS_PIN, ! sel);
+    uint16_t crc = 0;
+    if ( sd->bSniff )
+        {
+        crc = dma_hw->sniff_data;
+        sd->bSniff = false;
+        uint32_t save = spin_lock_blocking (sd_lock);
+        sd_sniff = NULL;
+        spin_unlock (sd_lock, save);
+        return crc;
+        }
+    while ( len-- > 0 )
+        {
+        crc ^= (uint16_t) *data++ << 8;
+        for (int i = 0; i < 8; ++i) crc = ( crc & 0x8000 ) ? ( crc << 1 ) ^ 0x1021 : ( crc << 1 );
+        }
+    return crc;
     }
 
 // Do 8 bit accesses on FIFO, so that write data is byte-replicated. This
 // gets us the left-justification for free (for MSB-first shift-out)
-void sd_spi_xfer (bool bWrite, const uint8_t *src, uint8_t *dst, size_t len)
+// If bIrq is set, completion of the transfer raises the DMA interrupt.
+// If bCrc is set, the CRC of the data is wanted by a following sd_spi_crc.
+static void sd_spi_xfer_start (SD_SPI *sd, bool bWrite, const uint8_t *src, uint8_t *dst, size_t len, bool bIrq, bool bCrc)
     {
-    io_rw_8 *txfifo = (io_rw_8 *) &pio_sd->txf[sd_sm];
-    io_rw_8 *rxfifo = (io_rw_8 *) &pio_sd->rxf[sd_sm];
-    dma_hw->sniff_data = 0;
-    dma_channel_config c = dma_channel_get_default_config (dma_rx);
+    io_rw_8 *txfifo = (io_rw_8 *) &sd->pio->txf[sd->sm];
+    io_rw_8 *rxfifo = (io_rw_8 *) &sd->pio->rxf[sd->sm];
+    sd->bSniff = bCrc && sd_spi_sniff_claim (sd);
+    if ( sd->bSniff ) dma_hw->sniff_data = 0;
+    dma_irqn_acknowledge_channel (SD_DMA_IRQN, sd->dma_rx);
+    dma_irqn_set_channel_enabled (SD_DMA_IRQN, sd->dma_rx, bIrq);
+    dma_channel_config c = dma_channel_get_default_config (sd->dma_rx);
     channel_config_set_transfer_data_size (&c, DMA_SIZE_8);
     channel_config_set_enable (&c, true);
     channel_config_set_read_increment (&c, false);
     channel_config_set_write_increment (&c, !bWrite);
-    channel_config_set_dreq (&c, DREQ_PIO1_RX0 + sd_sm);
-    if ( ! bWrite )
+    channel_config_set_dreq (&c, pio_get_dreq (sd->pio, sd->sm, false));
+    if (( ! bWrite ) && sd->bSniff )
         {
         channel_config_set_sniff_enable (&c, true);
-        dma_sniffer_enable (dma_rx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
+        dma_sniffer_enable (sd->dma_rx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
         }
-    dma_channel_configure (dma_rx, &c, dst, rxfifo, len, true);
-    c = dma_channel_get_default_config (dma_tx);
+    dma_channel_configure (sd->dma_rx, &c, dst, rxfifo, len, true);
+    c = dma_channel_get_default_config (sd->dma_tx);
     channel_config_set_transfer_data_size (&c, DMA_SIZE_8);
     channel_config_set_enable (&c, true);
     channel_config_set_read_increment (&c, bWrite);
     channel_config_set_write_increment (&c, false);
-    channel_config_set_dreq (&c, DREQ_PIO1_TX0 + sd_sm);
-    if ( bWrite )
+    channel_config_set_dreq (&c, pio_get_dreq (sd->pio, sd->sm, true));
+    if ( bWrite && sd->bSniff )
         {
         channel_config_set_sniff_enable (&c, true);
-        dma_sniffer_enable (dma_tx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
+        dma_sniffer_enable (sd->dma_tx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
         }
-    dma_channel_configure (dma_tx, &c, txfifo, src, len, true);
-    dma_channel_wait_for_finish_blocking (dma_rx);
+    dma_channel_configure (sd->dma_tx, &c, txfifo, src, len, true);
     }
 
-uint8_t sd_spi_put (const uint8_t *src, size_t len)
+void sd_spi_xfer (SD_SPI *sd, bool bWrite, const uint8_t *src, uint8_t *dst, size_t len, bool bCrc)
+    {
+    sd_spi_xfer_start (sd, bWrite, src, dst, len, false, bCrc);
+    dma_channel_wait_for_finish_blocking (sd->dma_rx);
+    }
+
+uint8_t sd_spi_put (SD_SPI *sd, const uint8_t *src, size_t len)
     {
     uint8_t resp;
-    sd_spi_xfer (true, src, &resp, len);
+    sd_spi_xfer (sd, true, src, &resp, len, false);
     return resp;
     }
 
-void sd_spi_get (uint8_t *dst, size_t len)
+void sd_spi_get (SD_SPI *sd, uint8_t *dst, size_t len)
     {
     uint8_t fill = 0xFF;
-    sd_spi_xfer (false, &fill, dst, len);
+    sd_spi_xfer (sd, false, &fill, dst, len, false);
     }
 
-uint8_t sd_spi_clk (size_t len)
+uint8_t sd_spi_clk (SD_SPI *sd, size_t len)
     {
     size_t tx_remain = len;
     size_t rx_remain = len;
     uint8_t resp;
-    io_rw_8 *txfifo = (io_rw_8 *) &pio_sd->txf[sd_sm];
-    io_rw_8 *rxfifo = (io_rw_8 *) &pio_sd->rxf[sd_sm];
+    io_rw_8 *txfifo = (io_rw_8 *) &sd->pio->txf[sd->sm];
+    io_rw_8 *rxfifo = (io_rw_8 *) &sd->pio->rxf[sd->sm];
     while (tx_remain || rx_remain)
         {
-        if (tx_remain && !pio_sm_is_tx_fifo_full (pio_sd, sd_sm))
+        if (tx_remain && !pio_sm_is_tx_fifo_full (sd->pio, sd->sm))
             {
             *txfifo = 0xFF;
             --tx_remain;
             }
-        if (rx_remain && !pio_sm_is_rx_fifo_empty (pio_sd, sd_sm))
+        if (rx_remain && !pio_sm_is_rx_fifo_empty (sd->pio, sd->sm))
             {
             resp = *rxfifo;
             --rx_remain;
@@ -179,6 +375,8 @@ uint8_t sd_spi_clk (size_t len)
 #define SD_R1_ILLEGAL   0x04
 
 #define SDBT_START	    0xFE	// Start of data token
+#define SDBT_MSTART	    0xFC	// Start of data token for multiple block write
+#define SDBT_MSTOP	    0xFD	// Stop transmission token for multiple block write
 #define SDBT_ERRMSK	    0xF0	// Mask to select zero bits in error token
 #define SDBT_ERANGE	    0x08	// Out of range error flag
 #define SDBT_EECC	    0x04	// Card ECC failed
@@ -186,49 +384,69 @@ uint8_t sd_spi_clk (size_t len)
 #define SDBT_ERROR	    0x01	// Error
 #define SDBT_ECLIP	    0x10	// Value above all error bits
 
-static uint8_t cmd0[]   = { 0xFF, 0x40 |  0, 0x00, 0x00, 0x00, 0x00, 0x95 }; // Go Idle
-static uint8_t cmd8[]   = { 0xFF, 0x40 |  8, 0x00, 0x00, 0x01, 0xAA, 0x87 }; // Set interface condition
-static uint8_t cmd17[]  = { 0xFF, 0x40 | 17, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Read single block
-static uint8_t cmd24[]  = { 0xFF, 0x40 | 24, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Write single block
-static uint8_t cmd55[]  = { 0xFF, 0x40 | 55, 0x00, 0x00, 0x01, 0xAA, 0x65 }; // Application command follows
-static uint8_t cmd58[]  = { 0xFF, 0x40 | 58, 0x00, 0x00, 0x00, 0x00, 0xFD }; // Read Operating Condition Reg.
-static uint8_t acmd41[] = { 0xFF, 0x40 | 41, 0x40, 0x00, 0x00, 0x00, 0x77 }; // Set operation condition
+static const uint8_t cmd0[]   = { 0xFF, 0x40 |  0, 0x00, 0x00, 0x00, 0x00, 0x95 }; // Go Idle
+static const uint8_t cmd8[]   = { 0xFF, 0x40 |  8, 0x00, 0x00, 0x01, 0xAA, 0x87 }; // Set interface condition
+static const uint8_t cmd9[]   = { 0xFF, 0x40 |  9, 0x00, 0x00, 0x00, 0x00, 0xAF }; // Send card specific data
+static const uint8_t cmd10[]  = { 0xFF, 0x40 | 10, 0x00, 0x00, 0x00, 0x00, 0x1B }; // Send card identification
+static const uint8_t cmd12[]  = { 0xFF, 0x40 | 12, 0x00, 0x00, 0x00, 0x00, 0x61 }; // Stop transmission
+static const uint8_t cmd17[]  = { 0xFF, 0x40 | 17, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Read single block
+static const uint8_t cmd18[]  = { 0xFF, 0x40 | 18, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Read multiple blocks
+static const uint8_t cmd24[]  = { 0xFF, 0x40 | 24, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Write single block
+static const uint8_t cmd25[]  = { 0xFF, 0x40 | 25, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Write multiple blocks
+static const uint8_t cmd32[]  = { 0xFF, 0x40 | 32, 0x00, 0x00, 0x00, 0x00, 0x00 }; // First block to erase
+static const uint8_t cmd33[]  = { 0xFF, 0x40 | 33, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Last block to erase
+static const uint8_t cmd38[]  = { 0xFF, 0x40 | 38, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Erase
+static const uint8_t cmd55[]  = { 0xFF, 0x40 | 55, 0x00, 0x00, 0x01, 0xAA, 0x65 }; // Application command follows
+static const uint8_t cmd58[]  = { 0xFF, 0x40 | 58, 0x00, 0x00, 0x00, 0x00, 0xFD }; // Read Operating Condition Reg.
+static const uint8_t acmd23[] = { 0xFF, 0x40 | 23, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Set write block erase count
+static const uint8_t acmd41[] = { 0xFF, 0x40 | 41, 0x40, 0x00, 0x00, 0x00, 0x77 }; // Set operation condition
 
-uint8_t sd_spi_cmd (uint8_t *src)
+// Poll for an R1 response
+static uint8_t sd_spi_cmd_resp (SD_SPI *sd)
     {
-    uint8_t resp = sd_spi_put (src, 7);
+    uint8_t resp = 0xFF;
     for (int i = 0; i < 100; ++i)
 	{
+        resp = sd_spi_clk (sd, 1);
 	if ( !( resp & 0x80 ) ) break;
-        resp = sd_spi_clk (1);
 	}
     return resp;
     }
 
-bool sd_spi_init (void)
+uint8_t sd_spi_cmd (SD_SPI *sd, const uint8_t *src)
+    {
+    pfs_trace (PFS_TR_SD_CMD, src[1] & 0x3F, ( src[2] << 24 ) | ( src[3] << 16 ) | ( src[4] << 8 ) | src[5]);
+    uint8_t resp = sd_spi_put (sd, src, 7);
+    if ( resp & 0x80 ) resp = sd_spi_cmd_resp (sd);
+    pfs_trace (PFS_TR_SD_RESP, resp, 0);
+    return resp;
+    }
+
+bool sd_spi_init_start (SD_SPI *sd)
     {
     uint8_t chk[4];
     uint8_t resp;
 #ifdef DEBUG
     printf ("sd_spi_init\n");
 #endif
-    if ( sd_sm < 0 ) sd_spi_load ();
-    sd_type = sdtpUnk;
-    sd_spi_freq (200);
-    sd_spi_chpsel (false);
-    sd_spi_clk (10);
+    sd->bInit = false;
+    if (( sd->sm < 0 ) && ( ! sd_spi_load (sd) )) return false;
+    sd->type = sdtpUnk;
+    sd_spi_freq (sd, SD_SPI_INIT_FREQ);
+    sd_spi_chpsel (sd, false);
+    sd_spi_clk (sd, 10);
     for (int i = 0; i < 256; ++i)
         {
-        sd_spi_chpsel (true);
+        sd_spi_chpsel (sd, true);
 #ifdef DEBUG
         printf ("Go idle\n");
 #endif
-        resp = sd_spi_cmd (cmd0);
+        resp = sd_spi_cmd (sd, cmd0);
 #ifdef DEBUG
         printf ("   Response 0x%02X\n", resp);
 #endif
         if ( resp == SD_R1_IDLE ) break;
-        sd_spi_chpsel (false);
+        sd_spi_chpsel (sd, false);
         sleep_ms (1);
         }
     if ( resp != SD_R1_IDLE )
@@ -243,13 +461,13 @@ bool sd_spi_init (void)
 #ifdef DEBUG
         printf ("Set interface condition\n");
 #endif
-        resp = sd_spi_cmd (cmd8);
+        resp = sd_spi_cmd (sd, cmd8);
 #ifdef DEBUG
         printf ("   Response 0x%02X\n", resp);
 #endif
         if ( resp == SD_R1_IDLE )
             {
-            sd_spi_get (chk, 4);
+            sd_spi_get (sd, chk, 4);
 #ifdef DEBUG
             printf ("   Data 0x%02X 0x%02X 0x%02X 0x%02X\n", chk[0], chk[1], chk[2], chk[3]);
 #endif
@@ -265,42 +483,54 @@ bool sd_spi_init (void)
 #ifdef DEBUG
         printf ("Version 1 SD Card\n");
 #endif
-        sd_type = sdtpVer1;
+        sd->type = sdtpVer1;
         }
     else if ( resp != SD_R1_IDLE )
         {
 #ifdef DEBUG
         printf ("Failed @2\n");
 #endif
-        sd_spi_chpsel (false);
+        sd_spi_chpsel (sd, false);
         return false;
         }
-    for (int i = 0; i < 256; ++i)
-        {
+    sd->init_try = 0;
+    sd->bInit = true;
+    return true;
+    }
+
+// The card leaves the idle state once its power up is complete, which may
+// take most of a second. Each call checks once.
+int sd_spi_init_poll (SD_SPI *sd)
+    {
+    uint8_t chk[4];
+    uint8_t resp;
+    if ( ! sd->bInit ) return ( sd->type == sdtpUnk ) ? -1 : 1;
 #ifdef DEBUG
-        printf ("Set operation condition\n");
+    printf ("Set operation condition\n");
 #endif
-        resp = sd_spi_cmd (cmd55);
-        resp = sd_spi_cmd (acmd41);
+    resp = sd_spi_cmd (sd, cmd55);
+    resp = sd_spi_cmd (sd, acmd41);
 #ifdef DEBUG
-        printf ("   Response 0x%02X\n", resp);
+    printf ("   Response 0x%02X\n", resp);
 #endif
-        if ( resp == SD_R1_OK ) break;
-        }
     if ( resp != SD_R1_OK )
         {
+        if ( ++sd->init_try < 256 ) return 0;
 #ifdef DEBUG
         printf ("Failed @3\n");
 #endif
-        sd_spi_chpsel (false);
-        return false;
+        sd->bInit = false;
+        sd->type = sdtpUnk;
+        sd_spi_chpsel (sd, false);
+        return -1;
         }
-    if ( sd_type == sdtpUnk )
+    sd->bInit = false;
+    if ( sd->type == sdtpUnk )
         {
 #ifdef DEBUG
         printf ("Read Operating Condition Register\n");
 #endif
-        resp = sd_spi_cmd (cmd58);
+        resp = sd_spi_cmd (sd, cmd58);
 #ifdef DEBUG
         printf ("   Response 0x%02X\n", resp);
 #endif
@@ -309,10 +539,10 @@ bool sd_spi_init (void)
 #ifdef DEBUG
             printf ("Failed @3\n");
 #endif
-            sd_spi_chpsel (false);
-            return false;
+            sd_spi_chpsel (sd, false);
+            return -1;
             }
-        sd_spi_get (chk, 4);
+        sd_spi_get (sd, chk, 4);
 #ifdef DEBUG
         printf ("   Data 0x%02X 0x%02X 0x%02X 0x%02X\n", chk[0], chk[1], chk[2], chk[3]);
 #endif
@@ -321,31 +551,47 @@ bool sd_spi_init (void)
 #ifdef DEBUG
             printf ("High capacity SD card\n");
 #endif
-            sd_type = sdtpHigh;
+            sd->type = sdtpHigh;
             }
         else
             {
 #ifdef DEBUG
             printf ("Version 2 SD card\n");
 #endif
-            sd_type = sdtpVer2;
+            sd->type = sdtpVer2;
             }
         }
+    sd_spi_freq (sd, sd->freq_tgt);
+    if ( sd->freq_probe )
+        {
+        uint8_t buff[512];
+        sd_spi_probe (sd, buff);
+        }
 #ifdef DEBUG
-    printf ("SD Card initialised\n");
+    printf ("SD Card initialised: Clock = %d kHz\n", (int) sd->freq_act);
 #endif
-    sd_spi_freq (25000);
-    return true;
+    return 1;
+    }
+
+bool sd_spi_init (SD_SPI *sd)
+    {
+    if ( ! sd_spi_init_start (sd) ) return false;
+    int r;
+    while (( r = sd_spi_init_poll (sd) ) == 0);
+    return ( r > 0 );
     }
 
-void sd_spi_term (void)
+void sd_spi_term (SD_SPI *sd)
     {
+    sd_spi_wait (sd);
 #ifdef DEBUG
     printf ("SD Card terminate\n");
 #endif
-    sd_type = sdtpUnk;
-    sd_spi_chpsel (false);
-    sd_spi_freq (200);
+    sd->bInit = false;
+    sd->type = sdtpUnk;
+    if ( sd->sm < 0 ) return;           // Never loaded
+    sd_spi_chpsel (sd, false);
+    sd_spi_freq (sd, SD_SPI_INIT_FREQ);
     }
 
 void sd_spi_set_crc7 (uint8_t *pcmd)
@@ -365,149 +611,589 @@ void sd_spi_set_crc7 (uint8_t *pcmd)
     *pcmd = crc + 1;
     }
 
-void sd_spi_set_lba (uint lba, uint8_t *pcmd)
+// Copy a command to the card's buffer and fill in its argument
+uint8_t *sd_spi_set_arg (SD_SPI *sd, uint arg, const uint8_t *tmpl)
     {
-    if ( sd_type != sdtpHigh ) lba <<= 9;
-    pcmd += 5;
+    memcpy (sd->cmd, tmpl, sizeof (sd->cmd));
+    uint8_t *pcmd = sd->cmd + 5;
     for (int i = 0; i < 4; ++i)
         {
-        *pcmd = lba & 0xFF;
-        lba >>= 8;
+        *pcmd = arg & 0xFF;
+        arg >>= 8;
         --pcmd;
         }
     sd_spi_set_crc7 (pcmd);
+    return sd->cmd;
     }
 
-bool sd_spi_read (uint lba, uint8_t *buff)
+uint8_t *sd_spi_set_lba (SD_SPI *sd, uint lba, const uint8_t *tmpl)
     {
-    uint8_t chk[2];
-    sd_spi_set_lba (lba, cmd17);
-#ifdef DEBUG
-    printf ("Read command 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
-        cmd17[1], cmd17[2], cmd17[3], cmd17[4], cmd17[5], cmd17[6]);
-#endif
-    uint8_t resp = sd_spi_cmd (cmd17);
-#ifdef DEBUG
-    printf ("   Resp 0x%02X", resp);
-#endif
-    if ( resp != SD_R1_OK )
+    if ( sd->type != sdtpHigh ) lba <<= 9;
+    return sd_spi_set_arg (sd, lba, tmpl);
+    }
+
+void sd_spi_set_timeout (SD_SPI *sd, uint rd_ms, uint wr_ms)
+    {
+    sd->rd_timeout = rd_ms;
+    sd->wr_timeout = wr_ms;
+    }
+
+void sd_spi_busy_stats (SD_SPI *sd, SD_BUSY_STATS *stats, bool bReset)
+    {
+    if ( stats != NULL ) *stats = sd->busy;
+    if ( bReset ) memset (&sd->busy, 0, sizeof (sd->busy));
+    }
+
+// Record the end of a period during which the card was busy
+static void sd_spi_busy_end (SD_SPI *sd, uint64_t t0, bool bOK)
+    {
+    uint32_t dt = (uint32_t) ( time_us_64 () - t0 );
+    pfs_trace (PFS_TR_SD_BUSY, bOK, dt);
+    ++sd->busy.count;
+    if ( ! bOK ) ++sd->busy.timeouts;
+    sd->busy.total_us += dt;
+    if ( dt > sd->busy.max_us ) sd->busy.max_us = dt;
+    }
+
+// Give up the processor for a while between polls of the card
+static void sd_spi_yield (SD_SPI *sd)
+    {
+    if ( __get_current_exception () != 0 ) busy_wait_us_32 (SD_ASYNC_POLL_US);
+    else if ( sd->idle != NULL ) sd->idle ();
+    else sleep_us (SD_ASYNC_POLL_US);
+    }
+
+// Poll the card until it stops returning its idle value. If bBusy is true, that is
+// until the card returns 0xFF (end of busy), otherwise until it returns something
+// other than 0xFF (a token). A few bytes are polled at a time, yielding in between.
+// Returns false on timeout.
+static bool sd_spi_poll (SD_SPI *sd, bool bBusy, uint timeout_ms, uint8_t *presp)
+    {
+    uint8_t resp = sd_spi_clk (sd, 1);
+    if (( resp == 0xFF ) == bBusy )
         {
-#ifdef DEBUG
-        printf ("\nFailed\n");
-#endif
-        return false;
+        if ( presp != NULL ) *presp = resp;
+        return true;
         }
+    uint64_t t0 = time_us_64 ();
+    uint64_t tend = t0 + 1000 * (uint64_t) timeout_ms;
+    bool bOK = false;
     while (true)
         {
-        resp = sd_spi_clk (1);
-#ifdef DEBUG
-        printf (" 0x%02X", resp);
-#endif
-        if ( resp == SDBT_START ) break;
-        if ( resp < SDBT_ECLIP )
+        for (int i = 0; i < SD_ASYNC_POLL; ++i)
             {
-#ifdef DEBUG
-            printf ("\nError\n");
-#endif
-            return false;
+            resp = sd_spi_clk (sd, 1);
+            if (( resp == 0xFF ) == bBusy )
+                {
+                bOK = true;
+                break;
+                }
             }
+        if ( bOK || ( time_us_64 () >= tend )) break;
+        sd_spi_yield (sd);
         }
-#ifdef DEBUG
-    printf ("\n");
-#endif
-    sd_spi_get (buff, 512);
-    uint16_t crc = dma_hw->sniff_data;
-    sd_spi_get (chk, 2);
-#ifdef DEBUG
-    printf ("Check bytes 0x%02X 0x%02X, checksum 0x%04X\n", chk[0], chk[1], crc);
-#endif
+    if ( bBusy ) sd_spi_busy_end (sd, t0, bOK);
+    else pfs_trace (PFS_TR_SD_TOKEN, resp, time_us_64 () - t0);
+    if ( presp != NULL ) *presp = resp;
+    return bOK;
+    }
+
+// Wait for the card to stop signalling busy
+static bool sd_spi_wait_busy (SD_SPI *sd)
+    {
+    return sd_spi_poll (sd, true, sd->wr_timeout, NULL);
+    }
+
+// Wait for the start token and then receive a data block and check its CRC
+static bool sd_spi_read_block (SD_SPI *sd, uint8_t *buff, size_t len)
+    {
+    uint8_t chk[2];
+    uint8_t resp;
+    bool bOK = sd_spi_poll (sd, false, sd->rd_timeout, &resp);
+    if (( ! bOK ) || ( resp != SDBT_START )) return false;
+    sd_spi_xfer (sd, false, &sd_fill, buff, len, true);
+    pfs_trace (PFS_TR_SD_DMA, sd->dma_rx, len);
+    uint16_t crc = sd_spi_crc (sd, buff, len);
+    sd_spi_get (sd, chk, 2);
     if (( chk[0] != ( crc >> 8 )) || (chk[1] != ( crc & 0xFF )))
         {
-#ifdef DEBUG
-        printf ("CRC mismatch\n");
-#endif
+        ++sd->busy.crc_errors;
+        pfs_trace (PFS_TR_SD_CRC, 0, 0);
         return false;
         }
     return true;
     }
 
-bool sd_spi_write (uint lba, const uint8_t *buff)
+bool sd_spi_read (SD_SPI *sd, uint lba, uint8_t *buff)
     {
-    uint8_t chk[2];
-#ifdef DEBUG
-    printf ("Write block\n");
-#endif
-    sd_spi_set_lba (lba, cmd24);
-#ifdef DEBUG
-    printf ("Write command 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
-        cmd24[1], cmd24[2], cmd24[3], cmd24[4], cmd24[5], cmd24[6]);
-#endif
-    uint8_t resp = sd_spi_cmd (cmd24);
-#ifdef DEBUG
-    printf ("   Resp 0x%02X\n", resp);
-#endif
-    if ( resp != SD_R1_OK )
+    sd_spi_wait (sd);
+    if ( sd_spi_cmd (sd, sd_spi_set_lba (sd, lba, cmd17)) != SD_R1_OK ) return false;
+    return sd_spi_read_block (sd, buff, 512);
+    }
+
+// Maximum data transfer rate (kHz) from the TRAN_SPEED field of the CSD, or zero if not known
+static uint sd_spi_tran_speed (SD_SPI *sd)
+    {
+    static const uint8_t mult[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+    uint8_t csd[16];
+    if ( sd_spi_cmd (sd, cmd9) != SD_R1_OK ) return 0;
+    if ( ! sd_spi_read_block (sd, csd, sizeof (csd)) ) return 0;
+    uint rate = 10 * mult[( csd[3] >> 3 ) & 0x0F];
+    for (int i = 0; i < ( csd[3] & 0x07 ); ++i) rate *= 10;
+    return rate;
+    }
+
+// Capacity of the card in 512 byte sectors, from the CSD, or zero if not known
+uint32_t sd_spi_sectors (SD_SPI *sd)
+    {
+    uint8_t csd[16];
+    sd_spi_wait (sd);
+    if ( sd_spi_cmd (sd, cmd9) != SD_R1_OK ) return 0;
+    if ( ! sd_spi_read_block (sd, csd, sizeof (csd)) ) return 0;
+    if (( csd[0] >> 6 ) == 1 )
         {
-#ifdef DEBUG
-        printf ("\nFailed\n");
-#endif
-        return false;
+        // CSD version 2 (SDHC / SDXC): capacity is ( C_SIZE + 1 ) * 512KB
+        uint32_t c_size = (( csd[7] & 0x3F ) << 16 ) | ( csd[8] << 8 ) | csd[9];
+        return ( c_size + 1 ) << 10;
         }
-#ifdef DEBUG
-    printf ("Write data\n");
-#endif
-    resp = SDBT_START;
-    resp = sd_spi_put (&resp, 1);
-#ifdef DEBUG
-    printf ("   Resp 0x%02X\n", resp);
-#endif
-    resp = sd_spi_put (buff, 512);
-    uint16_t crc = dma_hw->sniff_data;
-#ifdef DEBUG
-    printf ("   Resp 0x%02X, crc = 0x%04X\n", resp, crc);
-#endif
+    // CSD version 1: capacity is ( C_SIZE + 1 ) * 2^( C_SIZE_MULT + 2 ) blocks of 2^READ_BL_LEN bytes
+    uint32_t c_size = (( csd[6] & 0x03 ) << 10 ) | ( csd[7] << 2 ) | ( csd[8] >> 6 );
+    int c_mult = (( csd[9] & 0x03 ) << 1 ) | ( csd[10] >> 7 );
+    int bl_len = csd[5] & 0x0F;
+    return ( c_size + 1 ) << ( c_mult + 2 + bl_len - 9 );
+    }
+
+// Erase blocks first to last (inclusive). The card may take up to 250ms for
+// each allocation unit (up to 4MB) included.
+bool sd_spi_erase (SD_SPI *sd, uint first, uint last)
+    {
+    sd_spi_wait (sd);
+    if ( sd_spi_cmd (sd, sd_spi_set_lba (sd, first, cmd32)) != SD_R1_OK ) return false;
+    if ( sd_spi_cmd (sd, sd_spi_set_lba (sd, last, cmd33)) != SD_R1_OK ) return false;
+    if ( sd_spi_cmd (sd, sd_spi_set_arg (sd, 0, cmd38)) != SD_R1_OK ) return false;
+    // R1b response: wait for the card to release busy
+    return sd_spi_poll (sd, true, sd->wr_timeout + 250 * ( 1 + ( last - first ) / 8192 ), NULL);
+    }
+
+// Manufacturer and serial number of the card, from the CID, or zero if not known
+uint32_t sd_spi_card_id (SD_SPI *sd)
+    {
+    uint8_t cid[16];
+    sd_spi_wait (sd);
+    if ( sd_spi_cmd (sd, cmd10) != SD_R1_OK ) return 0;
+    if ( ! sd_spi_read_block (sd, cid, sizeof (cid)) ) return 0;
+    // The product serial number (PSN) is only unique for each manufacturer (MID)
+    uint32_t psn = ( cid[9] << 24 ) | ( cid[10] << 16 ) | ( cid[11] << 8 ) | cid[12];
+    return psn ^ ( cid[0] << 24 );
+    }
+
+// Step the clock up through the integer PIO dividers until either the card's
+// rated speed is reached or test reads fail, then settle on the last good speed.
+// The caller supplies the 512 byte buffer for the test reads.
+static void sd_spi_probe (SD_SPI *sd, uint8_t *buff)
+    {
+    uint limit = sd_spi_tran_speed (sd);
+    if ( limit == 0 ) return;
+    float good = sd->freq_act;
+    uint clk = clock_get_hz (clk_sys) / ( SD_SPI_PIO_CYCLES * 1000 );
+    uint div = (uint) ( clk / sd->freq_act );
+    if ( clk / div <= sd->freq_act ) --div;
+    for ( ; div > 0; --div)
+        {
+        float freq = (float) clk / div;
+        if ( freq > limit ) break;
+        sd_spi_freq (sd, freq);
+        bool bOK = true;
+        for (int i = 0; i < SD_SPI_PROBE_READS; ++i)
+            {
+            if ( ! sd_spi_read (sd, 0, buff) )
+                {
+                bOK = false;
+                break;
+                }
+            }
+        pfs_trace (PFS_TR_SD_PROBE, bOK, (uint32_t) freq);
+        if ( ! bOK ) break;
+        good = freq;
+        }
+    sd_spi_freq (sd, good);
+    }
+
+// Send one 512 byte data block with the given start token and check the data response
+static bool sd_spi_write_block (SD_SPI *sd, uint8_t token, const uint8_t *buff)
+    {
+    uint8_t chk[2];
+    uint8_t resp;
+    // One byte gap (Nwr) then the start token
+    chk[0] = 0xFF;
+    chk[1] = token;
+    resp = sd_spi_put (sd, chk, 2);
+    sd_spi_xfer (sd, true, buff, &resp, 512, true);
+    uint16_t crc = sd_spi_crc (sd, buff, 512);
     chk[0] = crc >> 8;
     chk[1] = crc & 0xFF;
-    sd_spi_put (chk, 2);
-#ifdef DEBUG
-    printf ("   Resp");
-#endif
+    sd_spi_put (sd, chk, 2);
+    for (int i = 0; i < 8; ++i)
+        {
+        resp = sd_spi_clk (sd, 1);
+        if ( resp != 0xFF ) break;
+        }
+    pfs_trace (PFS_TR_SD_TOKEN, resp, 0);
+    // Data response token is xxx0sss1: 0x05 accepted, 0x0B CRC error, 0x0D write error
     bool bResp = false;
-    while (true)
+    switch (resp & 0x1F)
         {
-        resp = sd_spi_clk (1);
-#ifdef DEBUG
-        printf (" 0x%02X", resp);
-#endif
-        switch (resp & 0x0E)
+        case 0x05:
+            bResp = true;
+            break;
+        case 0x0B:
+            ++sd->busy.crc_errors;
+            pfs_trace (PFS_TR_SD_CRC, 1, 0);
+            break;
+        default:
+            break;
+        }
+    if ( ! sd_spi_wait_busy (sd) ) bResp = false;
+    return bResp;
+    }
+
+bool sd_spi_write (SD_SPI *sd, uint lba, const uint8_t *buff)
+    {
+    sd_spi_wait (sd);
+    if ( sd_spi_cmd (sd, sd_spi_set_lba (sd, lba, cmd24)) != SD_R1_OK ) return false;
+    return sd_spi_write_block (sd, SDBT_START, buff);
+    }
+
+/*
+    Asynchronous multiple block transfers.
+
+    The command is issued by the caller, after which each step of the transfer
+    runs from the DMA interrupt: the data phase of a block is performed by DMA while
+    the CPU is free, and polling for tokens or the end of busy is done a few bytes at
+    a time, with a timer used to come back later if the card is not yet ready.
+
+    When a block callback is given the buffer holds two blocks which are used
+    alternately, so that the callback can process (or fill) one block while the
+    other is being transferred.
+*/
+
+static uint8_t *sd_spi_job_buff (SD_SPI *sd, uint blk)
+    {
+    if ( sd->job.cb != NULL ) return sd->job.buff + 512 * ( blk & 1 );
+    return sd->job.buff + 512 * blk;
+    }
+
+static void sd_spi_job_end (SD_SPI *sd, bool bOK)
+    {
+    if ( ! bOK ) sd->job.bOK = false;
+    sd->job.state = sdjsIdle;
+    dma_irqn_set_channel_enabled (SD_DMA_IRQN, sd->dma_rx, false);
+    __sev ();
+    }
+
+// Poll briefly for the end of a busy period. Returns 1 when the card is ready,
+// 0 if it is still busy, or -1 on timeout (which ends the transfer).
+static int sd_spi_wr_ready (SD_SPI *sd)
+    {
+    for (int i = 0; i < SD_ASYNC_POLL; ++i)
+        {
+        if ( sd_spi_clk (sd, 1) == 0xFF )
             {
-            case 0x04:
-#ifdef DEBUG
-                printf (" Data accepted\n");
-#endif
-                bResp = true;
-                break;
-            case 0xA0:
-#ifdef DEBUG
-                printf (" CRC error\n");
-#endif
-                bResp = false;
-                break;
-            case 0xC0:
-#ifdef DEBUG
-                printf (" Write error\n");
-#endif
-                bResp = false;
-                break;
-            default:
-                break;
+            sd_spi_busy_end (sd, sd->job.t0, true);
+            return 1;
             }
-        if ( resp == 0xFF ) break;
         }
-#ifdef DEBUG
-    printf ("\n");
-#endif
-    return bResp;
+    if ( time_us_64 () - sd->job.t0 >= 1000 * (uint64_t) sd->wr_timeout )
+        {
+        sd_spi_busy_end (sd, sd->job.t0, false);
+        sd_spi_job_end (sd, false);
+        return -1;
+        }
+    return 0;
+    }
+
+// Poll briefly for the card to finish the busy period after a stop token or CMD12
+static bool sd_spi_stop_busy (SD_SPI *sd)
+    {
+    int iReady = sd_spi_wr_ready (sd);
+    if ( iReady > 0 ) sd_spi_job_end (sd, true);
+    return ( iReady == 0 );
+    }
+
+// Terminate a multiple block read with CMD12, then wait for the card to
+// release busy (R1b response) by polling from the alarm, as for the end of a
+// write, so that the interrupt is not held for the busy period. bOK is false
+// if the read has already failed. Returns true if polling must be repeated later.
+static bool sd_spi_rd_stop (SD_SPI *sd, bool bOK)
+    {
+    pfs_trace (PFS_TR_SD_CMD, 12, 0);
+    sd_spi_put (sd, cmd12, 7);
+    // The byte following CMD12 is a stuff byte and must be discarded
+    sd_spi_clk (sd, 1);
+    uint8_t resp = sd_spi_cmd_resp (sd);
+    pfs_trace (PFS_TR_SD_RESP, resp, 0);
+    if (( ! bOK ) || ( resp & 0x80 )) sd->job.bOK = false;
+    sd->job.state = sdjsRdStop;
+    sd->job.t0 = time_us_64 ();
+    return sd_spi_stop_busy (sd);
+    }
+
+// Poll briefly for the start of the next block. Returns true if polling must be repeated later.
+static bool sd_spi_rd_token (SD_SPI *sd)
+    {
+    for (int i = 0; i < SD_ASYNC_POLL; ++i)
+        {
+        uint8_t resp = sd_spi_clk (sd, 1);
+        if ( resp == SDBT_START )
+            {
+            pfs_trace (PFS_TR_SD_TOKEN, resp, time_us_64 () - sd->job.t0);
+            sd->job.state = sdjsRdData;
+            sd_spi_xfer_start (sd, false, &sd_fill, sd_spi_job_buff (sd, sd->job.nblk), 512, true, true);
+            return false;
+            }
+        if ( resp < SDBT_ECLIP )
+            {
+            pfs_trace (PFS_TR_SD_TOKEN, resp, time_us_64 () - sd->job.t0);
+            return sd_spi_rd_stop (sd, false);
+            }
+        }
+    if ( time_us_64 () - sd->job.t0 >= 1000 * (uint64_t) sd->rd_timeout )
+        {
+        pfs_trace (PFS_TR_SD_TOKEN, 0xFF, time_us_64 () - sd->job.t0);
+        return sd_spi_rd_stop (sd, false);
+        }
+    return true;
+    }
+
+// A block has been received
+static bool sd_spi_rd_data (SD_SPI *sd)
+    {
+    uint8_t chk[2];
+    uint16_t crc = sd_spi_crc (sd, sd_spi_job_buff (sd, sd->job.nblk), 512);
+    sd_spi_get (sd, chk, 2);
+    if (( chk[0] != ( crc >> 8 )) || (chk[1] != ( crc & 0xFF )))
+        {
+        ++sd->busy.crc_errors;
+        pfs_trace (PFS_TR_SD_CRC, 0, 0);
+        return sd_spi_rd_stop (sd, false);
+        }
+    bool bWanted = ! sd->job.bStop;
+    uint blk = sd->job.nblk++;
+    bool bMore = ( sd->job.nblk < sd->job.count ) && bWanted;
+    bool bPoll = false;
+    if ( bMore )
+        {
+        // Get the next block moving before handing this one over
+        sd->job.state = sdjsRdToken;
+        sd->job.t0 = time_us_64 ();
+        bPoll = sd_spi_rd_token (sd);
+        if (( sd->job.state == sdjsIdle ) || ( sd->job.state == sdjsRdStop )) return bPoll;
+        }
+    if (( sd->job.cb != NULL ) && bWanted && ( ! sd->job.cb (sd->job.ctx, sd_spi_job_buff (sd, blk), blk) ))
+        sd->job.bStop = true;
+    if (( ! bMore ) || ( sd->job.bStop && ( sd->job.state == sdjsRdToken )))
+        return sd_spi_rd_stop (sd, true);
+    return bPoll;
+    }
+
+// Send the start token and begin the data phase of the next block
+static void sd_spi_wr_start (SD_SPI *sd)
+    {
+    static const uint8_t token[2] = { 0xFF, SDBT_MSTART };
+    sd_spi_put (sd, token, 2);
+    sd->job.state = sdjsWrData;
+    sd_spi_xfer_start (sd, true, sd_spi_job_buff (sd, sd->job.nblk), &sd_sink, 512, true, true);
+    // Fill the other buffer while this one is being sent
+    uint next = sd->job.nblk + 1;
+    if (( sd->job.cb != NULL ) && ( next < sd->job.count ) && ( ! sd->job.bStop ))
+        {
+        if ( ! sd->job.cb (sd->job.ctx, sd_spi_job_buff (sd, next), next) ) sd->job.bStop = true;
+        }
+    }
+
+static bool sd_spi_wr_finish (SD_SPI *sd)
+    {
+    static const uint8_t stop[2] = { SDBT_MSTOP, 0xFF };
+    sd_spi_put (sd, stop, 2);
+    sd->job.state = sdjsWrStop;
+    sd->job.t0 = time_us_64 ();
+    return sd_spi_stop_busy (sd);
+    }
+
+// Poll briefly for the card to finish programming a block
+static bool sd_spi_wr_busy (SD_SPI *sd)
+    {
+    int iReady = sd_spi_wr_ready (sd);
+    if ( iReady > 0 )
+        {
+        ++sd->job.nblk;
+        if (( sd->job.nblk < sd->job.count ) && ( ! sd->job.bStop ))
+            {
+            sd_spi_wr_start (sd);
+            return false;
+            }
+        return sd_spi_wr_finish (sd);
+        }
+    return ( iReady == 0 );
+    }
+
+// The data phase of a block has finished
+static bool sd_spi_wr_data (SD_SPI *sd)
+    {
+    uint8_t chk[2];
+    uint8_t resp;
+    uint16_t crc = sd_spi_crc (sd, sd_spi_job_buff (sd, sd->job.nblk), 512);
+    chk[0] = crc >> 8;
+    chk[1] = crc & 0xFF;
+    sd_spi_put (sd, chk, 2);
+    for (int i = 0; i < 8; ++i)
+        {
+        resp = sd_spi_clk (sd, 1);
+        if ( resp != 0xFF ) break;
+        }
+    pfs_trace (PFS_TR_SD_TOKEN, resp, 0);
+    if (( resp & 0x1F ) != 0x05 )
+        {
+        sd->job.bOK = false;
+        sd->job.bStop = true;
+        }
+    sd->job.state = sdjsWrBusy;
+    sd->job.t0 = time_us_64 ();
+    return sd_spi_wr_busy (sd);
+    }
+
+// Perform the next step of a transfer. Returns true if the step must be repeated later.
+static bool sd_spi_step (SD_SPI *sd)
+    {
+    switch (sd->job.state)
+        {
+        case sdjsRdToken:
+            return sd_spi_rd_token (sd);
+        case sdjsRdData:
+            return sd_spi_rd_data (sd);
+        case sdjsWrStart:
+            sd_spi_wr_start (sd);
+            return false;
+        case sdjsWrData:
+            return sd_spi_wr_data (sd);
+        case sdjsWrBusy:
+            return sd_spi_wr_busy (sd);
+        case sdjsWrStop:
+        case sdjsRdStop:
+            return sd_spi_stop_busy (sd);
+        default:
+            return false;
+        }
+    }
+
+// Run the next step from the DMA interrupt, so that all steps execute in the same context.
+// The interrupt is forced through the DMA controller, rather than made pending in the
+// NVIC, so that it is taken by the core servicing the cards whichever core calls this.
+static void sd_spi_kick (SD_SPI *sd)
+    {
+    dma_irqn_set_channel_enabled (SD_DMA_IRQN, sd->dma_rx, true);
+    hw_set_bits (SD_DMA_IRQN ? &dma_hw->intf1 : &dma_hw->intf0, 1u << sd->dma_rx);
+    }
+
+static int64_t sd_spi_alarm (alarm_id_t id, void *user_data)
+    {
+    sd_spi_kick ((SD_SPI *) user_data);
+    return 0;
+    }
+
+static void sd_spi_dma_irq (void)
+    {
+    for (SD_SPI *sd = sd_list; sd != NULL; sd = sd->next)
+        {
+        if ( dma_irqn_get_channel_status (SD_DMA_IRQN, sd->dma_rx) )
+            {
+            hw_clear_bits (SD_DMA_IRQN ? &dma_hw->intf1 : &dma_hw->intf0, 1u << sd->dma_rx);
+            dma_irqn_acknowledge_channel (SD_DMA_IRQN, sd->dma_rx);
+            pfs_trace (PFS_TR_SD_DMA, sd->dma_rx, 0);
+            if ( sd_spi_step (sd) ) add_alarm_in_us (SD_ASYNC_POLL_US, sd_spi_alarm, sd, true);
+            }
+        }
+    }
+
+static void sd_spi_job_init (SD_SPI *sd, uint8_t *buff, uint count, SD_SPI_BLOCK_CB cb, void *ctx)
+    {
+    sd->job.bOK = true;
+    sd->job.bStop = false;
+    sd->job.count = count;
+    sd->job.nblk = 0;
+    sd->job.buff = buff;
+    sd->job.cb = cb;
+    sd->job.ctx = ctx;
+    }
+
+bool sd_spi_read_async (SD_SPI *sd, uint lba, uint8_t *buff, uint count, SD_SPI_BLOCK_CB cb, void *ctx)
+    {
+    sd_spi_wait (sd);
+    if ( count == 0 ) return false;
+    if ( sd_spi_cmd (sd, sd_spi_set_lba (sd, lba, cmd18)) != SD_R1_OK ) return false;
+    sd_spi_job_init (sd, buff, count, cb, ctx);
+    sd->job.state = sdjsRdToken;
+    sd->job.t0 = time_us_64 ();
+    sd_spi_kick (sd);
+    return true;
+    }
+
+bool sd_spi_write_async (SD_SPI *sd, uint lba, const uint8_t *buff, uint count, SD_SPI_BLOCK_CB cb, void *ctx)
+    {
+    sd_spi_wait (sd);
+    if ( count == 0 ) return false;
+    // Tell the card how many blocks are coming so that it can pre-erase them.
+    // This is only a hint, so a failure is not fatal. Pre-erased blocks which
+    // are not then written have undefined contents, so it is not given when a
+    // callback may end the transfer early.
+    if ( cb == NULL )
+        {
+        sd_spi_cmd (sd, cmd55);
+        sd_spi_cmd (sd, sd_spi_set_arg (sd, count & 0x7FFFFF, acmd23));
+        }
+    if ( sd_spi_cmd (sd, sd_spi_set_lba (sd, lba, cmd25)) != SD_R1_OK ) return false;
+    // The buffer is only written if there is a callback to fill it
+    sd_spi_job_init (sd, (uint8_t *) buff, count, cb, ctx);
+    if (( cb != NULL ) && ( ! cb (ctx, (uint8_t *) buff, 0) ))
+        {
+        // Nothing to write after all
+        if ( sd_spi_wr_finish (sd) ) sd_spi_kick (sd);
+        return true;
+        }
+    sd->job.state = sdjsWrStart;
+    sd_spi_kick (sd);
+    return true;
+    }
+
+bool sd_spi_busy (SD_SPI *sd)
+    {
+    return ( sd->job.state != sdjsIdle );
+    }
+
+bool sd_spi_wait (SD_SPI *sd)
+    {
+    while ( sd->job.state != sdjsIdle )
+        {
+        if ( sd->idle != NULL ) sd->idle ();
+        else __wfe ();
+        }
+    return sd->job.bOK;
+    }
+
+void sd_spi_set_idle (SD_SPI *sd, void (*idle)(void))
+    {
+    sd->idle = idle;
+    }
+
+bool sd_spi_read_multi (SD_SPI *sd, uint lba, uint8_t *buff, uint count)
+    {
+    if ( ! sd_spi_read_async (sd, lba, buff, count, NULL, NULL) ) return false;
+    return sd_spi_wait (sd);
+    }
+
+bool sd_spi_write_multi (SD_SPI *sd, uint lba, const uint8_t *buff, uint count)
+    {
+    if ( ! sd_spi_write_async (sd, lba, buff, count, NULL, NULL) ) return false;
+    return sd_spi_wait (sd);
     }
 
-#endif // End of check that SD Card connections are specified.
@@ -79,6 +79,15 @@ struct pfs_v_file ser_v_file =
     ser_write,
     ser_lseek,
     ser_fstat,
+    NULL,           // isatty
+    NULL,           // ioctl
+    NULL,           // allocate
+    NULL,           // lseek64
+    NULL,           // readv
+    NULL,           // writev
+    NULL,           // pread
+    NULL,           // pwrite
+    NULL            // fsync
     };
 
 struct pfs_v_dir ser_v_dir =
@@ -107,13 +116,14 @@ struct ser_dir
     int                         flags;
     struct pfs_mount *          m;
     struct dirent               de;
+    long long                   size;       // Size of the file in de (0 if not known)
     DEVID               did;
     };
 
 struct pfs_file *ser_open (struct pfs_pfs *pfs, const char *dn, int oflag)
     {
     struct ser_pfs *ser = (struct ser_pfs *) pfs;
-    struct ser_file *fd = (struct ser_file *) malloc (sizeof (struct ser_file));
+    struct ser_file *fd = (struct ser_file *) pfs_file_alloc (sizeof (struct ser_file));
     if ( fd == NULL )
         {
         pfs_error (ENOMEM);
@@ -149,12 +159,13 @@ struct pfs_file *ser_open (struct pfs_pfs *pfs, const char *dn, int oflag)
 #endif
                     }
                 }
+            pfs_file_free (fd);
             pfs_error (EINVAL);
             return NULL;
             }
         }
+    pfs_file_free (fd);
     pfs_error (ENXIO);
-    free (fd);
     return NULL;
     }
 
@@ -284,6 +295,7 @@ struct dirent *ser_readdir (void *dirp)
     struct ser_dir *dd = (struct ser_dir *) dirp;
     if ( dd->did >= didCount ) return NULL;
     strncpy (dd->de.d_name, psDevName[dd->did], NAME_MAX);
+    dd->de.d_type = DT_CHR;
     ++dd->did;
     return &dd->de;
     }
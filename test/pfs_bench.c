@@ -0,0 +1,384 @@
+// pfs_bench.c - Performance measurements of pico-filesystem volumes
+// Copyright (c) 2023, Memotech-Bill
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Each result is printed as one line of comma separated values:
+//
+//   pfs_bench,<volume>,<test>,<block size>,<value>,<unit>
+//
+// so that the output of different builds, releases or SD cards may be
+// compared with a script. Other lines start with '#'.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pfs.h>
+#include <pico/stdlib.h>
+#include <pico/stdio.h>
+
+#if HAVE_LFS
+#include <ffs_pico.h>
+#endif
+#if HAVE_DEV
+#include <pfs_dev_gdd.h>
+#endif
+#if PFS_HOST
+#include <pfs_host.h>
+#endif
+
+// Largest amount of data written or read in one sequential test
+#ifndef BENCH_FILE_SIZE
+#define BENCH_FILE_SIZE     0x100000
+#endif
+// Largest number of calls in one sequential test
+#ifndef BENCH_MAX_OPS
+#define BENCH_MAX_OPS       16384
+#endif
+// Number of operations for the latency and random access tests
+#ifndef BENCH_NOPS
+#define BENCH_NOPS          200
+#endif
+// Number of files in the directory for the readdir test
+#ifndef BENCH_NFILES
+#define BENCH_NFILES        32
+#endif
+// Largest block size
+#define BENCH_BLOCK_MAX     65536
+// Block size for the random access tests
+#define BENCH_RANDOM_BLOCK  4096
+
+// Tests which may be run on a volume
+#define BT_SEQ_READ         0x01
+#define BT_SEQ_WRITE        0x02
+#define BT_RANDOM           0x04
+#define BT_OPEN             0x08
+#define BT_READDIR          0x10
+#define BT_FILES            ( BT_SEQ_READ | BT_SEQ_WRITE | BT_RANDOM | BT_OPEN | BT_READDIR )
+
+static const int block_sizes[] = { 1, 16, 64, 256, 512, 1024, 4096, 16384, 65536 };
+#define NBLOCK_SIZES        (int) ( sizeof (block_sizes) / sizeof (block_sizes[0]) )
+
+static uint8_t *buffer;
+static uint32_t rand_state = 0x12345678;
+
+static uint32_t bench_rand (void)
+    {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+    }
+
+static void result (const char *vol, const char *test, int size, double value, const char *unit)
+    {
+    printf ("pfs_bench,%s,%s,%d,%.1f,%s\n", vol, test, size, value, unit);
+    }
+
+static void failed (const char *vol, const char *test, int size)
+    {
+    printf ("# %s %s %d failed: errno = %d\n", vol, test, size, errno);
+    }
+
+// Bytes per second for a transfer
+static double rate (long long nbyte, uint64_t t)
+    {
+    if ( t == 0 ) t = 1;
+    return 1E6 * (double) nbyte / (double) t;
+    }
+
+// Number of bytes for a sequential test with a block size
+static long long seq_bytes (int size, long long fsize)
+    {
+    long long nbyte = (long long) size * BENCH_MAX_OPS;
+    if ( nbyte > fsize ) nbyte = fsize;
+    return nbyte - nbyte % size;
+    }
+
+static void bench_seq_write (const char *vol, const char *path, int size, long long fsize)
+    {
+    long long nbyte = seq_bytes (size, fsize);
+    if ( nbyte <= 0 ) return;
+    int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if ( fd < 0 )
+        {
+        failed (vol, "seq_write", size);
+        return;
+        }
+    uint64_t t0 = time_us_64 ();
+    for (long long done = 0; done < nbyte; done += size)
+        {
+        if ( write (fd, buffer, size) != size )
+            {
+            failed (vol, "seq_write", size);
+            close (fd);
+            return;
+            }
+        }
+    // Include the time to get the data onto the media
+    fsync (fd);
+    close (fd);
+    result (vol, "seq_write", size, rate (nbyte, time_us_64 () - t0), "B/s");
+    }
+
+static void bench_seq_read (const char *vol, const char *path, int size, long long fsize)
+    {
+    long long nbyte = seq_bytes (size, fsize);
+    if ( nbyte <= 0 ) return;
+    int fd = open (path, O_RDONLY);
+    if ( fd < 0 )
+        {
+        failed (vol, "seq_read", size);
+        return;
+        }
+    uint64_t t0 = time_us_64 ();
+    for (long long done = 0; done < nbyte; done += size)
+        {
+        if ( read (fd, buffer, size) != size )
+            {
+            failed (vol, "seq_read", size);
+            close (fd);
+            return;
+            }
+        }
+    close (fd);
+    result (vol, "seq_read", size, rate (nbyte, time_us_64 () - t0), "B/s");
+    }
+
+// Random 4KB reads and writes within a file written by the sequential tests
+static void bench_random (const char *vol, const char *path, long long fsize)
+    {
+    int nblk = fsize / BENCH_RANDOM_BLOCK;
+    if ( nblk < 2 ) return;
+    int fd = open (path, O_RDWR);
+    if ( fd < 0 )
+        {
+        failed (vol, "random", BENCH_RANDOM_BLOCK);
+        return;
+        }
+    uint64_t t0 = time_us_64 ();
+    for (int i = 0; i < BENCH_NOPS; ++i)
+        {
+        off_t off = (off_t) ( bench_rand () % nblk ) * BENCH_RANDOM_BLOCK;
+        if ( pread (fd, buffer, BENCH_RANDOM_BLOCK, off) != BENCH_RANDOM_BLOCK )
+            {
+            failed (vol, "random_read", BENCH_RANDOM_BLOCK);
+            close (fd);
+            return;
+            }
+        }
+    uint64_t t = time_us_64 () - t0;
+    result (vol, "random_read", BENCH_RANDOM_BLOCK, 1E6 * BENCH_NOPS / (double) ( t ? t : 1 ), "IOPS");
+    t0 = time_us_64 ();
+    for (int i = 0; i < BENCH_NOPS; ++i)
+        {
+        off_t off = (off_t) ( bench_rand () % nblk ) * BENCH_RANDOM_BLOCK;
+        if ( pwrite (fd, buffer, BENCH_RANDOM_BLOCK, off) != BENCH_RANDOM_BLOCK )
+            {
+            failed (vol, "random_write", BENCH_RANDOM_BLOCK);
+            close (fd);
+            return;
+            }
+        }
+    fsync (fd);
+    t = time_us_64 () - t0;
+    close (fd);
+    result (vol, "random_write", BENCH_RANDOM_BLOCK, 1E6 * BENCH_NOPS / (double) ( t ? t : 1 ), "IOPS");
+    }
+
+// Average time to open and close, and to stat, an existing file
+static void bench_open (const char *vol, const char *path, int oflag)
+    {
+    uint64_t t0 = time_us_64 ();
+    for (int i = 0; i < BENCH_NOPS; ++i)
+        {
+        int fd = open (path, oflag);
+        if ( fd < 0 )
+            {
+            failed (vol, "open_close", 0);
+            return;
+            }
+        close (fd);
+        }
+    result (vol, "open_close", 0, (double) ( time_us_64 () - t0 ) / BENCH_NOPS, "us");
+    struct stat st;
+    t0 = time_us_64 ();
+    for (int i = 0; i < BENCH_NOPS; ++i)
+        {
+        if ( stat (path, &st) != 0 )
+            {
+            failed (vol, "stat", 0);
+            return;
+            }
+        }
+    result (vol, "stat", 0, (double) ( time_us_64 () - t0 ) / BENCH_NOPS, "us");
+    }
+
+// Number of directory entries read per second
+static void bench_readdir (const char *vol, const char *dir)
+    {
+    int nent = 0;
+    uint64_t t0 = time_us_64 ();
+    for (int i = 0; i < BENCH_NOPS / 10; ++i)
+        {
+        DIR *dp = opendir (dir);
+        if ( dp == NULL )
+            {
+            failed (vol, "readdir", 0);
+            return;
+            }
+        while ( readdir (dp) != NULL ) ++nent;
+        closedir (dp);
+        }
+    result (vol, "readdir", 0, rate (nent, time_us_64 () - t0), "entries/s");
+    }
+
+// Fill a directory with files for the readdir test, or remove them again
+static bool bench_files (const char *dir, bool bCreate)
+    {
+    char path[64];
+    if ( bCreate ) mkdir (dir, 0777);
+    for (int i = 0; i < BENCH_NFILES; ++i)
+        {
+        snprintf (path, sizeof (path), "%s/f%03d", dir, i);
+        if ( bCreate )
+            {
+            int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if ( fd < 0 ) return false;
+            write (fd, path, strlen (path));
+            close (fd);
+            }
+        else
+            {
+            unlink (path);
+            }
+        }
+    if ( ! bCreate ) rmdir (dir);
+    return true;
+    }
+
+// Run the tests selected by flags on the volume mounted at mount, with
+// files of up to fsize bytes
+static void bench_volume (const char *vol, const char *mount, int flags, long long fsize)
+    {
+    char path[64];
+    printf ("# %s mounted at %s\n", vol, mount);
+    snprintf (path, sizeof (path), "%s/bench.dat", mount);
+    if ( flags & BT_SEQ_WRITE )
+        {
+        for (int i = 0; i < NBLOCK_SIZES; ++i)
+            {
+            bench_seq_write (vol, path, block_sizes[i], fsize);
+            if ( flags & BT_SEQ_READ ) bench_seq_read (vol, path, block_sizes[i], fsize);
+            }
+        // Leave a full size file for the remaining tests
+        bench_seq_write (vol, path, BENCH_BLOCK_MAX, fsize);
+        }
+    if ( flags & BT_RANDOM ) bench_random (vol, path, fsize);
+    if ( flags & BT_OPEN ) bench_open (vol, path, O_RDONLY);
+    if ( flags & BT_SEQ_WRITE ) unlink (path);
+    if ( flags & BT_READDIR )
+        {
+        snprintf (path, sizeof (path), "%s/bench.dir", mount);
+        if ( bench_files (path, true) ) bench_readdir (vol, path);
+        bench_files (path, false);
+        }
+    }
+
+// Time the creation and mounting of a volume. Returns false if it failed.
+static bool bench_mount (const char *vol, struct pfs_pfs *pfs, const char *mount, uint64_t t0)
+    {
+    if (( pfs == NULL ) || ( pfs_mount (pfs, mount) != 0 ))
+        {
+        printf ("# %s not mounted\n", vol);
+        return false;
+        }
+    result (vol, "mount", 0, (double) ( time_us_64 () - t0 ), "us");
+    return true;
+    }
+
+#if HAVE_DEV
+// Output routine for the dev test device, which discards the data
+static void bench_discard (char ch)
+    {
+    }
+#endif
+
+int main (void)
+    {
+    stdio_init_all ();
+    while ( ! stdio_usb_connected () ) sleep_ms (100);
+    sleep_ms (500);
+    printf ("# pfs_bench built %s %s\n", __DATE__, __TIME__);
+    printf ("# format: pfs_bench,volume,test,block,value,unit\n");
+    buffer = (uint8_t *) malloc (BENCH_BLOCK_MAX);
+    if ( buffer == NULL )
+        {
+        printf ("# Unable to allocate buffer\n");
+        return 1;
+        }
+    for (int i = 0; i < BENCH_BLOCK_MAX; ++i) buffer[i] = (uint8_t) bench_rand ();
+#if PFS_HOST && HAVE_FAT
+    // A freshly formatted 64MB card, in memory
+    if ( ! sd_host_format (0, sd_host_create (NULL, 131072)) ) printf ("# Unable to format SD card\n");
+#endif
+    uint64_t t0;
+#if HAVE_LFS
+        {
+        static struct lfs_config cfg;
+        t0 = time_us_64 ();
+        ffs_pico_createcfg (&cfg, BENCH_LFS_OFFSET, BENCH_LFS_SIZE);
+        if ( bench_mount ("lfs", pfs_ffs_create (&cfg), "/flash", t0) )
+            bench_volume ("lfs", "/flash", BT_FILES, BENCH_LFS_SIZE / 4);
+        }
+#endif
+#if HAVE_FAT
+    t0 = time_us_64 ();
+    if ( bench_mount ("fat", pfs_fat_create (), "/sdcard", t0) )
+        bench_volume ("fat", "/sdcard", BT_FILES, BENCH_FILE_SIZE);
+#endif
+#if HAVE_RAM
+    t0 = time_us_64 ();
+    if ( bench_mount ("ram", pfs_ram_create (BENCH_RAM_SIZE, BENCH_NFILES + 8), "/ram", t0) )
+        bench_volume ("ram", "/ram", BT_FILES, BENCH_RAM_SIZE / 2);
+#endif
+#if HAVE_DEV
+    struct pfs_device *dev = pfs_dev_gdd_create (bench_discard);
+    if ( dev != NULL ) pfs_mknod ("null", 0, dev);
+    t0 = time_us_64 ();
+    if ( bench_mount ("dev", pfs_dev_fetch (), "/dev", t0) )
+        {
+        printf ("# dev mounted at /dev\n");
+        for (int i = 0; i < NBLOCK_SIZES; ++i)
+            {
+            int size = block_sizes[i];
+            long long nbyte = seq_bytes (size, BENCH_FILE_SIZE);
+            int fd = open ("/dev/null", O_WRONLY);
+            if ( fd < 0 )
+                {
+                failed ("dev", "seq_write", size);
+                break;
+                }
+            t0 = time_us_64 ();
+            for (long long done = 0; done < nbyte; done += size) write (fd, buffer, size);
+            uint64_t t = time_us_64 () - t0;
+            close (fd);
+            result ("dev", "seq_write", size, rate (nbyte, t), "B/s");
+            }
+        bench_open ("dev", "/dev/null", O_WRONLY);
+        bench_readdir ("dev", "/dev");
+        }
+#endif
+    printf ("# pfs_bench finished\n");
+#if PFS_HOST
+    return 0;
+#endif
+    while (true)
+        {
+        sleep_ms (1000);
+        }
+    }